@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Library Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Library Public License for more details.
+#
+
+source $CEPH_ROOT/qa/standalone/ceph-helpers.sh
+
+function run() {
+    local dir=$1
+    shift
+
+    export CEPH_MON="127.0.0.1:7148" # git grep '\<7148\>' : there must be only one
+    export CEPH_ARGS
+    CEPH_ARGS+="--fsid=$(uuidgen) --auth-supported=none "
+    CEPH_ARGS+="--mon-host=$CEPH_MON "
+    CEPH_ARGS+="--osd_pool_default_size=1 "
+
+    local funcs=${@:-$(set | sed -n -e 's/^\(TEST_[0-9a-z_]*\) .*/\1/p')}
+    for func in $funcs ; do
+        setup $dir || return 1
+        $func $dir || return 1
+        teardown $dir || return 1
+    done
+}
+
+function get_fast_reads() {
+    ceph tell osd.0 perf dump osd | jq '.osd.op_fast_read'
+}
+
+# One client writes objects and reads each back right after, without
+# waiting for the write: a read must see the write issued before it,
+# whether it was run inline by the fast read path or queued.  Reads issued
+# once the writes are done find the data in the cache and take the fast
+# path.
+function TEST_fast_read_ordering() {
+    local dir=$1
+    local poolname=test
+
+    run_mon $dir a || return 1
+    run_mgr $dir x || return 1
+    run_osd $dir 0 --osd_op_fast_read=true \
+        --bluestore_default_buffered_write=true || return 1
+    create_pool $poolname 8 8 || return 1
+    wait_for_clean || return 1
+
+    local fast_reads=$(get_fast_reads)
+
+    python3 - $poolname 50 <<'EOF' || return 1
+import sys
+import rados
+
+pool, rounds = sys.argv[1], int(sys.argv[2])
+cluster = rados.Rados()
+cluster.conf_parse_env()
+cluster.connect()
+ioctx = cluster.open_ioctx(pool)
+objects = ['obj%d' % i for i in range(16)]
+errors = []
+
+def data(name, r):
+    return ('%s.%08d' % (name, r)).encode() * 256
+
+def check(name, r, got):
+    if got != data(name, r):
+        errors.append('%s round %d: read %r' % (name, r, got[:16]))
+
+for r in range(rounds):
+    completions = []
+    for name in objects:
+        completions.append(ioctx.aio_write_full(name, data(name, r)))
+        completions.append(ioctx.aio_read(
+            name, len(data(name, r)), 0,
+            lambda c, got, name=name, r=r: check(name, r, got)))
+    for c in completions:
+        c.wait_for_complete()
+    for name in objects:
+        check(name, r, ioctx.read(name, len(data(name, r))))
+
+ioctx.close()
+cluster.shutdown()
+for e in errors:
+    print(e)
+sys.exit(1 if errors else 0)
+EOF
+
+    test $(get_fast_reads) -gt $fast_reads || return 1
+}
+
+main osd-fast-read "$@"
@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Library Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Library Public License for more details.
+#
+
+source $CEPH_ROOT/qa/standalone/ceph-helpers.sh
+
+function run() {
+    local dir=$1
+    shift
+
+    export CEPH_MON="127.0.0.1:7149" # git grep '\<7149\>' : there must be only one
+    export CEPH_ARGS
+    CEPH_ARGS+="--fsid=$(uuidgen) --auth-supported=none "
+    CEPH_ARGS+="--mon-host=$CEPH_MON "
+    CEPH_ARGS+="--osd_pool_default_size=1 "
+    CEPH_ARGS+="--osd_pool_default_pg_autoscale_mode=off "
+
+    local funcs=${@:-$(set | sed -n -e 's/^\(TEST_[0-9a-z_]*\) .*/\1/p')}
+    for func in $funcs ; do
+        setup $dir || return 1
+        $func $dir || return 1
+        teardown $dir || return 1
+    done
+}
+
+function get_shard_counter() {
+    local counter=$1
+    ceph tell osd.0 perf dump | \
+        jq "[to_entries[] | select(.key | startswith(\"osd_shard.\")) |
+             .value.$counter] | add"
+}
+
+# All of the load goes to a single PG, so to a single shard with a single
+# thread: the threads of the other shards have to steal its ops, and every
+# object must still see its appends in the order they were sent.
+function TEST_steal_skewed_load() {
+    local dir=$1
+    local poolname=test
+
+    run_mon $dir a || return 1
+    run_mgr $dir x || return 1
+    run_osd $dir 0 --osd_op_queue=wpq --osd_op_queue_steal=true \
+        --osd_op_num_shards=4 --osd_op_num_threads_per_shard=1 || return 1
+    create_pool $poolname 1 1 || return 1
+    wait_for_clean || return 1
+
+    python3 - $poolname 8 200 <<'EOF' || return 1
+import sys
+import rados
+
+pool, nobjects, rounds = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+cluster = rados.Rados()
+cluster.conf_parse_env()
+cluster.connect()
+ioctx = cluster.open_ioctx(pool)
+objects = ['obj%d' % i for i in range(nobjects)]
+
+completions = []
+for r in range(rounds):
+    for name in objects:
+        completions.append(ioctx.aio_append(name, b'%08d' % r))
+for c in completions:
+    c.wait_for_complete()
+
+expected = b''.join(b'%08d' % r for r in range(rounds))
+errors = 0
+for name in objects:
+    got = ioctx.read(name, len(expected) + 1)
+    if got != expected:
+        print('%s out of order: %r' % (name, got[:64]))
+        errors += 1
+ioctx.close()
+cluster.shutdown()
+sys.exit(1 if errors else 0)
+EOF
+
+    local steal=$(get_shard_counter steal)
+    local stolen=$(get_shard_counter stolen)
+    echo "steal $steal stolen $stolen"
+    test $steal -gt 0 || return 1
+    test $steal = $stolen || return 1
+}
+
+main osd-op-steal "$@"
@@ -115,6 +115,28 @@ function TEST_repro_long_log2()
     test_log_size $PGID 21 18 || return 1
 }
 
+function TEST_repro_long_log2_segments()
+{
+    local dir=$1
+    # store the pg logs in segments, which trim-pg-log must decode as such
+    local -x CEPH_ARGS="$CEPH_ARGS --osd-pg-log-segment-entries=4 "
+
+    setup_log_test $dir || return 1
+    local PRIMARY=$(ceph pg $PGID query  | jq '.info.stats.up_primary')
+    kill_daemons $dir TERM osd.$PRIMARY || return 1
+    CEPH_ARGS="$CEPH_ARGS --osd-max-pg-log-entries=2 --osd-pg-log-dups-tracked=3 --no-mon-config" ceph-objectstore-tool --data-path $dir/$PRIMARY --pgid $PGID --op trim-pg-log || return 1
+    # segments newer than the trim point are kept, and the tail moves up
+    CEPH_ARGS="$CEPH_ARGS --no-mon-config" ceph-objectstore-tool --data-path $dir/$PRIMARY --pgid $PGID --op log > $dir/result.log || return 1
+    local LOGLEN=$(jq '.pg_log_t.log | length' $dir/result.log)
+    if [ $LOGLEN -lt 2 -o $LOGLEN -gt 20 ]; then
+        echo "FAILED: Wrong log length after trim $LOGLEN"
+        return 1
+    fi
+    activate_osd $dir $PRIMARY || return 1
+    wait_for_clean || return 1
+    test_log_size $PGID 21 18 || return 1
+}
+
 function TEST_trim_max_entries()
 {
     local dir=$1
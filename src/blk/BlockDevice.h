@@ -100,6 +100,8 @@ public:
   std::atomic_int num_running = {0};
   bool allow_eio;
   uint32_t flags = 0;               // FLAG_*
+  int queue_hint = -1;              ///< picks the device queue, e.g. the OSD shard
+  int queue = -1;                   ///< what the device queue was picked by
 
   explicit IOContext(CephContext* cct, void *p, bool allow_eio = false)
     : cct(cct), priv(p), allow_eio(allow_eio)
@@ -35,6 +35,7 @@ struct aio_t {
   uint64_t offset, length;
   long rval;
   ceph::buffer::list bl;  ///< write payload (so that it remains stable for duration)
+  int buf_index = -1;     ///< registered buffer holding bl, if any
 
   boost::intrusive::list_member_hook<> queue_item;
 
@@ -103,6 +104,13 @@ struct io_queue_t {
   virtual int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
 			   void *priv, int *retries) = 0;
   virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+
+  /// Append to bl a buffer of len bytes that is registered with the queue,
+  /// to copy write payload into.  Returns its index, or -1 if the queue
+  /// has no registered buffers or none is free.
+  virtual int get_fixed_buffer(unsigned len, ceph::buffer::list *bl) {
+    return -1;
+  }
 };
 
 struct aio_queue_t final : public io_queue_t {
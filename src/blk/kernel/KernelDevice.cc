@@ -20,6 +20,8 @@
 #include <fcntl.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <boost/container/flat_map.hpp>
 #include <boost/lockfree/queue.hpp>
@@ -67,7 +69,6 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
     aio_stop(false),
     discard_started(false),
     discard_stop(false),
-    aio_thread(this),
     discard_thread(this),
     injecting_crash(0)
 {
@@ -75,20 +76,38 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   fd_buffereds.resize(WRITE_LIFE_MAX, -1);
 
   bool use_ioring = cct->_conf.get_val<bool>("bdev_ioring");
-  unsigned int iodepth = cct->_conf->bdev_aio_max_queue_depth;
+  unsigned num_queues = std::max<uint64_t>(
+    1, cct->_conf.get_val<uint64_t>("bdev_aio_queues"));
+  // the queues share the depth a single one would have
+  unsigned int iodepth = std::max<unsigned>(
+    1, cct->_conf->bdev_aio_max_queue_depth / num_queues);
 
-  if (use_ioring && ioring_queue_t::supported()) {
-    bool use_ioring_hipri = cct->_conf.get_val<bool>("bdev_ioring_hipri");
-    bool use_ioring_sqthread_poll = cct->_conf.get_val<bool>("bdev_ioring_sqthread_poll");
-    io_queue = std::make_unique<ioring_queue_t>(iodepth, use_ioring_hipri, use_ioring_sqthread_poll);
-  } else {
+  if (use_ioring && !ioring_queue_t::supported()) {
     static bool once;
-    if (use_ioring && !once) {
+    if (!once) {
       derr << "WARNING: io_uring API is not supported! Fallback to libaio!"
            << dendl;
       once = true;
     }
-    io_queue = std::make_unique<aio_queue_t>(iodepth);
+    use_ioring = false;
+  }
+  // the registered buffers are a budget for the whole device
+  const uint64_t fixed_buffers =
+    cct->_conf.get_val<uint64_t>("bdev_ioring_fixed_buffers");
+  for (unsigned i = 0; i < num_queues; ++i) {
+    auto q = std::make_unique<AioQueue>(this, i);
+    if (use_ioring) {
+      bool use_ioring_hipri = cct->_conf.get_val<bool>("bdev_ioring_hipri");
+      bool use_ioring_sqthread_poll = cct->_conf.get_val<bool>("bdev_ioring_sqthread_poll");
+      q->io_queue = std::make_unique<ioring_queue_t>(
+	iodepth, use_ioring_hipri, use_ioring_sqthread_poll,
+	cct->_conf.get_val<uint64_t>("bdev_ioring_sqthread_idle_ms"),
+	fixed_buffers / num_queues + (i < fixed_buffers % num_queues),
+	cct->_conf.get_val<Option::size_t>("bdev_ioring_fixed_buffer_size"));
+    } else {
+      q->io_queue = std::make_unique<aio_queue_t>(iodepth);
+    }
+    aio_queues.push_back(std::move(q));
   }
 }
 
@@ -503,18 +522,43 @@ int KernelDevice::flush()
 int KernelDevice::_aio_start()
 {
   if (aio) {
-    dout(10) << __func__ << dendl;
-    int r = io_queue->init(fd_directs);
-    if (r < 0) {
-      if (r == -EAGAIN) {
-	derr << __func__ << " io_setup(2) failed with EAGAIN; "
-	     << "try increasing /proc/sys/fs/aio-max-nr" << dendl;
-      } else {
-	derr << __func__ << " io_setup(2) failed: " << cpp_strerror(r) << dendl;
+    dout(10) << __func__ << " " << aio_queues.size() << " queues" << dendl;
+    for (unsigned i = 0; i < aio_queues.size(); ++i) {
+      auto& q = *aio_queues[i];
+      int r = q.io_queue->init(fd_directs);
+      if (r < 0) {
+	if (r == -EAGAIN) {
+	  derr << __func__ << " io_setup(2) failed with EAGAIN; "
+	       << "try increasing /proc/sys/fs/aio-max-nr" << dendl;
+	} else {
+	  derr << __func__ << " io_setup(2) failed: " << cpp_strerror(r) << dendl;
+	}
+	while (i-- > 0) {
+	  aio_queues[i]->io_queue->shutdown();
+	}
+	return r;
+      }
+      if (auto ioring = dynamic_cast<ioring_queue_t*>(q.io_queue.get());
+	  ioring && ioring->fixed_buffers &&
+	  ioring->get_num_fixed_buffers() == 0) {
+	derr << __func__ << " failed to register " << ioring->fixed_buffers
+	     << " io_uring buffers, check RLIMIT_MEMLOCK" << dendl;
       }
-      return r;
     }
-    aio_thread.create("bstore_aio");
+    for (unsigned i = 0; i < aio_queues.size(); ++i) {
+      auto& q = *aio_queues[i];
+      PerfCountersBuilder b(cct, _perf_name() + "-queue" + stringify(i),
+			    l_bdev_aio_first, l_bdev_aio_last);
+      b.add_u64(l_bdev_aio_queue_depth, "queue_depth",
+		"IOs submitted to the queue and not completed yet");
+      b.add_u64_counter(l_bdev_aio_submitted, "submitted",
+			"IOs submitted to the queue");
+      b.add_u64_counter(l_bdev_aio_completed, "completed",
+			"IOs completed by the queue");
+      q.logger = b.create_perf_counters();
+      cct->get_perfcounters_collection()->add(q.logger);
+      q.thread.create("bstore_aio");
+    }
   }
   return 0;
 }
@@ -524,15 +568,67 @@ void KernelDevice::_aio_stop()
   if (aio) {
     dout(10) << __func__ << dendl;
     aio_stop = true;
-    aio_thread.join();
+    for (auto& q : aio_queues) {
+      q->thread.join();
+    }
     aio_stop = false;
-    io_queue->shutdown();
+    for (auto& q : aio_queues) {
+      q->io_queue->shutdown();
+      cct->get_perfcounters_collection()->remove(q->logger);
+      delete q->logger;
+      q->logger = nullptr;
+    }
+  }
+}
+
+string KernelDevice::_perf_name() const
+{
+  return "bdev-" +
+    (devname.empty() ? path.substr(path.rfind('/') + 1) : devname);
+}
+
+KernelDevice::AioQueue& KernelDevice::_pick_aio_queue(IOContext *ioc)
+{
+  if (aio_queues.size() == 1) {
+    return *aio_queues[0];
   }
+  // stick to the first pick, registered buffers belong to a queue
+  if (ioc->queue < 0) {
+    if (ioc->queue_hint >= 0) {
+      ioc->queue = ioc->queue_hint;
+    } else {
+      int cpu = sched_getcpu();
+      ioc->queue = cpu < 0 ? 0 : cpu;
+    }
+  }
+  return *aio_queues[ioc->queue % aio_queues.size()];
 }
 
 void KernelDevice::_discard_start()
 {
-    discard_thread.create("bstore_discard");
+  PerfCountersBuilder b(cct, _perf_name(), l_bdev_first, l_bdev_last);
+  b.add_u64(l_bdev_discard_queued_bytes, "discard_queued_bytes",
+	    "Bytes waiting to be discarded", "dqb",
+	    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  b.add_u64(l_bdev_discard_queued_extents, "discard_queued_extents",
+	    "Extents waiting to be discarded");
+  b.add_u64_counter(l_bdev_discard_ops, "discard_ops",
+		    "Discard requests sent to the device");
+  b.add_u64_counter(l_bdev_discard_bytes, "discard_bytes",
+		    "Bytes discarded", NULL, 0, unit_t(UNIT_BYTES));
+  b.add_time_avg(l_bdev_discard_lat, "discard_lat",
+		 "Average latency of a discard request");
+  b.add_time_avg(l_bdev_discard_throttle_lat, "discard_throttle_lat",
+		 "Time spent waiting for discard budget");
+  b.add_u64_counter(l_bdev_discard_dropped_bytes, "discard_dropped_bytes",
+		    "Bytes released without discard due to a full queue",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bdev_discard_overlapped_ios, "discard_overlapped_ios",
+		    "IOs completed while a discard was in progress");
+  discard_logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(discard_logger);
+
+  discard_thread.create("bstore_discard");
 }
 
 void KernelDevice::_discard_stop()
@@ -551,6 +647,11 @@ void KernelDevice::_discard_stop()
     std::lock_guard l(discard_lock);
     discard_stop = false;
   }
+  if (discard_logger) {
+    cct->get_perfcounters_collection()->remove(discard_logger);
+    delete discard_logger;
+    discard_logger = nullptr;
+  }
   dout(10) << __func__ << " stopped" << dendl;
 }
 
@@ -558,9 +659,12 @@ void KernelDevice::discard_drain()
 {
   dout(10) << __func__ << dendl;
   std::unique_lock l(discard_lock);
+  ++discard_draining;
+  discard_cond.notify_all();
   while (!discard_queued.empty() || discard_running) {
     discard_cond.wait(l);
   }
+  --discard_draining;
 }
 
 static bool is_expected_ioerr(const int r)
@@ -577,22 +681,50 @@ static bool is_expected_ioerr(const int r)
 	  );
 }
 
-void KernelDevice::_aio_thread()
+void KernelDevice::_aio_thread(unsigned queue)
 {
-  dout(10) << __func__ << " start" << dendl;
+  dout(10) << __func__ << " " << queue << " start" << dendl;
+  auto& q = *aio_queues[queue];
+#if defined(__linux__)
+  if (aio_queues.size() > 1 &&
+      cct->_conf.get_val<bool>("bdev_aio_queue_affinity")) {
+    // every n-th of the cpus we may run on, so that the completions of a
+    // queue stay on the same cores rather than bouncing between all of them
+    cpu_set_t allowed, mine;
+    CPU_ZERO(&mine);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+      unsigned n = 0;
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+	if (CPU_ISSET(cpu, &allowed) && n++ % aio_queues.size() == queue) {
+	  CPU_SET(cpu, &mine);
+	}
+      }
+      if (CPU_COUNT(&mine) > 0) {
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+	if (r != 0) {
+	  derr << __func__ << " failed to set affinity: " << cpp_strerror(r)
+	       << dendl;
+	}
+      }
+    }
+  }
+#endif
   int inject_crash_count = 0;
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
     int max = cct->_conf->bdev_aio_reap_max;
     aio_t *aio[max];
-    int r = io_queue->get_next_completed(cct->_conf->bdev_aio_poll_ms,
-					 aio, max);
+    int r = q.io_queue->get_next_completed(cct->_conf->bdev_aio_poll_ms,
+					   aio, max);
     if (r < 0) {
       derr << __func__ << " got " << cpp_strerror(r) << dendl;
       ceph_abort_msg("got unexpected error from io_getevents");
     }
     if (r > 0) {
       dout(30) << __func__ << " got " << r << " completed aios" << dendl;
+      q.depth -= r;
+      q.logger->set(l_bdev_aio_queue_depth, std::max<int64_t>(0, q.depth));
+      q.logger->inc(l_bdev_aio_completed, r);
       for (int i = 0; i < r; ++i) {
 	IOContext *ioc = static_cast<IOContext*>(aio[i]->priv);
 	_aio_log_finish(ioc, aio[i]->offset, aio[i]->length);
@@ -601,6 +733,10 @@ void KernelDevice::_aio_thread()
 	  debug_aio_unlink(*aio[i]);
 	}
 
+	if (discard_in_flight && discard_logger) {
+	  discard_logger->inc(l_bdev_discard_overlapped_ios);
+	}
+
 	// set flag indicating new ios have completed.  we do this *before*
 	// any completion or notifications so that any user flush() that
 	// follows the observed io completion will include this io.  Note
@@ -698,8 +834,49 @@ void KernelDevice::_aio_thread()
   dout(10) << __func__ << " end" << dendl;
 }
 
+void KernelDevice::_discard_pick(uint64_t max_bytes, uint64_t max_ops)
+{
+  if (!max_bytes && !max_ops) {
+    discard_finishing.swap(discard_queued);
+    return;
+  }
+  // largest ranges first: fewer, bigger discards are cheaper for the
+  // device, and small ones have more time to merge with their neighbours
+  std::vector<std::pair<uint64_t, uint64_t>> by_len;  // length, offset
+  by_len.reserve(discard_queued.num_intervals());
+  for (auto p = discard_queued.begin(); p != discard_queued.end(); ++p) {
+    by_len.emplace_back(p.get_len(), p.get_start());
+  }
+  std::sort(by_len.begin(), by_len.end(), std::greater<>());
+  uint64_t bytes = 0, ops = 0;
+  for (auto [len, off] : by_len) {
+    if ((max_bytes && bytes >= max_bytes) || (max_ops && ops >= max_ops)) {
+      break;
+    }
+    if (max_bytes) {
+      // a range larger than the budget is taken piece by piece; a budget
+      // below a block still sends one block per slice
+      uint64_t room = bytes < max_bytes ?
+	p2align(max_bytes - bytes, (uint64_t)block_size) : 0;
+      if (!room) {
+	if (ops) {
+	  break;
+	}
+	room = block_size;
+      }
+      len = std::min(len, room);
+    }
+    discard_finishing.insert(off, len);
+    bytes += len;
+    ++ops;
+  }
+  discard_queued.subtract(discard_finishing);
+}
+
 void KernelDevice::_discard_thread()
 {
+  // discard budgets are granted for slices of this length
+  constexpr double slice = 0.1;
   std::unique_lock l(discard_lock);
   ceph_assert(!discard_started);
   discard_started = true;
@@ -714,18 +891,64 @@ void KernelDevice::_discard_thread()
       discard_cond.wait(l);
       dout(20) << __func__ << " wake" << dendl;
     } else {
-      discard_finishing.swap(discard_queued);
+      // give adjacent releases a chance to merge into larger ranges
+      bool hurry = discard_stop || discard_draining;
+      auto ready = discard_queued_since + make_timespan(
+	cct->_conf.get_val<double>("bdev_discard_coalesce_window"));
+      if (!hurry && ceph::mono_clock::now() < ready) {
+	discard_cond.wait_until(l, ready);
+	continue;
+      }
+      uint64_t bytes_per_sec = hurry ? 0 :
+	cct->_conf.get_val<Option::size_t>("bdev_discard_max_bytes_per_sec");
+      uint64_t ops_per_sec = hurry ? 0 :
+	cct->_conf.get_val<uint64_t>("bdev_discard_max_ops_per_sec");
+      _discard_pick(
+	bytes_per_sec ? std::max<uint64_t>(bytes_per_sec * slice, 1) : 0,
+	ops_per_sec ? std::max<uint64_t>(ops_per_sec * slice, 1) : 0);
+      discard_logger->set(l_bdev_discard_queued_bytes, discard_queued.size());
+      discard_logger->set(l_bdev_discard_queued_extents,
+			  discard_queued.num_intervals());
       discard_running = true;
       l.unlock();
       dout(20) << __func__ << " finishing" << dendl;
+      auto start = ceph::mono_clock::now();
+      uint64_t bytes = 0, ops = 0;
+      discard_in_flight = true;
       for (auto p = discard_finishing.begin();p != discard_finishing.end(); ++p) {
+	auto t0 = ceph::mono_clock::now();
 	_discard(p.get_start(), p.get_len());
+	discard_logger->tinc(l_bdev_discard_lat, ceph::mono_clock::now() - t0);
+	bytes += p.get_len();
+	++ops;
       }
+      discard_in_flight = false;
+      discard_logger->inc(l_bdev_discard_ops, ops);
+      discard_logger->inc(l_bdev_discard_bytes, bytes);
 
       discard_callback(discard_callback_priv, static_cast<void*>(&discard_finishing));
       discard_finishing.clear();
       l.lock();
       discard_running = false;
+
+      // hold off until what was just discarded fits into the budget
+      double busy = 0;
+      if (bytes_per_sec) {
+	busy = std::max(busy, double(bytes) / bytes_per_sec);
+      }
+      if (ops_per_sec) {
+	busy = std::max(busy, double(ops) / ops_per_sec);
+      }
+      auto until = start + make_timespan(busy);
+      auto now = ceph::mono_clock::now();
+      if (now < until && !discard_queued.empty()) {
+	discard_cond.notify_all(); // for the thread trying to drain...
+	discard_cond.wait_for(l, until - now, [&] {
+	  return discard_stop || discard_draining;
+	});
+	discard_logger->tinc(l_bdev_discard_throttle_lat,
+			     ceph::mono_clock::now() - now);
+      }
     }
   }
   dout(10) << __func__ << " finish" << dendl;
@@ -742,11 +965,35 @@ int KernelDevice::_queue_discard(interval_set<uint64_t> &to_release)
     return 0;
 
   std::lock_guard l(discard_lock);
-  discard_queued.insert(to_release);
+  if (!_discard_enqueue(to_release, cct->_conf.get_val<Option::size_t>(
+			  "bdev_discard_max_queued_bytes"))) {
+    // the device is not keeping up; let the caller release these
+    // without a discard rather than holding back ever more free space
+    discard_logger->inc(l_bdev_discard_dropped_bytes, to_release.size());
+    return -1;
+  }
+  discard_logger->set(l_bdev_discard_queued_bytes, discard_queued.size());
+  discard_logger->set(l_bdev_discard_queued_extents,
+		      discard_queued.num_intervals());
   discard_cond.notify_all();
   return 0;
 }
 
+// add to the discard queue unless that takes it over max_queued bytes (0 for
+// no limit); called with discard_lock held
+bool KernelDevice::_discard_enqueue(const interval_set<uint64_t> &to_release,
+				    uint64_t max_queued)
+{
+  if (max_queued && discard_queued.size() + to_release.size() > max_queued) {
+    return false;
+  }
+  if (discard_queued.empty()) {
+    discard_queued_since = ceph::mono_clock::now();
+  }
+  discard_queued.insert(to_release);
+  return true;
+}
+
 // return true only if _queue_discard succeeded, so caller won't have to do alloc->release
 // otherwise false
 bool KernelDevice::try_discard(interval_set<uint64_t> &to_release, bool async)
@@ -868,8 +1115,12 @@ void KernelDevice::aio_submit(IOContext *ioc)
   int r, retries = 0;
   // num of pending aios should not overflow when passed to submit_batch()
   assert(pending <= std::numeric_limits<uint16_t>::max());
-  r = io_queue->submit_batch(ioc->running_aios.begin(), e,
-			     pending, priv, &retries);
+  auto& q = _pick_aio_queue(ioc);
+  q.depth += pending;
+  q.logger->set(l_bdev_aio_queue_depth, q.depth);
+  q.logger->inc(l_bdev_aio_submitted, pending);
+  r = q.io_queue->submit_batch(ioc->running_aios.begin(), e,
+			       pending, priv, &retries);
 
   if (retries)
     derr << __func__ << " retries " << retries << dendl;
@@ -988,7 +1239,17 @@ int KernelDevice::aio_write(
     return 0;
   }
 
-  if ((!buffered || bl.get_num_buffers() >= IOV_MAX) &&
+  // small direct writes are copied into a buffer registered with the
+  // io queue, if it has any, instead of being aligned in place
+  ceph::buffer::list fixed_bl;
+  int buf_index = -1;
+#ifdef HAVE_LIBAIO
+  if (aio && dio && !buffered && len <= RW_IO_MAX) {
+    buf_index = _pick_aio_queue(ioc).io_queue->get_fixed_buffer(len, &fixed_bl);
+  }
+#endif
+  if (buf_index < 0 &&
+      (!buffered || bl.get_num_buffers() >= IOV_MAX) &&
       bl.rebuild_aligned_size_and_memory(block_size, block_size, IOV_MAX)) {
     dout(20) << __func__ << " rebuilding buffer to be aligned" << dendl;
   }
@@ -1021,8 +1282,14 @@ int KernelDevice::aio_write(
 	ioc->pending_aios.push_back(aio_t(ioc, choose_fd(false, write_hint)));
 	++ioc->num_pending;
 	auto& aio = ioc->pending_aios.back();
-	bl.prepare_iov(&aio.iov);
-	aio.bl.claim_append(bl);
+	if (buf_index >= 0) {
+	  bl.begin().copy(len, fixed_bl.c_str());
+	  aio.bl.claim_append(fixed_bl);
+	  aio.buf_index = buf_index;
+	} else {
+	  aio.bl.claim_append(bl);
+	}
+	aio.bl.prepare_iov(&aio.iov);
 	aio.pwritev(off, len);
 	dout(30) << aio << dendl;
 	dout(5) << __func__ << " 0x" << std::hex << off << "~" << len
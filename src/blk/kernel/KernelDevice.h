@@ -21,6 +21,7 @@
 #include "include/interval_set.h"
 #include "common/Thread.h"
 #include "include/utime.h"
+#include "common/perf_counters.h"
 
 #include "aio/aio.h"
 #include "BlockDevice.h"
@@ -28,7 +29,29 @@
 
 #define RW_IO_MAX (INT_MAX & CEPH_PAGE_MASK)
 
+enum {
+  l_bdev_first = 733000,
+  l_bdev_discard_queued_bytes,
+  l_bdev_discard_queued_extents,
+  l_bdev_discard_ops,
+  l_bdev_discard_bytes,
+  l_bdev_discard_lat,
+  l_bdev_discard_throttle_lat,
+  l_bdev_discard_dropped_bytes,
+  l_bdev_discard_overlapped_ios,
+  l_bdev_last,
+};
+
+enum {
+  l_bdev_aio_first = 733100,
+  l_bdev_aio_queue_depth,
+  l_bdev_aio_submitted,
+  l_bdev_aio_completed,
+  l_bdev_aio_last,
+};
+
 class KernelDevice : public BlockDevice {
+  friend class KernelDeviceDiscardTest;
 protected:
   std::string path;
 private:
@@ -46,7 +69,6 @@ private:
   std::atomic<bool> io_since_flush = {false};
   ceph::mutex flush_mutex = ceph::make_mutex("KernelDevice::flush_mutex");
 
-  std::unique_ptr<io_queue_t> io_queue;
   aio_callback_t discard_callback;
   void *discard_callback_priv;
   bool aio_stop;
@@ -56,17 +78,32 @@ private:
   ceph::mutex discard_lock = ceph::make_mutex("KernelDevice::discard_lock");
   ceph::condition_variable discard_cond;
   bool discard_running = false;
+  unsigned discard_draining = 0;   ///< drainers waiting, skip window and budget
   interval_set<uint64_t> discard_queued;
   interval_set<uint64_t> discard_finishing;
+  ceph::mono_clock::time_point discard_queued_since;
+  std::atomic<bool> discard_in_flight = {false};
+  PerfCounters *discard_logger = nullptr;
 
   struct AioCompletionThread : public Thread {
     KernelDevice *bdev;
-    explicit AioCompletionThread(KernelDevice *b) : bdev(b) {}
+    unsigned queue;
+    AioCompletionThread(KernelDevice *b, unsigned q) : bdev(b), queue(q) {}
     void *entry() override {
-      bdev->_aio_thread();
+      bdev->_aio_thread(queue);
       return NULL;
     }
-  } aio_thread;
+  };
+
+  /// an io queue, and the thread reaping its completions
+  struct AioQueue {
+    std::unique_ptr<io_queue_t> io_queue;
+    AioCompletionThread thread;
+    std::atomic<int64_t> depth = {0};
+    PerfCounters *logger = nullptr;
+    AioQueue(KernelDevice *b, unsigned q) : thread(b, q) {}
+  };
+  std::vector<std::unique_ptr<AioQueue>> aio_queues;
 
   struct DiscardThread : public Thread {
     KernelDevice *bdev;
@@ -82,9 +119,14 @@ private:
   virtual int _post_open() { return 0; }  // hook for child implementations
   virtual void  _pre_close() { }  // hook for child implementations
 
-  void _aio_thread();
+  void _aio_thread(unsigned queue);
+  AioQueue& _pick_aio_queue(IOContext *ioc);
+  std::string _perf_name() const;
   void _discard_thread();
   int _queue_discard(interval_set<uint64_t> &to_release);
+  bool _discard_enqueue(const interval_set<uint64_t> &to_release,
+			uint64_t max_queued);
+  void _discard_pick(uint64_t max_bytes, uint64_t max_ops);
   bool try_discard(interval_set<uint64_t> &to_release, bool async = true) override;
 
   int _aio_start();
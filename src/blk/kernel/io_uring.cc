@@ -8,15 +8,69 @@
 #include "liburing.h"
 #include <sys/epoll.h>
 
+#include "common/deleter.h"
+#include "include/intarith.h"
+
 using std::list;
 using std::make_unique;
 
+/*
+ * Page aligned buffers registered with the ring, so that writes from them
+ * do not need their pages pinned and unpinned by the kernel every time.
+ * Shared with the payload lists that hold a buffer, which hand it back
+ * when they go away, so the memory outlives the ring if it has to.
+ */
+struct ioring_fixed_buffers {
+  char *base = nullptr;
+  unsigned count = 0;
+  unsigned size = 0;
+  std::mutex lock;
+  std::vector<int> free;
+
+  ioring_fixed_buffers(unsigned count_, unsigned size_)
+    : count(count_), size(size_) {
+    base = static_cast<char*>(
+      aligned_alloc(CEPH_PAGE_SIZE, (size_t)count * size));
+    ceph_assert(base);
+    free.reserve(count);
+    for (int i = count - 1; i >= 0; --i) {
+      free.push_back(i);
+    }
+  }
+  ~ioring_fixed_buffers() {
+    ::free(base);
+  }
+
+  std::vector<struct iovec> iovecs() const {
+    std::vector<struct iovec> v(count);
+    for (unsigned i = 0; i < count; ++i) {
+      v[i].iov_base = base + (size_t)i * size;
+      v[i].iov_len = size;
+    }
+    return v;
+  }
+  int get() {
+    std::lock_guard l(lock);
+    if (free.empty()) {
+      return -1;
+    }
+    int i = free.back();
+    free.pop_back();
+    return i;
+  }
+  void put(int i) {
+    std::lock_guard l(lock);
+    free.push_back(i);
+  }
+};
+
 struct ioring_data {
   struct io_uring io_uring;
   pthread_mutex_t cq_mutex;
   pthread_mutex_t sq_mutex;
   int epoll_fd = -1;
   std::map<int, int> fixed_fds_map;
+  std::shared_ptr<ioring_fixed_buffers> fixed_buffers;
 };
 
 static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
@@ -57,7 +111,11 @@ static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 
   ceph_assert(fixed_fd != -1);
 
-  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
+  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV && io->buf_index >= 0) {
+    ceph_assert(io->iov.size() == 1);
+    io_uring_prep_write_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+			      io->iov[0].iov_len, io->offset, io->buf_index);
+  } else if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
     io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
 			 io->iov.size(), io->offset);
   else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
@@ -106,11 +164,17 @@ static void build_fixed_fds_map(struct ioring_data *d,
   }
 }
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_) :
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+			       unsigned sq_thread_idle_ms_,
+			       unsigned fixed_buffers_,
+			       unsigned fixed_buffer_size_) :
   d(make_unique<ioring_data>()),
   iodepth(iodepth_),
   hipri(hipri_),
-  sq_thread(sq_thread_)
+  sq_thread(sq_thread_),
+  sq_thread_idle_ms(sq_thread_idle_ms_),
+  fixed_buffers(fixed_buffers_),
+  fixed_buffer_size(p2roundup(fixed_buffer_size_, (unsigned)CEPH_PAGE_SIZE))
 {
 }
 
@@ -120,17 +184,19 @@ ioring_queue_t::~ioring_queue_t()
 
 int ioring_queue_t::init(std::vector<int> &fds)
 {
-  unsigned flags = 0;
+  struct io_uring_params params = {};
 
   pthread_mutex_init(&d->cq_mutex, NULL);
   pthread_mutex_init(&d->sq_mutex, NULL);
 
   if (hipri)
-    flags |= IORING_SETUP_IOPOLL;
-  if (sq_thread)
-    flags |= IORING_SETUP_SQPOLL;
+    params.flags |= IORING_SETUP_IOPOLL;
+  if (sq_thread) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = sq_thread_idle_ms;
+  }
 
-  int ret = io_uring_queue_init(iodepth, &d->io_uring, flags);
+  int ret = io_uring_queue_init_params(iodepth, &d->io_uring, &params);
   if (ret < 0)
     return ret;
 
@@ -143,6 +209,17 @@ int ioring_queue_t::init(std::vector<int> &fds)
 
   build_fixed_fds_map(d.get(), fds);
 
+  if (fixed_buffers && fixed_buffer_size) {
+    auto bufs = std::make_shared<ioring_fixed_buffers>(fixed_buffers,
+						       fixed_buffer_size);
+    auto iov = bufs->iovecs();
+    // this pins the buffers for good, which RLIMIT_MEMLOCK may not allow;
+    // plain writes work just as well, so go on without them then
+    if (io_uring_register_buffers(&d->io_uring, iov.data(), iov.size()) == 0) {
+      d->fixed_buffers = std::move(bufs);
+    }
+  }
+
   d->epoll_fd = epoll_create1(0);
   if (d->epoll_fd < 0) {
     ret = -errno;
@@ -170,6 +247,8 @@ close_ring_fd:
 void ioring_queue_t::shutdown()
 {
   d->fixed_fds_map.clear();
+  // buffers still held by payloads go back to a pool nobody takes from
+  d->fixed_buffers.reset();
   close(d->epoll_fd);
   d->epoll_fd = -1;
   io_uring_queue_exit(&d->io_uring);
@@ -209,6 +288,27 @@ get_cqe:
   return events;
 }
 
+int ioring_queue_t::get_fixed_buffer(unsigned len, ceph::buffer::list *bl)
+{
+  auto bufs = d->fixed_buffers;
+  if (!bufs || len > bufs->size) {
+    return -1;
+  }
+  int i = bufs->get();
+  if (i < 0) {
+    return -1;
+  }
+  bl->append(ceph::buffer::claim_buffer(
+    len, bufs->base + (size_t)i * bufs->size,
+    make_deleter([bufs, i] { bufs->put(i); })));
+  return i;
+}
+
+unsigned ioring_queue_t::get_num_fixed_buffers() const
+{
+  return d->fixed_buffers ? d->fixed_buffers->count : 0;
+}
+
 bool ioring_queue_t::supported()
 {
   struct io_uring ring;
@@ -224,7 +324,10 @@ bool ioring_queue_t::supported()
 
 struct ioring_data {};
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_)
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+			       unsigned sq_thread_idle_ms_,
+			       unsigned fixed_buffers_,
+			       unsigned fixed_buffer_size_)
 {
   ceph_assert(0);
 }
@@ -256,6 +359,16 @@ int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
   ceph_assert(0);
 }
 
+int ioring_queue_t::get_fixed_buffer(unsigned len, ceph::buffer::list *bl)
+{
+  ceph_assert(0);
+}
+
+unsigned ioring_queue_t::get_num_fixed_buffers() const
+{
+  ceph_assert(0);
+}
+
 bool ioring_queue_t::supported()
 {
   return false;
@@ -229,6 +229,63 @@ namespace PriorityCache
               "total bytes committed,", "c",
               PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
 
+    b.add_u64_counter(cur_index + Extra::E_MISSES, "misses",
+              "lookups that missed the cache");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI0, "pri0_hits",
+              "hits on pri0 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI1, "pri1_hits",
+              "hits on pri1 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI2, "pri2_hits",
+              "hits on pri2 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI3, "pri3_hits",
+              "hits on pri3 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI4, "pri4_hits",
+              "hits on pri4 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI5, "pri5_hits",
+              "hits on pri5 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI6, "pri6_hits",
+              "hits on pri6 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI7, "pri7_hits",
+              "hits on pri7 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI8, "pri8_hits",
+              "hits on pri8 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI9, "pri9_hits",
+              "hits on pri9 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI10, "pri10_hits",
+              "hits on pri10 items");
+
+    b.add_u64_counter(cur_index + Extra::E_HITS + Priority::PRI11, "pri11_hits",
+              "hits on pri11 items");
+
+    PerfHistogramCommon::axis_config_d hit_age_x{
+      "age (bins)",
+      PerfHistogramCommon::SCALE_LINEAR,
+      0,                 // min age
+      1,                 // one bin per bucket
+      HIT_AGE_BINS + 2,  // with the underflow and overflow buckets
+    };
+    PerfHistogramCommon::axis_config_d hit_age_y{
+      "pool (high, low)",
+      PerfHistogramCommon::SCALE_LINEAR,
+      0,
+      1,
+      3,
+    };
+    b.add_u64_counter_histogram(cur_index + Extra::E_HIT_AGES, "hit_ages",
+              hit_age_x, hit_age_y,
+              "histogram of hits by the age in bins of the item hit");
+
     for (int i = 0; i < Extra::E_LAST+1; i++) {
       indexes[name][i] = cur_index + i;
     }
@@ -294,6 +351,8 @@ namespace PriorityCache
 
         auto bytes = it->second->get_cache_bytes(pri);
         l.second->set(indexes[it->first][pri], bytes);
+        l.second->set(indexes[it->first][Extra::E_HITS + pri],
+                      it->second->get_cache_hits(pri));
       }
     }
     // assert if we assigned more memory than is available.
@@ -310,6 +369,22 @@ namespace PriorityCache
 
       l.second->set(indexes[it->first][Extra::E_RESERVED], committed - alloc);
       l.second->set(indexes[it->first][Extra::E_COMMITTED], committed);
+      l.second->set(indexes[it->first][Extra::E_MISSES],
+                    it->second->get_cache_misses());
+
+      std::vector<uint64_t> ages[2];
+      it->second->get_cache_hit_ages(&ages[0], &ages[1]);
+      for (int pool = 0; pool < 2; pool++) {
+        // the last bucket takes every age past HIT_AGE_BINS
+        std::vector<uint64_t> hits(HIT_AGE_BINS + 1);
+        for (size_t age = 0; age < ages[pool].size(); age++) {
+          hits[std::min<size_t>(age, HIT_AGE_BINS)] += ages[pool][age];
+        }
+        for (int age = 0; age < HIT_AGE_BINS + 1; age++) {
+          l.second->hset(indexes[it->first][Extra::E_HIT_AGES],
+                         age, pool, hits[age]);
+        }
+      }
     }
   }
 
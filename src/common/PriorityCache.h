@@ -57,9 +57,16 @@ namespace PriorityCache {
   enum Extra {
     E_RESERVED = Priority::LAST+1,
     E_COMMITTED,
-    E_LAST = E_COMMITTED,
+    E_MISSES,
+    E_HITS,  // hits of PRI0, followed by the hits of the other priorities
+    E_HIT_AGES = E_HITS + Priority::LAST + 1,
+    E_LAST = E_HIT_AGES,
   };
 
+  // Ages, in bins, the hit age histogram tells apart; older hits share the
+  // overflow bucket.
+  constexpr int HIT_AGE_BINS = 32;
+
   int64_t get_chunk(uint64_t usage, uint64_t total_bytes);
 
   struct PriCache {
@@ -112,6 +119,27 @@ namespace PriorityCache {
 
     // Get bins
     virtual uint64_t get_bins(PriorityCache::Priority pri) const = 0;
+
+    /* Get the number of hits so far on items of the given priority, that is
+     * on items in the same age range as counted by request_cache_bytes.  To
+     * tell how much use each priority gets out of the bytes assigned to it.
+     */
+    virtual uint64_t get_cache_hits(PriorityCache::Priority pri) const {
+      return 0;
+    }
+
+    // Get the number of misses so far.
+    virtual uint64_t get_cache_misses() const {
+      return 0;
+    }
+
+    /* Get the number of hits so far on high and low priority items by their
+     * age in bins, one element per bin; the last element counts the hits on
+     * items older than the bins the cache tracks.  Left empty by caches that
+     * don't keep track. */
+    virtual void get_cache_hit_ages(std::vector<uint64_t>* high,
+                                    std::vector<uint64_t>* low) const {
+    }
   };
 
   class Manager {
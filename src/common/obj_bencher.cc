@@ -16,6 +16,7 @@
  * it will just loop forever.
  */
 #include "include/compat.h"
+#include <algorithm>
 #include <pthread.h>
 #include "common/ceph_mutex.h"
 #include "common/Clock.h"
@@ -244,6 +245,18 @@ void *ObjBencher::status_printer(void *_bencher) {
   return NULL;
 }
 
+double ObjBencher::latency_percentile(double p)
+{
+  if (data.latencies.empty()) {
+    return 0;
+  }
+  size_t n = std::min<size_t>(data.latencies.size() * p,
+                              data.latencies.size() - 1);
+  std::nth_element(data.latencies.begin(), data.latencies.begin() + n,
+                   data.latencies.end());
+  return data.latencies[n];
+}
+
 int ObjBencher::aio_bench(
   int operation, int secondsToRun,
   int concurrentios,
@@ -456,6 +469,7 @@ int ObjBencher::write_bench(int secondsToRun,
   ceph_pthread_setname(print_thread, "write_stat");
   std::unique_lock locker{lock};
   data.finished = 0;
+  data.latencies.clear();
   data.start_time = mono_clock::now();
   locker.unlock();
   for (int i = 0; i<concurrentios; ++i) {
@@ -511,6 +525,7 @@ int ObjBencher::write_bench(int secondsToRun,
     }
     data.cur_latency = mono_clock::now() - start_times[slot];
     total_latency += data.cur_latency.count();
+    data.latencies.push_back(data.cur_latency.count());
     if( data.cur_latency.count() > data.max_latency)
       data.max_latency = data.cur_latency.count();
     if (data.cur_latency.count() < data.min_latency)
@@ -608,7 +623,9 @@ int ObjBencher::write_bench(int secondsToRun,
        << "Average Latency(s):     " << data.avg_latency << std::endl
        << "Stddev Latency(s):      " << latency_stddev << std::endl
        << "Max latency(s):         " << data.max_latency << std::endl
-       << "Min latency(s):         " << data.min_latency << std::endl;
+       << "Min latency(s):         " << data.min_latency << std::endl
+       << "p50 latency(s):         " << latency_percentile(0.5) << std::endl
+       << "p99 latency(s):         " << latency_percentile(0.99) << std::endl;
   } else {
     formatter->dump_format("total_time_run", "%f", timePassed.count());
     formatter->dump_format("total_writes_made", "%d", data.finished);
@@ -626,6 +643,8 @@ int ObjBencher::write_bench(int secondsToRun,
     formatter->dump_format("stddev_latency", "%f", latency_stddev);
     formatter->dump_format("max_latency", "%f", data.max_latency);
     formatter->dump_format("min_latency", "%f", data.min_latency);
+    formatter->dump_format("p50_latency", "%f", latency_percentile(0.5));
+    formatter->dump_format("p99_latency", "%f", latency_percentile(0.99));
   }
   //write object size/number data for read benchmarks
   encode(data.object_size, b_write);
@@ -686,6 +705,7 @@ int ObjBencher::seq_read_bench(
 
   std::unique_lock locker{lock};
   data.finished = 0;
+  data.latencies.clear();
   data.start_time = mono_clock::now();
   locker.unlock();
 
@@ -772,6 +792,7 @@ int ObjBencher::seq_read_bench(
       goto ERR;
     }
     total_latency += data.cur_latency.count();
+    data.latencies.push_back(data.cur_latency.count());
     if (data.cur_latency.count() > data.max_latency)
       data.max_latency = data.cur_latency.count();
     if (data.cur_latency.count() < data.min_latency)
@@ -830,7 +851,9 @@ int ObjBencher::seq_read_bench(
        << "Min IOPS:             " << data.idata.min_iops << std::endl
        << "Average Latency(s):   " << data.avg_latency << std::endl
        << "Max latency(s):       " << data.max_latency << std::endl
-       << "Min latency(s):       " << data.min_latency << std::endl;
+       << "Min latency(s):       " << data.min_latency << std::endl
+       << "p50 latency(s):       " << latency_percentile(0.5) << std::endl
+       << "p99 latency(s):       " << latency_percentile(0.99) << std::endl;
   } else {
     formatter->dump_format("total_time_run", "%f", timePassed.count());
     formatter->dump_format("total_reads_made", "%d", data.finished);
@@ -844,6 +867,8 @@ int ObjBencher::seq_read_bench(
     formatter->dump_format("average_latency", "%f", data.avg_latency);
     formatter->dump_format("max_latency", "%f", data.max_latency);
     formatter->dump_format("min_latency", "%f", data.min_latency);
+    formatter->dump_format("p50_latency", "%f", latency_percentile(0.5));
+    formatter->dump_format("p99_latency", "%f", latency_percentile(0.99));
   }
 
   completions_done();
@@ -898,6 +923,7 @@ int ObjBencher::rand_read_bench(
 
   unique_lock locker{lock};
   data.finished = 0;
+  data.latencies.clear();
   data.start_time = mono_clock::now();
   locker.unlock();
 
@@ -967,6 +993,7 @@ int ObjBencher::rand_read_bench(
     }
 
     total_latency += data.cur_latency.count();
+    data.latencies.push_back(data.cur_latency.count());
     if (data.cur_latency.count() > data.max_latency)
       data.max_latency = data.cur_latency.count();
     if (data.cur_latency.count() < data.min_latency)
@@ -1043,7 +1070,9 @@ int ObjBencher::rand_read_bench(
        << "Min IOPS:             " << data.idata.min_iops << std::endl
        << "Average Latency(s):   " << data.avg_latency << std::endl
        << "Max latency(s):       " << data.max_latency << std::endl
-       << "Min latency(s):       " << data.min_latency << std::endl;
+       << "Min latency(s):       " << data.min_latency << std::endl
+       << "p50 latency(s):       " << latency_percentile(0.5) << std::endl
+       << "p99 latency(s):       " << latency_percentile(0.99) << std::endl;
   } else {
     formatter->dump_format("total_time_run", "%f", timePassed.count());
     formatter->dump_format("total_reads_made", "%d", data.finished);
@@ -1057,6 +1086,8 @@ int ObjBencher::rand_read_bench(
     formatter->dump_format("average_latency", "%f", data.avg_latency);
     formatter->dump_format("max_latency", "%f", data.max_latency);
     formatter->dump_format("min_latency", "%f", data.min_latency);
+    formatter->dump_format("p50_latency", "%f", latency_percentile(0.5));
+    formatter->dump_format("p99_latency", "%f", latency_percentile(0.99));
   }
   completions_done();
 
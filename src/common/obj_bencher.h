@@ -19,6 +19,7 @@
 #include "common/Formatter.h"
 #include "ceph_time.h"
 #include <cfloat>
+#include <vector>
 
 using ceph::mono_clock;
 
@@ -50,6 +51,7 @@ struct bench_data {
   struct bench_interval_data idata; // data that is updated by time intervals and not by events
   double latency_diff_sum;
   std::chrono::duration<double> cur_latency; //latency of last completed transaction - in seconds by default
+  std::vector<double> latencies; //latency of every completed transaction, for percentiles
   mono_time start_time; //start time for benchmark - use the monotonic clock as we'll measure the passage of time
   char *object_contents; //pointer to the contents written to each object
 };
@@ -72,6 +74,9 @@ protected:
 
   static void *status_printer(void *bencher);
 
+  // the latency below which p of the completed transactions finished
+  double latency_percentile(double p);
+
   struct bench_data data;
 
   int fetch_bench_metadata(const std::string& metadata_file, uint64_t* op_size,
@@ -347,6 +347,23 @@ void PerfCounters::hinc(int idx, int64_t x, int64_t y)
   data.histogram->inc(x, y);
 }
 
+void PerfCounters::hset(int idx, int64_t x, int64_t y, uint64_t v)
+{
+#ifndef WITH_SEASTAR
+  if (!m_cct->_conf->perf)
+    return;
+#endif
+
+  ceph_assert(idx > m_lower_bound);
+  ceph_assert(idx < m_upper_bound);
+
+  perf_counter_data_any_d& data(m_data[idx - m_lower_bound - 1]);
+  ceph_assert(data.type == (PERFCOUNTER_HISTOGRAM | PERFCOUNTER_COUNTER | PERFCOUNTER_U64));
+  ceph_assert(data.histogram);
+
+  data.histogram->set(v, x, y);
+}
+
 pair<uint64_t, uint64_t> PerfCounters::get_tavg_ns(int idx) const
 {
 #ifndef WITH_SEASTAR
@@ -140,7 +140,8 @@ private:
  * The difference between values, counters and histograms is in how they are initialized
  * and accessed. For a counter, use the inc(counter, amount) function (note
  * that amount defaults to 1 if you don't set it). For a value, use the
- * set(index, value) function. For histogram use the hinc(value1, value2) function.
+ * set(index, value) function. For histogram use the hinc(value1, value2) function,
+ * or hset(value1, value2, count) for counts kept elsewhere.
  * (For time, use the tinc and tset variants.)
  *
  * If for some reason you would like to reset your counters, you can do so using
@@ -244,6 +245,7 @@ public:
   utime_t tget(int idx) const;
 
   void hinc(int idx, int64_t x, int64_t y);
+  void hset(int idx, int64_t x, int64_t y, uint64_t v);
 
   void reset();
   void dump_formatted(ceph::Formatter *f, bool schema, bool dump_labeled,
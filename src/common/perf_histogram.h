@@ -121,6 +121,13 @@ public:
     m_rawData[index]++;
   }
 
+  /// Set counter for given axis values
+  template <typename... T>
+  void set(uint64_t v, T... axis) {
+    auto index = get_raw_index_for_value(axis...);
+    m_rawData[index] = v;
+  }
+
   /// Read value from given bucket
   template <typename... T>
   uint64_t read_bucket(T... bucket) const {
@@ -372,6 +372,16 @@ public:
     return nullptr;
   }
 
+  /// a column family cache that is sized separately from the main one
+  struct cf_cache_t {
+    std::shared_ptr<PriorityCache::PriCache> cache;
+    double ratio = 0;  ///< share of the total cache size it asked for
+  };
+  /// dedicated column family caches, by column family name
+  virtual std::map<std::string, cf_cache_t> get_cf_priority_caches() const {
+    return {};
+  }
+
 
 
   virtual ~KeyValueDB() {}
@@ -426,6 +436,11 @@ public:
     return;
   }
 
+  /// key ranges waiting for a compaction because of their tombstones
+  virtual void dump_tombstone_ranges(ceph::Formatter *f) {
+    return;
+  }
+
   /**
    * Return your perf counters if you have any.  Subclasses are not
    * required to implement this, and callers must respect a null return
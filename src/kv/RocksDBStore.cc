@@ -17,6 +17,7 @@
 #include "rocksdb/slice.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/filter_policy.h"
+#include "rocksdb/slice_transform.h"
 #include "rocksdb/utilities/convenience.h"
 #include "rocksdb/utilities/table_properties_collectors.h"
 #include "rocksdb/merge_operator.h"
@@ -872,10 +873,11 @@ extern rocksdb::Status rocksdb::StringToMap(const std::string& opts_str,
 // Splits column family options from single string into name->value column_opts_map.
 // The split is done using RocksDB parser that understands "{" and "}", so it
 // properly extracts compound options.
-// If non-RocksDB option "block_cache" is defined it is extracted to block_cache_opt.
+// Non-RocksDB options "block_cache", "bloom_bits" and "prefix_len" are moved
+// to ceph_opts_map.
 int RocksDBStore::split_column_family_options(const std::string& options,
 					      std::unordered_map<std::string, std::string>* opt_map,
-					      std::string* block_cache_opt)
+					      std::unordered_map<std::string, std::string>* ceph_opts_map)
 {
   dout(20) << __func__ << " options=" << options << dendl;
   rocksdb::Status status = rocksdb::StringToMap(options, opt_map);
@@ -884,12 +886,12 @@ int RocksDBStore::split_column_family_options(const std::string& options,
 	    << "' while parsing options '" << options << "'" << dendl;
     return -EINVAL;
   }
-  // if "block_cache" option exists, then move it to separate string
-  if (auto it = opt_map->find("block_cache"); it != opt_map->end()) {
-    *block_cache_opt = it->second;
-    opt_map->erase(it);
-  } else {
-    block_cache_opt->clear();
+  ceph_opts_map->clear();
+  for (const char* name : {"block_cache", "bloom_bits", "prefix_len"}) {
+    if (auto it = opt_map->find(name); it != opt_map->end()) {
+      (*ceph_opts_map)[name] = it->second;
+      opt_map->erase(it);
+    }
   }
   return 0;
 }
@@ -899,6 +901,8 @@ int RocksDBStore::split_column_family_options(const std::string& options,
 // Allowed options are exactly the same as allowed for column families in RocksDB.
 // Ceph addition is "block_cache" option that is translated to block_cache and
 // allows to specialize separate block cache for O column family.
+// Ceph additions "bloom_bits" and "prefix_len" set the bloom filter and
+// the fixed size prefix extractor of the column family, see apply_filter_options.
 //
 // base_name - name of column without shard suffix: "-"+number
 // options - additional options to apply
@@ -908,9 +912,9 @@ int RocksDBStore::update_column_family_options(const std::string& base_name,
 					       rocksdb::ColumnFamilyOptions* cf_opt)
 {
   std::unordered_map<std::string, std::string> options_map;
-  std::string block_cache_opt;
+  std::unordered_map<std::string, std::string> ceph_opts_map;
   rocksdb::Status status;
-  int r = split_column_family_options(more_options, &options_map, &block_cache_opt);
+  int r = split_column_family_options(more_options, &options_map, &ceph_opts_map);
   if (r != 0) {
     dout(5) << __func__ << " failed to parse options; column family=" << base_name
 	    << " options=" << more_options << dendl;
@@ -927,13 +931,17 @@ int RocksDBStore::update_column_family_options(const std::string& base_name,
     // default cf has its merge operator defined in load_rocksdb_options, should not override it
     install_cf_mergeop(base_name, cf_opt);
   }
-  if (!block_cache_opt.empty()) {
-    r = apply_block_cache_options(base_name, block_cache_opt, cf_opt);
+  if (auto it = ceph_opts_map.find("block_cache"); it != ceph_opts_map.end()) {
+    r = apply_block_cache_options(base_name, it->second, cf_opt);
     if (r != 0) {
       // apply_block_cache_options already does all necessary douts
       return r;
     }
   }
+  r = apply_filter_options(base_name, ceph_opts_map, cf_opt);
+  if (r != 0) {
+    return r;
+  }
 
   // Set Compact on Deletion Factory
   if (cct->_conf->rocksdb_cf_compact_on_deletion) {
@@ -987,6 +995,18 @@ int RocksDBStore::apply_block_cache_options(const std::string& column_name,
     cache_options_map.erase(it);
     require_new_block_cache = true;
   }
+  // share of the total cache size given to this cache by the cache autotuner
+  double cache_ratio = 0.0;
+  if (auto it = cache_options_map.find("ratio"); it != cache_options_map.end()) {
+    std::string error;
+    cache_ratio = strict_strtod(it->second.c_str(), &error);
+    if (!error.empty() || cache_ratio < 0 || cache_ratio > 1.0) {
+      dout(10) << __func__ << " invalid ratio (float): '" << it->second << "'" << dendl;
+      return -EINVAL;
+    }
+    cache_options_map.erase(it);
+    require_new_block_cache = true;
+  }
 
   rocksdb::BlockBasedTableOptions column_bbt_opts;
   status = GetBlockBasedTableOptionsFromMap(bbt_opts, cache_options_map, &column_bbt_opts);
@@ -1015,10 +1035,71 @@ int RocksDBStore::apply_block_cache_options(const std::string& column_name,
   }
   column_bbt_opts.block_cache = block_cache;
   cf_bbt_opts[column_name] = column_bbt_opts;
+  if (require_new_block_cache && block_cache && cache_ratio > 0) {
+    cf_cache_ratio[column_name] = cache_ratio;
+  } else {
+    cf_cache_ratio.erase(column_name);
+  }
   cf_opt->table_factory.reset(NewBlockBasedTableFactory(cf_bbt_opts[column_name]));
   return 0;
 }
 
+// Applies "bloom_bits" and "prefix_len" to a column family.
+// bloom_bits - bits per key of the bloom filter, 0 disables the filter;
+//   when not given the filter of rocksdb_bloom_bits_per_key is kept.
+// prefix_len - length of the fixed prefix to build prefix blooms on, both in
+//   the tables and in the memtable.  Seeks that stay within one prefix, like
+//   an object's omap in "p", can then skip tables without that prefix.
+int RocksDBStore::apply_filter_options(
+  const std::string& column_name,
+  const std::unordered_map<std::string, std::string>& ceph_opts_map,
+  rocksdb::ColumnFamilyOptions* cf_opt)
+{
+  if (auto it = ceph_opts_map.find("bloom_bits"); it != ceph_opts_map.end()) {
+    std::string error;
+    int64_t bloom_bits = strict_strtoll(it->second.c_str(), 10, &error);
+    if (!error.empty() || bloom_bits < 0) {
+      dout(5) << __func__ << " invalid bloom_bits: '" << it->second
+	      << "'; column=" << column_name << dendl;
+      return -EINVAL;
+    }
+    // column may share the default block cache, its table options are then
+    // a copy of the default ones
+    auto p = cf_bbt_opts.find(column_name);
+    if (p == cf_bbt_opts.end()) {
+      p = cf_bbt_opts.emplace(column_name, bbt_opts).first;
+    }
+    if (bloom_bits > 0) {
+      p->second.filter_policy.reset(rocksdb::NewBloomFilterPolicy(bloom_bits));
+    } else {
+      p->second.filter_policy.reset();
+    }
+    dout(10) << __func__ << " column=" << column_name
+	     << " bloom_bits=" << bloom_bits << dendl;
+    cf_opt->table_factory.reset(NewBlockBasedTableFactory(p->second));
+  }
+  if (auto it = ceph_opts_map.find("prefix_len"); it != ceph_opts_map.end()) {
+    std::string error;
+    int64_t prefix_len = strict_strtoll(it->second.c_str(), 10, &error);
+    if (!error.empty() || prefix_len < 0) {
+      dout(5) << __func__ << " invalid prefix_len: '" << it->second
+	      << "'; column=" << column_name << dendl;
+      return -EINVAL;
+    }
+    if (prefix_len > 0) {
+      cf_opt->prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(prefix_len));
+      if (cf_opt->memtable_prefix_bloom_size_ratio == 0) {
+	cf_opt->memtable_prefix_bloom_size_ratio = 0.02;
+      }
+    } else {
+      cf_opt->prefix_extractor.reset();
+    }
+    dout(10) << __func__ << " column=" << column_name
+	     << " prefix_len=" << prefix_len << dendl;
+  }
+  return 0;
+}
+
 int RocksDBStore::verify_sharding(const rocksdb::Options& opt,
 				  std::vector<rocksdb::ColumnFamilyDescriptor>& existing_cfs,
 				  std::vector<std::pair<size_t, RocksDBStore::ColumnFamily> >& existing_cfs_shard,
@@ -1251,9 +1332,33 @@ int RocksDBStore::do_open(ostream &out,
   plb.add_time_avg(l_rocksdb_write_delay_time, "rocksdb_write_delay_time", "Rocksdb write delay time");
   plb.add_time_avg(l_rocksdb_write_pre_and_post_process_time, 
       "rocksdb_write_pre_and_post_time", "total time spent on writing a record, excluding write process");
+  plb.add_u64_counter(l_rocksdb_tombstones_skipped, "tombstones_skipped",
+    "Tombstones tracked iterator runs stepped over");
+  plb.add_u64(l_rocksdb_tombstone_ranges, "tombstone_ranges",
+    "Key ranges tracked for their tombstones");
+  plb.add_u64_counter(l_rocksdb_tombstone_compact, "tombstone_compact",
+    "Compactions of key ranges dense with tombstones");
+  plb.add_time_avg(l_rocksdb_tombstone_compact_lat, "tombstone_compact_lat",
+    "Average compaction time of a key range dense with tombstones");
   logger = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 
+  tombstone_compact = cct->_conf.get_val<bool>("rocksdb_tombstone_compact");
+  tombstone_compact_min_skipped =
+    cct->_conf.get_val<uint64_t>("rocksdb_tombstone_compact_min_skipped");
+  tombstone_compact_ratio =
+    cct->_conf.get_val<double>("rocksdb_tombstone_compact_ratio");
+  tombstone_compact_trigger =
+    cct->_conf.get_val<uint64_t>("rocksdb_tombstone_compact_trigger");
+  tombstone_compact_interval = std::chrono::duration_cast<ceph::timespan>(
+    cct->_conf.get_val<std::chrono::seconds>("rocksdb_tombstone_compact_interval"));
+  tombstone_compact_duty =
+    cct->_conf.get_val<double>("rocksdb_tombstone_compact_duty");
+  tombstone_compact_max_ranges =
+    cct->_conf.get_val<uint64_t>("rocksdb_tombstone_compact_max_ranges");
+  tombstone_compact_sample = std::max<uint64_t>(
+    1, cct->_conf.get_val<uint64_t>("rocksdb_tombstone_compact_sample"));
+
   if (compact_on_mount) {
     derr << "Compacting rocksdb store..." << dendl;
     compact();
@@ -1728,7 +1833,7 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
     for (auto cf : p_iter->second.handles) {
       uint64_t cnt = db->get_delete_range_threshold();
       bat.SetSavePoint();
-      auto it = db->new_shard_iterator(cf);
+      auto it = db->new_shard_iterator(cf, prefix);
       for (it->seek_to_first(); it->valid() && (--cnt) != 0; it->next()) {
 	bat.Delete(cf, it->key());
       }
@@ -2020,12 +2125,289 @@ void RocksDBStore::compact_thread_entry()
       l.lock();
       continue;
     }
+    auto p = _pick_tombstone_range();
+    if (p != tombstone_ranges.end()) {
+      auto now = ceph::mono_clock::now();
+      if (now < next_tombstone_compact) {
+	// throttled, so user io does not keep competing with compactions
+	compact_queue_cond.wait_for(l, next_tombstone_compact - now);
+	continue;
+      }
+      dout(5) << __func__ << " compacting " << pretty_binary_string(p->first)
+	      << " to " << pretty_binary_string(p->second.end)
+	      << " with " << p->second.skipped << " tombstones, "
+	      << p->second.keys << " keys seen" << dendl;
+      tombstone_compacting.emplace(p->first, p->second.end);
+      tombstone_ranges.erase(p);
+      logger->set(l_rocksdb_tombstone_ranges, tombstone_ranges.size());
+      l.unlock();
+      compact_range(tombstone_compacting->first, tombstone_compacting->second);
+      auto lat = ceph::mono_clock::now() - now;
+      logger->inc(l_rocksdb_tombstone_compact);
+      logger->tinc(l_rocksdb_tombstone_compact_lat, lat);
+      l.lock();
+      tombstone_compacting.reset();
+      // rest long enough for these compactions to take no more than
+      // their duty share of the time
+      auto rest = std::chrono::duration_cast<ceph::timespan>(
+	lat * ((1.0 - tombstone_compact_duty) / tombstone_compact_duty));
+      next_tombstone_compact = ceph::mono_clock::now() +
+	std::max(tombstone_compact_interval, rest);
+      continue;
+    }
     dout(10) << __func__ << " waiting" << dendl;
     compact_queue_cond.wait(l);
   }
   dout(10) << __func__ << " exit" << dendl;
 }
 
+RocksDBStore::TombstoneTracker::TombstoneTracker(const RocksDBStore *db,
+						 std::string prefix,
+						 std::string limit)
+  : db(const_cast<RocksDBStore*>(db)),
+    prefix(std::move(prefix)),
+    limit(std::move(limit)),
+    enabled(db->tombstone_compact)
+{}
+
+// which runs of this thread are tracked
+static thread_local uint64_t tombstone_runs = 0;
+
+void RocksDBStore::TombstoneTracker::_raise_perf_level()
+{
+  // internal_delete_skipped_count is only kept from this level on
+  saved_perf_level = rocksdb::GetPerfLevel();
+  if (saved_perf_level < rocksdb::PerfLevel::kEnableCount) {
+    rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableCount);
+    raised_perf_level = true;
+  }
+}
+
+void RocksDBStore::TombstoneTracker::_restore_perf_level()
+{
+  if (raised_perf_level) {
+    raised_perf_level = false;
+    // leave it alone if someone else changed it meanwhile
+    if (rocksdb::GetPerfLevel() == rocksdb::PerfLevel::kEnableCount) {
+      rocksdb::SetPerfLevel(saved_perf_level);
+    }
+  }
+}
+
+void RocksDBStore::TombstoneTracker::seek()
+{
+  if (!enabled) {
+    return;
+  }
+  _finish();
+  if (tombstone_runs++ % db->tombstone_compact_sample != 0) {
+    return;
+  }
+  active = true;
+  _raise_perf_level();
+  mark = rocksdb::get_perf_context()->internal_delete_skipped_count;
+}
+
+void RocksDBStore::TombstoneTracker::seek(const rocksdb::Slice& target)
+{
+  seek();
+  if (active) {
+    _extend(target);
+  }
+}
+
+void RocksDBStore::TombstoneTracker::step()
+{
+  if (active) {
+    _raise_perf_level();
+    mark = rocksdb::get_perf_context()->internal_delete_skipped_count;
+  }
+}
+
+void RocksDBStore::TombstoneTracker::moved(rocksdb::Iterator *it, bool backward)
+{
+  if (!active) {
+    return;
+  }
+  uint64_t count = rocksdb::get_perf_context()->internal_delete_skipped_count;
+  _restore_perf_level();
+  // the perf context may have been reset in between, by rocksdb_perf
+  skipped += count >= mark ? count - mark : count;
+  mark = count;
+  if (it->Valid()) {
+    ++keys;
+    _extend(it->key());
+  } else if (!backward) {
+    ran_off = true;
+  }
+}
+
+void RocksDBStore::TombstoneTracker::abort()
+{
+  if (!active) {
+    return;
+  }
+  _restore_perf_level();
+  active = false;
+  ran_off = false;
+  skipped = 0;
+  keys = 0;
+  lo.clear();
+  hi.clear();
+}
+
+void RocksDBStore::TombstoneTracker::_extend(const rocksdb::Slice& key)
+{
+  // walks extend hi on every step, keep the buffers instead of allocating
+  if (lo.empty() && hi.empty()) {
+    lo.assign(key.data(), key.size());
+    hi.assign(key.data(), key.size());
+  } else if (key.compare(lo) < 0) {
+    lo.assign(key.data(), key.size());
+  } else if (key.compare(hi) > 0) {
+    hi.assign(key.data(), key.size());
+  }
+}
+
+void RocksDBStore::TombstoneTracker::_finish()
+{
+  if (!active) {
+    return;
+  }
+  active = false;
+  if (skipped > 0) {
+    db->logger->inc(l_rocksdb_tombstones_skipped, skipped);
+  }
+  if (skipped > 0 &&
+      skipped >= db->tombstone_compact_min_skipped &&
+      skipped >= db->tombstone_compact_ratio * (skipped + keys)) {
+    std::string start, end;
+    if (prefix.empty()) {
+      start = lo;
+      end = hi;
+    } else {
+      start = combine_strings(prefix, lo);
+      end = combine_strings(prefix, hi);
+    }
+    if (ran_off) {
+      if (!limit.empty()) {
+	end = limit;
+      } else {
+	// combined keys: up to the end of the last prefix seen
+	std::string last_prefix;
+	if (split_key(hi, &last_prefix, nullptr) == 0) {
+	  end = combine_strings(last_prefix, "\xff\xff\xff\xff");
+	}
+      }
+    }
+    if (!end.empty() && start <= end) {
+      // each tracked run stands for the runs that were not
+      uint64_t n = db->tombstone_compact_sample;
+      db->note_tombstones(start, end, skipped * n, keys * n);
+    }
+  }
+  ran_off = false;
+  skipped = 0;
+  keys = 0;
+  lo.clear();
+  hi.clear();
+}
+
+void RocksDBStore::note_tombstones(const string& start, const string& end,
+				   uint64_t skipped, uint64_t keys)
+{
+  dout(20) << __func__ << " " << pretty_binary_string(start)
+	   << " to " << pretty_binary_string(end)
+	   << " tombstones " << skipped << " keys " << keys << dendl;
+  std::lock_guard l(compact_queue_lock);
+  string range_start = start;
+  tombstone_range_t r;
+  r.end = end;
+  r.skipped = skipped;
+  r.keys = keys;
+  r.runs = 1;
+  r.first_seen = ceph::mono_clock::now();
+
+  // fold in the ranges this one overlaps
+  auto p = tombstone_ranges.upper_bound(start);
+  if (p != tombstone_ranges.begin() && std::prev(p)->second.end >= start) {
+    --p;
+  }
+  while (p != tombstone_ranges.end() && p->first <= r.end) {
+    range_start = std::min(range_start, p->first);
+    r.end = std::max(r.end, p->second.end);
+    r.skipped += p->second.skipped;
+    r.keys += p->second.keys;
+    r.runs += p->second.runs;
+    r.first_seen = std::min(r.first_seen, p->second.first_seen);
+    p = tombstone_ranges.erase(p);
+  }
+  bool ready = r.skipped >= tombstone_compact_trigger;
+  tombstone_ranges.emplace(range_start, std::move(r));
+
+  if (tombstone_ranges.size() > tombstone_compact_max_ranges) {
+    auto victim = std::min_element(
+      tombstone_ranges.begin(), tombstone_ranges.end(),
+      [](const auto& a, const auto& b) {
+	return a.second.skipped < b.second.skipped;
+      });
+    dout(10) << __func__ << " dropping " << pretty_binary_string(victim->first)
+	     << " with " << victim->second.skipped << " tombstones" << dendl;
+    tombstone_ranges.erase(victim);
+  }
+  logger->set(l_rocksdb_tombstone_ranges, tombstone_ranges.size());
+
+  if (ready && !compact_queue_stop) {
+    compact_queue_cond.notify_all();
+    if (!compact_thread.is_started()) {
+      compact_thread.create("rstore_compact");
+    }
+  }
+}
+
+RocksDBStore::tombstone_ranges_iterator RocksDBStore::_pick_tombstone_range()
+{
+  auto best = tombstone_ranges.end();
+  for (auto p = tombstone_ranges.begin(); p != tombstone_ranges.end(); ++p) {
+    if (p->second.skipped >= tombstone_compact_trigger &&
+	(best == tombstone_ranges.end() ||
+	 p->second.skipped > best->second.skipped)) {
+      best = p;
+    }
+  }
+  return best;
+}
+
+void RocksDBStore::dump_tombstone_ranges(Formatter *f)
+{
+  std::lock_guard l(compact_queue_lock);
+  auto now = ceph::mono_clock::now();
+  f->open_object_section("tombstone_ranges");
+  f->dump_bool("enabled", tombstone_compact);
+  f->dump_unsigned("trigger", tombstone_compact_trigger);
+  f->dump_unsigned("compact_queue_len", compact_queue.size());
+  if (tombstone_compacting) {
+    f->open_object_section("compacting");
+    f->dump_string("start", pretty_binary_string(tombstone_compacting->first));
+    f->dump_string("end", pretty_binary_string(tombstone_compacting->second));
+    f->close_section();
+  }
+  f->open_array_section("pending");
+  for (auto& [start, r] : tombstone_ranges) {
+    f->open_object_section("range");
+    f->dump_string("start", pretty_binary_string(start));
+    f->dump_string("end", pretty_binary_string(r.end));
+    f->dump_unsigned("tombstones", r.skipped);
+    f->dump_unsigned("keys", r.keys);
+    f->dump_unsigned("runs", r.runs);
+    f->dump_float("age", std::chrono::duration<double>(now - r.first_seen).count());
+    f->dump_bool("ready", r.skipped >= tombstone_compact_trigger);
+    f->close_section();
+  }
+  f->close_section();
+  f->close_section();
+}
+
 void RocksDBStore::compact_range_async(const string& start, const string& end)
 {
   std::lock_guard l(compact_queue_lock);
@@ -2129,20 +2511,26 @@ RocksDBStore::RocksDBWholeSpaceIteratorImpl::~RocksDBWholeSpaceIteratorImpl()
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first()
 {
+  tombstones.seek(rocksdb::Slice());
   dbiter->SeekToFirst();
+  tombstones.moved(dbiter);
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first(const string &prefix)
 {
   rocksdb::Slice slice_prefix(prefix);
+  tombstones.seek(slice_prefix);
   dbiter->Seek(slice_prefix);
+  tombstones.moved(dbiter);
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last()
 {
+  tombstones.seek();
   dbiter->SeekToLast();
+  tombstones.moved(dbiter, true);
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
 }
@@ -2150,6 +2538,7 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last(const string &pref
 {
   string limit = past_prefix(prefix);
   rocksdb::Slice slice_limit(limit);
+  tombstones.seek();
   dbiter->Seek(slice_limit);
 
   if (!dbiter->Valid()) {
@@ -2157,6 +2546,7 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last(const string &pref
   } else {
     dbiter->Prev();
   }
+  tombstones.moved(dbiter, true);
   return dbiter->status().ok() ? 0 : -1;
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::upper_bound(const string &prefix, const string &after)
@@ -2173,7 +2563,9 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::lower_bound(const string &prefi
 {
   string bound = combine_strings(prefix, to);
   rocksdb::Slice slice_bound(bound);
+  tombstones.seek(slice_bound);
   dbiter->Seek(slice_bound);
+  tombstones.moved(dbiter);
   return dbiter->status().ok() ? 0 : -1;
 }
 bool RocksDBStore::RocksDBWholeSpaceIteratorImpl::valid()
@@ -2183,7 +2575,9 @@ bool RocksDBStore::RocksDBWholeSpaceIteratorImpl::valid()
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::next()
 {
   if (valid()) {
+    tombstones.step();
     dbiter->Next();
+    tombstones.moved(dbiter);
   }
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
@@ -2191,7 +2585,9 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::next()
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::prev()
 {
   if (valid()) {
+    tombstones.step();
     dbiter->Prev();
+    tombstones.moved(dbiter, true);
   }
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
@@ -2252,6 +2648,18 @@ string RocksDBStore::past_prefix(const string &prefix)
   return limit;
 }
 
+// where a tombstone run of a column family iterator that walked off the
+// end stops, as a combined key
+static std::string tombstone_limit(const std::string& prefix,
+				   const KeyValueDB::IteratorBounds& bounds,
+				   bool bounds_enabled)
+{
+  if (bounds.upper_bound && bounds_enabled) {
+    return RocksDBStore::combine_strings(prefix, *bounds.upper_bound);
+  }
+  return RocksDBStore::combine_strings(prefix, "\xff\xff\xff\xff");
+}
+
 class CFIteratorImpl : public KeyValueDB::IteratorImpl {
 protected:
   string prefix;
@@ -2259,6 +2667,7 @@ protected:
   const KeyValueDB::IteratorBounds bounds;
   const rocksdb::Slice iterate_lower_bound;
   const rocksdb::Slice iterate_upper_bound;
+  RocksDBStore::TombstoneTracker tombstones;
 public:
   explicit CFIteratorImpl(const RocksDBStore* db,
                           const std::string& p,
@@ -2266,9 +2675,14 @@ public:
                           KeyValueDB::IteratorBounds bounds_)
     : prefix(p), bounds(std::move(bounds_)),
       iterate_lower_bound(make_slice(bounds.lower_bound)),
-      iterate_upper_bound(make_slice(bounds.upper_bound))
+      iterate_upper_bound(make_slice(bounds.upper_bound)),
+      tombstones(db, p, tombstone_limit(
+        p, bounds, db->cct->_conf->osd_rocksdb_iterator_bounds_enabled))
       {
       auto options = rocksdb::ReadOptions();
+      // use prefix blooms only where they give the same result as a total
+      // order seek, for columns with a prefix_len
+      options.auto_prefix_mode = true;
       if (db->cct->_conf->osd_rocksdb_iterator_bounds_enabled) {
         if (bounds.lower_bound) {
           options.iterate_lower_bound = &iterate_lower_bound;
@@ -2284,11 +2698,15 @@ public:
   }
 
   int seek_to_first() override {
+    tombstones.seek(iterate_lower_bound);
     dbiter->SeekToFirst();
+    tombstones.moved(dbiter);
     return dbiter->status().ok() ? 0 : -1;
   }
   int seek_to_last() override {
+    tombstones.seek();
     dbiter->SeekToLast();
+    tombstones.moved(dbiter, true);
     return dbiter->status().ok() ? 0 : -1;
   }
   int upper_bound(const string &after) override {
@@ -2300,18 +2718,24 @@ public:
   }
   int lower_bound(const string &to) override {
     rocksdb::Slice slice_bound(to);
+    tombstones.seek(slice_bound);
     dbiter->Seek(slice_bound);
+    tombstones.moved(dbiter);
     return dbiter->status().ok() ? 0 : -1;
   }
   int next() override {
     if (valid()) {
+      tombstones.step();
       dbiter->Next();
+      tombstones.moved(dbiter);
     }
     return dbiter->status().ok() ? 0 : -1;
   }
   int prev() override {
     if (valid()) {
+      tombstones.step();
       dbiter->Prev();
+      tombstones.moved(dbiter, true);
     }
     return dbiter->status().ok() ? 0 : -1;
   }
@@ -2814,6 +3238,7 @@ private:
   const rocksdb::Slice iterate_lower_bound;
   const rocksdb::Slice iterate_upper_bound;
   std::vector<rocksdb::Iterator*> iters;
+  RocksDBStore::TombstoneTracker tombstones;
 public:
   explicit ShardMergeIteratorImpl(const RocksDBStore* db,
 				  const std::string& prefix,
@@ -2821,10 +3246,13 @@ public:
                   KeyValueDB::IteratorBounds bounds_)
     : db(db), keyless(db->comparator), prefix(prefix), bounds(std::move(bounds_)),
       iterate_lower_bound(make_slice(bounds.lower_bound)),
-      iterate_upper_bound(make_slice(bounds.upper_bound))
+      iterate_upper_bound(make_slice(bounds.upper_bound)),
+      tombstones(db, prefix, tombstone_limit(
+        prefix, bounds, db->cct->_conf->osd_rocksdb_iterator_bounds_enabled))
   {
     iters.reserve(shards.size());
     auto options = rocksdb::ReadOptions();
+    options.auto_prefix_mode = true;
     if (db->cct->_conf->osd_rocksdb_iterator_bounds_enabled) {
       if (bounds.lower_bound) {
         options.iterate_lower_bound = &iterate_lower_bound;
@@ -2843,20 +3271,25 @@ public:
     }
   }
   int seek_to_first() override {
+    tombstones.seek(iterate_lower_bound);
     for (auto& it : iters) {
       it->SeekToFirst();
       if (!it->status().ok()) {
+	tombstones.abort();
 	return -1;
       }
     }
     //all iterators seeked, sort
     std::sort(iters.begin(), iters.end(), keyless);
+    tombstones.moved(iters[0]);
     return 0;
   }
   int seek_to_last() override {
+    tombstones.seek();
     for (auto& it : iters) {
       it->SeekToLast();
       if (!it->status().ok()) {
+	tombstones.abort();
 	return -1;
       }
     }
@@ -2880,36 +3313,44 @@ public:
       }
     }
     //no need to sort, as at most 1 iterator is valid now
+    tombstones.moved(iters[0], true);
     return 0;
   }
   int upper_bound(const string &after) override {
     rocksdb::Slice slice_bound(after);
+    tombstones.seek(slice_bound);
     for (auto& it : iters) {
       it->Seek(slice_bound);
       if (it->Valid() && it->key() == after) {
 	it->Next();
       }
       if (!it->status().ok()) {
+	tombstones.abort();
 	return -1;
       }
     }
     std::sort(iters.begin(), iters.end(), keyless);
+    tombstones.moved(iters[0]);
     return 0;
   }
   int lower_bound(const string &to) override {
     rocksdb::Slice slice_bound(to);
+    tombstones.seek(slice_bound);
     for (auto& it : iters) {
       it->Seek(slice_bound);
       if (!it->status().ok()) {
+	tombstones.abort();
 	return -1;
       }
     }
     std::sort(iters.begin(), iters.end(), keyless);
+    tombstones.moved(iters[0]);
     return 0;
   }
   int next() override {
     int r = -1;
     if (iters[0]->Valid()) {
+      tombstones.step();
       iters[0]->Next();
       if (iters[0]->status().ok()) {
 	r = 0;
@@ -2921,6 +3362,9 @@ public:
 	  }
 	  std::swap(iters[i], iters[i + 1]);
 	}
+	tombstones.moved(iters[0]);
+      } else {
+	tombstones.abort();
       }
     }
     return r;
@@ -2938,6 +3382,7 @@ public:
   // 3. go next() on all iterators except (2)
   // 4. sort
   int prev() override {
+    tombstones.step();
     std::vector<rocksdb::Iterator*> prev_done;
     //1
     for (auto it: iters) {
@@ -2961,6 +3406,7 @@ public:
 	iters[0]->Prev();
 	ceph_assert(!iters[0]->Valid());
       }
+      tombstones.moved(iters[0], true);
       return 0;
     }
     //2,3
@@ -2982,6 +3428,7 @@ public:
       if (hold == highest) break;
     }
     ceph_assert(hold == highest);
+    tombstones.moved(iters[0], true);
     return 0;
   }
   bool valid() override {
@@ -3039,12 +3486,14 @@ KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix, Itera
   }
 }
 
-RocksDBStore::WholeSpaceIterator RocksDBStore::new_shard_iterator(rocksdb::ColumnFamilyHandle* cf)
+RocksDBStore::WholeSpaceIterator RocksDBStore::new_shard_iterator(rocksdb::ColumnFamilyHandle* cf,
+								   const std::string& prefix)
 {
   return std::make_shared<RocksDBWholeSpaceIteratorImpl>(
     this,
     cf,
-    0);
+    0,
+    prefix);
 }
 
 KeyValueDB::Iterator RocksDBStore::new_shard_iterator(rocksdb::ColumnFamilyHandle* cf,
@@ -3304,8 +3753,10 @@ int RocksDBStore::reshard_cleanup(const RocksDBStore::columns_t& current_columns
     dout(5) << "Column " << name << " not part of new sharding. Deleting." << dendl;
 
     // verify that column is empty
+    rocksdb::ReadOptions ropts;
+    ropts.total_order_seek = true;
     std::unique_ptr<rocksdb::Iterator> it{
-      db->NewIterator(rocksdb::ReadOptions(), handle.get())};
+      db->NewIterator(ropts, handle.get())};
     ceph_assert(it);
     it->SeekToFirst();
     ceph_assert(!it->Valid());
@@ -3345,8 +3796,11 @@ int RocksDBStore::reshard(const std::string& new_sharding, const RocksDBStore::r
 			    const std::string& fixed_prefix)
   {
     dout(5) << " column=" << (void*)handle << " prefix=" << fixed_prefix << dendl;
+    // walk all keys, whatever prefix_len the column has
+    rocksdb::ReadOptions ropts;
+    ropts.total_order_seek = true;
     std::unique_ptr<rocksdb::Iterator> it{
-      db->NewIterator(rocksdb::ReadOptions(), handle)};
+      db->NewIterator(ropts, handle)};
     ceph_assert(it);
 
     rocksdb::WriteBatch bat;
@@ -3360,7 +3814,7 @@ int RocksDBStore::reshard(const std::string& new_sharding, const RocksDBStore::r
 	bytes_per_iterator = 0;
 	keys_per_iterator = 0;
 	std::string raw_key_str = raw_key.ToString();
-	it.reset(db->NewIterator(rocksdb::ReadOptions(), handle));
+	it.reset(db->NewIterator(ropts, handle));
 	ceph_assert(it);
 	it->Seek(raw_key_str);
 	ceph_assert(it->Valid());
@@ -10,6 +10,7 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <optional>
 #include <boost/scoped_ptr.hpp>
 #include "rocksdb/write_batch.h"
 #include "rocksdb/perf_context.h"
@@ -26,6 +27,7 @@
 #include "common/Formatter.h"
 #include "common/Cond.h"
 #include "common/ceph_context.h"
+#include "common/ceph_time.h"
 #include "common/PriorityCache.h"
 #include "common/pretty_binary.h"
 
@@ -42,6 +44,10 @@ enum {
   l_rocksdb_write_memtable_time,
   l_rocksdb_write_delay_time,
   l_rocksdb_write_pre_and_post_process_time,
+  l_rocksdb_tombstones_skipped,
+  l_rocksdb_tombstone_ranges,
+  l_rocksdb_tombstone_compact,
+  l_rocksdb_tombstone_compact_lat,
   l_rocksdb_last,
 };
 
@@ -125,6 +131,8 @@ private:
   typedef decltype(cf_handles)::iterator cf_handles_iterator;
   std::unordered_map<uint32_t, std::string> cf_ids_to_prefix;
   std::unordered_map<std::string, rocksdb::BlockBasedTableOptions> cf_bbt_opts;
+  /// share of the total cache size asked for by column families with their own cache
+  std::unordered_map<std::string, double> cf_cache_ratio;
   
   void add_column_family(const std::string& cf_name, uint32_t hash_l, uint32_t hash_h,
 			 size_t shard_idx, rocksdb::ColumnFamilyHandle *handle);
@@ -165,10 +173,13 @@ private:
   std::shared_ptr<rocksdb::Cache> create_block_cache(const std::string& cache_type, size_t cache_size, double cache_prio_high = 0.0);
   int split_column_family_options(const std::string& opts_str,
 				  std::unordered_map<std::string, std::string>* column_opts_map,
-				  std::string* block_cache_opt);
+				  std::unordered_map<std::string, std::string>* ceph_opts_map);
   int apply_block_cache_options(const std::string& column_name,
 				const std::string& block_cache_opt,
 				rocksdb::ColumnFamilyOptions* cf_opt);
+  int apply_filter_options(const std::string& column_name,
+			   const std::unordered_map<std::string, std::string>& ceph_opts_map,
+			   rocksdb::ColumnFamilyOptions* cf_opt);
   int update_column_family_options(const std::string& base_name,
 				   const std::string& more_options,
 				   rocksdb::ColumnFamilyOptions* cf_opt);
@@ -191,12 +202,90 @@ private:
 
   void compact_thread_entry();
 
+  /// a key range iterators found dense with tombstones
+  struct tombstone_range_t {
+    std::string end;
+    uint64_t skipped = 0;  ///< tombstones stepped over, summed over runs
+    uint64_t keys = 0;     ///< live keys landed on, summed over runs
+    uint32_t runs = 0;     ///< iterator runs that reported the range
+    ceph::mono_time first_seen;
+  };
+  // tunables, read on open
+  bool tombstone_compact = false;
+  uint64_t tombstone_compact_min_skipped = 0;
+  double tombstone_compact_ratio = 0;
+  uint64_t tombstone_compact_trigger = 0;
+  ceph::timespan tombstone_compact_interval = ceph::timespan::zero();
+  double tombstone_compact_duty = 0;
+  uint64_t tombstone_compact_max_ranges = 0;
+  uint64_t tombstone_compact_sample = 1;
+  /// ranges by start key, not overlapping, protected by compact_queue_lock
+  std::map<std::string, tombstone_range_t> tombstone_ranges;
+  /// the range being compacted, if any
+  std::optional<std::pair<std::string, std::string>> tombstone_compacting;
+  ceph::mono_time next_tombstone_compact;
+
+  typedef decltype(tombstone_ranges)::iterator tombstone_ranges_iterator;
+  /// the range with the most tombstones past the trigger, or end()
+  tombstone_ranges_iterator _pick_tombstone_range();
+
   void compact_range(const std::string& start, const std::string& end);
   void compact_range_async(const std::string& start, const std::string& end);
   int tryInterpret(const std::string& key, const std::string& val,
 		   rocksdb::Options& opt);
 
 public:
+  /**
+   * Counts the tombstones an iterator steps over between seeks and reports
+   * a run dense with them to note_tombstones().  Keys are the raw keys of
+   * the column family walked; with a prefix they are turned into the
+   * combined keys compact_range() takes, without they already are.
+   *
+   * Only one in rocksdb_tombstone_compact_sample runs of each thread is
+   * tracked.  The perf level of the thread is raised for each move of a
+   * tracked run only, from seek() or step() to moved() or abort(), so it
+   * is always put back on the thread that raised it.
+   */
+  class TombstoneTracker {
+    RocksDBStore *db;
+    std::string prefix;
+    std::string limit;   ///< where a run that walked off the end stops
+    bool enabled;
+    bool active = false;
+    bool ran_off = false;
+    bool raised_perf_level = false;
+    rocksdb::PerfLevel saved_perf_level = rocksdb::PerfLevel::kUninitialized;
+    uint64_t mark = 0;   ///< perf context count before the last move
+    uint64_t skipped = 0;
+    uint64_t keys = 0;
+    std::string lo, hi;  ///< raw keys covered by the run
+    void _raise_perf_level();
+    void _restore_perf_level();
+    void _finish();
+    void _extend(const rocksdb::Slice& key);
+  public:
+    TombstoneTracker(const RocksDBStore *db, std::string prefix,
+		     std::string limit);
+    ~TombstoneTracker() {
+      _finish();
+    }
+    /// call before a seek, which starts a new run
+    void seek();
+    void seek(const rocksdb::Slice& target);
+    /// call before next() or prev()
+    void step();
+    /// call once the iterator moved
+    void moved(rocksdb::Iterator *it, bool backward = false);
+    /// call instead of moved() if the move failed; drops the run
+    void abort();
+  };
+
+  /// an iterator run stepped over skipped tombstones and keys live keys
+  /// between combined keys start and end
+  void note_tombstones(const std::string& start, const std::string& end,
+		       uint64_t skipped, uint64_t keys);
+  void dump_tombstone_ranges(ceph::Formatter *f) override;
+
   /// compact the underlying rocksdb store
   bool compact_on_mount;
   bool disableWAL;
@@ -356,12 +445,21 @@ public:
     public KeyValueDB::WholeSpaceIteratorImpl {
   protected:
     rocksdb::Iterator *dbiter;
+    TombstoneTracker tombstones;
   public:
+    /// prefix is that of the keys of a shard cf, empty for combined keys
     explicit RocksDBWholeSpaceIteratorImpl(const RocksDBStore* db,
                                            rocksdb::ColumnFamilyHandle* cf,
-                                           const KeyValueDB::IteratorOpts opts)
+                                           const KeyValueDB::IteratorOpts opts,
+                                           const std::string& prefix = {})
+      : tombstones(db, prefix,
+                   prefix.empty() ? std::string() :
+                   combine_strings(prefix, "\xff\xff\xff\xff"))
       {
         rocksdb::ReadOptions options = rocksdb::ReadOptions();
+        // whole space iteration crosses prefixes, so prefix blooms may only
+        // be used where they give the same result as a total order seek
+        options.auto_prefix_mode = true;
         if (opts & ITERATOR_NOCACHE)
           options.fill_cache=false;
         dbiter = db->db->NewIterator(options, cf);
@@ -389,8 +487,9 @@ public:
 
   Iterator get_iterator(const std::string& prefix, IteratorOpts opts = 0, IteratorBounds = IteratorBounds()) override;
 private:
-  /// this iterator spans single cf
-  WholeSpaceIterator new_shard_iterator(rocksdb::ColumnFamilyHandle* cf);
+  /// this iterator spans single cf, a shard of prefix
+  WholeSpaceIterator new_shard_iterator(rocksdb::ColumnFamilyHandle* cf,
+					const std::string& prefix);
   Iterator new_shard_iterator(rocksdb::ColumnFamilyHandle* cf,
 			      const std::string& prefix, IteratorBounds bound);
 public:
@@ -515,13 +614,34 @@ err:
   virtual std::shared_ptr<PriorityCache::PriCache>
       get_priority_cache(std::string prefix) const override {
     auto it = cf_bbt_opts.find(prefix);
-    if (it != cf_bbt_opts.end()) {
+    if (it != cf_bbt_opts.end() &&
+	it->second.block_cache != bbt_opts.block_cache) {
       return std::dynamic_pointer_cast<PriorityCache::PriCache>(
           it->second.block_cache);
     }
     return nullptr;
   }
 
+  std::map<std::string, cf_cache_t> get_cf_priority_caches() const override {
+    std::map<std::string, cf_cache_t> caches;
+    for (auto& [name, opts] : cf_bbt_opts) {
+      if (!opts.block_cache || opts.block_cache == bbt_opts.block_cache) {
+	continue;
+      }
+      // caches without a ratio keep the size they were given
+      auto r = cf_cache_ratio.find(name);
+      if (r == cf_cache_ratio.end()) {
+	continue;
+      }
+      auto cache = std::dynamic_pointer_cast<PriorityCache::PriCache>(
+	opts.block_cache);
+      if (cache) {
+	caches[name] = {cache, r->second};
+      }
+    }
+    return caches;
+  }
+
   WholeSpaceIterator get_wholespace_iterator(IteratorOpts opts = 0) override;
 private:
   WholeSpaceIterator get_default_cf_iterator();
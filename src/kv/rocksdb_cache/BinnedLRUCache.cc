@@ -13,6 +13,7 @@
 
 #include "BinnedLRUCache.h"
 
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -109,9 +110,15 @@ BinnedLRUCacheShard::BinnedLRUCacheShard(CephContext *c, size_t capacity, bool s
       strict_capacity_limit_(strict_capacity_limit),
       high_pri_pool_ratio_(high_pri_pool_ratio),
       high_pri_pool_capacity_(0),
+      lru_len_(0),
       usage_(0),
       lru_usage_(0),
-      age_bins(1) {
+      age_bins(1),
+      bin_epoch_(0),
+      age_hits_(new std::atomic<uint64_t>[1]),
+      high_pri_age_hits_(new std::atomic<uint64_t>[1]) {
+  age_hits_[0] = 0;
+  high_pri_age_hits_[0] = 0;
   shift_bins();
   // Make empty circular linked list
   lru_.next = &lru_;
@@ -124,8 +131,37 @@ BinnedLRUCacheShard::~BinnedLRUCacheShard() {}
 
 bool BinnedLRUCacheShard::Unref(BinnedLRUHandle* e) {
   ceph_assert(e->refs > 0);
-  e->refs--;
-  return e->refs == 0;
+  return e->refs.fetch_sub(1) == 1;
+}
+
+void BinnedLRUCacheShard::CountHit(BinnedLRUHandle* e) {
+  bool high_pri = e->InHighPriPool();
+  if (high_pri) {
+    high_pri_hits_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    low_pri_hits_.fetch_add(1, std::memory_order_relaxed);
+  }
+  uint64_t age = bin_epoch_ - e->bin_epoch;
+  if (age < age_bins.size()) {
+    auto& hits = high_pri ? high_pri_age_hits_ : age_hits_;
+    hits[age].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void BinnedLRUCacheShard::AddToPool(BinnedLRUHandle* e) {
+  if (e->InHighPriPool()) {
+    high_pri_pool_usage_ += e->charge;
+  } else {
+    *(e->age_bin) += e->charge;
+  }
+}
+
+void BinnedLRUCacheShard::SubFromPool(BinnedLRUHandle* e) {
+  if (e->InHighPriPool()) {
+    high_pri_pool_usage_ -= e->charge;
+  } else {
+    *(e->age_bin) -= e->charge;
+  }
 }
 
 // Call deleter and free
@@ -133,18 +169,21 @@ bool BinnedLRUCacheShard::Unref(BinnedLRUHandle* e) {
 void BinnedLRUCacheShard::EraseUnRefEntries() {
   ceph::autovector<BinnedLRUHandle*> last_reference_list;
   {
-    std::lock_guard<std::mutex> l(mutex_);
-    while (lru_.next != &lru_) {
-      BinnedLRUHandle* old = lru_.next;
+    std::unique_lock l(mutex_);
+    BinnedLRUHandle* old = lru_.next;
+    while (old != &lru_) {
+      BinnedLRUHandle* next = old->next;
       ceph_assert(old->InCache());
-      ceph_assert(old->refs ==
-             1);  // LRU list contains elements which may be evicted
-      LRU_Remove(old);
-      table_.Remove(old->key(), old->hash);
-      old->SetInCache(false);
-      Unref(old);
-      usage_ -= old->charge;
-      last_reference_list.push_back(old);
+      if (old->refs == 1) {
+        LRU_Remove(old);
+        table_.Remove(old->key(), old->hash);
+        old->SetInCache(false);
+        Unref(old);
+        usage_ -= old->charge;
+        lru_usage_ -= old->charge;
+        last_reference_list.push_back(old);
+      }
+      old = next;
     }
   }
 
@@ -161,14 +200,14 @@ void BinnedLRUCacheShard::ApplyToAllCacheEntries(
   bool thread_safe)
 {
   if (thread_safe) {
-    mutex_.lock();
+    mutex_.lock_shared();
   }
   table_.ApplyToAllCacheEntries(
     [callback](BinnedLRUHandle* h) {
       callback(h->key(), h->value, h->charge, h->deleter);
     });
   if (thread_safe) {
-    mutex_.unlock();
+    mutex_.unlock_shared();
   }
 }
 
@@ -188,13 +227,13 @@ size_t BinnedLRUCacheShard::TEST_GetLRUSize() {
 }
 
 double BinnedLRUCacheShard::GetHighPriPoolRatio() const {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::shared_lock l(mutex_);
   return high_pri_pool_ratio_;
 }
 
 size_t BinnedLRUCacheShard::GetHighPriPoolUsage() const {
-  std::lock_guard<std::mutex> l(mutex_);
-  return high_pri_pool_usage_;
+  std::shared_lock l(mutex_);
+  return std::max<int64_t>(high_pri_pool_usage_, 0);
 }
 
 void BinnedLRUCacheShard::LRU_Remove(BinnedLRUHandle* e) {
@@ -206,13 +245,16 @@ void BinnedLRUCacheShard::LRU_Remove(BinnedLRUHandle* e) {
   e->next->prev = e->prev;
   e->prev->next = e->next;
   e->prev = e->next = nullptr;
-  lru_usage_ -= e->charge;
-  if (e->InHighPriPool()) {
-    ceph_assert(high_pri_pool_usage_ >= e->charge);
-    high_pri_pool_usage_ -= e->charge;
-  } else {
-    ceph_assert(*(e->age_bin) >= e->charge);
-    *(e->age_bin) -= e->charge;
+  --lru_len_;
+  // With mutex_ held exclusively nothing changes the pools concurrently, so
+  // they are exact here.
+  if (e->refs == 1) {
+    if (e->InHighPriPool()) {
+      ceph_assert(high_pri_pool_usage_ >= (int64_t)e->charge);
+    } else {
+      ceph_assert(*(e->age_bin) >= (int64_t)e->charge);
+    }
+    SubFromPool(e);
   }
 }
 
@@ -220,6 +262,7 @@ void BinnedLRUCacheShard::LRU_Insert(BinnedLRUHandle* e) {
   ceph_assert(e->next == nullptr);
   ceph_assert(e->prev == nullptr);
   e->age_bin = age_bins.front();
+  e->bin_epoch = bin_epoch_;
 
   if (high_pri_pool_ratio_ > 0 && e->IsHighPri()) {
     // Inset "e" to head of LRU list.
@@ -228,7 +271,9 @@ void BinnedLRUCacheShard::LRU_Insert(BinnedLRUHandle* e) {
     e->prev->next = e;
     e->next->prev = e;
     e->SetInHighPriPool(true);
-    high_pri_pool_usage_ += e->charge;
+    if (e->refs == 1) {
+      high_pri_pool_usage_ += e->charge;
+    }
     MaintainPoolSize();
   } else {
     // Insert "e" to the head of low-pri pool. Note that when
@@ -239,13 +284,15 @@ void BinnedLRUCacheShard::LRU_Insert(BinnedLRUHandle* e) {
     e->next->prev = e;
     e->SetInHighPriPool(false);
     lru_low_pri_ = e;
-    *(e->age_bin) += e->charge;
+    if (e->refs == 1) {
+      *(e->age_bin) += e->charge;
+    }
   }
-  lru_usage_ += e->charge;
+  ++lru_len_;
 }
 
 uint64_t BinnedLRUCacheShard::sum_bins(uint32_t start, uint32_t end) const {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::shared_lock l(mutex_);
   auto size = age_bins.size();
   if (size < start) {
     return 0;
@@ -253,33 +300,90 @@ uint64_t BinnedLRUCacheShard::sum_bins(uint32_t start, uint32_t end) const {
   uint64_t bytes = 0;
   end = (size < end) ? size : end;
   for (auto i = start; i < end; i++) {
-    bytes += *(age_bins[i]);
+    bytes += std::max<int64_t>(*(age_bins[i]), 0);
   }
   return bytes;
 }
 
+uint64_t BinnedLRUCacheShard::sum_hits(uint32_t start, uint32_t end) const {
+  std::shared_lock l(mutex_);
+  auto size = age_bins.capacity();
+  if (size < start) {
+    return 0;
+  }
+  uint64_t hits = 0;
+  end = (size < end) ? size : end;
+  for (auto i = start; i < end; i++) {
+    hits += age_hits_[i].load(std::memory_order_relaxed);
+  }
+  return hits;
+}
+
+void BinnedLRUCacheShard::add_hit_ages(std::vector<uint64_t>* high,
+                                       std::vector<uint64_t>* low) const {
+  std::shared_lock l(mutex_);
+  auto count = age_bins.capacity();
+  high->resize(std::max<size_t>(high->size(), count + 1));
+  low->resize(std::max<size_t>(low->size(), count + 1));
+  uint64_t high_binned = 0;
+  uint64_t low_binned = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t h = high_pri_age_hits_[i].load(std::memory_order_relaxed);
+    uint64_t lo = age_hits_[i].load(std::memory_order_relaxed);
+    (*high)[i] += h;
+    (*low)[i] += lo;
+    high_binned += h;
+    low_binned += lo;
+  }
+  uint64_t high_all = high_pri_hits_;
+  uint64_t low_all = low_pri_hits_;
+  high->back() += high_all > high_binned ? high_all - high_binned : 0;
+  low->back() += low_all > low_binned ? low_all - low_binned : 0;
+}
+
 void BinnedLRUCacheShard::MaintainPoolSize() {
   while (high_pri_pool_usage_ > high_pri_pool_capacity_) {
-    // Overflow last entry in high-pri pool to low-pri pool.
+    // Overflow last entry in high-pri pool to low-pri pool.  Referenced
+    // entries move along, but their charge is in neither pool.
     lru_low_pri_ = lru_low_pri_->next;
     ceph_assert(lru_low_pri_ != &lru_);
-    lru_low_pri_->SetInHighPriPool(false);
-    high_pri_pool_usage_ -= lru_low_pri_->charge;
-    *(lru_low_pri_->age_bin) += lru_low_pri_->charge;
+    if (lru_low_pri_->refs == 1) {
+      SubFromPool(lru_low_pri_);
+      lru_low_pri_->SetInHighPriPool(false);
+      AddToPool(lru_low_pri_);
+    } else {
+      lru_low_pri_->SetInHighPriPool(false);
+    }
   }
 }
 
 void BinnedLRUCacheShard::EvictFromLRU(size_t charge,
                                  ceph::autovector<BinnedLRUHandle*>* deleted) {
+  // Two laps are enough to clear the hit bit of every entry and then come
+  // across it again; whatever is left after that is referenced.  This runs
+  // under the exclusive lock, so a long run of referenced or hit entries
+  // is only partly skipped, and the cache stays over capacity until the
+  // next insert or release carries on from there.
+  size_t passes = std::min<size_t>(2 * lru_len_, kMaxEvictSkips);
   while (usage_ + charge > capacity_ && lru_.next != &lru_) {
     BinnedLRUHandle* old = lru_.next;
     ceph_assert(old->InCache());
-    ceph_assert(old->refs == 1);  // LRU list contains elements which may be evicted
+    if (old->refs > 1 || old->ClearHit()) {
+      if (passes == 0) {
+        break;
+      }
+      --passes;
+      // second chance: back to the head of its pool, and the current bin
+      LRU_Remove(old);
+      LRU_Insert(old);
+      continue;
+    }
     LRU_Remove(old);
     table_.Remove(old->key(), old->hash);
     old->SetInCache(false);
     Unref(old);
     usage_ -= old->charge;
+    lru_usage_ -= old->charge;
     deleted->push_back(old);
   }
 }
@@ -287,7 +391,7 @@ void BinnedLRUCacheShard::EvictFromLRU(size_t charge,
 void BinnedLRUCacheShard::SetCapacity(size_t capacity) {
   ceph::autovector<BinnedLRUHandle*> last_reference_list;
   {
-    std::lock_guard<std::mutex> l(mutex_);
+    std::unique_lock l(mutex_);
     capacity_ = capacity;
     high_pri_pool_capacity_ = capacity_ * high_pri_pool_ratio_;
     EvictFromLRU(0, &last_reference_list);
@@ -300,36 +404,40 @@ void BinnedLRUCacheShard::SetCapacity(size_t capacity) {
 }
 
 void BinnedLRUCacheShard::SetStrictCapacityLimit(bool strict_capacity_limit) {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::unique_lock l(mutex_);
   strict_capacity_limit_ = strict_capacity_limit;
 }
 
 rocksdb::Cache::Handle* BinnedLRUCacheShard::Lookup(const rocksdb::Slice& key, uint32_t hash) {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::shared_lock l(mutex_);
   BinnedLRUHandle* e = table_.Lookup(key, hash);
   if (e != nullptr) {
     ceph_assert(e->InCache());
-    if (e->refs == 1) {
-      LRU_Remove(e);
+    // leave e on the LRU list, EvictFromLRU skips it while it is referenced
+    if (e->refs.fetch_add(1) == 1) {
+      lru_usage_ -= e->charge;
+      SubFromPool(e);
     }
-    e->refs++;
     e->SetHit();
+    CountHit(e);
+  } else {
+    misses_.fetch_add(1, std::memory_order_relaxed);
   }
   return reinterpret_cast<rocksdb::Cache::Handle*>(e);
 }
 
 bool BinnedLRUCacheShard::Ref(rocksdb::Cache::Handle* h) {
   BinnedLRUHandle* handle = reinterpret_cast<BinnedLRUHandle*>(h);
-  std::lock_guard<std::mutex> l(mutex_);
-  if (handle->InCache() && handle->refs == 1) {
-    LRU_Remove(handle);
+  std::shared_lock l(mutex_);
+  if (handle->refs.fetch_add(1) == 1 && handle->InCache()) {
+    lru_usage_ -= handle->charge;
+    SubFromPool(handle);
   }
-  handle->refs++;
   return true;
 }
 
 void BinnedLRUCacheShard::SetHighPriPoolRatio(double high_pri_pool_ratio) {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::unique_lock l(mutex_);
   high_pri_pool_ratio_ = high_pri_pool_ratio;
   high_pri_pool_capacity_ = capacity_ * high_pri_pool_ratio_;
   MaintainPoolSize();
@@ -341,28 +449,55 @@ bool BinnedLRUCacheShard::Release(rocksdb::Cache::Handle* handle, bool force_era
   }
   BinnedLRUHandle* e = reinterpret_cast<BinnedLRUHandle*>(handle);
   bool last_reference = false;
-  {
-    std::lock_guard<std::mutex> l(mutex_);
+  ceph::autovector<BinnedLRUHandle*> last_reference_list;
+  if (!force_erase) {
+    // The entry stays where it is on the LRU list, so there is nothing that
+    // needs the exclusive lock.
+    bool over_capacity;
+    {
+      std::shared_lock l(mutex_);
+      uint32_t refs = e->refs.fetch_sub(1);
+      ceph_assert(refs > 0);
+      if (refs == 1) {
+        // in-cache entries hold a reference of their own
+        ceph_assert(!e->InCache());
+        usage_ -= e->charge;
+        last_reference = true;
+      } else if (refs == 2 && e->InCache()) {
+        // the item can be evicted again
+        lru_usage_ += e->charge;
+        AddToPool(e);
+      }
+      over_capacity = usage_ > capacity_;
+    }
+    // Inserts evict down to the capacity, but not past the referenced
+    // entries.  Carry on with that from where it stopped, rather than
+    // dropping the entry just released, which was the most recently used.
+    // Whoever has the lock already evicts or will release again, so don't
+    // wait for it.
+    if (over_capacity) {
+      std::unique_lock l(mutex_, std::try_to_lock);
+      if (l.owns_lock()) {
+        EvictFromLRU(0, &last_reference_list);
+      }
+    }
+  } else {
+    std::unique_lock l(mutex_);
     last_reference = Unref(e);
     if (last_reference) {
       usage_ -= e->charge;
     }
     if (e->refs == 1 && e->InCache()) {
       // The item is still in cache, and nobody else holds a reference to it
-      if (usage_ > capacity_ || force_erase) {
-        // the cache is full
-        // The LRU list must be empty since the cache is full
-        ceph_assert(!(usage_ > capacity_) || lru_.next == &lru_);
-        // take this opportunity and remove the item
-        table_.Remove(e->key(), e->hash);
-        e->SetInCache(false);
-        Unref(e);
-        usage_ -= e->charge;
-        last_reference = true;
-      } else {
-        // put the item on the list to be potentially freed
-        LRU_Insert(e);
-      }
+      lru_usage_ += e->charge;
+      AddToPool(e);
+      LRU_Remove(e);
+      table_.Remove(e->key(), e->hash);
+      e->SetInCache(false);
+      Unref(e);
+      usage_ -= e->charge;
+      lru_usage_ -= e->charge;
+      last_reference = true;
     }
   }
 
@@ -370,6 +505,9 @@ bool BinnedLRUCacheShard::Release(rocksdb::Cache::Handle* handle, bool force_era
   if (last_reference) {
     e->Free();
   }
+  for (auto entry : last_reference_list) {
+    entry->Free();
+  }
   return last_reference;
 }
 
@@ -397,12 +535,12 @@ rocksdb::Status BinnedLRUCacheShard::Insert(const rocksdb::Slice& key, uint32_t
   std::copy_n(key.data(), e->key_length, e->key_data);
 
   {
-    std::lock_guard<std::mutex> l(mutex_);
-    // Free the space following strict LRU policy until enough space
-    // is freed or the lru list is empty
+    std::unique_lock l(mutex_);
+    // Free the space following the CLOCK policy until enough space
+    // is freed or only referenced entries are left
     EvictFromLRU(charge, &last_reference_list);
 
-    if (usage_ - lru_usage_ + charge > capacity_ &&
+    if (GetPinnedUsageLocked() + charge > capacity_ &&
         (strict_capacity_limit_ || handle == nullptr)) {
       if (handle == nullptr) {
         // Don't insert the entry but still return ok, as if the entry inserted
@@ -420,17 +558,20 @@ rocksdb::Status BinnedLRUCacheShard::Insert(const rocksdb::Slice& key, uint32_t
       BinnedLRUHandle* old = table_.Insert(e);
       usage_ += e->charge;
       if (old != nullptr) {
+        // old is on LRU because it's in cache
+        LRU_Remove(old);
+        if (old->refs == 1) {
+          lru_usage_ -= old->charge;
+        }
         old->SetInCache(false);
         if (Unref(old)) {
           usage_ -= old->charge;
-          // old is on LRU because it's in cache and its reference count
-          // was just 1 (Unref returned 0)
-          LRU_Remove(old);
           last_reference_list.push_back(old);
         }
       }
+      LRU_Insert(e);
       if (handle == nullptr) {
-        LRU_Insert(e);
+        lru_usage_ += e->charge;
       } else {
         *handle = reinterpret_cast<rocksdb::Cache::Handle*>(e);
       }
@@ -451,17 +592,18 @@ void BinnedLRUCacheShard::Erase(const rocksdb::Slice& key, uint32_t hash) {
   BinnedLRUHandle* e;
   bool last_reference = false;
   {
-    std::lock_guard<std::mutex> l(mutex_);
+    std::unique_lock l(mutex_);
     e = table_.Remove(key, hash);
     if (e != nullptr) {
+      LRU_Remove(e);
+      if (e->refs == 1) {
+        lru_usage_ -= e->charge;
+      }
+      e->SetInCache(false);
       last_reference = Unref(e);
       if (last_reference) {
         usage_ -= e->charge;
       }
-      if (last_reference && e->InCache()) {
-        LRU_Remove(e);
-      }
-      e->SetInCache(false);
     }
   }
 
@@ -473,28 +615,45 @@ void BinnedLRUCacheShard::Erase(const rocksdb::Slice& key, uint32_t hash) {
 }
 
 size_t BinnedLRUCacheShard::GetUsage() const {
-  std::lock_guard<std::mutex> l(mutex_);
   return usage_;
 }
 
+size_t BinnedLRUCacheShard::GetPinnedUsageLocked() const {
+  size_t usage = usage_;
+  int64_t lru_usage = std::max<int64_t>(lru_usage_, 0);
+  return usage > (size_t)lru_usage ? usage - lru_usage : 0;
+}
+
 size_t BinnedLRUCacheShard::GetPinnedUsage() const {
-  std::lock_guard<std::mutex> l(mutex_);
-  ceph_assert(usage_ >= lru_usage_);
-  return usage_ - lru_usage_;
+  std::shared_lock l(mutex_);
+  return GetPinnedUsageLocked();
 }
 
 void BinnedLRUCacheShard::shift_bins() {
-  std::lock_guard<std::mutex> l(mutex_);
-  age_bins.push_front(std::make_shared<uint64_t>(0));
+  std::unique_lock l(mutex_);
+  age_bins.push_front(std::make_shared<std::atomic<int64_t>>(0));
+  ++bin_epoch_;
 }
 
 uint32_t BinnedLRUCacheShard::get_bin_count() const {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::shared_lock l(mutex_);
   return age_bins.capacity();
 }
 
 void BinnedLRUCacheShard::set_bin_count(uint32_t count) {
-  std::lock_guard<std::mutex> l(mutex_);
+  std::unique_lock l(mutex_);
+  if (count == age_bins.capacity()) {
+    return;
+  }
+  // keep the hits counted so far for the ages that are still tracked
+  for (auto h : {&age_hits_, &high_pri_age_hits_}) {
+    std::unique_ptr<std::atomic<uint64_t>[]> hits(
+      new std::atomic<uint64_t>[count]);
+    for (uint32_t i = 0; i < count; i++) {
+      hits[i] = i < age_bins.capacity() ? (*h)[i].load() : 0;
+    }
+    h->swap(hits);
+  }
   age_bins.set_capacity(count);
 }
 
@@ -502,7 +661,7 @@ std::string BinnedLRUCacheShard::GetPrintableOptions() const {
   const int kBufferSize = 200;
   char buffer[kBufferSize];
   {
-    std::lock_guard<std::mutex> l(mutex_);
+    std::shared_lock l(mutex_);
     snprintf(buffer, kBufferSize, "    high_pri_pool_ratio: %.3lf\n",
              high_pri_pool_ratio_);
   }
@@ -682,6 +841,63 @@ uint64_t BinnedLRUCache::sum_bins(uint32_t start, uint32_t end) const {
   return bytes;
 }
 
+uint64_t BinnedLRUCache::get_cache_hits(PriorityCache::Priority pri) const
+{
+  uint64_t hits = 0;
+  switch(pri) {
+  case PriorityCache::Priority::PRI0:
+    {
+      for (int s = 0; s < num_shards_; s++) {
+        hits += shards_[s].get_high_pri_hits();
+      }
+      break;
+    }
+  case PriorityCache::Priority::LAST:
+    {
+      // hits on low-pri entries older than the bins we track, as for
+      // request_cache_bytes
+      auto max = get_bin_count();
+      for (int s = 0; s < num_shards_; s++) {
+        uint64_t all = shards_[s].get_low_pri_hits();
+        uint64_t binned = shards_[s].sum_hits(0, max);
+        hits += all > binned ? all - binned : 0;
+      }
+      break;
+    }
+  default:
+    {
+      ceph_assert(pri > 0 && pri < PriorityCache::Priority::LAST);
+      auto prev_pri = static_cast<PriorityCache::Priority>(pri - 1);
+      uint64_t start = get_bins(prev_pri);
+      uint64_t end = get_bins(pri);
+      for (int s = 0; s < num_shards_; s++) {
+        hits += shards_[s].sum_hits(start, end);
+      }
+      break;
+    }
+  }
+  return hits;
+}
+
+uint64_t BinnedLRUCache::get_cache_misses() const
+{
+  uint64_t misses = 0;
+  for (int s = 0; s < num_shards_; s++) {
+    misses += shards_[s].get_misses();
+  }
+  return misses;
+}
+
+void BinnedLRUCache::get_cache_hit_ages(std::vector<uint64_t>* high,
+                                        std::vector<uint64_t>* low) const
+{
+  high->clear();
+  low->clear();
+  for (int s = 0; s < num_shards_; s++) {
+    shards_[s].add_hit_ages(high, low);
+  }
+}
+
 uint32_t BinnedLRUCache::get_bin_count() const {
   uint32_t result = 0;
   if (num_shards_ > 0) {
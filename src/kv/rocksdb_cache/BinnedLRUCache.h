@@ -10,8 +10,12 @@
 #ifndef ROCKSDB_BINNED_LRU_CACHE
 #define ROCKSDB_BINNED_LRU_CACHE
 
+#include <atomic>
 #include <string>
+#include <memory>
+#include <vector>
 #include <mutex>
+#include <shared_mutex>
 #include <boost/circular_buffer.hpp>
 
 #include "ShardedCache.h"
@@ -26,12 +30,11 @@ namespace rocksdb_cache {
 
 // An entry is a variable length heap-allocated structure.
 // Entries are referenced by cache and/or by any external entity.
-// The cache keeps all its entries in table. Some elements
-// are also stored on LRU list.
+// The cache keeps all its entries in table and on the LRU list.
 //
 // BinnedLRUHandle can be in these states:
 // 1. Referenced externally AND in hash table.
-//  In that case the entry is *not* in the LRU. (refs > 1 && in_cache == true)
+//  The entry is on the LRU but cannot be freed. (refs > 1 && in_cache == true)
 // 2. Not referenced externally and in hash table. In that case the entry is
 // in the LRU and can be freed. (refs == 1 && in_cache == true)
 // 3. Referenced externally and not in hash table. In that case the entry is
@@ -43,6 +46,18 @@ namespace rocksdb_cache {
 // state 3, either call BinnedLRUCacheShard::Erase or BinnedLRUCacheShard::Insert with the
 // same key.
 // To move from state 2 to state 1, use BinnedLRUCacheShard::Lookup.
+//
+// Lookup, Ref and Release only take the shard mutex shared and leave the
+// entry where it is on the LRU list.  A hit sets the entry's hit bit
+// instead, and eviction works like CLOCK: an entry at the old end that was
+// hit since the last pass, or that is referenced, is moved back to the head
+// of its pool (and into the current age bin) rather than being freed.
+// Referenced (pinned) entries stay on the list, but as with the strict LRU
+// this replaced their charge is kept out of the age bins and the high-pri
+// pool usage while they are referenced: it is taken out when the first
+// external reference is taken and put back in the entry's bin on the last
+// release.  So the bytes the cache requests per priority from the
+// PriorityCache manager still leave pinned data to the LAST priority.
 // Before destruction, make sure that no handles are in state 1. This means
 // that any successful BinnedLRUCacheShard::Lookup/BinnedLRUCacheShard::Insert have a
 // matching
@@ -56,7 +71,7 @@ std::shared_ptr<rocksdb::Cache> NewBinnedLRUCache(
     double high_pri_pool_ratio = 0.0);
 
 struct BinnedLRUHandle {
-  std::shared_ptr<uint64_t> age_bin;
+  std::shared_ptr<std::atomic<int64_t>> age_bin;
   void* value;
   DeleterFn deleter;
   BinnedLRUHandle* next_hash;
@@ -64,15 +79,23 @@ struct BinnedLRUHandle {
   BinnedLRUHandle* prev;
   size_t charge;  // TODO(opt): Only allow uint32_t?
   size_t key_length;
-  uint32_t refs;     // a number of refs to this entry
-                     // cache itself is counted as 1
+  std::atomic<uint32_t> refs;  // a number of refs to this entry
+                               // cache itself is counted as 1
 
   // Include the following flags:
   //   in_cache:    whether this entry is referenced by the hash table.
   //   is_high_pri: whether this entry is high priority entry.
   //   in_high_pri_pool: whether this entry is in high-pri pool.
+  // Only changed with the shard mutex held exclusively.
   char flags;
 
+  // Set on a hit, cleared when eviction passes the entry.  Hits only hold
+  // the shard mutex shared, so this one lives outside of flags.
+  std::atomic<bool> hit = {false};
+
+  // The age bin generation the entry was put in, to tell its age on a hit.
+  uint64_t bin_epoch = 0;
+
   uint32_t hash;     // Hash of key(); used for fast sharding and comparisons
 
   char* key_data = nullptr;  // Beginning of key
@@ -90,7 +113,7 @@ struct BinnedLRUHandle {
   bool InCache() { return flags & 1; }
   bool IsHighPri() { return flags & 2; }
   bool InHighPriPool() { return flags & 4; }
-  bool HasHit() { return flags & 8; }
+  bool HasHit() { return hit.load(std::memory_order_relaxed); }
 
   void SetInCache(bool in_cache) {
     if (in_cache) {
@@ -116,7 +139,16 @@ struct BinnedLRUHandle {
     }
   }
 
-  void SetHit() { flags |= 8; }
+  void SetHit() {
+    if (!HasHit()) {
+      hit.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  // Clear the hit bit, return whether it was set.
+  bool ClearHit() {
+    return HasHit() && hit.exchange(false, std::memory_order_relaxed);
+  }
 
   void Free() {
     ceph_assert((refs == 1 && InCache()) || (refs == 0 && !InCache()));
@@ -200,9 +232,8 @@ class alignas(CACHE_LINE_SIZE) BinnedLRUCacheShard : public CacheShard {
                        bool force_erase = false) override;
   virtual void Erase(const rocksdb::Slice& key, uint32_t hash) override;
 
-  // Although in some platforms the update of size_t is atomic, to make sure
-  // GetUsage() and GetPinnedUsage() work correctly under any platform, we'll
-  // protect them with mutex_.
+  // The usage counters are atomic, as Release() updates them with mutex_
+  // only held shared.
 
   virtual size_t GetUsage() const override;
   virtual size_t GetPinnedUsage() const override;
@@ -244,7 +275,32 @@ class alignas(CACHE_LINE_SIZE) BinnedLRUCacheShard : public CacheShard {
   // Get the byte counts for a range of age bins
   uint64_t sum_bins(uint32_t start, uint32_t end) const;
 
+  // Get the number of hits on low-pri entries for a range of ages in bins
+  uint64_t sum_hits(uint32_t start, uint32_t end) const;
+
+  // Add the hits by age in bins to high and low, one element per bin; the
+  // last element counts the hits on entries older than the bins tracked.
+  void add_hit_ages(std::vector<uint64_t>* high,
+                    std::vector<uint64_t>* low) const;
+
+  // Hits on entries in the high-pri pool
+  uint64_t get_high_pri_hits() const {
+    return high_pri_hits_;
+  }
+
+  // Hits on entries in the low-pri pool, of any age
+  uint64_t get_low_pri_hits() const {
+    return low_pri_hits_;
+  }
+
+  uint64_t get_misses() const {
+    return misses_;
+  }
+
  private:
+  // Most entries one EvictFromLRU() call passes over without freeing them.
+  static constexpr size_t kMaxEvictSkips = 1024;
+
   CephContext *cct;
   void LRU_Remove(BinnedLRUHandle* e);
   void LRU_Insert(BinnedLRUHandle* e);
@@ -257,17 +313,31 @@ class alignas(CACHE_LINE_SIZE) BinnedLRUCacheShard : public CacheShard {
   // Return true if last reference
   bool Unref(BinnedLRUHandle* e);
 
-  // Free some space following strict LRU policy until enough space
-  // to hold (usage_ + charge) is freed or the lru list is empty
+  // Account a hit on e, with mutex_ held at least shared.
+  void CountHit(BinnedLRUHandle* e);
+
+  // Add e's charge to, or take it out of, its pool: the high-pri pool usage
+  // or its age bin.  Done for the entries that are in the cache and only
+  // referenced by it, with mutex_ held at least shared.
+  void AddToPool(BinnedLRUHandle* e);
+  void SubFromPool(BinnedLRUHandle* e);
+
+  // GetPinnedUsage() with mutex_ held.
+  size_t GetPinnedUsageLocked() const;
+
+  // Free some space following the CLOCK policy until enough space to hold
+  // (usage_ + charge) is freed, or kMaxEvictSkips entries (at most every
+  // entry twice over) were passed over for being referenced or hit.
   // This function is not thread safe - it needs to be executed while
-  // holding the mutex_
+  // holding the mutex_ exclusively
   void EvictFromLRU(size_t charge, ceph::autovector<BinnedLRUHandle*>* deleted);
 
   // Initialized before use.
   size_t capacity_;
 
-  // Memory size for entries in high-pri pool.
-  size_t high_pri_pool_usage_;
+  // Memory size for unreferenced entries in high-pri pool.  Like the age
+  // bins it is updated under the shared lock, see lru_usage_.
+  std::atomic<int64_t> high_pri_pool_usage_;
 
   // Whether to reject insertion if cache reaches its full capacity.
   bool strict_capacity_limit_;
@@ -281,9 +351,12 @@ class alignas(CACHE_LINE_SIZE) BinnedLRUCacheShard : public CacheShard {
 
   // Dummy head of LRU list.
   // lru.prev is newest entry, lru.next is oldest entry.
-  // LRU contains items which can be evicted, ie reference only by cache
+  // LRU contains all the items in the table, referenced or not
   BinnedLRUHandle lru_;
 
+  // Number of entries on the LRU list.
+  size_t lru_len_;
+
   // Pointer to head of low-pri pool in LRU list.
   BinnedLRUHandle* lru_low_pri_;
 
@@ -301,18 +374,33 @@ class alignas(CACHE_LINE_SIZE) BinnedLRUCacheShard : public CacheShard {
   BinnedLRUHandleTable table_;
 
   // Memory size for entries residing in the cache
-  size_t usage_;
+  std::atomic<size_t> usage_;
 
-  // Memory size for entries residing only in the LRU list
-  size_t lru_usage_;
+  // Memory size for entries in the cache that are referenced only by the
+  // cache.  Updated under the shared lock by lookups and releases racing on
+  // different entries, so it may be seen below zero for a moment.
+  std::atomic<int64_t> lru_usage_;
 
-  // mutex_ protects the following state.
+  // mutex_ protects the following state.  It is taken shared by Lookup,
+  // Ref and Release, which only touch the atomics above and below, and
+  // exclusively by everything that changes the table or the LRU list.
   // We don't count mutex_ as the cache's internal state so semantically we
   // don't mind mutex_ invoking the non-const actions.
-  mutable std::mutex mutex_;
+  mutable std::shared_mutex mutex_;
 
   // Circular buffer of byte counters for age binning
-  boost::circular_buffer<std::shared_ptr<uint64_t>> age_bins;
+  boost::circular_buffer<std::shared_ptr<std::atomic<int64_t>>> age_bins;
+
+  // Bumped whenever the bins shift, see BinnedLRUHandle::bin_epoch.
+  uint64_t bin_epoch_;
+
+  // Hit counters, by age in bins as long as the entry's bin is still
+  // tracked; sized to age_bins.capacity().
+  std::unique_ptr<std::atomic<uint64_t>[]> age_hits_;
+  std::unique_ptr<std::atomic<uint64_t>[]> high_pri_age_hits_;
+  std::atomic<uint64_t> high_pri_hits_ = {0};
+  std::atomic<uint64_t> low_pri_hits_ = {0};
+  std::atomic<uint64_t> misses_ = {0};
 };
 
 class BinnedLRUCache : public ShardedCache {
@@ -350,6 +438,10 @@ class BinnedLRUCache : public ShardedCache {
   uint64_t sum_bins(uint32_t start, uint32_t end) const;
   uint32_t get_bin_count() const;
   void set_bin_count(uint32_t count);
+  virtual uint64_t get_cache_hits(PriorityCache::Priority pri) const;
+  virtual uint64_t get_cache_misses() const;
+  virtual void get_cache_hit_ages(std::vector<uint64_t>* high,
+                                  std::vector<uint64_t>* low) const;
 
   virtual std::string get_cache_name() const {
     return "RocksDB Binned LRU Cache";
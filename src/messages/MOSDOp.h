@@ -32,11 +32,19 @@
 
 class MOSDOpReply;
 
+// the dmclock phase an op was scheduled in, reported to clients that
+// track the service they get from each osd
+enum {
+  OSD_OP_QOS_PHASE_NONE = 0,	    // not scheduled by dmclock
+  OSD_OP_QOS_PHASE_RESERVATION = 1,
+  OSD_OP_QOS_PHASE_PRIORITY = 2,
+};
+
 namespace _mosdop {
 template<typename V>
 class MOSDOp final : public MOSDFastDispatchOp {
 private:
-  static constexpr int HEAD_VERSION = 8;
+  static constexpr int HEAD_VERSION = 9;
   static constexpr int COMPAT_VERSION = 3;
 
 private:
@@ -65,6 +73,16 @@ private:
   bool bdata_encode;
   osd_reqid_t reqid; // reqid explicitly set by sender
 
+  // dmclock feedback of clients tracking the service they get from each
+  // osd: delta and rho count the service other osds gave them since their
+  // last op to this one, in the cost units of the replies.  the phase and
+  // cost the op was scheduled with are set on the osd, for the reply.
+  bool qos_tracked = false;
+  uint32_t qos_delta = 0;
+  uint32_t qos_rho = 0;
+  uint8_t qos_phase = 0;
+  uint32_t qos_cost = 0;
+
 public:
   friend MOSDOpReply;
 
@@ -82,6 +100,15 @@ public:
   void set_spg(spg_t p) {
     pgid = p;
   }
+  void set_qos_params(uint32_t delta, uint32_t rho) {
+    qos_tracked = true;
+    qos_delta = delta;
+    qos_rho = rho;
+  }
+  void set_qos_resp(uint8_t phase, uint32_t cost) {
+    qos_phase = phase;
+    qos_cost = cost;
+  }
 
   // Fields decoded in partial decoding
   pg_t get_pg() const {
@@ -104,6 +131,18 @@ public:
     ceph_assert(!partial_decode_needed);
     return flags;
   }
+  bool has_qos_params() const {
+    ceph_assert(!partial_decode_needed);
+    return qos_tracked;
+  }
+  uint32_t get_qos_delta() const {
+    ceph_assert(!partial_decode_needed);
+    return qos_delta;
+  }
+  uint32_t get_qos_rho() const {
+    ceph_assert(!partial_decode_needed);
+    return qos_rho;
+  }
   osd_reqid_t get_reqid() const {
     ceph_assert(!partial_decode_needed);
     if (reqid.name != entity_name_t() || reqid.tid != 0) {
@@ -366,8 +405,12 @@ struct ceph_osd_request_head {
       encode(features, payload);
     } else {
       // latest v8 encoding with hobject_t hash separate from pgid, no
-      // reassert version
-      header.version = HEAD_VERSION;
+      // reassert version, and v9 with dmclock feedback.  v9 is only sent
+      // by clients configured to track their service, and only to osds
+      // that can decode it.
+      const bool encode_qos =
+	qos_tracked && HAVE_FEATURE(features, OSD_OP_QOS);
+      header.version = encode_qos ? HEAD_VERSION : 8;
 
       encode(pgid, payload);
       encode(hobj.get_hash(), payload);
@@ -375,6 +418,10 @@ struct ceph_osd_request_head {
       encode(flags, payload);
       encode(reqid, payload);
       encode_trace(payload, features);
+      if (encode_qos) {
+	encode(qos_delta, payload);
+	encode(qos_rho, payload);
+      }
 
       // -- above decoded up front; below decoded post-dispatch thread --
 
@@ -403,7 +450,7 @@ struct ceph_osd_request_head {
     p = std::cbegin(payload);
 
     // Always keep here the newest version of decoding order/rule
-    if (header.version == HEAD_VERSION) {
+    if (header.version >= 8) {
       decode(pgid, p);      // actual pgid
       uint32_t hash;
       decode(hash, p); // raw hash value
@@ -412,6 +459,11 @@ struct ceph_osd_request_head {
       decode(flags, p);
       decode(reqid, p);
       decode_trace(p);
+      if (header.version >= 9) {
+	decode(qos_delta, p);
+	decode(qos_rho, p);
+	qos_tracked = true;
+      }
     } else if (header.version == 7) {
       decode(pgid.pgid, p);      // raw pgid
       hobj.set_hash(pgid.pgid.ps());
@@ -31,7 +31,7 @@
 
 class MOSDOpReply final : public Message {
 private:
-  static constexpr int HEAD_VERSION = 8;
+  static constexpr int HEAD_VERSION = 9;
   static constexpr int COMPAT_VERSION = 2;
 
   object_t oid;
@@ -47,6 +47,8 @@ private:
   int32_t retry_attempt = -1;
   bool do_redirect;
   request_redirect_t redirect;
+  uint8_t qos_phase = OSD_OP_QOS_PHASE_NONE;
+  uint32_t qos_cost = 0;
 
 public:
   const object_t& get_oid() const { return oid; }
@@ -96,6 +98,13 @@ public:
 
   void add_flags(int f) { flags |= f; }
 
+  /// true if the op was scheduled by dmclock and the client tracks service
+  bool has_qos_resp() const { return qos_phase != OSD_OP_QOS_PHASE_NONE; }
+  bool is_qos_reservation() const {
+    return qos_phase == OSD_OP_QOS_PHASE_RESERVATION;
+  }
+  uint32_t get_qos_cost() const { return qos_cost; }
+
   void claim_op_out_data(std::vector<OSDOp>& o) {
     ceph_assert(ops.size() == o.size());
     for (unsigned i = 0; i < o.size(); i++) {
@@ -154,6 +163,10 @@ public:
     user_version = 0;
     retry_attempt = req->get_retry_attempt();
     do_redirect = false;
+    if (req->qos_tracked) {
+      qos_phase = req->qos_phase;
+      qos_cost = req->qos_cost;
+    }
 
     for (unsigned i = 0; i < ops.size(); i++) {
       // zero out input data
@@ -192,7 +205,11 @@ public:
       }
       ceph::encode_nohead(oid.name, payload);
     } else {
-      header.version = HEAD_VERSION;
+      // v9 adds the dmclock phase, only sent to clients that asked for it
+      // and can decode it
+      header.version =
+	has_qos_resp() && HAVE_FEATURE(features, OSD_OP_QOS) ?
+	HEAD_VERSION : 8;
       encode(oid, payload);
       encode(pgid, payload);
       encode(flags, payload);
@@ -223,6 +240,10 @@ public:
         }
       }
       encode_trace(payload, features);
+      if (header.version == HEAD_VERSION) {
+	encode(qos_phase, payload);
+	encode(qos_cost, payload);
+      }
     }
   }
   void decode_payload() override {
@@ -256,6 +277,8 @@ public:
       if (do_redirect)
 	decode(redirect, p);
       decode_trace(p);
+      decode(qos_phase, p);
+      decode(qos_cost, p);
     } else if (header.version < 2) {
       ceph_osd_reply_head head;
       decode(head, p);
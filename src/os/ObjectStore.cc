@@ -111,3 +111,40 @@ int ObjectStore::read_meta(const std::string& key,
   *value = string(buf, r);
   return 0;
 }
+
+int ObjectStore::omap_get_range(
+  CollectionHandle &c,
+  const ghobject_t &oid,
+  const std::string &start_after,
+  const std::string &filter_prefix,
+  uint64_t max_keys,
+  uint64_t max_bytes,
+  ceph::buffer::list *out,
+  uint32_t *num,
+  bool *more)
+{
+  *num = 0;
+  *more = false;
+  ObjectMap::ObjectMapIterator iter = get_omap_iterator(c, oid);
+  if (!iter) {
+    return -ENOENT;
+  }
+  iter->upper_bound(start_after);
+  if (filter_prefix > start_after) {
+    iter->lower_bound(filter_prefix);
+  }
+  for (; iter->valid(); iter->next()) {
+    std::string key = iter->key();
+    if (key.compare(0, filter_prefix.size(), filter_prefix) != 0) {
+      break;
+    }
+    if (*num >= max_keys || out->length() >= max_bytes) {
+      *more = true;
+      break;
+    }
+    encode(key, *out);
+    encode(iter->value(), *out);
+    ++*num;
+  }
+  return 0;
+}
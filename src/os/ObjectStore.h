@@ -120,6 +120,29 @@ public:
    */
   virtual const PerfCounters* get_perf_counters() const = 0;
 
+  /**
+   * Cumulative counts of the transactions committed and of the reads
+   * that went to the device, for estimating the capacity of the
+   * underlying device.
+   */
+  struct commit_stats_t {
+    uint64_t txcs = 0;           ///< transactions committed
+    uint64_t commit_lat_ns = 0;  ///< sum of their submit to commit latency
+    uint64_t bytes = 0;          ///< bytes they wrote
+    uint64_t reads = 0;          ///< reads that waited for the device
+    uint64_t read_lat_ns = 0;    ///< sum of their device latency
+    uint64_t read_bytes = 0;     ///< bytes they read from the device
+  };
+
+  /**
+   * Fetch Object Store commit statistics.
+   *
+   * Returns -EOPNOTSUPP if the store does not track them.
+   */
+  virtual int get_commit_stats(commit_stats_t *stats) {
+    return -EOPNOTSUPP;
+  }
+
   /**
    * a collection also orders transactions
    *
@@ -478,6 +501,26 @@ public:
      ceph::buffer::list& bl,
      uint32_t op_flags = 0) = 0;
 
+  /**
+   * is_read_cached -- would a read be served from memory
+   *
+   * Returns true only if stat() and a read() of the given range need
+   * no IO, and false if they may, or if the store cannot tell cheaply.
+   * Never blocks.  The answer may be stale by the time of the read.
+   *
+   * @param cid collection for object
+   * @param oid oid of object
+   * @param offset location offset of first byte to be read
+   * @param len number of bytes to be read, 0 for the metadata only
+   */
+  virtual bool is_read_cached(
+    CollectionHandle &c,
+    const ghobject_t& oid,
+    uint64_t offset,
+    size_t len) {
+    return false;
+  }
+
   /**
    * fiemap -- get extent std::map of data of an object
    *
@@ -569,6 +612,43 @@ public:
     return -ENOTSUP;
   }
 
+  struct defrag_stats_t {
+    uint64_t objects = 0;        ///< objects examined
+    uint64_t rewritten = 0;      ///< objects rewritten
+    uint64_t bytes = 0;          ///< bytes rewritten
+    uint64_t blobs_before = 0;   ///< blobs of rewritten objects, before
+    uint64_t blobs_after = 0;    ///< blobs of rewritten objects, after
+    uint64_t shards_before = 0;  ///< extent map shards, before
+    uint64_t shards_after = 0;   ///< extent map shards, after
+  };
+
+  /**
+   * defragment -- rewrite a fragmented object into fewer, larger extents
+   *
+   * The content of the object does not change.  The rewrite is queued on
+   * the collection like any other transaction, so the caller must order it
+   * with its own updates of the object, e.g. by holding the PG lock.
+   *
+   * @param cid collection for object
+   * @param oid oid of object
+   * @param stats [in,out] accumulated statistics
+   * @param on_commit completed once the rewrite is committed, or right away
+   *                  if nothing was rewritten
+   * @param handle to suspend the thread pool timeout while throttled
+   * @returns 1 if rewritten, 0 if left alone, negative error code on failure.
+   */
+  virtual int defragment(
+    CollectionHandle &c,
+    const ghobject_t& oid,
+    defrag_stats_t *stats,
+    Context *on_commit,
+    ThreadPool::TPHandle *handle = nullptr) {
+    if (on_commit) {
+      on_commit->complete(-ENOTSUP);
+    }
+    return -ENOTSUP;
+  }
+
   /**
    * getattr -- get an xattr of an object
    *
@@ -732,6 +812,31 @@ public:
     ) = 0;
 #endif
 
+  /**
+   * Get a range of key values in one call
+   *
+   * Returns the keys that sort after start_after and start with
+   * filter_prefix, with their values, encoded back to back into out the
+   * way CEPH_OSD_OP_OMAPGETVALS returns them.  No more than max_keys pairs
+   * are returned, and no more pairs once out has grown to max_bytes.
+   *
+   * @param num [out] number of pairs in out
+   * @param more [out] whether matching keys were left out because of
+   *                   max_keys or max_bytes
+   * @return zero on success, or negative error
+   */
+  virtual int omap_get_range(
+    CollectionHandle &c,               ///< [in] Collection containing oid
+    const ghobject_t &oid,             ///< [in] Object containing omap
+    const std::string &start_after,    ///< [in] Keys to get sort after this
+    const std::string &filter_prefix,  ///< [in] Keys to get start with this
+    uint64_t max_keys,                 ///< [in] Most pairs to return
+    uint64_t max_bytes,                ///< [in] Stop once out is this long
+    ceph::buffer::list *out,           ///< [out] Encoded keys and values
+    uint32_t *num,
+    bool *more
+    );
+
   /// Filters keys into out which are defined on oid
   virtual int omap_check_keys(
     CollectionHandle &c,     ///< [in] Collection containing oid
@@ -2,12 +2,15 @@
 // vim: ts=8 sw=2 smarttab
 
 #include "Allocator.h"
+#include <array>
 #include <bit>
+#include <cmath>
 #include "StupidAllocator.h"
 #include "BitmapAllocator.h"
 #include "AvlAllocator.h"
 #include "BtreeAllocator.h"
 #include "HybridAllocator.h"
+#include "SizeClassAllocator.h"
 #ifdef HAVE_LIBZBD
 #include "ZonedAllocator.h"
 #endif
@@ -190,6 +193,8 @@ Allocator *Allocator::create(
     return new HybridAllocator(cct, size, block_size,
       cct->_conf.get_val<uint64_t>("bluestore_hybrid_alloc_mem_cap"),
       name);
+  } else if (type == "sizeclass") {
+    return new SizeClassAllocator(cct, size, block_size, name);
 #ifdef HAVE_LIBZBD
   } else if (type == "zoned") {
     return new ZonedAllocator(cct, size, block_size, zone_size, first_sequential_zone,
@@ -228,24 +233,22 @@ void Allocator::release(const PExtentVector& release_vec)
  * Final score is obtained by proportion between score that would have been obtained
  * in condition of absolute fragmentation and score in no fragmentation at all.
  */
-double Allocator::get_fragmentation_score()
-{
-  // this value represents how much worth is 2X bytes in one chunk then in X + X bytes
-  static const double double_size_worth_small = 1.2;
-  // chunks larger then 128MB are large enough that should be counted without penalty
-  static const double double_size_worth_huge = 1;
-  static const size_t small_chunk_p2 = 20; // 1MB
-  static const size_t huge_chunk_p2 = 27; // 128MB
-  // for chunks 1MB - 128MB penalty coeffs are linearly weighted 1.2 (at small) ... 1 (at huge)
-  static std::vector<double> scales{1};
-  double score_sum = 0;
-  size_t sum = 0;
+namespace {
+// this value represents how much worth is 2X bytes in one chunk then in X + X bytes
+const double double_size_worth_small = 1.2;
+// chunks larger then 128MB are large enough that should be counted without penalty
+const double double_size_worth_huge = 1;
+const size_t small_chunk_p2 = 20; // 1MB
+const size_t huge_chunk_p2 = 27; // 128MB
 
-  auto get_score = [&](size_t v) -> double {
-    size_t sc = sizeof(v) * 8 - std::countl_zero(v) - 1; //assign to grade depending on log2(len)
-    while (scales.size() <= sc + 1) {
-      //unlikely expand scales vector
-      auto ss = scales.size();
+// scales[sc] is the per-byte value of a chunk of 2^sc bytes
+// for chunks 1MB - 128MB penalty coeffs are linearly weighted 1.2 (at small) ... 1 (at huge)
+const std::array<double, 66>& score_scales()
+{
+  static const std::array<double, 66> scales = [] {
+    std::array<double, 66> s;
+    s[0] = 1;
+    for (size_t ss = 1; ss < s.size(); ++ss) {
       double scale = double_size_worth_small;
       if (ss >= huge_chunk_p2) {
 	scale = double_size_worth_huge;
@@ -254,26 +257,55 @@ double Allocator::get_fragmentation_score()
 	scale = (double_size_worth_huge * (ss - small_chunk_p2) + double_size_worth_small * (huge_chunk_p2 - ss)) /
 	  (huge_chunk_p2 - small_chunk_p2);
       }
-      scales.push_back(scales[scales.size() - 1] * scale);
+      s[ss] = s[ss - 1] * scale;
     }
-    size_t sc_shifted = size_t(1) << sc;
-    double x = double(v - sc_shifted) / sc_shifted; //x is <0,1) in its scale grade
-    // linear extrapolation in its scale grade
-    double score = (sc_shifted    ) * scales[sc]   * (1-x) +
-                   (sc_shifted * 2) * scales[sc+1] * x;
-    return score;
-  };
+    return s;
+  }();
+  return scales;
+}
+}
+
+double Allocator::get_fragmentation_chunk_score(uint64_t len)
+{
+  ceph_assert(len > 0);
+  unsigned sc = std::bit_width(len) - 1; //assign to grade depending on log2(len)
+  return get_fragmentation_grade_score(sc, 1, len);
+}
 
+double Allocator::get_fragmentation_grade_score(unsigned sc, uint64_t count,
+						uint64_t bytes)
+{
+  // within its grade the score of a chunk is a linear extrapolation
+  //   2^sc * scales[sc] * (1 - x) + 2^(sc+1) * scales[sc+1] * x
+  // with x = len / 2^sc - 1 in <0,1), so for a number of chunks of the
+  // same grade only their count and total length matter
+  auto& scales = score_scales();
+  double sc_shifted = std::ldexp(1.0, sc);
+  return count * 2 * sc_shifted * (scales[sc] - scales[sc + 1]) +
+    bytes * (2 * scales[sc + 1] - scales[sc]);
+}
+
+double Allocator::get_fragmentation_score_of(double score_sum, uint64_t sum) const
+{
+  if (sum == 0) {
+    return 0;
+  }
+  double ideal = get_fragmentation_chunk_score(sum);
+  double terrible = (sum / block_size) * get_fragmentation_chunk_score(block_size);
+  return (ideal - score_sum) / (ideal - terrible);
+}
+
+double Allocator::get_fragmentation_score()
+{
+  double score_sum = 0;
+  size_t sum = 0;
   auto iterated_allocation = [&](size_t off, size_t len) {
     ceph_assert(len > 0);
-    score_sum += get_score(len);
+    score_sum += get_fragmentation_chunk_score(len);
     sum += len;
   };
   foreach(iterated_allocation);
-
-  double ideal = get_score(sum);
-  double terrible = (sum / block_size) * get_score(block_size);
-  return (ideal - score_sum) / (ideal - terrible);
+  return get_fragmentation_score_of(score_sum, sum);
 }
 
 void Allocator::build_free_state_histogram(
@@ -64,6 +64,8 @@ public:
   {
     return 0.0;
   }
+  /// walks the free extents, see get_fragmentation_grade_score() to do
+  /// without
   virtual double get_fragmentation_score();
   virtual void shutdown() = 0;
 
@@ -125,6 +127,13 @@ private:
 protected:
   const int64_t device_size = 0;
   const int64_t block_size = 0;
+
+  static double get_fragmentation_chunk_score(uint64_t len);
+  /// summed score of count chunks of [2^sc, 2^(sc+1)) bytes, bytes in total
+  static double get_fragmentation_grade_score(unsigned sc, uint64_t count,
+					      uint64_t bytes);
+  /// the score of free space of sum bytes whose chunks score score_sum
+  double get_fragmentation_score_of(double score_sum, uint64_t sum) const;
 };
 
 #endif
@@ -403,6 +403,16 @@ void BlueFS::_init_logger()
 	    "How many times bluefs read found page with all 0s");
   b.add_u64(l_bluefs_read_zeros_errors, "read_zeros_errors",
 	    "How many times bluefs read found transient page with all 0s");
+  b.add_u64_counter(l_bluefs_log_expand_waits, "log_expand_waits",
+		    "Log expansions that waited for async compaction");
+  b.add_time_avg(l_bluefs_log_expand_wait_lat, "log_expand_wait_lat",
+		 "Average wait for async compaction to permit log expansion");
+  b.add_u64_counter(l_bluefs_fsync_flushes, "fsync_flushes",
+		    "Device flushes issued for fsync");
+  b.add_u64_counter(l_bluefs_fsync_flushes_saved, "fsync_flushes_saved",
+		    "Device flushes saved by sharing another fsync's flush");
+  b.add_u64_counter(l_bluefs_recycled_wal_presized, "recycled_wal_presized",
+		    "Recycled WAL size extensions to the allocated space");
 
   logger = b.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
@@ -943,6 +953,7 @@ int BlueFS::mount()
     _stop_alloc();
     goto out;
   }
+  _rebuild_names_N();
 
   // init freelist
   for (auto& p : nodes.file_map) {
@@ -1017,6 +1028,7 @@ void BlueFS::umount(bool avoid_compact)
   _stop_alloc();
   nodes.file_map.clear();
   nodes.dir_map.clear();
+  names.clear_N();
   super = bluefs_super_t();
   _shutdown_logger();
 }
@@ -2471,6 +2483,60 @@ void BlueFS::_compact_log_dump_metadata_NF(uint64_t start_seq,
   }
 }
 
+void BlueFS::_compact_log_snapshot_NF(log_snapshot_t *snap,
+				      uint64_t capture_before_seq)
+{
+  dout(20) << __func__ << dendl;
+  std::lock_guard nl(nodes.lock);
+
+  snap->files.reserve(nodes.file_map.size());
+  for (auto& [ino, file_ref] : nodes.file_map) {
+    if (ino == 1)
+      continue;
+    ceph_assert(ino > 1);
+    std::lock_guard fl(file_ref->lock);
+    if (file_ref->dirty_seq >= capture_before_seq) {
+      dout(20) << __func__ << " just modified, dirty_seq="
+	       << file_ref->dirty_seq << " " << file_ref->fnode << dendl;
+    }
+    snap->files.emplace_back(file_ref->fnode);
+    // snapshot holds the whole fnode, updates to come are relative to it
+    file_ref->fnode.reset_delta();
+  }
+  snap->dirs.reserve(nodes.dir_map.size());
+  for (auto& [path, dir_ref] : nodes.dir_map) {
+    auto& links = snap->dirs.emplace_back(
+      path, std::vector<std::pair<std::string, uint64_t>>()).second;
+    links.reserve(dir_ref->file_map.size());
+    for (auto& [fname, file_ref] : dir_ref->file_map) {
+      links.emplace_back(fname, file_ref->fnode.ino);
+    }
+  }
+}
+
+void BlueFS::_compact_log_encode_snapshot(uint64_t start_seq,
+					  log_snapshot_t& snap,
+					  bluefs_transaction_t *t)
+{
+  dout(20) << __func__ << " " << snap.files.size() << " files, "
+	   << snap.dirs.size() << " dirs" << dendl;
+  t->seq = start_seq;
+  t->uuid = super.uuid;
+  for (auto& fnode : snap.files) {
+    dout(20) << __func__ << " op_file_update " << fnode << dendl;
+    t->op_file_update(fnode);
+  }
+  for (auto& [path, links] : snap.dirs) {
+    dout(20) << __func__ << " op_dir_create " << path << dendl;
+    t->op_dir_create(path);
+    for (auto& [fname, ino] : links) {
+      dout(20) << __func__ << " op_dir_link " << path << "/" << fname
+	       << " to " << ino << dendl;
+      t->op_dir_link(path, fname, ino);
+    }
+  }
+}
+
 void BlueFS::_compact_log_sync_LNF_LD()
 {
   dout(10) << __func__ << dendl;
@@ -2737,8 +2803,9 @@ void BlueFS::_rewrite_log_and_layout_sync_LNF_LD(bool permit_dev_fallback,
  *
  * 2. Build new log. It will include log's starter, compacted metadata
  *    body and the above tail. Jump ops appended to the starter and meta body
- *    will link the pieces togather. Log's lock is releases in the mid of the
- *    process to permit parallel access to it.
+ *    will link the pieces togather. Only a snapshot of the file map is taken
+ *    under log's lock; it is encoded after the lock is released, while
+ *    writers keep appending to the tail.
  *
  * 3. Write out new log's content.
  *
@@ -2799,12 +2866,18 @@ void BlueFS::_compact_log_async_LD_LNF_D() //also locks FW for new_writer
   // 1.1 allocate new log extents and store them at fnode_tail
   File *log_file = log.writer->file.get();
 
+  // The log can't be expanded until compaction completes, so make the tail
+  // large enough to take what was appended during the last compaction.
   old_log_jump_to = log_file->fnode.get_allocated();
+  uint64_t tail_need = std::clamp<uint64_t>(
+    2 * log_compact_growth + cct->_conf->bluefs_min_log_runway,
+    cct->_conf->bluefs_max_log_runway,
+    16 * cct->_conf->bluefs_max_log_runway);
   bluefs_fnode_t fnode_tail;
   dout(10) << __func__ << " old_log_jump_to 0x" << std::hex << old_log_jump_to
-           << " need 0x" << cct->_conf->bluefs_max_log_runway << std::dec << dendl;
+           << " need 0x" << tail_need << std::dec << dendl;
   int r = _allocate(vselector->select_prefer_bdev(log_file->vselector_hint),
-		    cct->_conf->bluefs_max_log_runway,
+		    tail_need,
                     0,
                     &fnode_tail);
   ceph_assert(r == 0);
@@ -2834,8 +2907,9 @@ void BlueFS::_compact_log_async_LD_LNF_D() //also locks FW for new_writer
   // Part 2.
   // Build new log starter and compacted metadata body
   // 2.1.  Build full compacted meta transaction.
-  //       While still holding the lock, encode a bluefs transaction
-  //       that dumps all of the in-memory fnodes and names.
+  //       While still holding the lock, capture a snapshot of all of the
+  //       in-memory fnodes and names. After releasing the lock encode
+  //       it into a bluefs transaction.
   //       This might be pretty large and its allocation map can exceed
   //       superblock size. Hence instead we'll need log starter part which
   //       goes to superblock and refers that new meta through op_update_inc.
@@ -2859,15 +2933,19 @@ void BlueFS::_compact_log_async_LD_LNF_D() //also locks FW for new_writer
   //
 
   // 2.1 Build full compacted meta transaction
-  bluefs_transaction_t compacted_meta_t;
-  _compact_log_dump_metadata_NF(starter_seq + 1, &compacted_meta_t, 0, seq_now);
+  log_snapshot_t snapshot;
+  _compact_log_snapshot_NF(&snapshot, seq_now);
 
-  // now state is captured to compacted_meta_t,
+  // now state is captured to snapshot,
   // current log can be used to write to,
   //ops in log will be continuation of captured state
   logger->tinc(l_bluefs_compaction_lock_lat, mono_clock::now() - t0);
   log.lock.unlock();
 
+  bluefs_transaction_t compacted_meta_t;
+  _compact_log_encode_snapshot(starter_seq + 1, snapshot, &compacted_meta_t);
+  snapshot = log_snapshot_t();
+
   // 2.2 Allocate the space required for the compacted meta transaction
   uint64_t compacted_meta_need = _estimate_transaction_size(&compacted_meta_t);
   dout(20) << __func__ << " compacted_meta_need " << compacted_meta_need
@@ -2965,6 +3043,9 @@ void BlueFS::_compact_log_async_LD_LNF_D() //also locks FW for new_writer
 
   // we need to acquire log's lock back at this point
   log.lock.lock();
+  log_compact_growth = log.writer->pos - old_log_jump_to;
+  dout(10) << __func__ << " log grew by 0x" << std::hex << log_compact_growth
+	   << " of 0x" << tail_need << std::dec << " while compacting" << dendl;
   // Reconstruct actual log object from the new one.
   vselector->sub_usage(log_file->vselector_hint, log_file->fnode);
   log_file->fnode.size =
@@ -3093,8 +3174,13 @@ int64_t BlueFS::_maybe_extend_log() {
 void BlueFS::_extend_log(uint64_t amount) {
   ceph_assert(ceph_mutex_is_locked(log.lock));
   std::unique_lock<ceph::mutex> ll(log.lock, std::adopt_lock);
-  while (log_forbidden_to_expand.load() == true) {
-    log_cond.wait(ll);
+  if (log_forbidden_to_expand.load() == true) {
+    auto t0 = mono_clock::now();
+    while (log_forbidden_to_expand.load() == true) {
+      log_cond.wait(ll);
+    }
+    logger->inc(l_bluefs_log_expand_waits);
+    logger->tinc(l_bluefs_log_expand_wait_lat, mono_clock::now() - t0);
   }
   ll.release();
   uint64_t allocated_before_extension = log.writer->file->fnode.get_allocated();
@@ -3418,6 +3504,13 @@ int BlueFS::_flush_range_F(FileWriter *h, uint64_t offset, uint64_t length)
   }
   if (h->file->fnode.size < offset + length) {
     h->file->fnode.size = offset + length;
+    if (h->recycled &&
+	cct->_conf.get_val<bool>("bluefs_recycled_wal_presize")) {
+      // cover the preallocated space at once, so that next appends find
+      // the size already logged
+      h->file->fnode.size = h->file->fnode.get_allocated();
+      logger->inc(l_bluefs_recycled_wal_presized);
+    }
     h->file->is_dirty = true;
   }
 
@@ -3697,7 +3790,11 @@ int BlueFS::fsync(FileWriter *h)/*_WF_WD_WLD_WLNF_WNF*/
     int r = _flush_F(h, true);
     if (r < 0)
       return r;
-    _flush_bdev(h);
+    if (cct->_conf.get_val<bool>("bluefs_group_fsync")) {
+      _flush_bdev_grouped(h);
+    } else {
+      _flush_bdev(h);
+    }
     if (h->file->is_dirty) {
       _signal_dirty_to_log_D(h);
       h->file->is_dirty = false;
@@ -3742,6 +3839,56 @@ void BlueFS::_flush_bdev(FileWriter *h, bool check_mutext_locked)
   _flush_bdev(flush_devs);
 }
 
+void BlueFS::_flush_bdev_grouped(FileWriter *h)
+{
+  ceph_assert(ceph_mutex_is_locked(h->lock));
+  std::array<bool, MAX_BDEV> flush_devs = h->dirty_devs;
+  h->dirty_devs.fill(false);
+#ifdef HAVE_LIBAIO
+  if (!cct->_conf->bluefs_sync_write) {
+    list<aio_t> completed_ios;
+    _claim_completed_aios(h, &completed_ios);
+    _wait_for_aio(h);
+    completed_ios.clear();
+  }
+#endif
+  for (unsigned i = 0; i < MAX_BDEV; i++) {
+    if (flush_devs[i]) {
+      _group_flush(i);
+    }
+  }
+}
+
+/*
+ * Group commit of device flushes.  Each caller takes a ticket once its
+ * writes are complete, so any flush started after that covers them.  The
+ * caller that finds no flush in progress flushes for every ticket handed
+ * out so far; callers that come during a flush wait for it and the next
+ * one, and return early if their ticket got covered meanwhile.
+ */
+void BlueFS::_group_flush(unsigned id)
+{
+  auto& g = flush_groups[id];
+  std::unique_lock l(g.lock);
+  uint64_t ticket = ++g.requested;
+  while (g.flushing) {
+    g.cond.wait(l);
+  }
+  if (g.completed >= ticket) {
+    logger->inc(l_bluefs_fsync_flushes_saved);
+    return;
+  }
+  g.flushing = true;
+  uint64_t covered = g.requested;
+  l.unlock();
+  bdev[id]->flush();
+  logger->inc(l_bluefs_fsync_flushes);
+  l.lock();
+  g.completed = covered;
+  g.flushing = false;
+  g.cond.notify_all();
+}
+
 void BlueFS::_flush_bdev(std::array<bool, MAX_BDEV>& dirty_bdevs)
 {
   // NOTE: this is safe to call without a lock.
@@ -4002,6 +4149,7 @@ int BlueFS::open_for_write(
     file->fnode.ino = ++ino_last;
     nodes.file_map[ino_last] = file;
     dir->file_map[string{filename}] = file;
+    names.insert_N(dirname, filename, file);
     ++file->refs;
     create = true;
     logger->set(l_bluefs_num_files, nodes.file_map.size());
@@ -4049,6 +4197,7 @@ int BlueFS::open_for_write(
 
   if (boost::algorithm::ends_with(filename, ".log")) {
     (*h)->writer_type = BlueFS::WRITER_WAL;
+    (*h)->recycled = overwrite;
     if (logger && !overwrite) {
       logger->inc(l_bluefs_files_written_wal);
     }
@@ -4122,27 +4271,17 @@ int BlueFS::open_for_read(
   std::string_view dirname,
   std::string_view filename,
   FileReader **h,
-  bool random)/*_N*/
+  bool random)
 {
   _maybe_check_vselector_LNF();
-  std::lock_guard nl(nodes.lock);
   dout(10) << __func__ << " " << dirname << "/" << filename
 	   << (random ? " (random)":" (sequential)") << dendl;
-  map<string,DirRef>::iterator p = nodes.dir_map.find(dirname);
-  if (p == nodes.dir_map.end()) {
-    dout(20) << __func__ << " dir " << dirname << " not found" << dendl;
-    return -ENOENT;
-  }
-  DirRef dir = p->second;
-
-  map<string,FileRef>::iterator q = dir->file_map.find(filename);
-  if (q == dir->file_map.end()) {
-    dout(20) << __func__ << " dir " << dirname << " (" << dir
-	     << ") file " << filename
+  FileRef file;
+  if (!names.find(dirname, filename, &file)) {
+    dout(20) << __func__ << " " << dirname << "/" << filename
 	     << " not found" << dendl;
     return -ENOENT;
   }
-  File *file = q->second.get();
 
   *h = new FileReader(file, random ? 4096 : cct->_conf->bluefs_max_prefetch,
 		      random, false);
@@ -4194,6 +4333,8 @@ int BlueFS::rename(
 
   new_dir->file_map[string{new_filename}] = file;
   old_dir->file_map.erase(string{old_filename});
+  names.insert_N(new_dirname, new_filename, file);
+  names.erase_N(old_dirname, old_filename);
 
   log.t.op_dir_link(new_dirname, new_filename, file->fnode.ino);
   log.t.op_dir_unlink(old_dirname, old_filename);
@@ -4211,6 +4352,7 @@ int BlueFS::mkdir(std::string_view dirname)/*_LN*/
     return -EEXIST;
   }
   nodes.dir_map[string{dirname}] = ceph::make_ref<Dir>();
+  names.insert_N(dirname, {}, nullptr);
   log.t.op_dir_create(dirname);
   return 0;
 }
@@ -4231,38 +4373,28 @@ int BlueFS::rmdir(std::string_view dirname)/*_LN*/
     return -ENOTEMPTY;
   }
   nodes.dir_map.erase(string{dirname});
+  names.erase_N(dirname, {});
   log.t.op_dir_remove(dirname);
   return 0;
 }
 
-bool BlueFS::dir_exists(std::string_view dirname)/*_N*/
+bool BlueFS::dir_exists(std::string_view dirname)
 {
-  std::lock_guard nl(nodes.lock);
-  map<string,DirRef>::iterator p = nodes.dir_map.find(dirname);
-  bool exists = p != nodes.dir_map.end();
+  bool exists = names.find(dirname, {}, nullptr);
   dout(10) << __func__ << " " << dirname << " = " << (int)exists << dendl;
   return exists;
 }
 
 int BlueFS::stat(std::string_view dirname, std::string_view filename,
-		 uint64_t *size, utime_t *mtime)/*_N*/
+		 uint64_t *size, utime_t *mtime)
 {
-  std::lock_guard nl(nodes.lock);
   dout(10) << __func__ << " " << dirname << "/" << filename << dendl;
-  map<string,DirRef>::iterator p = nodes.dir_map.find(dirname);
-  if (p == nodes.dir_map.end()) {
-    dout(20) << __func__ << " dir " << dirname << " not found" << dendl;
-    return -ENOENT;
-  }
-  DirRef dir = p->second;
-  map<string,FileRef>::iterator q = dir->file_map.find(filename);
-  if (q == dir->file_map.end()) {
-    dout(20) << __func__ << " dir " << dirname << " (" << dir
-	     << ") file " << filename
+  FileRef file;
+  if (!names.find(dirname, filename, &file)) {
+    dout(20) << __func__ << " " << dirname << "/" << filename
 	     << " not found" << dendl;
     return -ENOENT;
   }
-  File *file = q->second.get();
   dout(10) << __func__ << " " << dirname << "/" << filename
 	   << " " << file->fnode << dendl;
   if (size)
@@ -4295,6 +4427,7 @@ int BlueFS::lock_file(std::string_view dirname, std::string_view filename,
     file->fnode.mtime = ceph_clock_now();
     nodes.file_map[ino_last] = file;
     dir->file_map[string{filename}] = file;
+    names.insert_N(dirname, filename, file);
     logger->set(l_bluefs_num_files, nodes.file_map.size());
     ++file->refs;
     log.t.op_file_update(file->fnode);
@@ -4323,6 +4456,103 @@ int BlueFS::unlock_file(FileLock *fl)/*_N*/
   return 0;
 }
 
+BlueFS::name_index_t::~name_index_t()
+{
+  for (auto& b : buckets) {
+    delete b.load();
+  }
+}
+
+unsigned BlueFS::name_index_t::bucket_of(std::string_view dirname,
+					 std::string_view filename)
+{
+  size_t h = std::hash<std::string_view>{}(dirname);
+  h = h * 31 + std::hash<std::string_view>{}(filename);
+  return h % num_buckets;
+}
+
+bool BlueFS::name_index_t::find(std::string_view dirname,
+				std::string_view filename,
+				FileRef *file) const
+{
+  EpochDomain<bucket_t>::Guard g(epoch);
+  const bucket_t *b = buckets[bucket_of(dirname, filename)].load();
+  if (!b) {
+    return false;
+  }
+  for (auto& e : *b) {
+    if (e.filename == filename && e.dirname == dirname) {
+      if (file) {
+	*file = e.file;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+void BlueFS::name_index_t::insert_N(std::string_view dirname,
+				    std::string_view filename,
+				    FileRef file)
+{
+  auto& slot = buckets[bucket_of(dirname, filename)];
+  const bucket_t *old = slot.load();
+  auto b = new bucket_t;
+  if (old) {
+    b->reserve(old->size() + 1);
+    for (auto& e : *old) {
+      if (e.filename != filename || e.dirname != dirname) {
+	b->push_back(e);
+      }
+    }
+  }
+  b->push_back(entry_t{std::string(dirname), std::string(filename),
+		       std::move(file)});
+  slot.store(b);
+  epoch.retire(old);
+}
+
+void BlueFS::name_index_t::erase_N(std::string_view dirname,
+				   std::string_view filename)
+{
+  auto& slot = buckets[bucket_of(dirname, filename)];
+  const bucket_t *old = slot.load();
+  if (!old) {
+    return;
+  }
+  bucket_t *b = nullptr;
+  if (old->size() > 1) {
+    b = new bucket_t;
+    b->reserve(old->size() - 1);
+    for (auto& e : *old) {
+      if (e.filename != filename || e.dirname != dirname) {
+	b->push_back(e);
+      }
+    }
+  }
+  slot.store(b);
+  epoch.retire(old);
+}
+
+void BlueFS::name_index_t::clear_N()
+{
+  for (auto& slot : buckets) {
+    epoch.retire(slot.exchange(nullptr));
+  }
+  epoch.reclaim();
+}
+
+void BlueFS::_rebuild_names_N()
+{
+  names.clear_N();
+  for (auto& [dirname, dir] : nodes.dir_map) {
+    names.insert_N(dirname, {}, nullptr);
+    for (auto& [filename, file] : dir->file_map) {
+      names.insert_N(dirname, filename, file);
+    }
+  }
+}
+
 int BlueFS::readdir(std::string_view dirname, vector<string> *ls)/*_N*/
 {
   // dirname may contain a trailing /
@@ -4379,6 +4609,7 @@ int BlueFS::unlink(std::string_view dirname, std::string_view filename)/*_LND*/
     return -EBUSY;
   }
   dir->file_map.erase(string{filename});
+  names.erase_N(dirname, filename);
   log.t.op_dir_unlink(dirname, filename);
   _drop_link_D(file);
   return 0;
@@ -8,6 +8,7 @@
 #include <limits>
 
 #include "bluefs_types.h"
+#include "EpochDomain.h"
 #include "blk/BlockDevice.h"
 
 #include "common/RefCountedObj.h"
@@ -73,6 +74,11 @@ enum {
   l_bluefs_alloc_shared_size_fallbacks,
   l_bluefs_read_zeros_candidate,
   l_bluefs_read_zeros_errors,
+  l_bluefs_log_expand_waits,
+  l_bluefs_log_expand_wait_lat,
+  l_bluefs_fsync_flushes,
+  l_bluefs_fsync_flushes_saved,
+  l_bluefs_recycled_wal_presized,
   l_bluefs_last,
 };
 
@@ -216,6 +222,7 @@ public:
   public:
     int writer_type = 0;    ///< WRITER_*
     int write_hint = WRITE_LIFE_NOT_SET;
+    bool recycled = false;  ///< WAL reused in place, see bluefs_recycled_wal_presize
 
     ceph::mutex lock = ceph::make_mutex("BlueFS::FileWriter::lock");
     std::array<IOContext*,MAX_BDEV> iocv; ///< for each bdev
@@ -354,6 +361,45 @@ private:
     mempool::bluefs::unordered_map<uint64_t, FileRef> file_map;     ///< ino -> File
   } nodes;
 
+  /*
+   * Name lookups without nodes.lock, for open_for_read, stat and
+   * dir_exists.  dirname/filename pairs are hashed into buckets, each an
+   * immutable vector published through an atomic pointer.  Updates are
+   * made under nodes.lock along with nodes.dir_map and copy one bucket;
+   * replaced buckets are freed once no lookup can still see them.
+   * A directory is an entry with an empty filename and no file.
+   *
+   * Only lookups are taken off nodes.lock.  Writers already lock per
+   * writer (FileWriter::lock) and per file (File::lock) for data; they
+   * still serialize on log.lock and dirty.lock whenever metadata has to
+   * reach the log (create, rename, unlink, fsync of a dirty fnode).
+   * Splitting the log is out of scope here.
+   */
+  struct name_index_t {
+    struct entry_t {
+      std::string dirname;
+      std::string filename;
+      FileRef file;
+    };
+    using bucket_t = std::vector<entry_t>;
+    static constexpr unsigned num_buckets = 1024;
+
+    std::atomic<const bucket_t*> buckets[num_buckets] = {};
+    mutable EpochDomain<bucket_t> epoch;
+
+    ~name_index_t();
+    static unsigned bucket_of(std::string_view dirname,
+			      std::string_view filename);
+    /// find a file, or a directory with empty filename; false if missing
+    bool find(std::string_view dirname, std::string_view filename,
+	      FileRef *file) const;
+    void insert_N(std::string_view dirname, std::string_view filename,
+		  FileRef file);
+    void erase_N(std::string_view dirname, std::string_view filename);
+    void clear_N();
+  } names;
+  void _rebuild_names_N();
+
   bluefs_super_t super;        ///< latest superblock (as last written)
   uint64_t ino_last = 0;       ///< last assigned ino (this one is in use)
 
@@ -381,6 +427,19 @@ private:
   std::atomic<bool> log_is_compacting{false};                    ///< signals that bluefs log is already ongoing compaction
   std::atomic<bool> log_forbidden_to_expand{false};              ///< used to signal that async compaction is in state
                                                                  ///  that prohibits expansion of bluefs log
+  uint64_t log_compact_growth = 0;                               ///< bytes appended to the log during last async
+                                                                 ///  compaction, sizes the next one's runway
+
+  /// device flushes shared by concurrent fsyncs, see _flush_bdev_grouped
+  struct flush_group_t {
+    ceph::mutex lock = ceph::make_mutex("BlueFS::flush_group_t::lock");
+    ceph::condition_variable cond;
+    uint64_t requested = 0;   ///< tickets handed out to fsync callers
+    uint64_t completed = 0;   ///< tickets covered by a finished flush
+    bool flushing = false;
+  };
+  std::array<flush_group_t, MAX_BDEV> flush_groups;
+
   /*
    * There are up to 3 block devices:
    *
@@ -482,6 +541,18 @@ private:
 				     int flags,
 				     uint64_t capture_before_seq);
 
+  /// file map as of a log seq, encoded later without holding log's lock
+  struct log_snapshot_t {
+    std::vector<bluefs_fnode_t> files;
+    std::vector<std::pair<std::string,
+			  std::vector<std::pair<std::string, uint64_t>>>> dirs;
+  };
+  void _compact_log_snapshot_NF(log_snapshot_t *snap,
+				uint64_t capture_before_seq);
+  void _compact_log_encode_snapshot(uint64_t start_seq,
+				    log_snapshot_t& snap,
+				    bluefs_transaction_t *t);
+
   void _compact_log_sync_LNF_LD();
   void _compact_log_async_LD_LNF_D();
 
@@ -496,6 +567,8 @@ private:
 
   void _flush_bdev(FileWriter *h, bool check_mutex_locked = true);
   void _flush_bdev();  // this is safe to call without a lock
+  void _flush_bdev_grouped(FileWriter *h);
+  void _group_flush(unsigned id);
   void _flush_bdev(std::array<bool, MAX_BDEV>& dirty_bdevs);  // this is safe to call without a lock
 
   int _preallocate(FileRef f, uint64_t off, uint64_t len);
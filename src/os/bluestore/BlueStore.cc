@@ -30,12 +30,14 @@
 #include "BlueStore.h"
 #include "bluestore_common.h"
 #include "simple_bitmap.h"
+#include "slab_arena.h"
 #include "os/kv.h"
 #include "include/compat.h"
 #include "include/intarith.h"
 #include "include/stringify.h"
 #include "include/str_map.h"
 #include "include/util.h"
+#include "common/admin_socket.h"
 #include "common/errno.h"
 #include "common/safe_io.h"
 #include "common/PriorityCache.h"
@@ -74,17 +76,28 @@
 using bid_t = decltype(BlueStore::Blob::id);
 
 // bluestore_cache_onode
-MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Onode, bluestore_onode,
-			      bluestore_cache_onode);
+MEMPOOL_DEFINE_SLAB_OBJECT_FACTORY(BlueStore::Onode, bluestore_onode,
+				   bluestore_cache_onode);
 
 MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Buffer, bluestore_buffer,
 			      bluestore_cache_buffer);
-MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Extent, bluestore_extent,
-			      bluestore_extent);
-MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Blob, bluestore_blob,
-			      bluestore_blob);
-MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::SharedBlob, bluestore_shared_blob,
-			      bluestore_shared_blob);
+MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::BufferSnapshot, bluestore_buffer_snapshot,
+			      bluestore_cache_meta);
+MEMPOOL_DEFINE_SLAB_OBJECT_FACTORY(BlueStore::Extent, bluestore_extent,
+				   bluestore_extent);
+MEMPOOL_DEFINE_SLAB_OBJECT_FACTORY(BlueStore::Blob, bluestore_blob,
+				   bluestore_blob);
+MEMPOOL_DEFINE_SLAB_OBJECT_FACTORY(BlueStore::SharedBlob, bluestore_shared_blob,
+				   bluestore_shared_blob);
+
+/// memory held by the slab arenas backing onode metadata
+static uint64_t get_onode_slab_bytes()
+{
+  return mempool::bluestore_cache_onode::slab_bluestore_onode.get_slab_bytes() +
+    mempool::bluestore_extent::slab_bluestore_extent.get_slab_bytes() +
+    mempool::bluestore_blob::slab_bluestore_blob.get_slab_bytes() +
+    mempool::bluestore_shared_blob::slab_bluestore_shared_blob.get_slab_bytes();
+}
 
 // bluestore_txc
 MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::TransContext, bluestore_transcontext,
@@ -133,6 +146,7 @@ const string PREFIX_DEFERRED = "L";    // id -> deferred_transaction_t
 const string PREFIX_ALLOC = "B";       // u64 offset -> u64 length (freelist)
 const string PREFIX_ALLOC_BITMAP = "b";// (see BitmapFreelistManager)
 const string PREFIX_SHARED_BLOB = "X"; // u64 SB id -> shared_blob_t
+const string PREFIX_ALLOC_JOURNAL = "J"; // allocator journal (see _alloc_journal_*)
 
 #ifdef HAVE_LIBZBD
 const string PREFIX_ZONED_FM_META = "Z";  // (see ZonedFreelistManager)
@@ -283,6 +297,14 @@ static const char *_key_decode_shard(const char *key, shard_id_t *pshard)
   return key + 1;
 }
 
+// PGs go to device queues the way the OSD spreads them over its shards,
+// so with as many queues as shards each shard submits to a queue of its own
+static int get_aio_queue_hint(const coll_t& cid)
+{
+  spg_t pgid;
+  return cid.is_pg(&pgid) ? (int)pgid.ps() : -1;
+}
+
 static void get_coll_range(const coll_t& cid, int bits,
   ghobject_t *temp_start, ghobject_t *temp_end,
   ghobject_t *start, ghobject_t *end, bool legacy)
@@ -1560,6 +1582,7 @@ public:
         *(b->cache_age_bin) -= b->length;
 	to_evict_bytes -= b->length;
         evicted += b->length;
+        b->space->_invalidate_snapshot(this);
         b->state = BlueStore::Buffer::STATE_EMPTY;
         b->data.clear();
         warm_in.erase(warm_in.iterator_to(*b));
@@ -1709,6 +1732,7 @@ int BlueStore::BufferSpace::_discard(BufferCacheShard* cache, uint32_t offset, u
            << std::dec << dendl;
   int cache_private = 0;
   cache->_audit("discard start");
+  _invalidate_snapshot(cache);
   auto i = _data_lower_bound(offset);
   uint32_t end = offset + length;
   while (i != buffer_map.end()) {
@@ -1778,6 +1802,30 @@ int BlueStore::BufferSpace::_discard(BufferCacheShard* cache, uint32_t offset, u
   return cache_private;
 }
 
+bool BlueStore::BufferSpace::is_cached(
+  BufferCacheShard* cache,
+  uint32_t offset,
+  uint32_t length) const
+{
+  uint32_t end = offset + length;
+  std::lock_guard l(cache->lock);
+  auto i = buffer_map.lower_bound(offset);
+  if (i != buffer_map.begin()) {
+    auto prev = std::prev(i);
+    if (prev->second->end() > offset) {
+      i = prev;
+    }
+  }
+  for (; offset < end; ++i) {
+    if (i == buffer_map.end() || i->first > offset ||
+	i->second->is_empty()) {
+      return false;
+    }
+    offset = i->second->end();
+  }
+  return true;
+}
+
 void BlueStore::BufferSpace::read(
   BufferCacheShard* cache, 
   uint32_t offset,
@@ -1791,8 +1839,22 @@ void BlueStore::BufferSpace::read(
   uint32_t want_bytes = length;
   uint32_t end = offset + length;
 
+  if (!(flags & BYPASS_CLEAN_CACHE) &&
+      cache->cct->_conf->bluestore_buffer_lockless_reads &&
+      _read_snapshot(cache, offset, length, res, res_intervals)) {
+    uint64_t hit_bytes = res_intervals.size();
+    cache->logger->inc(l_bluestore_buffer_lockless_hits);
+    cache->logger->inc(l_bluestore_buffer_hit_bytes, hit_bytes);
+    cache->logger->inc(l_bluestore_buffer_miss_bytes, want_bytes - hit_bytes);
+    return;
+  }
+
   {
-    std::lock_guard l(cache->lock);
+    std::unique_lock l(cache->lock, std::try_to_lock);
+    if (!l.owns_lock()) {
+      cache->logger->inc(l_bluestore_buffer_lock_waits);
+      l.lock();
+    }
     for (auto i = _data_lower_bound(offset);
          i != buffer_map.end() && offset < end && i->first < end;
          ++i) {
@@ -1842,6 +1904,14 @@ void BlueStore::BufferSpace::read(
         }
       }
     }
+    // blobs that keep being read from the cache get a snapshot
+    if (!(flags & BYPASS_CLEAN_CACHE) &&
+        res_intervals.size() == want_bytes &&
+        cache->cct->_conf->bluestore_buffer_lockless_reads &&
+        ++locked_hits >= cache->cct->_conf->bluestore_buffer_snapshot_min_hits &&
+        snapshot.load(std::memory_order_relaxed) == nullptr) {
+      _publish_snapshot(cache);
+    }
   }
 
   uint64_t hit_bytes = res_intervals.size();
@@ -1851,6 +1921,77 @@ void BlueStore::BufferSpace::read(
   cache->logger->inc(l_bluestore_buffer_miss_bytes, miss_bytes);
 }
 
+bool BlueStore::BufferSpace::_read_snapshot(
+  BufferCacheShard* cache,
+  uint32_t offset,
+  uint32_t length,
+  BlueStore::ready_regions_t& res,
+  interval_set<uint32_t>& res_intervals)
+{
+  EpochDomain<BufferSnapshot>::Guard g(cache->snapshot_epoch);
+  const BufferSnapshot *s = snapshot.load();
+  if (!s) {
+    return false;
+  }
+  // nothing here updates the cache's LRU; let every 64th hit take the
+  // locked path to keep these buffers from aging out
+  if ((s->hits.fetch_add(1, std::memory_order_relaxed) & 63) == 63) {
+    return false;
+  }
+  uint32_t end = offset + length;
+  auto i = std::upper_bound(
+    s->buffers.begin(), s->buffers.end(), offset,
+    [](uint32_t o, const BufferSnapshot::entry_t& e) {
+      return o < e.offset;
+    });
+  if (i != s->buffers.begin() &&
+      std::prev(i)->offset + std::prev(i)->data.length() > offset) {
+    --i;
+  }
+  for (; i != s->buffers.end() && length > 0 && i->offset < end; ++i) {
+    uint32_t b_len = i->data.length();
+    if (i->offset < offset) {
+      uint32_t skip = offset - i->offset;
+      uint32_t l = std::min(length, b_len - skip);
+      res[offset].substr_of(i->data, skip, l);
+      res_intervals.insert(offset, l);
+      offset += l;
+      length -= l;
+      continue;
+    }
+    if (i->offset > offset) {
+      uint32_t gap = i->offset - offset;
+      if (length <= gap) {
+	break;
+      }
+      offset += gap;
+      length -= gap;
+    }
+    uint32_t l = std::min(length, b_len);
+    res[offset].substr_of(i->data, 0, l);
+    res_intervals.insert(offset, l);
+    offset += l;
+    length -= l;
+  }
+  return true;
+}
+
+void BlueStore::BufferSpace::_publish_snapshot(BufferCacheShard* cache)
+{
+  // note: we already hold cache->lock
+  auto s = new BufferSnapshot;
+  s->buffers.reserve(buffer_map.size());
+  for (auto& [off, b] : buffer_map) {
+    if ((b->is_clean() || b->is_writing()) && b->length) {
+      s->buffers.push_back(BufferSnapshot::entry_t{off, b->data});
+    }
+  }
+  ldout(cache->cct, 30) << __func__ << " " << s->buffers.size()
+			<< " buffers" << dendl;
+  snapshot = s;
+  cache->logger->inc(l_bluestore_buffer_snapshots);
+}
+
 void BlueStore::BufferSpace::_finish_write(BufferCacheShard* cache, uint64_t seq)
 {
   auto i = writing.begin();
@@ -1869,6 +2010,7 @@ void BlueStore::BufferSpace::_finish_write(BufferCacheShard* cache, uint64_t seq
     if (b->flags & Buffer::FLAG_NOCACHE) {
       writing.erase(i++);
       ldout(cache->cct, 20) << __func__ << " discard " << *b << dendl;
+      _invalidate_snapshot(cache);
       buffer_map.erase(b->offset);
     } else {
       b->state = Buffer::STATE_CLEAN;
@@ -1910,6 +2052,7 @@ void BlueStore::BufferSpace::split(BufferCacheShard* cache, size_t pos, BlueStor
   if (buffer_map.empty())
     return;
 
+  _invalidate_snapshot(cache);
   auto p = --buffer_map.end();
   while (true) {
     if (p->second->end() <= pos)
@@ -2873,6 +3016,8 @@ uint32_t BlueStore::Blob::merge_blob(CephContext* cct, Blob* blob_to_dissolve)
   dst_blob.dirty_extents().swap(tmp_extents);
 
   // move BufferSpace buffers
+  src->bc._invalidate_snapshot(src->shared_blob->get_cache());
+  dst->bc._invalidate_snapshot(shared_blob->get_cache());
   while(!src->bc.buffer_map.empty()) {
     auto buf = src->bc.buffer_map.extract(src->bc.buffer_map.cbegin());
     buf.mapped()->space = &dst->bc;
@@ -4189,6 +4334,26 @@ void BlueStore::ExtentMap::init_shards(bool loaded, bool dirty)
   }
 }
 
+bool BlueStore::ExtentMap::is_range_loaded(
+  uint32_t offset,
+  uint32_t length)
+{
+  if (shards.size() == 0) {
+    return true;
+  }
+  auto start = seek_shard(offset);
+  auto last = seek_shard(offset + length);
+  if (start < 0) {
+    return false;
+  }
+  for (; start <= last; ++start) {
+    if (!shards[start].loaded) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void BlueStore::ExtentMap::fault_range(
   KeyValueDB *db,
   uint32_t offset,
@@ -5168,6 +5333,8 @@ void BlueStore::Collection::split_cache(
       // may not be faulted in)
 
       auto rehome_blob = [&](Blob* b) {
+	// readers of the snapshot go through this shard's epoch domain
+	b->bc._invalidate_snapshot(cache);
 	for (auto& i : b->bc.buffer_map) {
 	  if (!i.second->is_writing()) {
 	    ldout(store->cct, 1) << __func__ << "   moving " << *i.second
@@ -5257,21 +5424,35 @@ void *BlueStore::MempoolThread::entry()
 
   binned_kv_cache = store->db->get_priority_cache();
   binned_kv_onode_cache = store->db->get_priority_cache(PREFIX_OBJ);
+  binned_kv_cf_caches = store->db->get_cf_priority_caches();
+  binned_kv_cf_caches.erase(PREFIX_OBJ);
+  // the shares of column families with a ratio in their block_cache
+  // definition are taken out of the kv share
+  double kv_cf_ratio = 0;
+  for (auto& [name, c] : binned_kv_cf_caches) {
+    kv_cf_ratio += c.ratio;
+  }
   if (store->cache_autotune && binned_kv_cache != nullptr) {
     pcm = std::make_shared<PriorityCache::Manager>(
         store->cct, min, max, target, true, "bluestore-pricache");
     pcm->insert("kv", binned_kv_cache, true);
     pcm->insert("meta", meta_cache, true);
     pcm->insert("data", data_cache, true);
+    readahead_cache_registered = false;
+    _update_readahead_cache();
     if (binned_kv_onode_cache != nullptr) {
       pcm->insert("kv_onode", binned_kv_onode_cache, true);
     }
+    for (auto& [name, c] : binned_kv_cf_caches) {
+      pcm->insert("kv_" + name, c.cache, true);
+    }
   }
 
   utime_t next_balance = ceph_clock_now();
   utime_t next_resize = ceph_clock_now();
   utime_t next_bin_rotation = ceph_clock_now();
   utime_t next_deferred_force_submit = ceph_clock_now();
+  utime_t next_deferred_size_update = ceph_clock_now();
   utime_t alloc_stats_dump_clock = ceph_clock_now();
 
   bool interval_stats_trim = false;
@@ -5288,6 +5469,8 @@ void *BlueStore::MempoolThread::entry()
     double autotune_interval = store->cache_autotune_interval;
     double resize_interval = store->osd_memory_cache_resize_interval;
     double max_defer_interval = store->max_defer_interval;
+    double deferred_size_interval = store->cct->_conf.get_val<double>(
+      "bluestore_deferred_adaptive_interval");
     double alloc_stats_dump_interval =
       store->cct->_conf->bluestore_alloc_stats_dump_interval;
 
@@ -5305,6 +5488,9 @@ void *BlueStore::MempoolThread::entry()
       if (binned_kv_onode_cache != nullptr) {
         binned_kv_onode_cache->import_bins(store->kv_onode_bins);
       }
+      for (auto& [name, c] : binned_kv_cf_caches) {
+        c.cache->import_bins(store->kv_bins);
+      }
       meta_cache->import_bins(store->meta_bins);
       data_cache->import_bins(store->data_bins);
 
@@ -5317,11 +5503,15 @@ void *BlueStore::MempoolThread::entry()
     // cache balancing
     if (autotune_interval > 0 && next_balance < ceph_clock_now()) {
       if (binned_kv_cache != nullptr) {
-        binned_kv_cache->set_cache_ratio(store->cache_kv_ratio);
+        binned_kv_cache->set_cache_ratio(
+          std::max(0.0, store->cache_kv_ratio - kv_cf_ratio));
       }
       if (binned_kv_onode_cache != nullptr) {
         binned_kv_onode_cache->set_cache_ratio(store->cache_kv_onode_ratio);
       }
+      for (auto& [name, c] : binned_kv_cf_caches) {
+        c.cache->set_cache_ratio(c.ratio);
+      }
       meta_cache->set_cache_ratio(store->cache_meta_ratio);
       data_cache->set_cache_ratio(store->cache_data_ratio);
 
@@ -5329,6 +5519,7 @@ void *BlueStore::MempoolThread::entry()
       interval_stats_trim = true;
 
       if (pcm != nullptr) {
+        _update_readahead_cache();
         pcm->balance();
       }
 
@@ -5353,6 +5544,17 @@ void *BlueStore::MempoolThread::entry()
       next_deferred_force_submit = ceph_clock_now();
       next_deferred_force_submit += max_defer_interval/3;
     }
+    // adaptive deferred size threshold
+    if (deferred_size_interval > 0 &&
+	next_deferred_size_update < ceph_clock_now()) {
+      store->_update_deferred_size();
+      next_deferred_size_update = ceph_clock_now();
+      next_deferred_size_update += deferred_size_interval;
+    }
+    // free buffer snapshots that lockless readers are done with
+    for (auto i : store->buffer_cache_shards) {
+      i->snapshot_epoch.reclaim();
+    }
 
     // Now Resize the shards 
     _resize_shards(interval_stats_trim);
@@ -5364,8 +5566,9 @@ void *BlueStore::MempoolThread::entry()
     cond.wait_for(l, wait);
   }
   // do final dump
-  store->_record_allocation_stats();
+  store->_record_allocation_stats(false);
   stop = false;
+  binned_kv_cf_caches.clear();
   pcm = nullptr;
   return NULL;
 }
@@ -5397,6 +5600,8 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
     if (binned_kv_onode_cache != nullptr) {
       kv_onode_alloc = binned_kv_onode_cache->get_committed_size();
     }
+    store->readahead_limit = std::min<uint64_t>(
+      store->readahead_budget, readahead_cache->get_committed_size());
   }
   
   if (interval_stats) {
@@ -5436,6 +5641,21 @@ void BlueStore::MempoolThread::_resize_shards(bool interval_stats)
   }
 }
 
+void BlueStore::MempoolThread::_update_readahead_cache()
+{
+  // reserve memory for read-ahead only while it is enabled
+  bool enabled = store->readahead_budget > 0;
+  if (enabled == readahead_cache_registered) {
+    return;
+  }
+  if (enabled) {
+    pcm->insert("readahead", readahead_cache, true);
+  } else {
+    pcm->erase("readahead");
+  }
+  readahead_cache_registered = enabled;
+}
+
 void BlueStore::MempoolThread::_update_cache_settings()
 {
   // Nothing to do if pcm is not used.
@@ -5646,6 +5866,75 @@ void BlueStore::handle_discard(interval_set<uint64_t>& to_release)
   alloc->release(to_release);
 }
 
+class BlueStore::SocketHook : public AdminSocketHook {
+  BlueStore* store;
+public:
+  static BlueStore::SocketHook* create(BlueStore* store)
+  {
+    BlueStore::SocketHook* hook = nullptr;
+    AdminSocket* admin_socket = store->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new BlueStore::SocketHook(store);
+      int r = admin_socket->register_command("bluestore startup timings",
+                                             hook,
+                                             "Show where the time of the last "
+                                             "BlueStore mount was spent");
+      if (r == 0) {
+        r = admin_socket->register_command("bluestore fsck progress",
+                                           hook,
+                                           "Show the phase and the estimated "
+                                           "time left of a running fsck");
+      }
+      if (r == 0) {
+        r = admin_socket->register_command("bluestore db tombstone ranges",
+                                           hook,
+                                           "Show the db key ranges waiting for "
+                                           "a compaction of their tombstones");
+      }
+      if (r != 0) {
+        lgeneric_dout(store->cct, 1) << "bluestore " << __func__
+                                     << " cannot register SocketHook"
+                                     << dendl;
+        delete hook;
+        hook = nullptr;
+      }
+    }
+    return hook;
+  }
+
+  ~SocketHook() {
+    AdminSocket* admin_socket = store->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  SocketHook(BlueStore* store) :
+    store(store) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   const bufferlist&,
+	   Formatter *f,
+	   std::ostream& errss,
+	   bufferlist& out) override {
+    if (command == "bluestore startup timings") {
+      store->_dump_startup_timings(f);
+      return 0;
+    }
+    if (command == "bluestore fsck progress") {
+      store->dump_fsck_progress(f);
+      return 0;
+    }
+    if (command == "bluestore db tombstone ranges") {
+      if (!store->db) {
+        errss << "bluestore is not mounted" << std::endl;
+        return -EAGAIN;
+      }
+      store->db->dump_tombstone_ranges(f);
+      return 0;
+    }
+    errss << "Invalid command" << std::endl;
+    return -ENOSYS;
+  }
+};
+
 BlueStore::BlueStore(CephContext *cct, const string& path)
   : BlueStore(cct, path, 0) {}
 
@@ -5655,8 +5944,7 @@ BlueStore::BlueStore(CephContext *cct,
   : ObjectStore(cct, path),
     throttle(cct),
     finisher(cct, "commit_finisher", "cfin"),
-    kv_sync_thread(this),
-    kv_finalize_thread(this),
+    alloc_journal_thread(this),
 #ifdef HAVE_LIBZBD
     zoned_cleaner_thread(this),
 #endif
@@ -5667,10 +5955,12 @@ BlueStore::BlueStore(CephContext *cct,
   _init_logger();
   cct->_conf.add_observer(this);
   set_cache_shards(1);
+  asok_hook = SocketHook::create(this);
 }
 
 BlueStore::~BlueStore()
 {
+  delete asok_hook;
   cct->_conf.remove_observer(this);
   _shutdown_logger();
   ceph_assert(!mounted);
@@ -5705,6 +5995,14 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_prefer_deferred_size",
     "bluestore_prefer_deferred_size_hdd",
     "bluestore_prefer_deferred_size_ssd",
+    "bluestore_deferred_adaptive",
+    "bluestore_deferred_adaptive_min_size",
+    "bluestore_deferred_adaptive_max_size",
+    "bluestore_readahead_budget_hdd",
+    "bluestore_readahead_budget_ssd",
+    "bluestore_readahead_trigger_requests",
+    "bluestore_readahead_min_size",
+    "bluestore_readahead_max_size",
     "bluestore_deferred_batch_ops",
     "bluestore_deferred_batch_ops_hdd",
     "bluestore_deferred_batch_ops_ssd",
@@ -5770,6 +6068,9 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
   if (changed.count("bluestore_prefer_deferred_size") ||
       changed.count("bluestore_prefer_deferred_size_hdd") ||
       changed.count("bluestore_prefer_deferred_size_ssd") ||
+      changed.count("bluestore_deferred_adaptive") ||
+      changed.count("bluestore_deferred_adaptive_min_size") ||
+      changed.count("bluestore_deferred_adaptive_max_size") ||
       changed.count("bluestore_max_alloc_size") ||
       changed.count("bluestore_deferred_batch_ops") ||
       changed.count("bluestore_deferred_batch_ops_hdd") ||
@@ -5779,6 +6080,15 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
       _set_alloc_sizes();
     }
   }
+  if (changed.count("bluestore_readahead_budget_hdd") ||
+      changed.count("bluestore_readahead_budget_ssd") ||
+      changed.count("bluestore_readahead_trigger_requests") ||
+      changed.count("bluestore_readahead_min_size") ||
+      changed.count("bluestore_readahead_max_size")) {
+    if (bdev) {
+      _set_readahead();
+    }
+  }
   if (changed.count("bluestore_throttle_cost_per_io") ||
       changed.count("bluestore_throttle_cost_per_io_hdd") ||
       changed.count("bluestore_throttle_cost_per_io_ssd")) {
@@ -5890,6 +6200,36 @@ void BlueStore::_set_throttle_params()
   dout(10) << __func__ << " throttle_cost_per_io " << throttle_cost_per_io
 	   << dendl;
 }
+void BlueStore::_set_readahead()
+{
+  ceph_assert(bdev);
+  uint64_t budget;
+  if (_use_rotational_settings()) {
+    budget = cct->_conf.get_val<Option::size_t>("bluestore_readahead_budget_hdd");
+  } else {
+    budget = cct->_conf.get_val<Option::size_t>("bluestore_readahead_budget_ssd");
+  }
+  readahead_trigger_requests = std::max<uint64_t>(
+    1, cct->_conf.get_val<uint64_t>("bluestore_readahead_trigger_requests"));
+  readahead_min_size = std::max<uint64_t>(
+    min_alloc_size,
+    cct->_conf.get_val<Option::size_t>("bluestore_readahead_min_size"));
+  readahead_max_size = std::max<uint64_t>(
+    readahead_min_size,
+    cct->_conf.get_val<Option::size_t>("bluestore_readahead_max_size"));
+  readahead_budget = budget;
+  // the cache autotuner grants what it can afford, keep that until it runs
+  // again; without it the budget is all there is
+  if (cache_autotune && readahead_limit > 0) {
+    readahead_limit = std::min<uint64_t>(readahead_limit, budget);
+  } else {
+    readahead_limit = budget;
+  }
+  dout(10) << __func__ << " budget 0x" << std::hex << budget
+	   << " window 0x" << readahead_min_size << "-0x" << readahead_max_size
+	   << std::dec << " trigger " << readahead_trigger_requests << dendl;
+}
+
 void BlueStore::_set_blob_size()
 {
   if (cct->_conf->bluestore_max_blob_size) {
@@ -6155,6 +6495,13 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_read_wait_aio_lat, "read_wait_aio_lat",
 		 "Average read I/O waiting latency",
 		 "rwal", PerfCountersBuilder::PRIO_USEFUL);
+  b.add_time_avg(l_bluestore_read_device_lat, "read_device_lat",
+		 "Average latency of the reads that went to the device");
+  b.add_u64_counter(l_bluestore_read_device_bytes, "read_device_bytes",
+		    "Bytes read from the device",
+		    NULL,
+		    PerfCountersBuilder::PRIO_DEBUGONLY,
+		    unit_t(UNIT_BYTES));
   b.add_time_avg(l_bluestore_csum_lat, "csum_lat",
 		 "Average checksum latency",
 		 "csml", PerfCountersBuilder::PRIO_USEFUL);
@@ -6163,9 +6510,35 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_reads_with_retries, "reads_with_retries",
                     "Read operations that required at least one retry due to failed checksum validation",
 		    "rd_r", PerfCountersBuilder::PRIO_USEFUL);
+  b.add_u64_counter(l_bluestore_read_coalesced_ios, "read_coalesced_ios",
+		    "Device reads saved by merging physically adjacent extents");
   b.add_time_avg(l_bluestore_read_lat, "read_lat",
 		 "Average read latency",
 		 "r_l", PerfCountersBuilder::PRIO_CRITICAL);
+  b.add_u64_counter(l_bluestore_readahead_ios, "readahead_ios",
+		    "Read-ahead reads issued for sequential streams");
+  b.add_u64_counter(l_bluestore_readahead_bytes, "readahead_bytes",
+		    "Bytes read ahead for sequential streams",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_readahead_skipped, "readahead_skipped",
+		    "Read-ahead not issued because the budget was used up");
+  b.add_time_avg(l_bluestore_readahead_lat, "readahead_lat",
+		 "Average read-ahead latency");
+  //****************************************
+
+  // defragmentation stats
+  //****************************************
+  b.add_u64_counter(l_bluestore_defrag_objects, "defrag_objects",
+		    "Fragmented objects rewritten");
+  b.add_u64_counter(l_bluestore_defrag_bytes, "defrag_bytes",
+		    "Bytes rewritten to defragment objects",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_defrag_blobs_reclaimed,
+		    "defrag_blobs_reclaimed",
+		    "Blobs saved by defragmenting objects");
+  b.add_u64_counter(l_bluestore_defrag_shards_reclaimed,
+		    "defrag_shards_reclaimed",
+		    "Extent map shards saved by defragmenting objects");
   //****************************************
 
   // kv_thread latencies
@@ -6242,6 +6615,15 @@ void BlueStore::_init_logger()
 		    NULL,
 		    PerfCountersBuilder::PRIO_DEBUGONLY,
 		    unit_t(UNIT_BYTES));
+  b.add_u64(l_bluestore_deferred_size, "deferred_size",
+	    "Current size threshold for deferred writes",
+	    NULL, PerfCountersBuilder::PRIO_DEBUGONLY, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_deferred_size_grow, "deferred_size_grow",
+		    "Adaptive deferred size threshold increases");
+  b.add_u64_counter(l_bluestore_deferred_size_shrink, "deferred_size_shrink",
+		    "Adaptive deferred size threshold decreases");
+  b.add_u64_counter(l_bluestore_deferred_size_hold, "deferred_size_hold",
+		    "Adaptive deferred size threshold kept unchanged");
 
   b.add_u64_counter(l_bluestore_write_big_skipped_blobs,
       "write_big_skipped_blobs",
@@ -6301,6 +6683,16 @@ void BlueStore::_init_logger()
 	    "Number of extents in cache");
   b.add_u64(l_bluestore_blobs, "onode_blobs",
 	    "Number of blobs in cache");
+  b.add_u64(l_bluestore_onode_slab_bytes, "onode_slab_bytes",
+	    "Memory held by onode, extent, blob and shared blob slabs",
+	    NULL,
+	    PerfCountersBuilder::PRIO_DEBUGONLY,
+	    unit_t(UNIT_BYTES));
+  b.add_u64(l_bluestore_onode_meta_bytes_per_onode, "onode_meta_bytes_per_onode",
+	    "Average in-memory metadata footprint of a cached onode",
+	    NULL,
+	    PerfCountersBuilder::PRIO_DEBUGONLY,
+	    unit_t(UNIT_BYTES));
   //****************************************
 
   // buffer cache stats
@@ -6322,6 +6714,12 @@ void BlueStore::_init_logger()
 	    NULL,
 	    PerfCountersBuilder::PRIO_DEBUGONLY,
 	    unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_buffer_lockless_hits, "buffer_lockless_hits",
+	    "Cache lookups served from a snapshot without the cache lock");
+  b.add_u64_counter(l_bluestore_buffer_lock_waits, "buffer_lock_waits",
+	    "Cache lookups that had to wait for the cache lock");
+  b.add_u64_counter(l_bluestore_buffer_snapshots, "buffer_snapshots",
+	    "Buffer snapshots published for lockless lookups");
   //****************************************
 
   // internal stats
@@ -6365,6 +6763,8 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_omap_get_values_lat, "omap_get_values_lat",
     "Average omap get_values call latency",
     "ogvl", PerfCountersBuilder::PRIO_USEFUL);
+  b.add_time_avg(l_bluestore_omap_get_range_lat, "omap_get_range_lat",
+    "Average omap get_range call latency");
   b.add_time_avg(l_bluestore_omap_clear_lat, "omap_clear_lat",
     "Average omap clear call latency");
   b.add_time_avg(l_bluestore_clist_lat, "clist_lat",
@@ -6401,6 +6801,18 @@ void BlueStore::_init_logger()
     "srwc",
     PerfCountersBuilder::PRIO_USEFUL);
 
+  // allocator journal
+  //****************************************
+  b.add_u64_counter(l_bluestore_alloc_journal_deltas,
+    "alloc_journal_deltas",
+    "Allocator journal deltas written");
+  b.add_u64_counter(l_bluestore_alloc_journal_checkpoints,
+    "alloc_journal_checkpoints",
+    "Allocator journal checkpoints");
+  b.add_time_avg(l_bluestore_alloc_journal_checkpoint_lat,
+    "alloc_journal_checkpoint_lat",
+    "Average allocator journal checkpoint latency");
+
   // Resulting size axis configuration for op histograms, values are in bytes
   PerfHistogramCommon::axis_config_d alloc_hist_x_axis_config{
     "Given size (bytes)",
@@ -6590,11 +7002,13 @@ int BlueStore::_check_or_set_bdev_label(
 void BlueStore::_set_alloc_sizes(void)
 {
   max_alloc_size = cct->_conf->bluestore_max_alloc_size;
+  bool adaptive = cct->_conf.get_val<bool>("bluestore_deferred_adaptive");
 
 #ifdef HAVE_LIBZBD
   ceph_assert(bdev);
   if (bdev->is_smr()) {
     prefer_deferred_size = 0;
+    adaptive = false;
   } else
 #endif
   if (cct->_conf->bluestore_prefer_deferred_size) {
@@ -6617,15 +7031,61 @@ void BlueStore::_set_alloc_sizes(void)
     }
   }
 
+  if (adaptive) {
+    // the static setting is just the starting point
+    DeferredSizeController::config_t c;
+    c.min_size = cct->_conf.get_val<Option::size_t>(
+      "bluestore_deferred_adaptive_min_size");
+    c.max_size = cct->_conf.get_val<Option::size_t>(
+      "bluestore_deferred_adaptive_max_size");
+    c.granularity = min_alloc_size ? min_alloc_size : 4096;
+    deferred_size_ctl.configure(c, prefer_deferred_size);
+    prefer_deferred_size = deferred_size_ctl.get_size();
+  }
+  deferred_adaptive = adaptive;
+  logger->set(l_bluestore_deferred_size, prefer_deferred_size);
+
   dout(10) << __func__ << " min_alloc_size 0x" << std::hex << min_alloc_size
 	   << std::dec << " order " << (int)min_alloc_size_order
 	   << " max_alloc_size 0x" << std::hex << max_alloc_size
 	   << " prefer_deferred_size 0x" << prefer_deferred_size
 	   << std::dec
 	   << " deferred_batch_ops " << deferred_batch_ops
+	   << " deferred_adaptive " << deferred_adaptive
 	   << dendl;
 }
 
+void BlueStore::_update_deferred_size()
+{
+  if (!deferred_adaptive) {
+    return;
+  }
+  double util = throttle.get_deferred_util();
+  auto d = deferred_size_ctl.update(util);
+  uint64_t size = deferred_size_ctl.get_size();
+  switch (d) {
+  case DeferredSizeController::GROW:
+    logger->inc(l_bluestore_deferred_size_grow);
+    break;
+  case DeferredSizeController::SHRINK:
+    logger->inc(l_bluestore_deferred_size_shrink);
+    break;
+  default:
+    logger->inc(l_bluestore_deferred_size_hold);
+    break;
+  }
+  if (d != DeferredSizeController::HOLD) {
+    dout(10) << __func__ << " prefer_deferred_size 0x" << std::hex
+	     << prefer_deferred_size << " -> 0x" << size << std::dec
+	     << " device lat " << deferred_size_ctl.get_device_lat()
+	     << " kv lat " << deferred_size_ctl.get_kv_lat()
+	     << " gain " << deferred_size_ctl.get_gain()
+	     << " deferred util " << util << dendl;
+  }
+  prefer_deferred_size = size;
+  logger->set(l_bluestore_deferred_size, size);
+}
+
 int BlueStore::_open_bdev(bool create)
 {
   ceph_assert(bdev == NULL);
@@ -6978,11 +7438,13 @@ int BlueStore::_init_alloc(std::map<uint64_t, uint64_t> *zone_adjustments)
 #endif
 
   uint64_t num = 0, bytes = 0;
+  const char *alloc_source = nullptr;
   utime_t start_time = ceph_clock_now();
   if (!fm->is_null_manager()) {
     // This is the original path - loading allocation map from RocksDB and feeding into the allocator
     dout(5) << __func__ << "::NCB::loading allocation from FM -> alloc" << dendl;
     // initialize from freelist
+    alloc_source = "freelist";
     fm->enumerate_reset();
     uint64_t offset, length;
     while (fm->enumerate_next(db, &offset, &length)) {
@@ -7005,6 +7467,12 @@ int BlueStore::_init_alloc(std::map<uint64_t, uint64_t> *zone_adjustments)
     }
     if (restore_allocator(alloc, &num, &bytes) == 0) {
       dout(5) << __func__ << "::NCB::restore_allocator() completed successfully alloc=" << alloc << dendl;
+      alloc_source = "allocation_file";
+    } else if (cct->_conf->bluestore_allocation_journal &&
+	       _alloc_journal_replay(alloc, &num, &bytes) == 0) {
+      // unplanned shutdown, but the allocator journal was kept up to date
+      dout(1) << __func__ << "::NCB::allocator restored from journal" << dendl;
+      alloc_source = "allocation_journal";
     } else {
       // This must mean that we had an unplanned shutdown and didn't manage to destage the allocator
       dout(0) << __func__ << "::NCB::restore_allocator() failed! Run Full Recovery from ONodes (might take a while) ..." << dendl;
@@ -7015,8 +7483,16 @@ int BlueStore::_init_alloc(std::map<uint64_t, uint64_t> *zone_adjustments)
 	derr << __func__ << "::NCB::If no HW fault is found, please report failure and consider redeploying OSD" << dendl;
 	return -ENOTRECOVERABLE;
       }
+      alloc_source = "onode_scan";
+    }
+    if (cct->_conf->bluestore_allocation_journal) {
+      _alloc_journal_capture_base();
     }
   }
+  {
+    std::lock_guard l(startup_timings_lock);
+    startup_alloc_source = alloc_source;
+  }
   dout(1) << __func__
           << " loaded " << byte_u_t(bytes) << " in " << num << " extents"
           << std::hex
@@ -7064,6 +7540,7 @@ void BlueStore::_post_init_alloc(const std::map<uint64_t, uint64_t>& zone_adjust
 void BlueStore::_close_alloc()
 {
   ceph_assert(bdev);
+  alloc_journal_base.clear();
   bdev->discard_drain();
 
   ceph_assert(alloc);
@@ -7474,6 +7951,7 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   // SMR devices may require a freelist adjustment, but that can only happen after
   // the db is read-write. we'll stash pending changes here.
   std::map<uint64_t, uint64_t> zone_adjustments;
+  auto phase_start = mono_clock::now();
 
   int r = _open_path();
   if (r < 0)
@@ -7493,12 +7971,14 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   r = _open_bdev(false);
   if (r < 0)
     goto out_fsid;
+  _startup_timing_note("open_bdev", phase_start);
 
   // GBH: can probably skip open_db step in REad-Only mode when operating in NULL-FM mode
   // (might need to open if failed to restore from file)
 
   // open in read-only first to read FM list and init allocator
   // as they might be needed for some BlueFS procedures
+  phase_start = mono_clock::now();
   r = _open_db(false, false, true);
   if (r < 0)
     goto out_bdev;
@@ -7511,10 +7991,13 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   r = _open_fm(nullptr, true, false);
   if (r < 0)
     goto out_db;
+  _startup_timing_note("open_db_read_only", phase_start);
 
+  phase_start = mono_clock::now();
   r = _init_alloc(&zone_adjustments);
   if (r < 0)
     goto out_fm;
+  _startup_timing_note("init_alloc", phase_start);
 
   // Re-open in the proper mode(s).
 
@@ -7522,6 +8005,7 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   // load allocated extents from bluefs into allocator.
   // And now it's time to do that
   //
+  phase_start = mono_clock::now();
   _close_db();
   r = _open_db(false, to_repair, read_only);
   if (r < 0) {
@@ -7531,6 +8015,7 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
   if (!read_only) {
     _post_init_alloc(zone_adjustments);
   }
+  _startup_timing_note("open_db", phase_start);
 
   // when function is called in repair mode (to_repair=true) we skip db->open()/create()
   // we can't change bluestore allocation so no need to invlidate allocation-file
@@ -7545,6 +8030,12 @@ int BlueStore::_open_db_and_around(bool read_only, bool to_repair)
       goto out_alloc;
     }
   }
+  // allocations may change from now on without going through the
+  // allocator journal (fsck repair, store expansion...), so drop it;
+  // _mount() starts a fresh one when appropriate.
+  if (!read_only && !to_repair) {
+    _alloc_journal_reset();
+  }
 
   // when function is called in repair mode (to_repair=true) we skip db->open()/create()
   if (!is_db_rotational() && !read_only && !to_repair && cct->_conf->bluestore_allocation_from_file
@@ -8802,6 +9293,7 @@ int BlueStore::_mount()
   }
 
   _kv_only = false;
+  auto mount_start = mono_clock::now();
   if (cct->_conf->bluestore_fsck_on_mount) {
     int rc = fsck(cct->_conf->bluestore_fsck_on_mount_deep);
     if (rc < 0)
@@ -8811,6 +9303,15 @@ int BlueStore::_mount()
       return -EIO;
     }
   }
+  // fsck reopens the db itself, start recording the mount phases after it
+  _startup_timing_begin();
+  auto end_timing = make_scope_guard([&] {
+    _startup_timing_end(mount_start);
+  });
+  if (cct->_conf->bluestore_fsck_on_mount) {
+    _startup_timing_note("fsck", mount_start);
+  }
+  auto phase_start = mono_clock::now();
 
   if (cct->_conf->osd_max_object_size > OBJECT_MAX_SIZE) {
     derr << __func__ << " osd_max_object_size "
@@ -8836,6 +9337,7 @@ int BlueStore::_mount()
   }
 
   // The recovery process for allocation-map needs to open collection early
+  phase_start = mono_clock::now();
   r = _open_collections();
   if (r < 0) {
     return r;
@@ -8845,23 +9347,45 @@ int BlueStore::_mount()
       _shutdown_cache();
     }
   });
+  _startup_timing_note("open_collections", phase_start);
 
   r = _reload_logger();
   if (r < 0) {
     return r;
   }
 
+  // quick-fix may change allocations behind the allocator journal's back
+  bool quick_fix = (!per_pool_stat_collection || per_pool_omap != OMAP_PER_PG) &&
+    cct->_conf->bluestore_fsck_quick_fix_on_mount == true;
+  if (fm->is_null_manager() && !alloc_journal_base.empty()) {
+    if (quick_fix) {
+      dout(1) << __func__ << " not starting allocator journal due to quick-fix"
+	      << dendl;
+    } else {
+      phase_start = mono_clock::now();
+      r = _alloc_journal_start();
+      if (r < 0) {
+	return r;
+      }
+      _startup_timing_note("alloc_journal_start", phase_start);
+    }
+  }
+  alloc_journal_base.clear();
+
   _kv_start();
   auto stop_kv = make_scope_guard([&] {
     if (!mounted) {
       _kv_stop();
+      _alloc_journal_stop();
     }
   });
 
+  phase_start = mono_clock::now();
   r = _deferred_replay();
   if (r < 0) {
     return r;
   }
+  _startup_timing_note("deferred_replay", phase_start);
 
 #ifdef HAVE_LIBZBD
   if (bdev->is_smr()) {
@@ -8870,14 +9394,16 @@ int BlueStore::_mount()
 #endif
 
   mempool_thread.init();
+  _readahead_start();
 
-  if ((!per_pool_stat_collection || per_pool_omap != OMAP_PER_PG) &&
-    cct->_conf->bluestore_fsck_quick_fix_on_mount == true) {
+  if (quick_fix) {
 
     auto was_per_pool_omap = per_pool_omap;
 
     dout(1) << __func__ << " quick-fix on mount" << dendl;
+    phase_start = mono_clock::now();
     _fsck_on_open(FSCK_SHALLOW, true);
+    _startup_timing_note("quick_fix", phase_start);
 
     //set again as hopefully it has been fixed
     if (was_per_pool_omap != OMAP_PER_PG) {
@@ -8889,6 +9415,101 @@ int BlueStore::_mount()
   return 0;
 }
 
+void BlueStore::_startup_timing_begin()
+{
+  std::lock_guard l(startup_timings_lock);
+  startup_timings.clear();
+  startup_timings_recording = true;
+}
+
+void BlueStore::_startup_timing_note(const char *phase,
+				     mono_clock::time_point start)
+{
+  double secs = std::chrono::duration<double>(mono_clock::now() - start).count();
+  std::lock_guard l(startup_timings_lock);
+  if (!startup_timings_recording) {
+    return;
+  }
+  dout(5) << __func__ << " " << phase << " took " << secs << "s" << dendl;
+  startup_timings.emplace_back(phase, secs);
+}
+
+void BlueStore::_startup_timing_end(mono_clock::time_point start)
+{
+  _startup_timing_note("total", start);
+  std::lock_guard l(startup_timings_lock);
+  startup_timings_recording = false;
+}
+
+void BlueStore::_dump_startup_timings(Formatter *f)
+{
+  std::lock_guard l(startup_timings_lock);
+  f->open_object_section("startup_timings");
+  f->dump_string("allocator_source", startup_alloc_source);
+  f->open_array_section("phases");
+  for (auto& [phase, secs] : startup_timings) {
+    f->open_object_section("phase");
+    f->dump_string("name", phase);
+    f->dump_float("seconds", secs);
+    f->close_section();
+  }
+  f->close_section();
+  f->close_section();
+}
+
+void BlueStore::_fsck_progress_phase(const char *phase)
+{
+  std::lock_guard l(fsck_progress_lock);
+  fsck_phase = phase;
+}
+
+void BlueStore::get_fsck_progress(fsck_progress_t *p)
+{
+  std::lock_guard l(fsck_progress_lock);
+  *p = fsck_progress_t();
+  p->running = fsck_running;
+  if (!fsck_running) {
+    return;
+  }
+  auto now = ceph::mono_clock::now();
+  p->phase = fsck_phase;
+  p->elapsed = std::chrono::duration<double>(now - fsck_start).count();
+  p->objects = fsck_objects_done;
+  if (fsck_walk_start == ceph::mono_clock::time_point()) {
+    return;
+  }
+  if (fsck_phase != "walking object keyspace") {
+    // the walk is over
+    p->progress = 1;
+    p->eta = 0;
+    return;
+  }
+  if (fsck_bytes_total) {
+    // the size estimate is rough, keep it from running past the end
+    p->progress = std::min(0.99, double(fsck_bytes_done) / fsck_bytes_total);
+  }
+  if (p->progress > 0) {
+    double walked = std::chrono::duration<double>(now - fsck_walk_start).count();
+    p->eta = walked / p->progress - walked;
+  }
+}
+
+void BlueStore::dump_fsck_progress(Formatter *f)
+{
+  fsck_progress_t p;
+  get_fsck_progress(&p);
+  f->open_object_section("fsck_progress");
+  f->dump_bool("running", p.running);
+  if (p.running) {
+    f->dump_string("phase", p.phase);
+    f->dump_float("elapsed", p.elapsed);
+    f->dump_unsigned("objects", p.objects);
+    f->dump_float("progress", p.progress);
+    f->dump_float("eta", p.eta);
+  }
+  f->close_section();
+}
+
 int BlueStore::umount()
 {
   ceph_assert(_kv_only || mounted);
@@ -8899,6 +9520,7 @@ int BlueStore::umount()
   ceph_assert(alloc);
 
   if (!_kv_only) {
+    _readahead_stop();
     mempool_thread.shutdown();
 #ifdef HAVE_LIBZBD
     if (bdev->is_smr()) {
@@ -8908,6 +9530,7 @@ int BlueStore::umount()
 #endif
     dout(20) << __func__ << " stopping kv thread" << dendl;
     _kv_stop();
+    _alloc_journal_stop();
     // skip cache cleanup step on fast shutdown
     if (likely(!m_fast_shutdown)) {
       _shutdown_cache();
@@ -8968,11 +9591,28 @@ int _fsck_sum_extents(
   return 0;
 }
 
+static bool fsck_test_and_set(BlueStore::mempool_dynamic_bitset &bs,
+			      uint64_t pos)
+{
+  if (bs.test(pos)) {
+    return true;
+  }
+  bs.set(pos);
+  return false;
+}
+
+static bool fsck_test_and_set(BlueStore::fsck_shared_bitset_t &bs,
+			      uint64_t pos)
+{
+  return bs.test_and_set(pos);
+}
+
+template <typename Bitset>
 int BlueStore::_fsck_check_extents(
   std::string_view ctx_descr,
   const PExtentVector& extents,
   bool compressed,
-  mempool_dynamic_bitset &used_blocks,
+  Bitset &used_blocks,
   uint64_t granularity,
   BlueStoreRepairer* repairer,
   store_statfs_t& expected_statfs,
@@ -8991,8 +9631,8 @@ int BlueStore::_fsck_check_extents(
       bool already = false;
       apply_for_bitset_range(
         e.offset, e.length, granularity, used_blocks,
-        [&](uint64_t pos, mempool_dynamic_bitset &bs) {
-	  if (bs.test(pos)) {
+        [&](uint64_t pos, Bitset &bs) {
+	  if (fsck_test_and_set(bs, pos)) {
 	    if (repairer) {
 	      repairer->note_misreference(
 	        pos * min_alloc_size, min_alloc_size, !already);
@@ -9004,8 +9644,6 @@ int BlueStore::_fsck_check_extents(
 	      already = true;
 	    }
 	  }
-	  else
-	    bs.set(pos);
         });
 
       if (e.end() > bdev->get_size()) {
@@ -9469,6 +10107,16 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
       if (sb_info_lock) {
         sb_info_lock->unlock();
       }
+    } else if (depth != FSCK_SHALLOW && ctx.shared_used_blocks) {
+      string ctx_descr = " oid " + stringify(oid);
+      errors += _fsck_check_extents(ctx_descr,
+	blob.get_extents(),
+        blob.is_compressed(),
+        *ctx.shared_used_blocks,
+        fm->get_alloc_size(),
+	repairer,
+        *res_statfs,
+        depth);
     } else if (depth != FSCK_SHALLOW) {
       ceph_assert(used_blocks);
       string ctx_descr = " oid " + stringify(oid);
@@ -9948,262 +10596,396 @@ void BlueStore::_fsck_check_object_omap(FSCKDepth depth,
   }
 }
 
-void BlueStore::_fsck_check_objects(
+size_t BlueStore::_fsck_walk_objects(
   FSCKDepth depth,
-  BlueStore::FSCK_ObjectCtx& ctx)
+  BlueStore::FSCK_ObjectCtx& ctx,
+  const string& start,
+  const string& end,
+  fsck_used_nids_t& used_nids,
+  std::function<bool(int64_t, CollectionRef, const ghobject_t&,
+		     const string&, const bufferlist&)> offload)
 {
   auto& errors = ctx.errors;
-  auto sb_info_lock = ctx.sb_info_lock;
-  auto& sb_info = ctx.sb_info;
-  auto& sb_ref_counts = ctx.sb_ref_counts;
-  auto repairer = ctx.repairer;
-
-  uint64_t_btree_t used_nids;
-
   size_t processed_myself = 0;
 
   auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
+  if (!it) {
+    return 0;
+  }
   mempool::bluestore_fsck::list<string> expecting_shards;
-  if (it) {
-    const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
-    typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
-    std::unique_ptr<WQ> wq(
-      new WQ(
-        "FSCKWorkQueue",
-        (thread_count ? : 1) * 32,
-        this,
-        sb_info_lock,
-        sb_info,
-	sb_ref_counts,
-        repairer));
-
-    ShallowFSCKThreadPool thread_pool(cct, "ShallowFSCKThreadPool", "ShallowFSCK", thread_count);
+  // fill global if not overriden below
+  CollectionRef c;
+  int64_t pool_id = -1;
+  spg_t pgid;
+  for (it->lower_bound(start);
+       it->valid() && (end.empty() || it->key() < end);
+       it->next()) {
+    dout(30) << __func__ << " key "
+      << pretty_binary_string(it->key()) << dendl;
+    fsck_bytes_done += it->key().size() + it->value().length();
+    if (is_extent_shard_key(it->key())) {
+      if (depth == FSCK_SHALLOW) {
+        continue;
+      }
+      while (!expecting_shards.empty() &&
+        expecting_shards.front() < it->key()) {
+        derr << "fsck error: missing shard key "
+          << pretty_binary_string(expecting_shards.front())
+          << dendl;
+        ++errors;
+        expecting_shards.pop_front();
+      }
+      if (!expecting_shards.empty() &&
+        expecting_shards.front() == it->key()) {
+        // all good
+        expecting_shards.pop_front();
+        continue;
+      }
 
-    thread_pool.add_work_queue(wq.get());
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
-      //not the best place but let's check anyway
-      ceph_assert(sb_info_lock);
-      thread_pool.start();
+      uint32_t offset;
+      string okey;
+      get_key_extent_shard(it->key(), &okey, &offset);
+      derr << "fsck error: stray shard 0x" << std::hex << offset
+        << std::dec << dendl;
+      if (expecting_shards.empty()) {
+        derr << "fsck error: " << pretty_binary_string(it->key())
+          << " is unexpected" << dendl;
+        ++errors;
+        continue;
+      }
+      while (expecting_shards.front() > it->key()) {
+        derr << "fsck error:   saw " << pretty_binary_string(it->key())
+          << dendl;
+        derr << "fsck error:   exp "
+          << pretty_binary_string(expecting_shards.front()) << dendl;
+        ++errors;
+        expecting_shards.pop_front();
+        if (expecting_shards.empty()) {
+          break;
+        }
+      }
+      continue;
     }
 
-    // fill global if not overriden below
-    CollectionRef c;
-    int64_t pool_id = -1;
-    spg_t pgid;
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      dout(30) << __func__ << " key "
+    ghobject_t oid;
+    int r = get_key_object(it->key(), &oid);
+    if (r < 0) {
+      derr << "fsck error: bad object key "
         << pretty_binary_string(it->key()) << dendl;
-      if (is_extent_shard_key(it->key())) {
-        if (depth == FSCK_SHALLOW) {
-          continue;
+      ++errors;
+      continue;
+    }
+    if (!c ||
+      oid.shard_id != pgid.shard ||
+      oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
+      !c->contains(oid)) {
+      c = nullptr;
+      for (auto& p : coll_map) {
+        if (p.second->contains(oid)) {
+          c = p.second;
+          break;
         }
-        while (!expecting_shards.empty() &&
-          expecting_shards.front() < it->key()) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(expecting_shards.front())
-            << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-        }
-        if (!expecting_shards.empty() &&
-          expecting_shards.front() == it->key()) {
-          // all good
-          expecting_shards.pop_front();
-          continue;
-        }
-
-        uint32_t offset;
-        string okey;
-        get_key_extent_shard(it->key(), &okey, &offset);
-        derr << "fsck error: stray shard 0x" << std::hex << offset
-          << std::dec << dendl;
-        if (expecting_shards.empty()) {
-          derr << "fsck error: " << pretty_binary_string(it->key())
-            << " is unexpected" << dendl;
-          ++errors;
-          continue;
-        }
-        while (expecting_shards.front() > it->key()) {
-          derr << "fsck error:   saw " << pretty_binary_string(it->key())
-            << dendl;
-          derr << "fsck error:   exp "
-            << pretty_binary_string(expecting_shards.front()) << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-          if (expecting_shards.empty()) {
-            break;
-          }
-        }
-        continue;
       }
-
-      ghobject_t oid;
-      int r = get_key_object(it->key(), &oid);
-      if (r < 0) {
-        derr << "fsck error: bad object key "
-          << pretty_binary_string(it->key()) << dendl;
+      if (!c) {
+        derr << "fsck error: stray object " << oid
+          << " not owned by any collection" << dendl;
         ++errors;
         continue;
       }
-      if (!c ||
-        oid.shard_id != pgid.shard ||
-        oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
-        !c->contains(oid)) {
-        c = nullptr;
-        for (auto& p : coll_map) {
-          if (p.second->contains(oid)) {
-            c = p.second;
-            break;
-          }
-        }
-        if (!c) {
-          derr << "fsck error: stray object " << oid
-            << " not owned by any collection" << dendl;
-          ++errors;
-          continue;
-        }
-        pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
-        dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
-          << dendl;
-      }
+      pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
+      dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
+        << dendl;
+    }
 
-      if (depth != FSCK_SHALLOW &&
-        !expecting_shards.empty()) {
-        for (auto& k : expecting_shards) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(k) << dendl;
-        }
-        ++errors;
-        expecting_shards.clear();
+    if (depth != FSCK_SHALLOW &&
+      !expecting_shards.empty()) {
+      for (auto& k : expecting_shards) {
+        derr << "fsck error: missing shard key "
+          << pretty_binary_string(k) << dendl;
       }
+      ++errors;
+      expecting_shards.clear();
+    }
 
-      bool queued = false;
-      if (depth == FSCK_SHALLOW && thread_count > 0) {
-        queued = wq->queue(
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value());
-      }
-      OnodeRef o;
-      map<BlobRef, bluestore_blob_t::unused_t> referenced;
-
-      if (!queued) {
-        ++processed_myself;
-         o = fsck_check_objects_shallow(
-          depth,
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value(),
-          &expecting_shards,
-          &referenced,
-          ctx);
-      }
+    ++fsck_objects_done;
+    bool queued = false;
+    if (offload) {
+      queued = offload(pool_id, c, oid, it->key(), it->value());
+    }
+    OnodeRef o;
+    map<BlobRef, bluestore_blob_t::unused_t> referenced;
 
-      if (depth != FSCK_SHALLOW) {
-        ceph_assert(o != nullptr);
-        if (o->onode.nid) {
-          if (o->onode.nid > nid_max) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " > nid_max " << nid_max << dendl;
-            ++errors;
-          }
-          if (used_nids.count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
-            continue; // go for next object
-          }
-          used_nids.insert(o->onode.nid);
+    if (!queued) {
+      ++processed_myself;
+       o = fsck_check_objects_shallow(
+        depth,
+        pool_id,
+        c,
+        oid,
+        it->key(),
+        it->value(),
+        &expecting_shards,
+        &referenced,
+        ctx);
+    }
+
+    if (depth != FSCK_SHALLOW) {
+      ceph_assert(o != nullptr);
+      if (o->onode.nid) {
+        if (o->onode.nid > nid_max) {
+          derr << "fsck error: " << oid << " nid " << o->onode.nid
+            << " > nid_max " << nid_max << dendl;
+          ++errors;
         }
-        for (auto& i : referenced) {
-          dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
-            << std::dec << " for " << *i.first << dendl;
-          const bluestore_blob_t& blob = i.first->get_blob();
-          if (i.second & blob.unused) {
-            derr << "fsck error: " << oid << " blob claims unused 0x"
-              << std::hex << blob.unused
-              << " but extents reference 0x" << i.second << std::dec
-              << " on blob " << *i.first << dendl;
-            ++errors;
-          }
-          if (blob.has_csum()) {
-            uint64_t blob_len = blob.get_logical_length();
-            uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
-            unsigned csum_count = blob.get_csum_count();
-            unsigned csum_chunk_size = blob.get_csum_chunk_size();
-            for (unsigned p = 0; p < csum_count; ++p) {
-              unsigned pos = p * csum_chunk_size;
-              unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
-              unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
-              unsigned mask = 1u << firstbit;
-              for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
-                mask |= 1u << b;
-              }
-              if ((blob.unused & mask) == mask) {
-                // this csum chunk region is marked unused
-                if (blob.get_csum_item(p) != 0) {
-                  derr << "fsck error: " << oid
-                    << " blob claims csum chunk 0x" << std::hex << pos
-                    << "~" << csum_chunk_size
-                    << " is unused (mask 0x" << mask << " of unused 0x"
-                    << blob.unused << ") but csum is non-zero 0x"
-                    << blob.get_csum_item(p) << std::dec << " on blob "
-                    << *i.first << dendl;
-                  ++errors;
-                }
+        if (!used_nids.insert(o->onode.nid)) {
+          derr << "fsck error: " << oid << " nid " << o->onode.nid
+            << " already in use" << dendl;
+          ++errors;
+          continue; // go for next object
+        }
+      }
+      for (auto& i : referenced) {
+        dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
+          << std::dec << " for " << *i.first << dendl;
+        const bluestore_blob_t& blob = i.first->get_blob();
+        if (i.second & blob.unused) {
+          derr << "fsck error: " << oid << " blob claims unused 0x"
+            << std::hex << blob.unused
+            << " but extents reference 0x" << i.second << std::dec
+            << " on blob " << *i.first << dendl;
+          ++errors;
+        }
+        if (blob.has_csum()) {
+          uint64_t blob_len = blob.get_logical_length();
+          uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
+          unsigned csum_count = blob.get_csum_count();
+          unsigned csum_chunk_size = blob.get_csum_chunk_size();
+          for (unsigned p = 0; p < csum_count; ++p) {
+            unsigned pos = p * csum_chunk_size;
+            unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
+            unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
+            unsigned mask = 1u << firstbit;
+            for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
+              mask |= 1u << b;
+            }
+            if ((blob.unused & mask) == mask) {
+              // this csum chunk region is marked unused
+              if (blob.get_csum_item(p) != 0) {
+                derr << "fsck error: " << oid
+                  << " blob claims csum chunk 0x" << std::hex << pos
+                  << "~" << csum_chunk_size
+                  << " is unused (mask 0x" << mask << " of unused 0x"
+                  << blob.unused << ") but csum is non-zero 0x"
+                  << blob.get_csum_item(p) << std::dec << " on blob "
+                  << *i.first << dendl;
+                ++errors;
               }
             }
           }
         }
-        // omap
-        if (o->onode.has_omap()) {
-          ceph_assert(ctx.used_omap_head);
-          if (ctx.used_omap_head->count(o->onode.nid)) {
-            derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
-                 << " already in use" << dendl;
+      }
+      // omap
+      if (o->onode.has_omap()) {
+        ceph_assert(ctx.used_omap_head);
+        if (ctx.used_omap_head->count(o->onode.nid)) {
+          derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
+               << " already in use" << dendl;
+          ++errors;
+        } else {
+          ctx.used_omap_head->insert(o->onode.nid);
+        }
+      } // if (o->onode.has_omap())
+      if (depth == FSCK_DEEP) {
+        bufferlist bl;
+        uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
+        uint64_t offset = 0;
+        do {
+          uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
+          int r = _do_read(c.get(), o, offset, l, bl,
+            CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+          if (r < 0) {
             ++errors;
-          } else {
-            ctx.used_omap_head->insert(o->onode.nid);
+            derr << "fsck error: " << oid << std::hex
+              << " error during read: "
+              << " " << offset << "~" << l
+              << " " << cpp_strerror(r) << std::dec
+              << dendl;
+            break;
           }
-        } // if (o->onode.has_omap())
-        if (depth == FSCK_DEEP) {
-          bufferlist bl;
-          uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
-          uint64_t offset = 0;
-          do {
-            uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
-            int r = _do_read(c.get(), o, offset, l, bl,
-              CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
-            if (r < 0) {
-              ++errors;
-              derr << "fsck error: " << oid << std::hex
-                << " error during read: "
-                << " " << offset << "~" << l
-                << " " << cpp_strerror(r) << std::dec
-                << dendl;
-              break;
-            }
-            offset += l;
-          } while (offset < o->onode.size);
-        } // deep
-      } //if (depth != FSCK_SHALLOW)
-    } // for (it->lower_bound(string()); it->valid(); it->next())
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
-      wq->finalize(thread_pool, ctx);
-      if (processed_myself) {
-        // may be needs more threads?
-        dout(0) << __func__ << " partial offload"
-                << ", done myself " << processed_myself
-                << " of " << ctx.num_objects
-                << "objects, threads " << thread_count
-                << dendl;
+          offset += l;
+        } while (offset < o->onode.size);
+      } // deep
+    } //if (depth != FSCK_SHALLOW)
+  } // for (it->lower_bound(start); it->valid(); it->next())
+  return processed_myself;
+}
+
+void BlueStore::_fsck_check_objects(
+  FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx)
+{
+  auto sb_info_lock = ctx.sb_info_lock;
+  auto& sb_info = ctx.sb_info;
+  auto& sb_ref_counts = ctx.sb_ref_counts;
+  auto repairer = ctx.repairer;
+
+  if (depth != FSCK_SHALLOW && !bdev->is_smr() &&
+      cct->_conf.get_val<uint64_t>("bluestore_fsck_threads") > 0) {
+    _fsck_check_objects_parallel(depth, ctx,
+      cct->_conf.get_val<uint64_t>("bluestore_fsck_threads"));
+    return;
+  }
+
+  fsck_used_nids_t used_nids;
+
+  const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
+  typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
+  std::unique_ptr<WQ> wq(
+    new WQ(
+      "FSCKWorkQueue",
+      (thread_count ? : 1) * 32,
+      this,
+      sb_info_lock,
+      sb_info,
+      sb_ref_counts,
+      repairer));
+
+  ShallowFSCKThreadPool thread_pool(cct, "ShallowFSCKThreadPool", "ShallowFSCK", thread_count);
+
+  thread_pool.add_work_queue(wq.get());
+  if (depth == FSCK_SHALLOW && thread_count > 0) {
+    //not the best place but let's check anyway
+    ceph_assert(sb_info_lock);
+    thread_pool.start();
+  }
+
+  size_t processed_myself = _fsck_walk_objects(depth, ctx,
+    string(), string(), used_nids,
+    [&](int64_t pool_id, CollectionRef c, const ghobject_t& oid,
+	const string& key, const bufferlist& value) {
+      if (depth == FSCK_SHALLOW && thread_count > 0) {
+	return wq->queue(pool_id, c, oid, key, value);
+      }
+      return false;
+    });
+
+  if (depth == FSCK_SHALLOW && thread_count > 0) {
+    wq->finalize(thread_pool, ctx);
+    if (processed_myself) {
+      // may be needs more threads?
+      dout(0) << __func__ << " partial offload"
+              << ", done myself " << processed_myself
+              << " of " << ctx.num_objects
+              << "objects, threads " << thread_count
+              << dendl;
+    }
+  }
+}
+
+void BlueStore::_fsck_check_objects_parallel(
+  FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx,
+  size_t thread_count)
+{
+  // Split the object keyspace at the start of each collection's temp and
+  // regular ranges.  An onode and its extent shards share the key prefix
+  // the split points are made of, so they always end up in the same range.
+  std::set<string> bounds;
+  for (auto& [cid, c] : coll_map) {
+    ghobject_t temp_start, temp_end, start, end;
+    get_coll_range(cid, c->cnode.bits, &temp_start, &temp_end,
+		   &start, &end, false);
+    string k;
+    _key_encode_prefix(temp_start, &k);
+    bounds.insert(k);
+    k.clear();
+    _key_encode_prefix(start, &k);
+    bounds.insert(k);
+  }
+  bounds.erase(string());
+  std::vector<std::pair<string, string>> ranges;
+  string last;
+  for (auto& b : bounds) {
+    ranges.emplace_back(last, b);
+    last = b;
+  }
+  ranges.emplace_back(last, string());
+  thread_count = std::min(thread_count, ranges.size());
+  dout(10) << __func__ << " " << ranges.size() << " key ranges, "
+	   << thread_count << " threads" << dendl;
+
+  // everything a worker collects on its own, merged when all are done
+  struct worker_t {
+    int64_t errors = 0;
+    int64_t warnings = 0;
+    uint64_t num_objects = 0;
+    uint64_t num_extents = 0;
+    uint64_t num_blobs = 0;
+    uint64_t num_sharded_objects = 0;
+    uint64_t num_spanning_blobs = 0;
+    store_statfs_t expected_store_statfs;
+    per_pool_statfs expected_pool_statfs;
+    uint64_t_btree_t used_omap_head;
+  };
+  std::vector<worker_t> workers(thread_count);
+
+  ceph_assert(ctx.used_blocks);
+  fsck_shared_bitset_t used_blocks(*ctx.used_blocks);
+  fsck_used_nids_t used_nids;
+  ceph::mutex sb_info_lock = ceph::make_mutex("BlueStore::fsck_sb_info_lock");
+  std::atomic<size_t> next_range = {0};
+
+  std::vector<std::thread> threads;
+  for (auto& w : workers) {
+    threads.push_back(make_named_thread("bstore_fsck", [&] {
+      FSCK_ObjectCtx wctx(
+	w.errors,
+	w.warnings,
+	w.num_objects,
+	w.num_extents,
+	w.num_blobs,
+	w.num_sharded_objects,
+	w.num_spanning_blobs,
+	nullptr, // used_blocks
+	&w.used_omap_head,
+	nullptr, // zone_refs
+	&sb_info_lock,
+	ctx.sb_info,
+	ctx.sb_ref_counts,
+	w.expected_store_statfs,
+	w.expected_pool_statfs,
+	ctx.repairer);
+      wctx.shared_used_blocks = &used_blocks;
+      for (size_t i = next_range++; i < ranges.size(); i = next_range++) {
+	_fsck_walk_objects(depth, wctx,
+	  ranges[i].first, ranges[i].second, used_nids, nullptr);
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (auto& w : workers) {
+    ctx.errors += w.errors;
+    ctx.warnings += w.warnings;
+    ctx.num_objects += w.num_objects;
+    ctx.num_extents += w.num_extents;
+    ctx.num_blobs += w.num_blobs;
+    ctx.num_sharded_objects += w.num_sharded_objects;
+    ctx.num_spanning_blobs += w.num_spanning_blobs;
+    ctx.expected_store_statfs.add(w.expected_store_statfs);
+    for (auto& [pool, statfs] : w.expected_pool_statfs) {
+      ctx.expected_pool_statfs[pool].add(statfs);
+    }
+    ceph_assert(ctx.used_omap_head);
+    for (auto nid : w.used_omap_head) {
+      if (!ctx.used_omap_head->insert(nid).second) {
+	derr << "fsck error: omap_head " << nid << " already in use" << dendl;
+	++ctx.errors;
       }
     }
-  } // if (it)
+  }
 }
 /**
 An overview for currently implemented repair logics 
@@ -10305,6 +11087,21 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
                 depth == FSCK_SHALLOW ? " (shallow)" : " (regular)")
           << " start sb_tracker_hash_size:" << sb_hash_size
           << dendl;
+  {
+    std::lock_guard l(fsck_progress_lock);
+    fsck_running = true;
+    fsck_phase = "starting";
+    fsck_start = ceph::mono_clock::now();
+    fsck_walk_start = {};
+    fsck_objects_done = 0;
+    fsck_bytes_done = 0;
+    fsck_bytes_total = 0;
+  }
+  auto fsck_done = make_scope_guard([&] {
+    std::lock_guard l(fsck_progress_lock);
+    fsck_running = false;
+    fsck_phase.clear();
+  });
   int64_t errors = 0;
   int64_t warnings = 0;
   unsigned repaired = 0;
@@ -10476,6 +11273,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 #endif
 
   dout(1) << __func__ << " checking shared_blobs (phase 1)" << dendl;
+  _fsck_progress_phase("checking shared_blobs (phase 1)");
   it = db->get_iterator(PREFIX_SHARED_BLOB, KeyValueDB::ITERATOR_NOCACHE);
   if (it) {
     for (it->lower_bound(string()); it->valid(); it->next()) {
@@ -10515,6 +11313,13 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
   // walk PREFIX_OBJ
   {
     dout(1) << __func__ << " walking object keyspace" << dendl;
+    _fsck_progress_phase("walking object keyspace");
+    {
+      std::lock_guard l(fsck_progress_lock);
+      fsck_walk_start = ceph::mono_clock::now();
+      fsck_bytes_total = std::max<int64_t>(
+	0, db->estimate_prefix_size(PREFIX_OBJ, string()));
+    }
     ceph::mutex sb_info_lock =  ceph::make_mutex("BlueStore::fsck::sbinfo_lock");
     BlueStore::FSCK_ObjectCtx ctx(
       errors,
@@ -10527,8 +11332,8 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
       &used_blocks,
       &used_omap_head,
       &zone_refs,
-      //no need for the below lock when in non-shallow mode as
-      // there is no multithreading in this case
+      // no need for the below lock when in non-shallow mode as the
+      // parallel object walk brings a lock of its own
       depth == FSCK_SHALLOW ? &sb_info_lock : nullptr,
       sb_info,
       sb_ref_counts,
@@ -10542,6 +11347,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
 #ifdef HAVE_LIBZBD
   if (bdev->is_smr() && depth != FSCK_SHALLOW) {
     dout(1) << __func__ << " checking for leaked zone refs" << dendl;
+    _fsck_progress_phase("checking for leaked zone refs");
     for (uint32_t zone = 0; zone < zone_refs.size(); ++zone) {
       for (auto& [oid, offset] : zone_refs[zone]) {
 	derr << "fsck error: stray zone ref 0x" << std::hex << zone
@@ -10588,6 +11394,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
     _fsck_repair_shared_blobs(repairer, sb_ref_counts, sb_info);
   }
   dout(1) << __func__ << " checking shared_blobs (phase 2)" << dendl;
+  _fsck_progress_phase("checking shared_blobs (phase 2)");
   it = db->get_iterator(PREFIX_SHARED_BLOB, KeyValueDB::ITERATOR_NOCACHE);
   if (it) {
     // FIXME minor: perhaps simplify for shallow mode?
@@ -10667,6 +11474,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
   if (repair && repairer.preprocess_misreference(db)) {
 
     dout(1) << __func__ << " sorting out misreferenced extents" << dendl;
+    _fsck_progress_phase("sorting out misreferenced extents");
     auto& misref_extents = repairer.get_misreferences();
     interval_set<uint64_t> to_release;
     it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
@@ -10868,10 +11676,12 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
   sb_ref_counts.reset();
 
   dout(1) << __func__ << " checking pool_statfs" << dendl;
+  _fsck_progress_phase("checking pool_statfs");
   _fsck_check_statfs(expected_store_statfs, expected_pool_statfs,
     errors, warnings, repair ? &repairer : nullptr);
   if (depth != FSCK_SHALLOW) {
     dout(1) << __func__ << " checking for stray omap data " << dendl;
+    _fsck_progress_phase("checking for stray omap data");
     it = db->get_iterator(PREFIX_OMAP, KeyValueDB::ITERATOR_NOCACHE);
     if (it) {
       uint64_t last_omap_head = 0;
@@ -10962,6 +11772,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
       }
     }
     dout(1) << __func__ << " checking deferred events" << dendl;
+    _fsck_progress_phase("checking deferred events");
     it = db->get_iterator(PREFIX_DEFERRED, KeyValueDB::ITERATOR_NOCACHE);
     if (it) {
       for (it->lower_bound(string()); it->valid(); it->next()) {
@@ -10998,6 +11809,7 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
     // skip freelist vs allocated compare when we have Null fm
     if (!fm->is_null_manager()) {
       dout(1) << __func__ << " checking freelist vs allocated" << dendl;
+      _fsck_progress_phase("checking freelist vs allocated");
 #ifdef HAVE_LIBZBD
       if (freelist_type == "zoned") {
 	// verify per-zone state
@@ -11735,8 +12547,8 @@ BlueStore::CollectionRef BlueStore::_get_collection_by_oid(const ghobject_t& oid
 void BlueStore::_queue_reap_collection(CollectionRef& c)
 {
   dout(10) << __func__ << " " << c << " " << c->cid << dendl;
-  // _reap_collections and this in the same thread,
-  // so no need a lock.
+  // kv finalize threads of different lanes may race here
+  std::lock_guard l(removed_collections_lock);
   removed_collections.push_back(c);
 }
 
@@ -11745,8 +12557,7 @@ void BlueStore::_reap_collections()
 
   list<CollectionRef> removed_colls;
   {
-    // _queue_reap_collection and this in the same thread.
-    // So no need a lock.
+    std::lock_guard l(removed_collections_lock);
     if (!removed_collections.empty())
       removed_colls.swap(removed_collections);
     else
@@ -11776,6 +12587,7 @@ void BlueStore::_reap_collections()
   if (removed_colls.empty()) {
     dout(10) << __func__ << " all reaped" << dendl;
   } else {
+    std::lock_guard l(removed_collections_lock);
     removed_collections.splice(removed_collections.begin(), removed_colls);
   }
 }
@@ -11801,6 +12613,19 @@ void BlueStore::_update_logger()
   logger->set(l_bluestore_blobs, num_blobs);
   logger->set(l_bluestore_buffers, num_buffers);
   logger->set(l_bluestore_buffer_bytes, num_buffer_bytes);
+
+  // onode metadata as accounted by mempool, which counts whole slabs
+  uint64_t slab_bytes = get_onode_slab_bytes();
+  uint64_t meta_bytes =
+    mempool::bluestore_cache_onode::allocated_bytes() +
+    mempool::bluestore_extent::allocated_bytes() +
+    mempool::bluestore_blob::allocated_bytes() +
+    mempool::bluestore_shared_blob::allocated_bytes() +
+    mempool::bluestore_cache_meta::allocated_bytes() +
+    mempool::bluestore_cache_other::allocated_bytes();
+  logger->set(l_bluestore_onode_slab_bytes, slab_bytes);
+  logger->set(l_bluestore_onode_meta_bytes_per_onode,
+	      meta_bytes / std::max<uint64_t>(1, num_onodes));
 }
 
 // ---------------
@@ -11940,6 +12765,8 @@ int BlueStore::read(
     r = _do_read(c, o, offset, length, bl, op_flags);
     if (r == -EIO) {
       logger->inc(l_bluestore_read_eio);
+    } else if (r > 0) {
+      _maybe_readahead(c, o, offset, r, op_flags);
     }
   }
 
@@ -11964,6 +12791,45 @@ int BlueStore::read(
   return r;
 }
 
+bool BlueStore::is_read_cached(
+  CollectionHandle &c_,
+  const ghobject_t& oid,
+  uint64_t offset,
+  size_t length)
+{
+  Collection *c = static_cast<Collection *>(c_.get());
+  std::shared_lock l(c->lock, std::try_to_lock);
+  if (!l.owns_lock() || !c->exists) {
+    return false;
+  }
+  // a miss would have get_onode() load it from the db
+  OnodeRef o = c->onode_space.lookup(oid);
+  if (!o || !o->exists) {
+    return false;
+  }
+  if (offset >= o->onode.size || length == 0) {
+    return true;
+  }
+  uint64_t end = std::min<uint64_t>(offset + length, o->onode.size);
+  if (!o->extent_map.is_range_loaded(offset, end - offset)) {
+    return false;
+  }
+  for (auto lp = o->extent_map.seek_lextent(offset);
+       lp != o->extent_map.extent_map.end() && lp->logical_offset < end;
+       ++lp) {
+    uint64_t l_start = std::max<uint64_t>(offset, lp->logical_offset);
+    uint64_t l_end = std::min<uint64_t>(end, lp->logical_end());
+    const BlobRef& b = lp->blob;
+    if (!b->get_bc().is_cached(
+	  b->shared_blob->get_cache(),
+	  l_start - lp->logical_offset + lp->blob_offset,
+	  l_end - l_start)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void BlueStore::_read_cache(
   OnodeRef& o,
   uint64_t offset,
@@ -12066,6 +12932,18 @@ int BlueStore::_prepare_read_ioc(
   vector<bufferlist>* compressed_blob_bls,
   IOContext* ioc)
 {
+  // device extents backing the uncompressed read requests, in the order
+  // they have to be appended to their request's buffer
+  struct read_piece_t {
+    uint64_t offset;
+    uint64_t length;
+    read_req_t *req;
+    bufferlist bl;
+    read_piece_t(uint64_t o, uint64_t l, read_req_t *r)
+      : offset(o), length(l), req(r) {}
+  };
+  vector<read_piece_t> pieces;
+
   for (auto& p : blobs2read) {
     const BlobRef& bptr = p.first;
     regions2read_t& r2r = p.second;
@@ -12096,7 +12974,7 @@ int BlueStore::_prepare_read_ioc(
         ceph_assert(r == 0);
       }
     } else {
-      // read the pieces
+      // collect the pieces
       for (auto& req : r2r) {
         dout(20) << __func__ << "    region 0x" << std::hex
                  << req.regs.front().logical_offset
@@ -12104,25 +12982,81 @@ int BlueStore::_prepare_read_ioc(
                  << " reading 0x" << req.r_off
                  << "~" << req.r_len << std::dec
                  << dendl;
-
-        // read it
-        auto r = bptr->get_blob().map(
+        bptr->get_blob().map(
           req.r_off, req.r_len,
           [&](uint64_t offset, uint64_t length) {
-            int r = bdev->aio_read(offset, length, &req.bl, ioc);
-            if (r < 0)
-              return r;
+            pieces.emplace_back(offset, length, &req);
             return 0;
           });
-        if (r < 0) {
-          derr << __func__ << " bdev-read failed: " << cpp_strerror(r)
-               << dendl;
-          if (r == -EIO) {
-            // propagate EIO to caller
-            return r;
-          }
-          ceph_assert(r == 0);
-        }
+      }
+    }
+  }
+  if (pieces.empty()) {
+    return 0;
+  }
+
+  // Heavily fragmented objects often have blobs that sit next to each
+  // other on disk.  Issue a single read for every run of physically
+  // adjacent pieces and hand out (shared, not copied) slices of it.
+  uint64_t max_merge =
+    cct->_conf.get_val<Option::size_t>("bluestore_read_coalesce_max_bytes");
+  vector<read_piece_t*> by_offset;
+  by_offset.reserve(pieces.size());
+  for (auto& piece : pieces) {
+    by_offset.push_back(&piece);
+  }
+  std::stable_sort(by_offset.begin(), by_offset.end(),
+    [](const read_piece_t *a, const read_piece_t *b) {
+      return a->offset < b->offset;
+    });
+  uint64_t coalesced = 0;
+  size_t i = 0;
+  while (i < by_offset.size()) {
+    uint64_t start = by_offset[i]->offset;
+    uint64_t end = start + by_offset[i]->length;
+    size_t j = i + 1;
+    while (j < by_offset.size() &&
+           by_offset[j]->offset == end &&
+           end - start + by_offset[j]->length <= max_merge) {
+      end += by_offset[j]->length;
+      ++j;
+    }
+    bufferlist run;
+    int r = bdev->aio_read(start, end - start, &run, ioc);
+    if (r < 0) {
+      derr << __func__ << " bdev-read failed: " << cpp_strerror(r)
+           << dendl;
+      if (r == -EIO) {
+        // propagate EIO to caller
+        return r;
+      }
+      ceph_assert(r == 0);
+    }
+    if (j - i == 1) {
+      by_offset[i]->bl.claim_append(run);
+    } else {
+      dout(20) << __func__ << "    coalesced " << (j - i)
+               << " reads into 0x" << std::hex << start << "~"
+               << (end - start) << std::dec << dendl;
+      for (size_t k = i; k < j; ++k) {
+        by_offset[k]->bl.substr_of(run, by_offset[k]->offset - start,
+                                   by_offset[k]->length);
+        by_offset[k]->req->coalesced = true;
+      }
+      coalesced += j - i - 1;
+    }
+    i = j;
+  }
+  if (coalesced) {
+    logger->inc(l_bluestore_read_coalesced_ios, coalesced);
+  }
+
+  for (auto& piece : pieces) {
+    piece.req->bl.claim_append(piece.bl);
+  }
+  for (auto& p : blobs2read) {
+    if (!p.first->get_blob().is_compressed()) {
+      for (auto& req : p.second) {
         ceph_assert(req.bl.length() == req.r_len);
       }
     }
@@ -12179,6 +13113,10 @@ int BlueStore::_generate_read_result_bl(
           return -EIO;
         }
         if (buffered) {
+          if (req.coalesced) {
+            // don't let the cache pin the whole coalesced read
+            req.bl.rebuild();
+          }
           bptr->dirty_bc().did_read(bptr->shared_blob->get_cache(),
                                          req.r_off, req.bl);
         }
@@ -12290,6 +13228,7 @@ int BlueStore::_do_read(
                              // The error isn't that much...
   vector<bufferlist> compressed_blob_bls;
   IOContext ioc(cct, NULL, !cct->_conf->bluestore_fail_eio);
+  ioc.queue_hint = get_aio_queue_hint(c->cid);
   r = _prepare_read_ioc(blobs2read, &compressed_blob_bls, &ioc);
   // we always issue aio for reading, so errors other than EIO are not allowed
   if (r < 0)
@@ -12298,6 +13237,8 @@ int BlueStore::_do_read(
   int64_t num_ios = blobs2read.size();
   if (ioc.has_pending_aios()) {
     num_ios = ioc.get_num_ios();
+    uint64_t aio_bytes = _get_pending_aio_bytes(ioc);
+    auto aio_start = mono_clock::now();
     bdev->aio_submit(&ioc);
     dout(20) << __func__ << " waiting for aio" << dendl;
     ioc.aio_wait();
@@ -12306,6 +13247,8 @@ int BlueStore::_do_read(
       ceph_assert(r == -EIO); // no other errors allowed
       return -EIO;
     }
+    logger->tinc(l_bluestore_read_device_lat, mono_clock::now() - aio_start);
+    logger->inc(l_bluestore_read_device_bytes, aio_bytes);
   }
   log_latency_fn(__func__,
     l_bluestore_read_wait_aio_lat,
@@ -12570,6 +13513,9 @@ int BlueStore::readv(
     r = _do_readv(c, o, m, bl, op_flags);
     if (r == -EIO) {
       logger->inc(l_bluestore_read_eio);
+    } else if (r > 0) {
+      _maybe_readahead(c, o, m.range_start(),
+		       m.range_end() - m.range_start(), op_flags);
     }
   }
 
@@ -12594,6 +13540,135 @@ int BlueStore::readv(
   return r;
 }
 
+void BlueStore::_maybe_readahead(
+  Collection *c,
+  OnodeRef& o,
+  uint64_t offset,
+  size_t length,
+  uint32_t op_flags)
+{
+  if (readahead_limit == 0 ||
+      (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+		   CEPH_OSD_OP_FLAG_FADVISE_NOCACHE |
+		   CEPH_OSD_OP_FLAG_BYPASS_CLEAN_CACHE))) {
+    return;
+  }
+  ReadaheadStream::config_t conf;
+  conf.trigger_requests = readahead_trigger_requests;
+  conf.min_size = readahead_min_size;
+  conf.max_size = readahead_max_size;
+  uint64_t tag = _readahead_tag(o);
+  auto e = readahead_streams.update(conf, tag, offset, length, o->onode.size);
+  if (e.second == 0) {
+    return;
+  }
+  if (readahead_inflight + e.second > readahead_limit) {
+    dout(20) << __func__ << " " << o->oid << " 0x" << std::hex << e.first
+	     << "~" << e.second << std::dec << " over budget" << dendl;
+    readahead_streams.cancel(tag, e);
+    logger->inc(l_bluestore_readahead_skipped);
+    return;
+  }
+  dout(20) << __func__ << " " << o->oid << " 0x" << std::hex << e.first
+	   << "~" << e.second << std::dec << dendl;
+  {
+    std::lock_guard l(readahead_lock);
+    if (!readahead_running || readahead_stop) {
+      readahead_streams.cancel(tag, e);
+      return;
+    }
+    readahead_inflight += e.second;
+    readahead_queue.push_back(readahead_req_t{c, o, e.first, e.second});
+  }
+  readahead_cond.notify_one();
+}
+
+void BlueStore::_readahead_start()
+{
+  std::lock_guard l(readahead_lock);
+  ceph_assert(!readahead_running);
+  readahead_stop = false;
+  readahead_running = true;
+  // each thread reads one request at a time, so as many streams are read
+  // ahead of at once
+  uint64_t n = std::max<uint64_t>(
+    1, cct->_conf.get_val<uint64_t>("bluestore_readahead_threads"));
+  for (uint64_t i = 0; i < n; ++i) {
+    readahead_threads.emplace_back(std::make_unique<ReadaheadThread>(this));
+    readahead_threads.back()->create("bstore_readahd");
+  }
+}
+
+void BlueStore::_readahead_stop()
+{
+  {
+    std::lock_guard l(readahead_lock);
+    if (!readahead_running) {
+      return;
+    }
+    readahead_stop = true;
+    readahead_cond.notify_all();
+  }
+  for (auto& t : readahead_threads) {
+    t->join();
+  }
+  readahead_threads.clear();
+  std::lock_guard l(readahead_lock);
+  readahead_running = false;
+  readahead_stop = false;
+}
+
+void BlueStore::_readahead_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l(readahead_lock);
+  while (true) {
+    if (readahead_stop) {
+      // pending read-ahead is only a hint, drop it
+      for (auto& req : readahead_queue) {
+	readahead_inflight -= req.length;
+      }
+      readahead_queue.clear();
+      break;
+    }
+    if (readahead_queue.empty()) {
+      readahead_cond.wait(l);
+      continue;
+    }
+    auto req = std::move(readahead_queue.front());
+    readahead_queue.pop_front();
+    l.unlock();
+
+    auto start = mono_clock::now();
+    int r = 0;
+    {
+      std::shared_lock cl(req.c->lock);
+      if (req.c->exists && req.o->exists) {
+	// a buffered read populates the buffer cache, the data is dropped
+	bufferlist bl;
+	r = _do_read(req.c.get(), req.o, req.offset, req.length, bl,
+		     CEPH_OSD_OP_FLAG_FADVISE_WILLNEED);
+      }
+    }
+    if (r < 0) {
+      dout(10) << __func__ << " " << req.o->oid << " 0x" << std::hex
+	       << req.offset << "~" << req.length << std::dec
+	       << " = " << cpp_strerror(r) << dendl;
+      uint64_t tag = _readahead_tag(req.o);
+      readahead_streams.reset(tag);
+    } else if (r > 0) {
+      logger->inc(l_bluestore_readahead_ios);
+      logger->inc(l_bluestore_readahead_bytes, r);
+      logger->tinc(l_bluestore_readahead_lat, mono_clock::now() - start);
+    }
+    readahead_inflight -= req.length;
+    req.o.reset();
+    req.c.reset();
+    l.lock();
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
 int BlueStore::_do_readv(
   Collection *c,
   OnodeRef& o,
@@ -12639,6 +13714,7 @@ int BlueStore::_do_readv(
   _dump_onode<30>(cct, *o);
 
   IOContext ioc(cct, NULL, !cct->_conf->bluestore_fail_eio);
+  ioc.queue_hint = get_aio_queue_hint(c->cid);
   vector<std::tuple<ready_regions_t, vector<bufferlist>, blobs2read_t>> raw_results;
   raw_results.reserve(m.num_intervals());
   int i = 0;
@@ -12655,6 +13731,8 @@ int BlueStore::_do_readv(
   auto num_ios = m.size();
   if (ioc.has_pending_aios()) {
     num_ios = ioc.get_num_ios();
+    uint64_t aio_bytes = _get_pending_aio_bytes(ioc);
+    auto aio_start = mono_clock::now();
     bdev->aio_submit(&ioc);
     dout(20) << __func__ << " waiting for aio" << dendl;
     ioc.aio_wait();
@@ -12663,6 +13741,8 @@ int BlueStore::_do_readv(
       ceph_assert(r == -EIO); // no other errors allowed
       return -EIO;
     }
+    logger->tinc(l_bluestore_read_device_lat, mono_clock::now() - aio_start);
+    logger->inc(l_bluestore_read_device_bytes, aio_bytes);
   }
   log_latency_fn(__func__,
     l_bluestore_read_wait_aio_lat,
@@ -12740,6 +13820,170 @@ int BlueStore::dump_onode(CollectionHandle &c_,
   return r;
 }
 
+BlueStore::fragmentation_t BlueStore::_get_fragmentation(OnodeRef& o)
+{
+  fragmentation_t r;
+  std::set<Blob*> seen;
+  for (auto& e : o->extent_map.extent_map) {
+    Blob *b = e.blob.get();
+    if (!seen.insert(b).second) {
+      continue;
+    }
+    const bluestore_blob_t& blob = b->get_blob();
+    if (blob.is_shared()) {
+      r.shared = true;
+    }
+    if (blob.is_compressed()) {
+      ++r.compressed;
+      if (b->get_referenced_bytes() < blob.get_logical_length() / 2) {
+	++r.wasted_compressed;
+      }
+    }
+  }
+  r.blobs = seen.size();
+  r.shards = o->extent_map.shards.size();
+  return r;
+}
+
+int BlueStore::defragment(
+  CollectionHandle &c_,
+  const ghobject_t& oid,
+  defrag_stats_t *stats,
+  Context *on_commit,
+  ThreadPool::TPHandle *handle)
+{
+  int r = _defragment(c_, oid, stats, on_commit, handle);
+  if (r <= 0 && on_commit) {
+    // nothing was queued
+    on_commit->complete(r);
+  }
+  return r;
+}
+
+int BlueStore::_defragment(
+  CollectionHandle &c_,
+  const ghobject_t& oid,
+  defrag_stats_t *stats,
+  Context *on_commit,
+  ThreadPool::TPHandle *handle)
+{
+  Collection *c = static_cast<Collection *>(c_.get());
+  dout(15) << __func__ << " " << c->cid << " " << oid << dendl;
+  if (!c->exists)
+    return -ENOENT;
+
+  const uint64_t min_blobs =
+    cct->_conf.get_val<uint64_t>("bluestore_defrag_min_blobs");
+  const double blob_ratio =
+    cct->_conf.get_val<double>("bluestore_defrag_blob_ratio");
+  const uint64_t max_size =
+    cct->_conf.get_val<Option::size_t>("bluestore_defrag_max_object_size");
+
+  fragmentation_t before;
+  Transaction t;
+  uint32_t write_alloc_hints = 0;
+  uint64_t bytes = 0;
+  {
+    std::shared_lock l(c->lock);
+    OnodeRef o = c->get_onode(oid, false);
+    if (!o || !o->exists) {
+      return -ENOENT;
+    }
+    ++stats->objects;
+    uint64_t size = o->onode.size;
+    if (size == 0 || size > max_size) {
+      return 0;
+    }
+    o->extent_map.fault_range(db, 0, size);
+    before = _get_fragmentation(o);
+    // clones share their blobs, rewriting would unshare (i.e. copy) them
+    if (before.shared) {
+      return 0;
+    }
+    uint64_t ideal = std::max<uint64_t>(
+      1, round_up_to(size, max_blob_size.load()) / max_blob_size);
+    if (before.wasted_compressed == 0 &&
+	(before.blobs < min_blobs || before.blobs < ideal * blob_ratio)) {
+      return 0;
+    }
+    dout(10) << __func__ << " " << oid << " size 0x" << std::hex << size
+	     << std::dec << " blobs " << before.blobs << " (ideal " << ideal
+	     << ") shards " << before.shards << " wasted compressed "
+	     << before.wasted_compressed << dendl;
+
+    // The write path picks the blob size, csum order and compression from
+    // the onode's allocation hints, so the rewrite is laid out like the
+    // original writes were.  Data that got compressed stays compressible,
+    // even if the pool only compresses on a hint; that is a hint for these
+    // writes only, the object's own hints are left as they are.
+    if (before.compressed &&
+	(o->onode.alloc_hint_flags &
+	 CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE) == 0) {
+      write_alloc_hints |= CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE;
+    }
+
+    // rewrite the data but not the holes, merging adjacent extents
+    interval_set<uint64_t> m;
+    for (auto& e : o->extent_map.extent_map) {
+      m.union_insert(e.logical_offset, e.length);
+    }
+    for (auto p = m.begin(); p != m.end(); ++p) {
+      bufferlist bl;
+      int r = _do_read(c, o, p.get_start(), p.get_len(), bl,
+		       CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+      if (r < 0) {
+	derr << __func__ << " " << oid << " read 0x" << std::hex
+	     << p.get_start() << "~" << p.get_len() << std::dec
+	     << " failed: " << cpp_strerror(r) << dendl;
+	return r;
+      }
+      bytes += bl.length();
+      t.write(c->cid, oid, p.get_start(), bl.length(), bl,
+	      CEPH_OSD_OP_FLAG_FADVISE_DONTNEED);
+    }
+  }
+
+  // The overwrite releases the old extents; compressed blobs that are only
+  // partly covered are picked up by the write path's GarbageCollector.
+  // The rewrite goes through the throttle like any other transaction.
+  if (on_commit) {
+    t.register_on_commit(on_commit);
+  }
+  std::vector<Transaction> tls;
+  tls.emplace_back(std::move(t));
+  _queue_transactions(c_, tls, TrackedOpRef(), handle, write_alloc_hints);
+
+  fragmentation_t after;
+  {
+    std::shared_lock l(c->lock);
+    OnodeRef o = c->get_onode(oid, false);
+    if (o && o->exists) {
+      o->extent_map.fault_range(db, 0, o->onode.size);
+      after = _get_fragmentation(o);
+    }
+  }
+  dout(10) << __func__ << " " << oid << " rewrote 0x" << std::hex << bytes
+	   << std::dec << " blobs " << before.blobs << " -> " << after.blobs
+	   << " shards " << before.shards << " -> " << after.shards << dendl;
+  ++stats->rewritten;
+  stats->bytes += bytes;
+  stats->blobs_before += before.blobs;
+  stats->blobs_after += after.blobs;
+  stats->shards_before += before.shards;
+  stats->shards_after += after.shards;
+  logger->inc(l_bluestore_defrag_objects);
+  logger->inc(l_bluestore_defrag_bytes, bytes);
+  if (before.blobs > after.blobs) {
+    logger->inc(l_bluestore_defrag_blobs_reclaimed,
+		before.blobs - after.blobs);
+  }
+  if (before.shards > after.shards) {
+    logger->inc(l_bluestore_defrag_shards_reclaimed,
+		before.shards - after.shards);
+  }
+  return 1;
+}
+
 int BlueStore::getattr(
   CollectionHandle &c_,
   const ghobject_t& oid,
@@ -13244,6 +14488,85 @@ int BlueStore::omap_get_values(
   return r;
 }
 
+int BlueStore::omap_get_range(
+  CollectionHandle &c_,
+  const ghobject_t &oid,
+  const string &start_after,
+  const string &filter_prefix,
+  uint64_t max_keys,
+  uint64_t max_bytes,
+  bufferlist *out,
+  uint32_t *num,
+  bool *more)
+{
+  Collection *c = static_cast<Collection *>(c_.get());
+  dout(15) << __func__ << " " << c->get_cid() << " oid " << oid
+	   << " start_after " << pretty_binary_string(start_after)
+	   << " filter_prefix " << pretty_binary_string(filter_prefix)
+	   << " max_keys " << max_keys << " max_bytes " << max_bytes << dendl;
+  *num = 0;
+  *more = false;
+  if (!c->exists)
+    return -ENOENT;
+  auto start1 = mono_clock::now();
+  std::shared_lock l(c->lock);
+  int r = 0;
+  OnodeRef o = c->get_onode(oid, false);
+  if (!o || !o->exists) {
+    r = -ENOENT;
+    goto out;
+  }
+  if (!o->onode.has_omap())
+    goto out;
+  o->flush();
+  {
+    // one db iterator walked under a single collection lock, keys and
+    // values are encoded as they come without building a map
+    const string& prefix = o->get_omap_prefix();
+    string head, tail, from;
+    o->get_omap_key(string(), &head);
+    o->get_omap_tail(&tail);
+    KeyValueDB::Iterator it = db->get_iterator(prefix, 0, KeyValueDB::IteratorBounds{head, tail});
+    if (filter_prefix > start_after) {
+      o->get_omap_key(filter_prefix, &from);
+      it->lower_bound(from);
+    } else {
+      o->get_omap_key(start_after, &from);
+      it->upper_bound(from);
+    }
+    for (; it->valid(); it->next()) {
+      string key = it->key();
+      if (key >= tail) {
+	dout(30) << __func__ << "  reached tail" << dendl;
+	break;
+      }
+      std::string_view user_key(key);
+      user_key.remove_prefix(head.size());
+      if (user_key.compare(0, filter_prefix.size(), filter_prefix) != 0) {
+	break;
+      }
+      if (*num >= max_keys || out->length() >= max_bytes) {
+	*more = true;
+	break;
+      }
+      dout(30) << __func__ << "  got " << pretty_binary_string(key) << dendl;
+      encode(user_key, *out);
+      encode(it->value(), *out);
+      ++*num;
+    }
+  }
+ out:
+  c->store->log_latency(
+    __func__,
+    l_bluestore_omap_get_range_lat,
+    mono_clock::now() - start1,
+    c->store->cct->_conf->bluestore_log_omap_iterator_age);
+
+  dout(10) << __func__ << " " << c->get_cid() << " oid " << oid << " = " << r
+	   << " num " << *num << " more " << *more << dendl;
+  return r;
+}
+
 #ifdef WITH_SEASTAR
 int BlueStore::omap_get_values(
   CollectionHandle &c_,        ///< [in] Collection containing oid
@@ -13540,6 +14863,7 @@ int BlueStore::_open_super_meta()
   _set_csum();
   _set_compression();
   _set_blob_size();
+  _set_readahead();
 
   _validate_bdev();
   return 0;
@@ -13637,6 +14961,7 @@ BlueStore::TransContext *BlueStore::_txc_create(
 {
   TransContext *txc = new TransContext(cct, c, osr, on_commits);
   txc->t = db->get_transaction();
+  txc->ioc.queue_hint = get_aio_queue_hint(c->cid);
 
 #ifdef WITH_BLKIN
   if (osd_op && osd_op->pg_trace) {
@@ -13729,6 +15054,10 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       {
 	mono_clock::duration lat = throttle.log_state_latency(
 	  *txc, logger, l_bluestore_state_aio_wait_lat);
+	if (deferred_adaptive && txc->aio_bytes) {
+	  deferred_size_ctl.add_device_write(ceph::to_seconds<double>(lat),
+					     txc->aio_bytes);
+	}
 	if (ceph::to_seconds<double>(lat) >= cct->_conf->bluestore_log_op_age) {
 	  logger->inc(l_bluestore_slow_aio_wait_count);
 	  dout(0) << __func__ << " slow aio_wait, txc = " << txc
@@ -13773,19 +15102,20 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 	}
       }
       {
-	std::lock_guard l(kv_lock);
-	kv_queue.push_back(txc);
-	if (!kv_sync_in_progress) {
-	  kv_sync_in_progress = true;
-	  kv_cond.notify_one();
+	KVSyncLane *lane = _get_kv_lane(txc->osr.get());
+	std::lock_guard l(lane->kv_lock);
+	lane->kv_queue.push_back(txc);
+	if (!lane->kv_sync_in_progress) {
+	  lane->kv_sync_in_progress = true;
+	  lane->kv_cond.notify_one();
 	}
 	if (txc->get_state() != TransContext::STATE_KV_SUBMITTED) {
-	  kv_queue_unsubmitted.push_back(txc);
+	  lane->kv_queue_unsubmitted.push_back(txc);
 	  ++txc->osr->kv_committing_serially;
 	}
 	if (txc->had_ios)
-	  kv_ios++;
-	kv_throttle_costs += txc->cost;
+	  lane->kv_ios++;
+	lane->kv_throttle_costs += txc->cost;
       }
       return;
     case TransContext::STATE_KV_SUBMITTED:
@@ -13914,6 +15244,29 @@ void BlueStore::BSPerfTracker::update_from_perfcounters(
       l_bluestore_commit_lat));
 }
 
+int BlueStore::get_commit_stats(commit_stats_t *stats)
+{
+  auto [txcs, lat_ns] = logger->get_tavg_ns(l_bluestore_commit_lat);
+  stats->txcs = txcs;
+  stats->commit_lat_ns = lat_ns;
+  stats->bytes = logger->get(l_bluestore_write_big_bytes) +
+    logger->get(l_bluestore_write_small_bytes);
+  auto [reads, read_lat_ns] = logger->get_tavg_ns(l_bluestore_read_device_lat);
+  stats->reads = reads;
+  stats->read_lat_ns = read_lat_ns;
+  stats->read_bytes = logger->get(l_bluestore_read_device_bytes);
+  return 0;
+}
+
+uint64_t BlueStore::_get_pending_aio_bytes(const IOContext& ioc)
+{
+  uint64_t bytes = 0;
+  for (auto& aio : ioc.pending_aios) {
+    bytes += aio.length;
+  }
+  return bytes;
+}
+
 void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
 {
   dout(20) << __func__ << " txc " << txc << std::hex
@@ -13921,7 +15274,8 @@ void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
 	   << " released 0x" << txc->released
 	   << std::dec << dendl;
 
-  if (!fm->is_null_manager())
+  bool journal = alloc_journal_active.load(std::memory_order_relaxed);
+  if (!fm->is_null_manager() || journal)
   {
     // We have to handle the case where we allocate *and* deallocate the
     // same region in this transaction.  The freelist doesn't like that.
@@ -13947,18 +15301,22 @@ void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
       }
     }
 
-    // update freelist with non-overlap sets
-    for (interval_set<uint64_t>::iterator p = pallocated->begin();
-	 p != pallocated->end();
-	 ++p) {
-      fm->allocate(p.get_start(), p.get_len(), t);
-    }
-    for (interval_set<uint64_t>::iterator p = preleased->begin();
-	 p != preleased->end();
-	 ++p) {
-      dout(20) << __func__ << " release 0x" << std::hex << p.get_start()
-	       << "~" << p.get_len() << std::dec << dendl;
-      fm->release(p.get_start(), p.get_len(), t);
+    if (fm->is_null_manager()) {
+      _alloc_journal_append(txc, t, *pallocated, *preleased);
+    } else {
+      // update freelist with non-overlap sets
+      for (interval_set<uint64_t>::iterator p = pallocated->begin();
+	   p != pallocated->end();
+	   ++p) {
+	fm->allocate(p.get_start(), p.get_len(), t);
+      }
+      for (interval_set<uint64_t>::iterator p = preleased->begin();
+	   p != preleased->end();
+	   ++p) {
+	dout(20) << __func__ << " release 0x" << std::hex << p.get_start()
+		 << "~" << p.get_len() << std::dec << dendl;
+	fm->release(p.get_start(), p.get_len(), t);
+      }
     }
   }
 
@@ -14218,11 +15576,7 @@ void BlueStore::_osr_drain_preceding(TransContext *txc)
   }
   {
     // wake up any previously finished deferred events
-    std::lock_guard l(kv_lock);
-    if (!kv_sync_in_progress) {
-      kv_sync_in_progress = true;
-      kv_cond.notify_one();
-    }
+    _kv_lane_wake(_get_kv_lane(osr));
   }
   osr->drain_preceding(txc);
   --deferred_aggressive;
@@ -14244,11 +15598,7 @@ void BlueStore::_osr_drain(OpSequencer *osr)
   }
   {
     // wake up any previously finished deferred events
-    std::lock_guard l(kv_lock);
-    if (!kv_sync_in_progress) {
-      kv_sync_in_progress = true;
-      kv_cond.notify_one();
-    }
+    _kv_lane_wake(_get_kv_lane(osr));
   }
   osr->drain();
   --deferred_aggressive;
@@ -14281,14 +15631,16 @@ void BlueStore::_osr_drain_all()
     // submit anything pending
     deferred_try_submit();
   }
-  {
+  for (auto& lane : kv_lanes) {
     // wake up any previously finished deferred events
-    std::lock_guard l(kv_lock);
-    kv_cond.notify_one();
-  }
-  {
-    std::lock_guard l(kv_finalize_lock);
-    kv_finalize_cond.notify_one();
+    {
+      std::lock_guard l(lane->kv_lock);
+      lane->kv_cond.notify_one();
+    }
+    {
+      std::lock_guard l(lane->kv_finalize_lock);
+      lane->kv_finalize_cond.notify_one();
+    }
   }
   for (auto osr : s) {
     dout(20) << __func__ << " drain " << osr << dendl;
@@ -14322,54 +15674,220 @@ void BlueStore::_kv_start()
   dout(10) << __func__ << dendl;
 
   finisher.start();
-  kv_sync_thread.create("bstore_kv_sync");
-  kv_finalize_thread.create("bstore_kv_final");
+  ceph_assert(kv_lanes.empty());
+  uint32_t num_lanes = std::max<uint64_t>(
+    1, cct->_conf.get_val<uint64_t>("bluestore_kv_sync_lanes"));
+  dout(10) << __func__ << " " << num_lanes << " kv sync lanes" << dendl;
+  for (uint32_t i = 0; i < num_lanes; ++i) {
+    auto lane = std::make_unique<KVSyncLane>(this, i);
+    PerfCountersBuilder b(cct, "bluestore-kv-lane-" + stringify(i),
+			  l_bluestore_kv_lane_first, l_bluestore_kv_lane_last);
+    b.add_u64_counter(l_bluestore_kv_lane_txc, "txc_committed",
+		      "Transactions committed by this lane");
+    b.add_u64_counter(l_bluestore_kv_lane_batches, "batches",
+		      "Commit batches processed by this lane");
+    b.add_u64(l_bluestore_kv_lane_queue_depth, "queue_depth",
+	      "Transactions in the last commit batch of this lane");
+    b.add_u64_counter(l_bluestore_kv_lane_group_lead, "group_sync_lead",
+		      "Group syncs issued by this lane");
+    b.add_u64_counter(l_bluestore_kv_lane_group_follow, "group_sync_follow",
+		      "Group syncs this lane piggybacked on");
+    b.add_time_avg(l_bluestore_kv_lane_sync_lat, "sync_lat",
+		   "Average flush + kv commit latency of this lane");
+    b.add_time(l_bluestore_kv_lane_idle, "idle_time",
+	       "Time the kv sync thread of this lane spent waiting for work");
+    b.add_u64_counter(l_bluestore_kv_lane_deferred_kicks, "deferred_kicks",
+		      "Times this idle lane was woken by another lane's commit "
+		      "to clean up deferred writes");
+    b.add_u64_counter(l_bluestore_kv_lane_deferred_only, "deferred_only_batches",
+		      "Commit batches of this lane without transactions, only "
+		      "cleaning up deferred writes");
+    lane->logger = b.create_perf_counters();
+    cct->get_perfcounters_collection()->add(lane->logger);
+    kv_lanes.push_back(std::move(lane));
+  }
+  {
+    std::lock_guard l(kv_id_max_lock);
+    nid_max_pending = nid_max;
+    blobid_max_pending = blobid_max;
+  }
+  for (auto& lane : kv_lanes) {
+    if (lane->is_primary()) {
+      lane->sync_thread.create("bstore_kv_sync");
+      lane->finalize_thread.create("bstore_kv_final");
+    } else {
+      lane->sync_thread.create(("bstore_kvs_" + stringify(lane->id)).c_str());
+      lane->finalize_thread.create(("bstore_kvf_" + stringify(lane->id)).c_str());
+    }
+  }
 }
 
 void BlueStore::_kv_stop()
 {
   dout(10) << __func__ << dendl;
-  {
-    std::unique_lock l{kv_lock};
-    while (!kv_sync_started) {
-      kv_cond.wait(l);
+  for (auto& lane : kv_lanes) {
+    {
+      std::unique_lock l{lane->kv_lock};
+      while (!lane->kv_sync_started) {
+	lane->kv_cond.wait(l);
+      }
+      lane->kv_stop = true;
+      lane->kv_cond.notify_all();
     }
-    kv_stop = true;
-    kv_cond.notify_all();
-  }
-  {
-    std::unique_lock l{kv_finalize_lock};
-    while (!kv_finalize_started) {
-      kv_finalize_cond.wait(l);
+    {
+      std::unique_lock l{lane->kv_finalize_lock};
+      while (!lane->kv_finalize_started) {
+	lane->kv_finalize_cond.wait(l);
+      }
+      lane->kv_finalize_stop = true;
+      lane->kv_finalize_cond.notify_all();
     }
-    kv_finalize_stop = true;
-    kv_finalize_cond.notify_all();
   }
-  kv_sync_thread.join();
-  kv_finalize_thread.join();
-  ceph_assert(removed_collections.empty());
-  {
-    std::lock_guard l(kv_lock);
-    kv_stop = false;
+  for (auto& lane : kv_lanes) {
+    lane->sync_thread.join();
+    lane->finalize_thread.join();
   }
-  {
-    std::lock_guard l(kv_finalize_lock);
-    kv_finalize_stop = false;
+  ceph_assert(removed_collections.empty());
+  for (auto& lane : kv_lanes) {
+    cct->get_perfcounters_collection()->remove(lane->logger);
+    delete lane->logger;
   }
+  kv_lanes.clear();
   dout(10) << __func__ << " stopping finishers" << dendl;
   finisher.wait_for_empty();
   finisher.stop();
   dout(10) << __func__ << " stopped" << dendl;
 }
 
-void BlueStore::_kv_sync_thread()
+void BlueStore::_kv_lane_wake(KVSyncLane *lane)
 {
-  dout(10) << __func__ << " start" << dendl;
+  std::lock_guard l(lane->kv_lock);
+  if (!lane->kv_sync_in_progress) {
+    lane->kv_sync_in_progress = true;
+    lane->kv_cond.notify_one();
+  }
+}
+
+void BlueStore::_kv_wake_all_lanes()
+{
+  for (auto& lane : kv_lanes) {
+    _kv_lane_wake(lane.get());
+  }
+}
+
+void BlueStore::_kv_kick_deferred(KVSyncLane *self)
+{
+  // With a single lane every commit picks up the deferred ios that are
+  // done by then.  With several, the lane of a sequencer that stopped
+  // writing may not commit for a long time; let it clean up along with
+  // the commits of the other lanes, so that deferred ios are batched at
+  // about the same rate as with one lane.
+  for (auto& lane : kv_lanes) {
+    if (lane.get() == self) {
+      continue;
+    }
+    std::lock_guard l(lane->kv_lock);
+    if ((!lane->deferred_done_queue.empty() ||
+	 lane->deferred_stable_pending) &&
+	!lane->kv_sync_in_progress) {
+      lane->deferred_kick = true;
+      lane->kv_sync_in_progress = true;
+      lane->kv_cond.notify_one();
+      lane->logger->inc(l_bluestore_kv_lane_deferred_kicks);
+    }
+  }
+}
+
+void BlueStore::_kv_reserve_ids(KeyValueDB::Transaction synct,
+				uint64_t *new_nid_max, uint64_t *new_blobid_max)
+{
+  // increase {nid,blobid}_max?  note that this covers both the
+  // case where we are approaching the max and the case we passed
+  // it.  with a single lane the update goes into synct, as it is
+  // committed before any txc relying on it can be.  with several, it
+  // goes to the db in its own transaction, submitted under
+  // kv_id_max_lock: that keeps the persisted values monotonic even when
+  // lanes race here, and puts them in the WAL ahead of every txc (of any
+  // lane) that is committed after this point.
+  std::lock_guard l(kv_id_max_lock);
+  const bool own_txn = kv_lanes.size() > 1;
+  KeyValueDB::Transaction t = own_txn ? KeyValueDB::Transaction() : synct;
+  if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max_pending) {
+    if (!t) {
+      t = db->get_transaction();
+    }
+    *new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
+    bufferlist bl;
+    encode(*new_nid_max, bl);
+    t->set(PREFIX_SUPER, "nid_max", bl);
+    nid_max_pending = *new_nid_max;
+    dout(10) << __func__ << " new_nid_max " << *new_nid_max << dendl;
+  }
+  if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 >
+      blobid_max_pending) {
+    if (!t) {
+      t = db->get_transaction();
+    }
+    *new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
+    bufferlist bl;
+    encode(*new_blobid_max, bl);
+    t->set(PREFIX_SUPER, "blobid_max", bl);
+    blobid_max_pending = *new_blobid_max;
+    dout(10) << __func__ << " new_blobid_max " << *new_blobid_max << dendl;
+  }
+  if (own_txn && t && !cct->_conf->bluestore_debug_omit_kv_commit) {
+    int r = db->submit_transaction(t);
+    ceph_assert(r == 0);
+  }
+}
+
+void BlueStore::_kv_group_sync(KVSyncLane *lane, KeyValueDB::Transaction synct)
+{
+  if (kv_lanes.size() == 1) {
+    // submit synct synchronously (block and wait for it to commit)
+    int r = db->submit_transaction_sync(synct);
+    ceph_assert(r == 0);
+    lane->logger->inc(l_bluestore_kv_lane_group_lead);
+    return;
+  }
+
+  // a synchronous db write makes everything that is already in the WAL
+  // durable.  queue our own keys first, then wait for (or issue) a sync
+  // that *starts* after this point; whoever issues it commits on behalf
+  // of all lanes that are waiting.
+  int r = db->submit_transaction(synct);
+  ceph_assert(r == 0);
+
+  std::unique_lock l(kv_group_lock);
+  const uint64_t ticket = kv_group_started + 1;
+  while (kv_group_committed < ticket) {
+    if (!kv_group_in_progress) {
+      kv_group_in_progress = true;
+      uint64_t seq = ++kv_group_started;
+      ceph_assert(seq == ticket);
+      l.unlock();
+      r = db->submit_transaction_sync(db->get_transaction());
+      ceph_assert(r == 0);
+      l.lock();
+      kv_group_committed = seq;
+      kv_group_in_progress = false;
+      kv_group_cond.notify_all();
+      lane->logger->inc(l_bluestore_kv_lane_group_lead);
+      return;
+    }
+    kv_group_cond.wait(l);
+  }
+  lane->logger->inc(l_bluestore_kv_lane_group_follow);
+}
+
+void BlueStore::_kv_sync_thread(KVSyncLane *lane)
+{
+  dout(10) << __func__ << " lane " << lane->id << " start" << dendl;
   deque<DeferredBatch*> deferred_stable_queue; ///< deferred ios done + stable
-  std::unique_lock l{kv_lock};
-  ceph_assert(!kv_sync_started);
-  kv_sync_started = true;
-  kv_cond.notify_all();
+  std::unique_lock l{lane->kv_lock};
+  ceph_assert(!lane->kv_sync_started);
+  lane->kv_sync_started = true;
+  lane->kv_cond.notify_all();
 
   auto t0 = mono_clock::now();
   timespan twait = ceph::make_timespan(0);
@@ -14381,7 +15899,8 @@ void BlueStore::_kv_sync_thread()
       ceph::make_timespan(period);
     auto elapsed = mono_clock::now() - t0;
     if (period && elapsed >= observation_period) {
-      dout(5) << __func__ << " utilization: idle "
+      dout(5) << __func__ << " lane " << lane->id
+	      << " utilization: idle "
 	      << twait << " of " << elapsed
 	      << ", submitted: " << kv_submitted
 	      <<dendl;
@@ -14389,17 +15908,20 @@ void BlueStore::_kv_sync_thread()
       twait = ceph::make_timespan(0);
       kv_submitted = 0;
     }
-    ceph_assert(kv_committing.empty());
-    if (kv_queue.empty() &&
-	((deferred_done_queue.empty() && deferred_stable_queue.empty()) ||
-	 !deferred_aggressive)) {
-      if (kv_stop)
+    ceph_assert(lane->kv_committing.empty());
+    if (lane->kv_queue.empty() &&
+	((lane->deferred_done_queue.empty() && deferred_stable_queue.empty()) ||
+	 !(deferred_aggressive || lane->deferred_kick))) {
+      if (lane->kv_stop)
 	break;
       dout(20) << __func__ << " sleep" << dendl;
       auto t = mono_clock::now();
-      kv_sync_in_progress = false;
-      kv_cond.wait(l);
-      twait += mono_clock::now() - t;
+      lane->kv_sync_in_progress = false;
+      lane->deferred_kick = false;
+      lane->kv_cond.wait(l);
+      auto waited = mono_clock::now() - t;
+      twait += waited;
+      lane->logger->tinc(l_bluestore_kv_lane_idle, waited);
 
       dout(20) << __func__ << " wake" << dendl;
     } else {
@@ -14407,20 +15929,22 @@ void BlueStore::_kv_sync_thread()
       deque<DeferredBatch*> deferred_done, deferred_stable;
       uint64_t aios = 0, costs = 0;
 
-      dout(20) << __func__ << " committing " << kv_queue.size()
-	       << " submitting " << kv_queue_unsubmitted.size()
-	       << " deferred done " << deferred_done_queue.size()
+      dout(20) << __func__ << " committing " << lane->kv_queue.size()
+	       << " submitting " << lane->kv_queue_unsubmitted.size()
+	       << " deferred done " << lane->deferred_done_queue.size()
 	       << " stable " << deferred_stable_queue.size()
 	       << dendl;
-      kv_committing.swap(kv_queue);
-      kv_submitting.swap(kv_queue_unsubmitted);
-      deferred_done.swap(deferred_done_queue);
+      lane->deferred_kick = false;
+      lane->kv_committing.swap(lane->kv_queue);
+      kv_submitting.swap(lane->kv_queue_unsubmitted);
+      deferred_done.swap(lane->deferred_done_queue);
       deferred_stable.swap(deferred_stable_queue);
-      aios = kv_ios;
-      costs = kv_throttle_costs;
-      kv_ios = 0;
-      kv_throttle_costs = 0;
+      aios = lane->kv_ios;
+      costs = lane->kv_throttle_costs;
+      lane->kv_ios = 0;
+      lane->kv_throttle_costs = 0;
       l.unlock();
+      auto& kv_committing = lane->kv_committing;
 
       dout(30) << __func__ << " committing " << kv_committing << dendl;
       dout(30) << __func__ << " submitting " << kv_submitting << dendl;
@@ -14471,29 +15995,8 @@ void BlueStore::_kv_sync_thread()
       // we will use one final transaction to force a sync
       KeyValueDB::Transaction synct = db->get_transaction();
 
-      // increase {nid,blobid}_max?  note that this covers both the
-      // case where we are approaching the max and the case we passed
-      // it.  in either case, we increase the max in the earlier txn
-      // we submit.
       uint64_t new_nid_max = 0, new_blobid_max = 0;
-      if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
-	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
-	bufferlist bl;
-	encode(new_nid_max, bl);
-	t->set(PREFIX_SUPER, "nid_max", bl);
-	dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
-      }
-      if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
-	KeyValueDB::Transaction t =
-	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
-	bufferlist bl;
-	encode(new_blobid_max, bl);
-	t->set(PREFIX_SUPER, "blobid_max", bl);
-	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
-      }
+      _kv_reserve_ids(synct, &new_nid_max, &new_blobid_max);
 
       for (auto txc : kv_committing) {
 	throttle.log_state_latency(*txc, logger, l_bluestore_state_kv_queued_lat);
@@ -14531,9 +16034,9 @@ void BlueStore::_kv_sync_thread()
 #if defined(WITH_LTTNG)
       auto sync_start = mono_clock::now();
 #endif
-      // submit synct synchronously (block and wait for it to commit)
-      int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction_sync(synct);
-      ceph_assert(r == 0);
+      if (!cct->_conf->bluestore_debug_omit_kv_commit) {
+	_kv_group_sync(lane, synct);
+      }
 
 #ifdef WITH_BLKIN
       for (auto txc : kv_committing) {
@@ -14565,38 +16068,41 @@ void BlueStore::_kv_sync_thread()
 #endif
 
       {
-	std::unique_lock m{kv_finalize_lock};
-	if (kv_committing_to_finalize.empty()) {
-	  kv_committing_to_finalize.swap(kv_committing);
+	std::unique_lock m{lane->kv_finalize_lock};
+	if (lane->kv_committing_to_finalize.empty()) {
+	  lane->kv_committing_to_finalize.swap(kv_committing);
 	} else {
-	  kv_committing_to_finalize.insert(
-	      kv_committing_to_finalize.end(),
+	  lane->kv_committing_to_finalize.insert(
+	      lane->kv_committing_to_finalize.end(),
 	      kv_committing.begin(),
 	      kv_committing.end());
 	  kv_committing.clear();
 	}
-	if (deferred_stable_to_finalize.empty()) {
-	  deferred_stable_to_finalize.swap(deferred_stable);
+	if (lane->deferred_stable_to_finalize.empty()) {
+	  lane->deferred_stable_to_finalize.swap(deferred_stable);
 	} else {
-	  deferred_stable_to_finalize.insert(
-	      deferred_stable_to_finalize.end(),
+	  lane->deferred_stable_to_finalize.insert(
+	      lane->deferred_stable_to_finalize.end(),
 	      deferred_stable.begin(),
 	      deferred_stable.end());
 	  deferred_stable.clear();
 	}
-	if (!kv_finalize_in_progress) {
-	  kv_finalize_in_progress = true;
-	  kv_finalize_cond.notify_one();
+	if (!lane->kv_finalize_in_progress) {
+	  lane->kv_finalize_in_progress = true;
+	  lane->kv_finalize_cond.notify_one();
 	}
       }
 
-      if (new_nid_max) {
-	nid_max = new_nid_max;
-	dout(10) << __func__ << " nid_max now " << nid_max << dendl;
-      }
-      if (new_blobid_max) {
-	blobid_max = new_blobid_max;
-	dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+      if (new_nid_max || new_blobid_max) {
+	std::lock_guard il(kv_id_max_lock);
+	if (new_nid_max > nid_max) {
+	  nid_max = new_nid_max;
+	  dout(10) << __func__ << " nid_max now " << nid_max << dendl;
+	}
+	if (new_blobid_max > blobid_max) {
+	  blobid_max = new_blobid_max;
+	  dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+	}
       }
 
       {
@@ -14617,45 +16123,60 @@ void BlueStore::_kv_sync_thread()
 	  l_bluestore_kv_commit_lat,
 	  dur_kv,
 	  cct->_conf->bluestore_log_op_age);
+	if (deferred_adaptive && committing_size) {
+	  deferred_size_ctl.add_kv_commit(ceph::to_seconds<double>(dur_kv));
+	}
 	log_latency("kv_sync",
 	  l_bluestore_kv_sync_lat,
 	  dur,
 	  cct->_conf->bluestore_log_op_age);
+	lane->logger->inc(l_bluestore_kv_lane_txc, committing_size);
+	lane->logger->inc(l_bluestore_kv_lane_batches);
+	if (!committing_size) {
+	  lane->logger->inc(l_bluestore_kv_lane_deferred_only);
+	}
+	lane->logger->set(l_bluestore_kv_lane_queue_depth, committing_size);
+	lane->logger->tinc(l_bluestore_kv_lane_sync_lat, dur);
+      }
+
+      if (kv_lanes.size() > 1 && committing_size) {
+	_kv_kick_deferred(lane);
       }
 
       l.lock();
       // previously deferred "done" are now "stable" by virtue of this
       // commit cycle.
       deferred_stable_queue.swap(deferred_done);
+      lane->deferred_stable_pending = !deferred_stable_queue.empty();
     }
   }
-  dout(10) << __func__ << " finish" << dendl;
-  kv_sync_started = false;
+  dout(10) << __func__ << " lane " << lane->id << " finish" << dendl;
+  lane->kv_sync_started = false;
 }
 
-void BlueStore::_kv_finalize_thread()
+void BlueStore::_kv_finalize_thread(KVSyncLane *lane)
 {
   deque<TransContext*> kv_committed;
   deque<DeferredBatch*> deferred_stable;
-  dout(10) << __func__ << " start" << dendl;
-  std::unique_lock l(kv_finalize_lock);
-  ceph_assert(!kv_finalize_started);
-  kv_finalize_started = true;
-  kv_finalize_cond.notify_all();
+  dout(10) << __func__ << " lane " << lane->id << " start" << dendl;
+  std::unique_lock l(lane->kv_finalize_lock);
+  ceph_assert(!lane->kv_finalize_started);
+  lane->kv_finalize_started = true;
+  lane->kv_finalize_cond.notify_all();
   while (true) {
     ceph_assert(kv_committed.empty());
     ceph_assert(deferred_stable.empty());
-    if (kv_committing_to_finalize.empty() &&
-	deferred_stable_to_finalize.empty()) {
-      if (kv_finalize_stop)
+    if (lane->kv_committing_to_finalize.empty() &&
+	lane->deferred_stable_to_finalize.empty()) {
+      if (lane->kv_finalize_stop)
 	break;
       dout(20) << __func__ << " sleep" << dendl;
-      kv_finalize_in_progress = false;
-      kv_finalize_cond.wait(l);
+      lane->kv_finalize_in_progress = false;
+      lane->kv_finalize_cond.wait(l);
       dout(20) << __func__ << " wake" << dendl;
     } else {
-      kv_committed.swap(kv_committing_to_finalize);
-      deferred_stable.swap(deferred_stable_to_finalize);
+      kv_committed.swap(lane->kv_committing_to_finalize);
+      deferred_stable.swap(lane->deferred_stable_to_finalize);
       l.unlock();
       dout(20) << __func__ << " kv_committed " << kv_committed << dendl;
       dout(20) << __func__ << " deferred_stable " << deferred_stable << dendl;
@@ -14690,8 +16211,10 @@ void BlueStore::_kv_finalize_thread()
       // this is as good a place as any ...
       _reap_collections();
 
-      logger->set(l_bluestore_fragmentation,
-	  (uint64_t)(alloc->get_fragmentation() * 1000));
+      if (lane->is_primary()) {
+	logger->set(l_bluestore_fragmentation,
+	    (uint64_t)(alloc->get_fragmentation() * 1000));
+      }
 
       log_latency("kv_final",
 	l_bluestore_kv_final_lat,
@@ -14701,8 +16224,8 @@ void BlueStore::_kv_finalize_thread()
       l.lock();
     }
   }
-  dout(10) << __func__ << " finish" << dendl;
-  kv_finalize_started = false;
+  dout(10) << __func__ << " lane " << lane->id << " finish" << dendl;
+  lane->kv_finalize_started = false;
 }
 
 #ifdef HAVE_LIBZBD
@@ -15112,14 +16635,16 @@ void BlueStore::_deferred_aio_finish(OpSequencer *osr)
   }
 
   {
-    std::lock_guard l(kv_lock);
-    deferred_done_queue.emplace_back(b);
+    KVSyncLane *lane = _get_kv_lane(osr);
+    std::lock_guard l(lane->kv_lock);
+    lane->deferred_done_queue.emplace_back(b);
 
     // in the normal case, do not bother waking up the kv thread; it will
-    // catch us on the next commit anyway.
-    if (deferred_aggressive && !kv_sync_in_progress) {
-	kv_sync_in_progress = true;
-	kv_cond.notify_one();
+    // catch us on the next commit anyway.  with several lanes, that may be
+    // the commit of another lane, see _kv_kick_deferred().
+    if (deferred_aggressive && !lane->kv_sync_in_progress) {
+      lane->kv_sync_in_progress = true;
+      lane->kv_cond.notify_one();
     }
   }
 }
@@ -15262,6 +16787,16 @@ int BlueStore::queue_transactions(
   vector<Transaction>& tls,
   TrackedOpRef op,
   ThreadPool::TPHandle *handle)
+{
+  return _queue_transactions(ch, tls, op, handle, 0);
+}
+
+int BlueStore::_queue_transactions(
+  CollectionHandle& ch,
+  vector<Transaction>& tls,
+  TrackedOpRef op,
+  ThreadPool::TPHandle *handle,
+  uint32_t write_alloc_hints)
 {
   FUNCTRACE(cct);
   list<Context *> on_applied, on_commit, on_applied_sync;
@@ -15287,6 +16822,7 @@ int BlueStore::queue_transactions(
   // prepare
   TransContext *txc = _txc_create(static_cast<Collection*>(ch.get()), osr,
 				  &on_commit, op);
+  txc->write_alloc_hints = write_alloc_hints;
 
   for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
     txc->bytes += (*p).get_num_bytes();
@@ -15328,14 +16864,8 @@ int BlueStore::queue_transactions(
 	     << dendl;
     ++deferred_aggressive;
     deferred_try_submit();
-    {
-      // wake up any previously finished deferred events
-      std::lock_guard l(kv_lock);
-      if (!kv_sync_in_progress) {
-	kv_sync_in_progress = true;
-	kv_cond.notify_one();
-      }
-    }
+    // wake up any previously finished deferred events
+    _kv_wake_all_lanes();
     throttle.finish_start_transaction(*db, *txc, tstart);
     --deferred_aggressive;
   }
@@ -15385,6 +16915,9 @@ int BlueStore::queue_transactions(
 void BlueStore::_txc_aio_submit(TransContext *txc)
 {
   dout(10) << __func__ << " txc " << txc << dendl;
+  if (deferred_adaptive) {
+    txc->aio_bytes += _get_pending_aio_bytes(txc->ioc);
+  }
   bdev->aio_submit(&txc->ioc);
 }
 
@@ -17095,6 +18628,7 @@ void BlueStore::_choose_write_options(
    CollectionRef& c,
    OnodeRef& o,
    uint32_t fadvise_flags,
+   uint32_t alloc_hints,
    WriteContext *wctx)
 {
   if (fadvise_flags & CEPH_OSD_OP_FLAG_FADVISE_WILLNEED) {
@@ -17111,7 +18645,7 @@ void BlueStore::_choose_write_options(
   wctx->csum_order = block_size_order;
 
   // compression parameters
-  unsigned alloc_hints = o->onode.alloc_hint_flags;
+  alloc_hints |= o->onode.alloc_hint_flags;
   auto cm = select_option(
     "compression_mode",
     comp_mode.load(),
@@ -17288,7 +18822,7 @@ int BlueStore::_do_write(
   auto dirty_end = end;
 
   WriteContext wctx;
-  _choose_write_options(c, o, fadvise_flags, &wctx);
+  _choose_write_options(c, o, fadvise_flags, txc->write_alloc_hints, &wctx);
   o->extent_map.fault_range(db, offset, length);
   _do_write_data(txc, c, o, offset, length, bl, &wctx);
   r = _do_alloc_write(txc, c, o, &wctx);
@@ -18932,20 +20466,28 @@ void BlueStore::_collect_allocation_stats(uint64_t need, uint32_t alloc_size,
   }
 }
 
-void BlueStore::_record_allocation_stats()
+void BlueStore::_record_allocation_stats(bool sample_score)
 {
+  // most allocators walk all of their free extents under their lock for
+  // the score, so the final dump on umount repeats the last one instead
+  double score = std::get<3>(alloc_stats_history[0]);
+  if (sample_score && alloc) {
+    score = alloc->get_fragmentation_score();
+  }
   // don't care about data consistency,
   // fields can be partially modified while making the tuple
   auto t0 = std::make_tuple(
     alloc_stats_count.exchange(0),
     alloc_stats_fragments.exchange(0),
-    alloc_stats_size.exchange(0));
+    alloc_stats_size.exchange(0),
+    score);
 
   dout(0) << " allocation stats probe "
     << probe_count << ":"
     << " cnt: " << std::get<0>(t0)
     << " frags: " << std::get<1>(t0)
     << " size: " << std::get<2>(t0)
+    << " score: " << std::get<3>(t0)
     << dendl;
 
 
@@ -18960,6 +20502,7 @@ void BlueStore::_record_allocation_stats()
       << std::get<0>(t)
       << ",  " << std::get<1>(t)
       << ", " << std::get<2>(t)
+      << ", " << std::get<3>(t)
       << dendl;
     base <<= 1;
   }
@@ -20028,6 +21571,518 @@ int BlueStore::restore_allocator(Allocator* dest_allocator, uint64_t *num, uint6
   return ret;
 }
 
+//-----------------------------------------------------------------------------------
+// Allocator journal
+//
+// In NCB mode the allocation map is only persisted on a clean shutdown, any
+// other one used to require a full onode scan.  With bluestore_allocation_journal
+// set we also keep the following under PREFIX_ALLOC_JOURNAL:
+//   "h"        header describing the base
+//   "b" + u64  base chunks: free extents of one fixed size region of the
+//              device, keyed by region index, BlueFS space reported as free
+//              (just like in the allocation file, BlueFS marks it used on
+//              mount); regions with no free space have no chunk
+//   "d" + u64  per transaction deltas (allocated, released), written in the
+//              same kv transaction as the metadata they belong to
+// The base is taken at mount time and deltas are periodically folded into it
+// by the journal thread.  A checkpoint only reads the pending deltas and the
+// chunks of the regions they touch, and only rewrites those chunks.
+// Kv sync lanes may commit deltas slightly out of key order, but a delta can
+// only reuse space released by deltas committed before its allocation, which
+// always got a lower key, so replaying in key order is safe.  Likewise a
+// checkpoint folds exactly the deltas it has seen and leaves the rest alone.
+static const std::string ALLOC_JOURNAL_HEADER_KEY = "h";
+static const char ALLOC_JOURNAL_BASE_KEY = 'b';
+static const char ALLOC_JOURNAL_DELTA_KEY = 'd';
+// allocation units per base chunk; a fully fragmented region still fits
+// its chunk in a couple of MB
+static const uint64_t ALLOC_JOURNAL_REGION_UNITS = 1ull << 18;
+
+struct alloc_journal_header_t {
+  uint64_t device_size = 0;
+  uint64_t alloc_unit = 0;
+  uint64_t region_size = 0; ///< device bytes covered by a base chunk
+  uint64_t chunks = 0;
+  uint64_t extents = 0;
+  uint64_t free_bytes = 0;
+
+  void encode(bufferlist& bl) const {
+    using ceph::encode;
+    ENCODE_START(2, 1, bl);
+    encode(device_size, bl);
+    encode(alloc_unit, bl);
+    encode(chunks, bl);
+    encode(extents, bl);
+    encode(free_bytes, bl);
+    encode(region_size, bl);
+    ENCODE_FINISH(bl);
+  }
+  void decode(bufferlist::const_iterator& p) {
+    using ceph::decode;
+    DECODE_START(2, p);
+    decode(device_size, p);
+    decode(alloc_unit, p);
+    decode(chunks, p);
+    decode(extents, p);
+    decode(free_bytes, p);
+    if (struct_v >= 2) {
+      decode(region_size, p);
+    }
+    DECODE_FINISH(p);
+  }
+};
+WRITE_CLASS_ENCODER(alloc_journal_header_t)
+
+static std::string alloc_journal_key(char type, uint64_t id)
+{
+  std::string key;
+  key.push_back(type);
+  _key_encode_u64(id, &key);
+  return key;
+}
+
+// calls f(region, offset, length) for the part of the extent in each
+// region it spans, stops at the first call returning false
+template <typename F>
+static bool alloc_journal_split(uint64_t region_size,
+				uint64_t offset, uint64_t length, F&& f)
+{
+  while (length > 0) {
+    uint64_t region = offset / region_size;
+    uint64_t l = std::min(length, (region + 1) * region_size - offset);
+    if (!f(region, offset, l)) {
+      return false;
+    }
+    offset += l;
+    length -= l;
+  }
+  return true;
+}
+
+// splits a stream of free extents into per region base chunks
+struct alloc_journal_base_builder_t {
+  uint64_t region_size;
+  std::map<uint64_t, interval_set<uint64_t>> regions;
+  uint64_t bytes = 0;
+
+  explicit alloc_journal_base_builder_t(uint64_t region_size)
+    : region_size(region_size) {}
+
+  void add(uint64_t offset, uint64_t length) {
+    bytes += length;
+    alloc_journal_split(region_size, offset, length,
+      [this](uint64_t region, uint64_t o, uint64_t l) {
+	regions[region].insert(o, l);
+	return true;
+      });
+  }
+  uint64_t finish(std::map<uint64_t, bufferlist> *chunks) {
+    uint64_t extents = 0;
+    for (auto& [region, free] : regions) {
+      extents += free.num_intervals();
+      encode(free, (*chunks)[region]);
+    }
+    regions.clear();
+    return extents;
+  }
+};
+
+// called at the end of _init_alloc(), before BlueFS claims its space
+void BlueStore::_alloc_journal_capture_base()
+{
+  alloc_journal_base_builder_t builder(
+    min_alloc_size * ALLOC_JOURNAL_REGION_UNITS);
+  alloc->foreach([&](uint64_t offset, uint64_t length) {
+    builder.add(offset, length);
+  });
+  alloc_journal_base.clear();
+  alloc_journal_base_extents = builder.finish(&alloc_journal_base);
+  alloc_journal_base_bytes = builder.bytes;
+  dout(10) << __func__ << " " << alloc_journal_base_extents << " extents, 0x"
+	   << std::hex << alloc_journal_base_bytes << std::dec << " free in "
+	   << alloc_journal_base.size() << " chunks" << dendl;
+}
+
+int BlueStore::_alloc_journal_load(interval_set<uint64_t> *free_extents,
+				   std::set<std::string> *deltas,
+				   uint64_t *max_seq)
+{
+  bufferlist hbl;
+  int r = db->get(PREFIX_ALLOC_JOURNAL, ALLOC_JOURNAL_HEADER_KEY, &hbl);
+  if (r < 0) {
+    dout(5) << __func__ << " no allocator journal" << dendl;
+    return -ENOENT;
+  }
+  alloc_journal_header_t header;
+  try {
+    auto p = hbl.cbegin();
+    decode(header, p);
+  } catch (ceph::buffer::error& e) {
+    derr << __func__ << " failed to decode header: " << e.what() << dendl;
+    return -EIO;
+  }
+  if (header.device_size != bdev->get_size() ||
+      header.alloc_unit != min_alloc_size ||
+      header.region_size == 0) {
+    dout(1) << __func__ << " stale allocator journal, device size 0x"
+	    << std::hex << header.device_size << "/" << bdev->get_size()
+	    << " alloc unit 0x" << header.alloc_unit << "/" << min_alloc_size
+	    << " region 0x" << header.region_size << std::dec << dendl;
+    return -ESTALE;
+  }
+
+  uint64_t chunks = 0;
+  auto it = db->get_iterator(PREFIX_ALLOC_JOURNAL);
+  try {
+    for (it->lower_bound(std::string(1, ALLOC_JOURNAL_BASE_KEY));
+	 it->valid() && it->key()[0] == ALLOC_JOURNAL_BASE_KEY;
+	 it->next()) {
+      interval_set<uint64_t> chunk;
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(chunk, p);
+      for (auto e = chunk.begin(); e != chunk.end(); ++e) {
+	if (free_extents->intersects(e.get_start(), e.get_len())) {
+	  derr << __func__ << " overlapping base extent 0x" << std::hex
+	       << e.get_start() << "~" << e.get_len() << std::dec << dendl;
+	  return -EIO;
+	}
+	free_extents->insert(e.get_start(), e.get_len());
+      }
+      ++chunks;
+    }
+    if (chunks != header.chunks || free_extents->size() != header.free_bytes) {
+      derr << __func__ << " base mismatch, " << chunks << "/" << header.chunks
+	   << " chunks, 0x" << std::hex << free_extents->size() << "/"
+	   << header.free_bytes << std::dec << " free" << dendl;
+      return -EIO;
+    }
+
+    for (it->lower_bound(std::string(1, ALLOC_JOURNAL_DELTA_KEY));
+	 it->valid() && it->key()[0] == ALLOC_JOURNAL_DELTA_KEY;
+	 it->next()) {
+      std::string key = it->key();
+      interval_set<uint64_t> allocated, released;
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(allocated, p);
+      decode(released, p);
+      for (auto e = allocated.begin(); e != allocated.end(); ++e) {
+	if (!free_extents->contains(e.get_start(), e.get_len())) {
+	  derr << __func__ << " delta " << pretty_binary_string(key)
+	       << " allocates non-free 0x" << std::hex << e.get_start()
+	       << "~" << e.get_len() << std::dec << dendl;
+	  return -EIO;
+	}
+	free_extents->erase(e.get_start(), e.get_len());
+      }
+      for (auto e = released.begin(); e != released.end(); ++e) {
+	if (free_extents->intersects(e.get_start(), e.get_len())) {
+	  derr << __func__ << " delta " << pretty_binary_string(key)
+	       << " releases free 0x" << std::hex << e.get_start()
+	       << "~" << e.get_len() << std::dec << dendl;
+	  return -EIO;
+	}
+	free_extents->insert(e.get_start(), e.get_len());
+      }
+      uint64_t seq = 0;
+      _key_decode_u64(key.c_str() + 1, &seq);
+      *max_seq = std::max(*max_seq, seq);
+      deltas->insert(std::move(key));
+    }
+  } catch (ceph::buffer::error& e) {
+    derr << __func__ << " failed to decode allocator journal: " << e.what()
+	 << dendl;
+    return -EIO;
+  }
+  dout(10) << __func__ << " base " << header.extents << " extents, "
+	   << deltas->size() << " deltas" << dendl;
+  return 0;
+}
+
+int BlueStore::_alloc_journal_replay(Allocator *dest, uint64_t *num,
+				     uint64_t *bytes)
+{
+  auto start = mono_clock::now();
+  interval_set<uint64_t> free_extents;
+  std::set<std::string> deltas;
+  uint64_t max_seq = 0;
+  int r = _alloc_journal_load(&free_extents, &deltas, &max_seq);
+  if (r < 0) {
+    return r;
+  }
+  for (auto e = free_extents.begin(); e != free_extents.end(); ++e) {
+    dest->init_add_free(e.get_start(), e.get_len());
+    ++(*num);
+    *bytes += e.get_len();
+  }
+  dout(1) << __func__ << " replayed " << deltas.size() << " deltas in "
+	  << timespan_str(mono_clock::now() - start) << dendl;
+  return 0;
+}
+
+// drop the journal; a stale one must never be replayed
+void BlueStore::_alloc_journal_reset()
+{
+  ceph_assert(!alloc_journal_active);
+  if (!cct->_conf->bluestore_allocation_journal) {
+    // nothing to drop unless it was enabled before, spare the sync commit
+    auto it = db->get_iterator(PREFIX_ALLOC_JOURNAL);
+    it->seek_to_first();
+    if (!it->valid()) {
+      return;
+    }
+  }
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->rmkeys_by_prefix(PREFIX_ALLOC_JOURNAL);
+  int r = db->submit_transaction_sync(t);
+  ceph_assert(r == 0);
+}
+
+int BlueStore::_alloc_journal_start()
+{
+  ceph_assert(!alloc_journal_active);
+  alloc_journal_header_t header;
+  header.device_size = bdev->get_size();
+  header.alloc_unit = min_alloc_size;
+  header.region_size = min_alloc_size * ALLOC_JOURNAL_REGION_UNITS;
+  header.chunks = alloc_journal_base.size();
+  header.extents = alloc_journal_base_extents;
+  header.free_bytes = alloc_journal_base_bytes;
+  KeyValueDB::Transaction t = db->get_transaction();
+  t->rmkeys_by_prefix(PREFIX_ALLOC_JOURNAL);
+  for (auto& [region, bl] : alloc_journal_base) {
+    t->set(PREFIX_ALLOC_JOURNAL,
+	   alloc_journal_key(ALLOC_JOURNAL_BASE_KEY, region), bl);
+  }
+  bufferlist hbl;
+  encode(header, hbl);
+  t->set(PREFIX_ALLOC_JOURNAL, ALLOC_JOURNAL_HEADER_KEY, hbl);
+  int r = db->submit_transaction_sync(t);
+  if (r < 0) {
+    derr << __func__ << " failed to write base: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  alloc_journal_seq = 0;
+  alloc_journal_pending = 0;
+  alloc_journal_active = true;
+  dout(1) << __func__ << " " << header.extents << " extents in "
+	  << header.chunks << " chunks" << dendl;
+  std::lock_guard l(alloc_journal_thread_lock);
+  ceph_assert(!alloc_journal_thread_running);
+  alloc_journal_thread_stop = false;
+  alloc_journal_thread_running = true;
+  alloc_journal_thread.create("bstore_ajournal");
+  return 0;
+}
+
+void BlueStore::_alloc_journal_stop()
+{
+  // the journal stays on disk, it is either replayed or dropped on next mount
+  alloc_journal_active = false;
+  {
+    std::lock_guard l(alloc_journal_thread_lock);
+    if (!alloc_journal_thread_running) {
+      return;
+    }
+    alloc_journal_thread_stop = true;
+    alloc_journal_cond.notify_all();
+  }
+  alloc_journal_thread.join();
+  std::lock_guard l(alloc_journal_thread_lock);
+  alloc_journal_thread_running = false;
+  alloc_journal_thread_stop = false;
+}
+
+void BlueStore::_alloc_journal_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock l(alloc_journal_thread_lock);
+  while (!alloc_journal_thread_stop) {
+    l.unlock();
+    _alloc_journal_maybe_checkpoint();
+    l.lock();
+    if (alloc_journal_thread_stop) {
+      break;
+    }
+    alloc_journal_cond.wait_for(
+      l, ceph::make_timespan(cct->_conf->bluestore_cache_trim_interval));
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void BlueStore::_alloc_journal_append(TransContext *txc,
+				      KeyValueDB::Transaction t,
+				      const interval_set<uint64_t>& allocated,
+				      const interval_set<uint64_t>& released)
+{
+  if (allocated.empty() && released.empty()) {
+    return;
+  }
+  bufferlist bl;
+  encode(allocated, bl);
+  encode(released, bl);
+  std::string key = alloc_journal_key(ALLOC_JOURNAL_DELTA_KEY,
+				      ++alloc_journal_seq);
+  dout(20) << __func__ << " txc " << txc << " "
+	   << pretty_binary_string(key) << dendl;
+  t->set(PREFIX_ALLOC_JOURNAL, key, bl);
+  ++alloc_journal_pending;
+  logger->inc(l_bluestore_alloc_journal_deltas);
+}
+
+void BlueStore::_alloc_journal_maybe_checkpoint()
+{
+  if (!alloc_journal_active) {
+    return;
+  }
+  uint64_t threshold = cct->_conf.get_val<uint64_t>(
+    "bluestore_allocation_journal_checkpoint_deltas");
+  if (threshold == 0 || alloc_journal_pending < threshold) {
+    return;
+  }
+  int r = _alloc_journal_checkpoint();
+  if (r < 0) {
+    // keep running, the next mount falls back to a full recovery
+    derr << __func__ << " checkpoint failed: " << cpp_strerror(r)
+	 << ", disabling allocator journal" << dendl;
+    alloc_journal_active = false;
+  }
+}
+
+// fold the pending deltas into the chunks of the regions they touch
+int BlueStore::_alloc_journal_checkpoint()
+{
+  std::lock_guard l(alloc_journal_lock);
+  auto start = mono_clock::now();
+  bufferlist hbl;
+  int r = db->get(PREFIX_ALLOC_JOURNAL, ALLOC_JOURNAL_HEADER_KEY, &hbl);
+  if (r < 0) {
+    return r;
+  }
+  alloc_journal_header_t header;
+  // touched regions, loaded on first use and updated in place
+  std::map<uint64_t, interval_set<uint64_t>> regions;
+  std::vector<std::string> deltas;
+  uint64_t max_seq = 0;
+  try {
+    auto p = hbl.cbegin();
+    decode(header, p);
+    if (header.region_size == 0) {
+      return -ESTALE;
+    }
+    auto region_free = [&](uint64_t region) -> interval_set<uint64_t>& {
+      auto [i, inserted] = regions.try_emplace(region);
+      if (inserted) {
+	bufferlist bl;
+	if (db->get(PREFIX_ALLOC_JOURNAL,
+		    alloc_journal_key(ALLOC_JOURNAL_BASE_KEY, region), &bl) >= 0) {
+	  auto q = bl.cbegin();
+	  decode(i->second, q);
+	  --header.chunks;
+	  header.extents -= i->second.num_intervals();
+	}
+      }
+      return i->second;
+    };
+
+    auto it = db->get_iterator(PREFIX_ALLOC_JOURNAL);
+    for (it->lower_bound(std::string(1, ALLOC_JOURNAL_DELTA_KEY));
+	 it->valid() && it->key()[0] == ALLOC_JOURNAL_DELTA_KEY;
+	 it->next()) {
+      std::string key = it->key();
+      interval_set<uint64_t> allocated, released;
+      bufferlist bl = it->value();
+      auto p = bl.cbegin();
+      decode(allocated, p);
+      decode(released, p);
+      for (auto e = allocated.begin(); e != allocated.end(); ++e) {
+	bool ok = alloc_journal_split(header.region_size,
+				      e.get_start(), e.get_len(),
+	  [&](uint64_t region, uint64_t o, uint64_t l) {
+	    auto& free = region_free(region);
+	    if (!free.contains(o, l)) {
+	      return false;
+	    }
+	    free.erase(o, l);
+	    return true;
+	  });
+	if (!ok) {
+	  derr << __func__ << " delta " << pretty_binary_string(key)
+	       << " allocates non-free 0x" << std::hex << e.get_start()
+	       << "~" << e.get_len() << std::dec << dendl;
+	  return -EIO;
+	}
+	header.free_bytes -= e.get_len();
+      }
+      for (auto e = released.begin(); e != released.end(); ++e) {
+	bool ok = alloc_journal_split(header.region_size,
+				      e.get_start(), e.get_len(),
+	  [&](uint64_t region, uint64_t o, uint64_t l) {
+	    auto& free = region_free(region);
+	    if (free.intersects(o, l)) {
+	      return false;
+	    }
+	    free.insert(o, l);
+	    return true;
+	  });
+	if (!ok) {
+	  derr << __func__ << " delta " << pretty_binary_string(key)
+	       << " releases free 0x" << std::hex << e.get_start()
+	       << "~" << e.get_len() << std::dec << dendl;
+	  return -EIO;
+	}
+	header.free_bytes += e.get_len();
+      }
+      uint64_t seq = 0;
+      _key_decode_u64(key.c_str() + 1, &seq);
+      max_seq = std::max(max_seq, seq);
+      deltas.push_back(std::move(key));
+    }
+  } catch (ceph::buffer::error& e) {
+    derr << __func__ << " failed to decode allocator journal: " << e.what()
+	 << dendl;
+    return -EIO;
+  }
+  if (deltas.empty()) {
+    return 0;
+  }
+
+  KeyValueDB::Transaction t = db->get_transaction();
+  for (auto& [region, free] : regions) {
+    std::string key = alloc_journal_key(ALLOC_JOURNAL_BASE_KEY, region);
+    if (free.empty()) {
+      t->rmkey(PREFIX_ALLOC_JOURNAL, key);
+      continue;
+    }
+    bufferlist bl;
+    encode(free, bl);
+    t->set(PREFIX_ALLOC_JOURNAL, key, bl);
+    ++header.chunks;
+    header.extents += free.num_intervals();
+  }
+  hbl.clear();
+  encode(header, hbl);
+  t->set(PREFIX_ALLOC_JOURNAL, ALLOC_JOURNAL_HEADER_KEY, hbl);
+  for (auto& key : deltas) {
+    t->rmkey(PREFIX_ALLOC_JOURNAL, key);
+  }
+  r = db->submit_transaction_sync(t);
+  if (r < 0) {
+    return r;
+  }
+  uint64_t pending = alloc_journal_pending;
+  while (!alloc_journal_pending.compare_exchange_weak(
+	   pending, pending - std::min<uint64_t>(pending, deltas.size())));
+  auto lat = mono_clock::now() - start;
+  logger->inc(l_bluestore_alloc_journal_checkpoints);
+  logger->tinc(l_bluestore_alloc_journal_checkpoint_lat, lat);
+  dout(5) << __func__ << " folded " << deltas.size() << " deltas up to "
+	  << max_seq << " into " << regions.size() << " of " << header.chunks
+	  << " chunks in " << timespan_str(lat) << dendl;
+  return 0;
+}
+
 //-----------------------------------------------------------------------------------
 void BlueStore::set_allocation_in_simple_bmap(SimpleBitmap* sbmap, uint64_t offset, uint64_t length)
 {
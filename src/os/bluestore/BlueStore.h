@@ -51,6 +51,9 @@
 
 #include "bluestore_types.h"
 #include "BlueFS.h"
+#include "DeferredSizeController.h"
+#include "EpochDomain.h"
+#include "ReadaheadStream.h"
 #include "common/EventTrace.h"
 
 #ifdef WITH_BLKIN
@@ -107,10 +110,25 @@ enum {
   //****************************************
   l_bluestore_read_onode_meta_lat,
   l_bluestore_read_wait_aio_lat,
+  l_bluestore_read_device_lat,
+  l_bluestore_read_device_bytes,
   l_bluestore_csum_lat,
   l_bluestore_read_eio,
   l_bluestore_reads_with_retries,
+  l_bluestore_read_coalesced_ios,
   l_bluestore_read_lat,
+  l_bluestore_readahead_ios,
+  l_bluestore_readahead_bytes,
+  l_bluestore_readahead_skipped,
+  l_bluestore_readahead_lat,
+  //****************************************
+
+  // defragmentation stats
+  //****************************************
+  l_bluestore_defrag_objects,
+  l_bluestore_defrag_bytes,
+  l_bluestore_defrag_blobs_reclaimed,
+  l_bluestore_defrag_shards_reclaimed,
   //****************************************
 
   // kv_thread latencies
@@ -141,6 +159,10 @@ enum {
   l_bluestore_issued_deferred_write_bytes,
   l_bluestore_submitted_deferred_writes,
   l_bluestore_submitted_deferred_write_bytes,
+  l_bluestore_deferred_size,
+  l_bluestore_deferred_size_grow,
+  l_bluestore_deferred_size_shrink,
+  l_bluestore_deferred_size_hold,
 
   l_bluestore_write_big_skipped_blobs,
   l_bluestore_write_big_skipped_bytes,
@@ -169,6 +191,8 @@ enum {
   l_bluestore_onode_shard_misses,
   l_bluestore_extents,
   l_bluestore_blobs,
+  l_bluestore_onode_slab_bytes,
+  l_bluestore_onode_meta_bytes_per_onode,
   //****************************************
 
   // buffer cache stats
@@ -177,6 +201,9 @@ enum {
   l_bluestore_buffer_bytes,
   l_bluestore_buffer_hit_bytes,
   l_bluestore_buffer_miss_bytes,
+  l_bluestore_buffer_lockless_hits,
+  l_bluestore_buffer_lock_waits,
+  l_bluestore_buffer_snapshots,
   //****************************************
 
   // internal stats
@@ -202,6 +229,7 @@ enum {
   l_bluestore_omap_next_lat,
   l_bluestore_omap_get_keys_lat,
   l_bluestore_omap_get_values_lat,
+  l_bluestore_omap_get_range_lat,
   l_bluestore_omap_clear_lat,
   l_bluestore_clist_lat,
   l_bluestore_remove_lat,
@@ -220,9 +248,30 @@ enum {
   l_bluestore_slow_read_onode_meta_count,
   l_bluestore_slow_read_wait_aio_count,
   //****************************************
+
+  // allocator journal
+  //****************************************
+  l_bluestore_alloc_journal_deltas,
+  l_bluestore_alloc_journal_checkpoints,
+  l_bluestore_alloc_journal_checkpoint_lat,
+  //****************************************
   l_bluestore_last
 };
 
+enum {
+  l_bluestore_kv_lane_first = 732800,
+  l_bluestore_kv_lane_txc,
+  l_bluestore_kv_lane_batches,
+  l_bluestore_kv_lane_queue_depth,
+  l_bluestore_kv_lane_group_lead,
+  l_bluestore_kv_lane_group_follow,
+  l_bluestore_kv_lane_sync_lat,
+  l_bluestore_kv_lane_idle,
+  l_bluestore_kv_lane_deferred_kicks,
+  l_bluestore_kv_lane_deferred_only,
+  l_bluestore_kv_lane_last
+};
+
 #define META_POOL_ID ((uint64_t)-1ull)
 using bptr_c_it_t = buffer::ptr::const_iterator;
 
@@ -352,6 +401,21 @@ public:
 
   struct BufferCacheShard;
 
+  /// read-only copy of the readable contents of a BufferSpace, so that
+  /// cache hits on hot blobs need not take the BufferCacheShard lock
+  struct BufferSnapshot {
+    MEMPOOL_CLASS_HELPERS();
+
+    struct entry_t {
+      uint32_t offset;
+      ceph::buffer::list data;
+    };
+    /// sorted by offset, not overlapping
+    mempool::bluestore_cache_meta::vector<entry_t> buffers;
+    /// hits since the last locked lookup, see BufferSpace::_read_snapshot()
+    mutable std::atomic<uint32_t> hits = {0};
+  };
+
   /// map logical extent range (object) onto buffers
   struct BufferSpace {
     enum {
@@ -373,13 +437,29 @@ public:
     // few IOs in flight to the same Blob at the same time).
     state_list_t writing;   ///< writing buffers, sorted by seq, ascending
 
+    /// published copy of buffer_map for lockless reads, reset by any change
+    /// to buffer_map or to the buffers in it
+    std::atomic<const BufferSnapshot*> snapshot = {nullptr};
+    /// full cache hits under the lock since the last change
+    uint16_t locked_hits = 0;
+
     ~BufferSpace() {
       ceph_assert(buffer_map.empty());
       ceph_assert(writing.empty());
+      ceph_assert(snapshot.load() == nullptr);
+    }
+
+    // must be called under protection of the Cache lock
+    void _invalidate_snapshot(BufferCacheShard* cache) {
+      locked_hits = 0;
+      if (snapshot.load(std::memory_order_relaxed)) {
+	cache->snapshot_epoch.retire(snapshot.exchange(nullptr));
+      }
     }
 
     void _add_buffer(BufferCacheShard* cache, Buffer* b, int level, Buffer* near) {
       cache->_audit("_add_buffer start");
+      _invalidate_snapshot(cache);
       buffer_map[b->offset].reset(b);
       if (b->is_writing()) {
         // we might get already cached data for which resetting mempool is inppropriate
@@ -412,6 +492,7 @@ public:
 		    std::map<uint32_t, std::unique_ptr<Buffer>>::iterator p) {
       ceph_assert(p != buffer_map.end());
       cache->_audit("_rm_buffer start");
+      _invalidate_snapshot(cache);
       if (p->second->is_writing()) {
         writing.erase(writing.iterator_to(*p->second));
       } else {
@@ -467,6 +548,15 @@ public:
 	      BlueStore::ready_regions_t& res,
 	      interval_set<uint32_t>& res_intervals,
 	      int flags = 0);
+    /// true if all of a range is cached, clean or being written
+    bool is_cached(BufferCacheShard* cache, uint32_t offset,
+		   uint32_t length) const;
+    bool _read_snapshot(BufferCacheShard* cache, uint32_t offset,
+			uint32_t length,
+			BlueStore::ready_regions_t& res,
+			interval_set<uint32_t>& res_intervals);
+    // must be called under protection of the Cache lock
+    void _publish_snapshot(BufferCacheShard* cache);
 
     void truncate(BufferCacheShard* cache, uint32_t offset) {
       discard(cache, offset, (uint32_t)-1 - offset);
@@ -864,6 +954,10 @@ public:
       return blob_start() < o || blob_end() > o + l;
     }
   };
+  // An intrusive set rather than a flat vector: the write path holds
+  // iterators and Extent pointers across inserts, punch_hole() and
+  // split, which a vector would invalidate.  The Extents themselves come
+  // from a slab_arena_t, see BlueStore.cc.
   typedef boost::intrusive::set<Extent> extent_map_t;
 
 
@@ -1036,6 +1130,9 @@ public:
     /// initialize Shards from the onode
     void init_shards(bool loaded, bool dirty);
 
+    /// true if fault_range() would not need to load any shard
+    bool is_range_loaded(uint32_t offset, uint32_t length);
+
     /// return index of shard containing offset
     /// or -1 if not found
     int seek_shard(uint32_t offset) {
@@ -1500,6 +1597,10 @@ private:
     uint64_t buffer_bytes = 0;
 
   public:
+    /// buffer snapshots of this shard's BufferSpaces are freed through
+    /// this once no lockless reader can use them
+    EpochDomain<BufferSnapshot> snapshot_epoch;
+
     BufferCacheShard(CephContext* cct) : CacheShard(cct) {}
     virtual ~BufferCacheShard() {
       ceph_assert(num_blobs == 0);
@@ -1843,6 +1944,11 @@ private:
     boost::intrusive::list_member_hook<> sequencer_item;
 
     uint64_t bytes = 0, ios = 0, cost = 0;
+    uint64_t aio_bytes = 0;  ///< submitted directly, for deferred_size_ctl
+
+    /// allocation hint flags the writes of this txc are made with, on top
+    /// of the onode's own (which are left alone)
+    uint32_t write_alloc_hints = 0;
 
     std::set<OnodeRef> onodes;     ///< these need to be updated/written
     std::set<OnodeRef> modified_objects;  ///< objects we modified (and need a ref)
@@ -2042,6 +2148,11 @@ private:
     bool should_submit_deferred() {
       return throttle_deferred_bytes.past_midpoint();
     }
+    double get_deferred_util() const {
+      auto max = throttle_deferred_bytes.get_max();
+      return max > 0 ?
+	(double)throttle_deferred_bytes.get_current() / max : 0;
+    }
     void reset_throttle(const ConfigProxy &conf) {
       throttle_bytes.reset_max(conf->bluestore_throttle_bytes);
       throttle_deferred_bytes.reset_max(
@@ -2225,23 +2336,84 @@ private:
       boost::intrusive::list_member_hook<>,
       &OpSequencer::deferred_osr_queue_item> > deferred_osr_queue_t;
 
+  struct KVSyncLane;
   struct KVSyncThread : public Thread {
     BlueStore *store;
-    explicit KVSyncThread(BlueStore *s) : store(s) {}
+    KVSyncLane *lane;
+    KVSyncThread(BlueStore *s, KVSyncLane *l) : store(s), lane(l) {}
+    void *entry() override {
+      store->_kv_sync_thread(lane);
+      return NULL;
+    }
+  };
+  struct ReadaheadThread : public Thread {
+    BlueStore *store;
+    explicit ReadaheadThread(BlueStore *s) : store(s) {}
     void *entry() override {
-      store->_kv_sync_thread();
+      store->_readahead_thread();
+      return NULL;
+    }
+  };
+  struct AllocJournalThread : public Thread {
+    BlueStore *store;
+    explicit AllocJournalThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_alloc_journal_thread();
       return NULL;
     }
   };
   struct KVFinalizeThread : public Thread {
     BlueStore *store;
-    explicit KVFinalizeThread(BlueStore *s) : store(s) {}
+    KVSyncLane *lane;
+    KVFinalizeThread(BlueStore *s, KVSyncLane *l) : store(s), lane(l) {}
     void *entry() override {
-      store->_kv_finalize_thread();
+      store->_kv_finalize_thread(lane);
       return NULL;
     }
   };
 
+  /// one kv commit pipeline.  every OpSequencer is bound to exactly one
+  /// lane (by sequencer id), so per-sequencer ordering is preserved while
+  /// independent sequencers batch and submit their txcs in parallel.  the
+  /// final sync is shared between lanes, see _kv_group_sync().
+  struct KVSyncLane {
+    const uint32_t id;
+    KVSyncThread sync_thread;
+    KVFinalizeThread finalize_thread;
+    PerfCounters *logger = nullptr;
+
+    ceph::mutex kv_lock = ceph::make_mutex("BlueStore::kv_lock");
+    ceph::condition_variable kv_cond;
+    bool kv_sync_started = false;
+    bool kv_stop = false;
+    std::deque<TransContext*> kv_queue;             ///< ready, already submitted
+    std::deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
+    std::deque<TransContext*> kv_committing;        ///< currently syncing
+    std::deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
+    bool deferred_stable_pending = false; ///< deferred ios stable, keys not removed
+    bool deferred_kick = false;  ///< clean up deferred ios without a txc
+    bool kv_sync_in_progress = false;
+    uint64_t kv_ios = 0;
+    uint64_t kv_throttle_costs = 0;
+
+    ceph::mutex kv_finalize_lock = ceph::make_mutex("BlueStore::kv_finalize_lock");
+    ceph::condition_variable kv_finalize_cond;
+    bool kv_finalize_started = false;
+    bool kv_finalize_stop = false;
+    std::deque<TransContext*> kv_committing_to_finalize;   ///< pending finalization
+    std::deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
+    bool kv_finalize_in_progress = false;
+
+    KVSyncLane(BlueStore *store, uint32_t id)
+      : id(id),
+	sync_thread(store, this),
+	finalize_thread(store, this) {}
+
+    bool is_primary() const {
+      return id == 0;
+    }
+  };
+
 #ifdef HAVE_LIBZBD
   struct ZonedCleanerThread : public Thread {
     BlueStore *store;
@@ -2299,6 +2471,45 @@ private:
   bool db_was_opened_read_only = true;
   bool need_to_destage_allocation_file = false;
 
+  // allocator journal (NCB mode only, see _alloc_journal_*)
+  ceph::mutex alloc_journal_lock =
+    ceph::make_mutex("BlueStore::alloc_journal_lock");
+  std::atomic<bool> alloc_journal_active = {false};
+  std::atomic<uint64_t> alloc_journal_seq = {0};     ///< last delta key handed out
+  std::atomic<uint64_t> alloc_journal_pending = {0}; ///< deltas not yet checkpointed
+  /// base chunks by region, captured by _init_alloc
+  std::map<uint64_t, ceph::buffer::list> alloc_journal_base;
+  uint64_t alloc_journal_base_extents = 0;
+  uint64_t alloc_journal_base_bytes = 0;
+  // checkpoints run off their own thread and rewrite the touched chunks
+  ceph::mutex alloc_journal_thread_lock =
+    ceph::make_mutex("BlueStore::alloc_journal_thread_lock");
+  ceph::condition_variable alloc_journal_cond;
+  bool alloc_journal_thread_running = false;
+  bool alloc_journal_thread_stop = false;
+  AllocJournalThread alloc_journal_thread;
+
+  // wall clock breakdown of the last mount, see "bluestore startup timings"
+  ceph::mutex startup_timings_lock =
+    ceph::make_mutex("BlueStore::startup_timings_lock");
+  bool startup_timings_recording = false;
+  std::vector<std::pair<std::string, double>> startup_timings;
+  std::string startup_alloc_source;
+
+  // progress of a running fsck, see "bluestore fsck progress"
+  ceph::mutex fsck_progress_lock =
+    ceph::make_mutex("BlueStore::fsck_progress_lock");
+  bool fsck_running = false;
+  std::string fsck_phase;
+  ceph::mono_clock::time_point fsck_start;
+  ceph::mono_clock::time_point fsck_walk_start;
+  std::atomic<uint64_t> fsck_objects_done = {0};
+  std::atomic<uint64_t> fsck_bytes_done = {0};  ///< onode keys and values
+  uint64_t fsck_bytes_total = 0;                ///< estimate
+
+  class SocketHook;
+  SocketHook* asok_hook = nullptr;
+
   ///< rwlock to protect coll_map/new_coll_map
   ceph::shared_mutex coll_lock = ceph::make_shared_mutex("BlueStore::coll_lock");
   mempool::bluestore_cache_other::unordered_map<coll_t, CollectionRef> coll_map;
@@ -2328,26 +2539,20 @@ private:
   Finisher  finisher;
   utime_t  deferred_last_submitted = utime_t();
 
-  KVSyncThread kv_sync_thread;
-  ceph::mutex kv_lock = ceph::make_mutex("BlueStore::kv_lock");
-  ceph::condition_variable kv_cond;
   bool _kv_only = false;
-  bool kv_sync_started = false;
-  bool kv_stop = false;
-  bool kv_finalize_started = false;
-  bool kv_finalize_stop = false;
-  std::deque<TransContext*> kv_queue;             ///< ready, already submitted
-  std::deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
-  std::deque<TransContext*> kv_committing;        ///< currently syncing
-  std::deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
-  bool kv_sync_in_progress = false;
-
-  KVFinalizeThread kv_finalize_thread;
-  ceph::mutex kv_finalize_lock = ceph::make_mutex("BlueStore::kv_finalize_lock");
-  ceph::condition_variable kv_finalize_cond;
-  std::deque<TransContext*> kv_committing_to_finalize;   ///< pending finalization
-  std::deque<DeferredBatch*> deferred_stable_to_finalize; ///< pending finalization
-  bool kv_finalize_in_progress = false;
+  std::vector<std::unique_ptr<KVSyncLane>> kv_lanes; ///< set up by _kv_start
+
+  // group commit shared by all kv lanes
+  ceph::mutex kv_group_lock = ceph::make_mutex("BlueStore::kv_group_lock");
+  ceph::condition_variable kv_group_cond;
+  uint64_t kv_group_started = 0;    ///< last group sync started
+  uint64_t kv_group_committed = 0;  ///< last group sync completed
+  bool kv_group_in_progress = false;
+
+  /// orders nid_max/blobid_max updates written by different lanes
+  ceph::mutex kv_id_max_lock = ceph::make_mutex("BlueStore::kv_id_max_lock");
+  uint64_t nid_max_pending = 0;     ///< highest nid_max submitted to the db
+  uint64_t blobid_max_pending = 0;  ///< highest blobid_max submitted to the db
 
 #ifdef HAVE_LIBZBD
   ZonedCleanerThread zoned_cleaner_thread;
@@ -2360,6 +2565,8 @@ private:
 
   PerfCounters *logger = nullptr;
 
+  ceph::mutex removed_collections_lock =
+    ceph::make_mutex("BlueStore::removed_collections_lock");
   std::list<CollectionRef> removed_collections;
 
   ceph::shared_mutex debug_read_error_lock =
@@ -2402,6 +2609,32 @@ private:
   ///< size threshold for forced deferred writes
   std::atomic<uint64_t> prefer_deferred_size = {0};
 
+  ///< adapts prefer_deferred_size if bluestore_deferred_adaptive is set
+  DeferredSizeController deferred_size_ctl;
+  std::atomic<bool> deferred_adaptive = {false};
+
+  ///< read-ahead of sequential streams, see _maybe_readahead()
+  std::atomic<uint64_t> readahead_budget = {0};  ///< configured, 0 = off
+  std::atomic<uint64_t> readahead_limit = {0};   ///< granted by the cache
+  std::atomic<uint64_t> readahead_inflight = {0};
+  std::atomic<uint32_t> readahead_trigger_requests = {0};
+  std::atomic<uint64_t> readahead_min_size = {0};
+  std::atomic<uint64_t> readahead_max_size = {0};
+  ReadaheadStreamTable<256> readahead_streams;  ///< sequential read detectors
+
+  struct readahead_req_t {
+    CollectionRef c;
+    OnodeRef o;
+    uint64_t offset;
+    uint64_t length;
+  };
+  ceph::mutex readahead_lock = ceph::make_mutex("BlueStore::readahead_lock");
+  ceph::condition_variable readahead_cond;
+  std::deque<readahead_req_t> readahead_queue;
+  bool readahead_running = false;
+  bool readahead_stop = false;
+  std::vector<std::unique_ptr<ReadaheadThread>> readahead_threads;
+
   ///< approx cost per io, in bytes
   std::atomic<uint64_t> throttle_cost_per_io = {0};
 
@@ -2454,6 +2687,8 @@ private:
     bool stop = false;
     std::shared_ptr<PriorityCache::PriCache> binned_kv_cache = nullptr;
     std::shared_ptr<PriorityCache::PriCache> binned_kv_onode_cache = nullptr;
+    /// other column families with a cache of their own, by name
+    std::map<std::string, KeyValueDB::cf_cache_t> binned_kv_cf_caches;
     std::shared_ptr<PriorityCache::Manager> pcm = nullptr;
 
     struct MempoolCache : public PriorityCache::PriCache {
@@ -2653,11 +2888,49 @@ private:
     };
     std::shared_ptr<DataCache> data_cache;
 
+    /// reserves memory for read-ahead in flight; what it is granted caps
+    /// BlueStore::readahead_limit.  Read-ahead data that has landed is
+    /// accounted by the data cache.
+    struct ReadaheadCache : public MempoolCache {
+      ReadaheadCache(BlueStore *s) : MempoolCache(s) {};
+
+      virtual int64_t request_cache_bytes(
+          PriorityCache::Priority pri, uint64_t total_cache) const {
+        // read-ahead is speculative, so it asks at the lowest priority
+        // that is not split by ratio, after every age bin that matters
+        if (pri != PriorityCache::Priority::LAST - 1) {
+          return 0;
+        }
+        int64_t assigned = get_cache_bytes(pri);
+        int64_t request = store->readahead_budget;
+        return (request > assigned) ? request - assigned : 0;
+      }
+      virtual uint32_t get_bin_count() const {
+        return 0;
+      }
+      virtual void set_bin_count(uint32_t count) {
+      }
+      virtual uint64_t _get_used_bytes() const {
+        return store->readahead_inflight;
+      }
+      virtual void shift_bins() {
+      }
+      virtual uint64_t _sum_bins(uint32_t start, uint32_t end) const {
+        return 0;
+      }
+      virtual std::string get_cache_name() const {
+        return "BlueStore Readahead Cache";
+      }
+    };
+    std::shared_ptr<ReadaheadCache> readahead_cache;
+    bool readahead_cache_registered = false;  ///< with pcm
+
   public:
     explicit MempoolThread(BlueStore *s)
       : store(s),
         meta_cache(new MetaCache(s)),
-        data_cache(new DataCache(s)) {}
+        data_cache(new DataCache(s)),
+        readahead_cache(new ReadaheadCache(s)) {}
 
     void *entry() override;
     void init() {
@@ -2674,6 +2947,7 @@ private:
 
   private:
     void _update_cache_settings();
+    void _update_readahead_cache();
     void _resize_shards(bool interval_stats);
   } mempool_thread;
 
@@ -2696,6 +2970,8 @@ private:
   int _write_fsid();
   void _close_fsid();
   void _set_alloc_sizes();
+  void _update_deferred_size();
+  void _set_readahead();
   void _set_blob_size();
   void _set_finisher_num();
   void _set_per_pool_omap();
@@ -2743,6 +3019,28 @@ private:
   int _create_alloc();
   int _init_alloc(std::map<uint64_t, uint64_t> *zone_adjustments);
   void _post_init_alloc(const std::map<uint64_t, uint64_t>& zone_adjustments);
+
+  void _alloc_journal_capture_base();
+  int _alloc_journal_load(interval_set<uint64_t> *free_extents,
+			  std::set<std::string> *deltas,
+			  uint64_t *max_seq);
+  int _alloc_journal_replay(Allocator *dest, uint64_t *num, uint64_t *bytes);
+  void _alloc_journal_reset();
+  int _alloc_journal_start();
+  void _alloc_journal_stop();
+  void _alloc_journal_append(TransContext *txc, KeyValueDB::Transaction t,
+			     const interval_set<uint64_t>& allocated,
+			     const interval_set<uint64_t>& released);
+  void _alloc_journal_maybe_checkpoint();
+  void _alloc_journal_thread();
+  int _alloc_journal_checkpoint();
+
+  void _startup_timing_begin();
+  void _startup_timing_note(const char *phase,
+			    ceph::mono_clock::time_point start);
+  void _startup_timing_end(ceph::mono_clock::time_point start);
+  void _dump_startup_timings(ceph::Formatter *f);
+  void _fsck_progress_phase(const char *phase);
   void _close_alloc();
   int _open_collections();
   void _fsck_collections(int64_t* errors);
@@ -2794,10 +3092,19 @@ private:
 			    TrackedOpRef osd_op=TrackedOpRef());
   void _txc_update_store_statfs(TransContext *txc);
   void _txc_add_transaction(TransContext *txc, Transaction *t);
+  /// queue_transactions(), with allocation hints for the writes, see
+  /// TransContext::write_alloc_hints
+  int _queue_transactions(
+    CollectionHandle& ch,
+    std::vector<Transaction>& tls,
+    TrackedOpRef op,
+    ThreadPool::TPHandle *handle,
+    uint32_t write_alloc_hints);
   void _txc_calc_cost(TransContext *txc);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
+  static uint64_t _get_pending_aio_bytes(const IOContext& ioc);
 public:
   void txc_aio_finish(void *p) {
     _txc_state_proc(static_cast<TransContext*>(p));
@@ -2818,8 +3125,18 @@ private:
 
   void _kv_start();
   void _kv_stop();
-  void _kv_sync_thread();
-  void _kv_finalize_thread();
+  KVSyncLane *_get_kv_lane(const OpSequencer *osr) {
+    ceph_assert(!kv_lanes.empty());
+    return kv_lanes[osr->get_sequencer_id() % kv_lanes.size()].get();
+  }
+  void _kv_lane_wake(KVSyncLane *lane);
+  void _kv_wake_all_lanes();
+  void _kv_kick_deferred(KVSyncLane *self);
+  void _kv_reserve_ids(KeyValueDB::Transaction synct,
+		       uint64_t *new_nid_max, uint64_t *new_blobid_max);
+  void _kv_group_sync(KVSyncLane *lane, KeyValueDB::Transaction synct);
+  void _kv_sync_thread(KVSyncLane *lane);
+  void _kv_finalize_thread(KVSyncLane *lane);
 
 #ifdef HAVE_LIBZBD
   void _zoned_cleaner_start();
@@ -2846,6 +3163,40 @@ public:
   using mempool_dynamic_bitset =
     boost::dynamic_bitset<uint64_t,
 			  mempool::bluestore_fsck::pool_allocator<uint64_t>>;
+
+  /**
+   * The used blocks bitmap, shared in place by the parallel fsck workers.
+   *
+   * dynamic_bitset has no access to its words, so bits are tested and set
+   * under one of a set of locks picked by word; workers checking different
+   * objects hardly ever meet on one.  A worker setting a bit that is set
+   * already learns it is a misreference.
+   */
+  class fsck_shared_bitset_t {
+    static constexpr size_t num_locks = 1024;
+    struct alignas(64) lock_t {
+      ceph::mutex lock =
+	ceph::make_mutex("BlueStore::fsck_shared_bitset_t::lock");
+    };
+    mempool_dynamic_bitset& bs;
+    std::unique_ptr<lock_t[]> locks;
+  public:
+    explicit fsck_shared_bitset_t(mempool_dynamic_bitset& bs)
+      : bs(bs), locks(new lock_t[num_locks]) {}
+    size_t size() const {
+      return bs.size();
+    }
+    /// set the bit, returns whether it was set already
+    bool test_and_set(uint64_t pos) {
+      auto word = pos / mempool_dynamic_bitset::bits_per_block;
+      std::lock_guard l(locks[word % num_locks].lock);
+      if (bs.test(pos)) {
+	return true;
+      }
+      bs.set(pos);
+      return false;
+    }
+  };
   using  per_pool_statfs =
     mempool::bluestore_fsck::map<uint64_t, store_statfs_t>;
 
@@ -2859,11 +3210,12 @@ public:
   };
 
 private:
+  template <typename Bitset>
   int _fsck_check_extents(
     std::string_view ctx_descr,
     const PExtentVector& extents,
     bool compressed,
-    mempool_dynamic_bitset &used_blocks,
+    Bitset &used_blocks,
     uint64_t granularity,
     BlueStoreRepairer* repairer,
     store_statfs_t& expected_statfs,
@@ -3011,6 +3363,17 @@ public:
     return _fsck(FSCK_SHALLOW, true);
   }
 
+  struct fsck_progress_t {
+    bool running = false;
+    std::string phase;
+    double elapsed = 0;     ///< seconds since fsck started
+    uint64_t objects = 0;   ///< objects walked so far
+    double progress = 0;    ///< of the object walk, 0..1
+    double eta = -1;        ///< seconds left in the object walk, -1 if unknown
+  };
+  void get_fsck_progress(fsck_progress_t *p);
+  void dump_fsck_progress(ceph::Formatter *f);
+
   void set_cache_shards(unsigned num) override;
   void dump_cache_stats(ceph::Formatter *f) override {
     int onode_count = 0, buffers_bytes = 0;
@@ -3092,6 +3455,11 @@ public:
     size_t len,
     ceph::buffer::list& bl,
     uint32_t op_flags = 0) override;
+  bool is_read_cached(
+    CollectionHandle &c,
+    const ghobject_t& oid,
+    uint64_t offset,
+    size_t len) override;
 
 private:
 
@@ -3128,6 +3496,7 @@ private:
     uint64_t r_len = 0;
     ceph::buffer::list bl;
     std::list<region_t> regs; // original read regions
+    bool coalesced = false;   // bl slices a read shared with other requests
 
     read_req_t(uint64_t off, uint64_t len) : r_off(off), r_len(len) {}
 
@@ -3184,8 +3553,34 @@ private:
     uint32_t op_flags = 0,
     uint64_t retry_count = 0);
 
+  static uint64_t _readahead_tag(const OnodeRef& o) {
+    return std::hash<std::string_view>{}(
+      std::string_view(o->key.data(), o->key.size()));
+  }
+  void _maybe_readahead(
+    Collection *c,
+    OnodeRef& o,
+    uint64_t offset,
+    size_t length,
+    uint32_t op_flags);
+  void _readahead_start();
+  void _readahead_stop();
+  void _readahead_thread();
+
   int _fiemap(CollectionHandle &c_, const ghobject_t& oid,
 	      uint64_t offset, size_t len, interval_set<uint64_t>& destset);
+
+  struct fragmentation_t {
+    uint64_t blobs = 0;
+    uint64_t shards = 0;
+    uint64_t compressed = 0;        ///< compressed blobs
+    uint64_t wasted_compressed = 0; ///< compressed blobs mostly overwritten
+    bool shared = false;            ///< shares blobs with a clone
+  };
+  fragmentation_t _get_fragmentation(OnodeRef& o);
+  int _defragment(CollectionHandle &c, const ghobject_t& oid,
+    defrag_stats_t *stats, Context *on_commit,
+    ThreadPool::TPHandle *handle);
 public:
   int fiemap(CollectionHandle &c, const ghobject_t& oid,
 	     uint64_t offset, size_t len, ceph::buffer::list& bl) override;
@@ -3202,6 +3597,10 @@ public:
   int dump_onode(CollectionHandle &c, const ghobject_t& oid,
     const std::string& section_name, ceph::Formatter *f) override;
 
+  int defragment(CollectionHandle &c, const ghobject_t& oid,
+    defrag_stats_t *stats, Context *on_commit,
+    ThreadPool::TPHandle *handle = nullptr) override;
+
   int getattr(CollectionHandle &c, const ghobject_t& oid, const char *name,
 	      ceph::buffer::ptr& value) override;
 
@@ -3283,6 +3682,18 @@ public:
     ) override;
 #endif
 
+  int omap_get_range(
+    CollectionHandle &c,
+    const ghobject_t &oid,
+    const std::string &start_after,
+    const std::string &filter_prefix,
+    uint64_t max_keys,
+    uint64_t max_bytes,
+    ceph::buffer::list *out,
+    uint32_t *num,
+    bool *more
+    ) override;
+
   /// Filters keys into out which are defined on oid
   int omap_check_keys(
     CollectionHandle &c,                ///< [in] Collection containing oid
@@ -3328,6 +3739,7 @@ public:
   const PerfCounters* get_perf_counters() const override {
     return logger;
   }
+  int get_commit_stats(commit_stats_t *stats) override;
   const PerfCounters* get_bluefs_perf_counters() const {
     return bluefs->get_perf_counters();
   }
@@ -3612,6 +4024,7 @@ private:
   void _choose_write_options(CollectionRef& c,
                              OnodeRef& o,
                              uint32_t fadvise_flags,
+                             uint32_t alloc_hints,
                              WriteContext *wctx);
 
   int _do_gc(TransContext *txc,
@@ -3739,15 +4152,15 @@ private:
 
   void _collect_allocation_stats(uint64_t need, uint32_t alloc_size,
                                  const PExtentVector&);
-  void _record_allocation_stats();
+  void _record_allocation_stats(bool sample_score = true);
 private:
   uint64_t probe_count = 0;
   std::atomic<uint64_t> alloc_stats_count = {0};
   std::atomic<uint64_t> alloc_stats_fragments = { 0 };
   std::atomic<uint64_t> alloc_stats_size = { 0 };
-  // 
-  std::array<std::tuple<uint64_t, uint64_t, uint64_t>, 5> alloc_stats_history =
-  { std::make_tuple(0ul, 0ul, 0ul) };
+  // count, fragments, size, allocator fragmentation score
+  std::array<std::tuple<uint64_t, uint64_t, uint64_t, double>, 5>
+    alloc_stats_history = { std::make_tuple(0ul, 0ul, 0ul, 0.0) };
 
   inline bool _use_rotational_settings();
 
@@ -3756,6 +4169,25 @@ public:
     uint64_t, std::less<uint64_t>,
     mempool::bluestore_fsck::pool_allocator<uint64_t>> uint64_t_btree_t;
 
+  /// nids seen by fsck, shared by the parallel workers
+  class fsck_used_nids_t {
+    static constexpr size_t num_shards = 64;
+    struct alignas(64) shard_t {
+      ceph::mutex lock =
+	ceph::make_mutex("BlueStore::fsck_used_nids_t::lock");
+      uint64_t_btree_t nids;
+    };
+    std::unique_ptr<shard_t[]> shards;
+  public:
+    fsck_used_nids_t() : shards(new shard_t[num_shards]) {}
+    /// false if the nid is in use already
+    bool insert(uint64_t nid) {
+      auto& s = shards[nid % num_shards];
+      std::lock_guard l(s.lock);
+      return s.nids.insert(nid).second;
+    }
+  };
+
   struct FSCK_ObjectCtx {
     int64_t& errors;
     int64_t& warnings;
@@ -3766,6 +4198,7 @@ public:
     uint64_t& num_spanning_blobs;
 
     mempool_dynamic_bitset* used_blocks;
+    fsck_shared_bitset_t* shared_used_blocks = nullptr; ///< instead of above
     uint64_t_btree_t* used_omap_head;
     std::vector<std::unordered_map<ghobject_t, uint64_t>> *zone_refs;
 
@@ -3939,6 +4372,16 @@ private:
 
   void _fsck_check_objects(FSCKDepth depth,
     FSCK_ObjectCtx& ctx);
+  size_t _fsck_walk_objects(FSCKDepth depth,
+    FSCK_ObjectCtx& ctx,
+    const std::string& start,
+    const std::string& end,
+    fsck_used_nids_t& used_nids,
+    std::function<bool(int64_t, CollectionRef, const ghobject_t&,
+		       const std::string&, const ceph::buffer::list&)> offload);
+  void _fsck_check_objects_parallel(FSCKDepth depth,
+    FSCK_ObjectCtx& ctx,
+    size_t thread_count);
 };
 
 inline std::ostream& operator<<(std::ostream& out, const BlueStore::volatile_statfs& s) {
@@ -0,0 +1,256 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+
+#include "common/ceph_mutex.h"
+#include "include/ceph_assert.h"
+#include "include/intarith.h"
+
+/**
+ * DeferredSizeController
+ *
+ * Adapts BlueStore's prefer_deferred_size to the latencies observed at
+ * runtime instead of relying on the static _hdd/_ssd defaults.
+ *
+ * A deferred write costs the client one kv (WAL) commit; the data reaches
+ * the main device later, batched and sorted with other deferred writes,
+ * which saves most of the per-IO cost of the main device but still writes
+ * every byte.  A direct write costs a main device write followed by the kv
+ * commit.
+ *
+ * The latency of direct writes is fit to a + b * length, a being the per-IO
+ * cost of the main device and b its per-byte cost.  Deferring a write of
+ * size s pays off by the gain
+ *
+ *   (a + b * s) / (kv + b * s)
+ *
+ * which falls toward 1 as s grows.  The threshold grows while the gain at
+ * the threshold is above grow_ratio and shrinks while the gain at half of
+ * it is below shrink_ratio.  As the gain falls with the size, a step never
+ * undoes the one before, and the threshold settles between the sizes at
+ * which the gain crosses the two ratios.  Fitting the per-IO cost keeps the
+ * long direct writes that are left at a high threshold from biasing it.
+ *
+ * Once every write is deferred there are no direct writes left to sample;
+ * the fit is then kept as it is, not decayed, while kv commit latency and
+ * the deferred queue keep being watched.  The fit only ages as new samples
+ * come in.
+ *
+ * add_device_write() and add_kv_commit() are called per txc and per kv
+ * commit, and only add to atomic sums.  configure() and update() serialize
+ * on a mutex of their own.
+ */
+class DeferredSizeController {
+public:
+  enum decision_t {
+    HOLD,
+    GROW,
+    SHRINK,
+  };
+
+  struct config_t {
+    uint64_t min_size = 0;        ///< lower bound, 0 allows no deferring at all
+    uint64_t max_size = 0;        ///< upper bound
+    uint64_t granularity = 4096;  ///< power of 2, usually min_alloc_size
+    double grow_ratio = 2.0;      ///< grow if the gain at size is above
+    double shrink_ratio = 1.5;    ///< shrink if the gain at size/2 is below
+    double max_queue_util = 0.75; ///< shrink if the deferred queue is fuller
+    uint64_t min_samples = 16;    ///< direct writes to fit, kv commits per update
+  };
+
+private:
+  static constexpr double ewma_weight = 0.2;
+
+  /// samples since the last update(); lengths in KiB, latencies in usec
+  struct alignas(64) device_sums_t {
+    std::atomic<uint64_t> n = {0};
+    std::atomic<uint64_t> x = {0};
+    std::atomic<uint64_t> y = {0};
+    std::atomic<uint64_t> xx = {0};
+    std::atomic<uint64_t> xy = {0};
+  } device;
+  struct alignas(64) kv_sums_t {
+    std::atomic<uint64_t> n = {0};
+    std::atomic<uint64_t> y = {0};
+  } kv;
+
+  /// decayed moments of the direct write samples, see update()
+  struct moments_t {
+    double n = 0, x = 0, y = 0, xx = 0, xy = 0;
+  };
+
+  mutable ceph::mutex lock = ceph::make_mutex("DeferredSizeController::lock");
+  config_t conf;
+  std::atomic<uint64_t> size = {0};
+  moments_t m;
+  double a = 0;            ///< usec per direct write
+  double b = 0;            ///< usec per KiB of direct write
+  double kv_lat = 0;       ///< usec, smoothed
+  bool have_kv_lat = false;
+
+  uint64_t _clamp(uint64_t s) const {
+    if (s > conf.max_size) {
+      s = conf.max_size;
+    }
+    if (s < conf.min_size) {
+      s = conf.min_size;
+    }
+    return s;
+  }
+
+  static uint64_t _usec(double lat) {
+    return lat > 0 ? std::llround(lat * 1000000.0) : 0;
+  }
+
+  void _fit() {
+    double mx = m.x / m.n;
+    double my = m.y / m.n;
+    double var = m.xx / m.n - mx * mx;
+    // all of the same length: take it all as per-IO cost, as if b were 0
+    b = var > 1.0 ? std::max(0.0, (m.xy / m.n - mx * my) / var) : 0;
+    a = std::max(0.0, my - b * mx);
+  }
+
+  /// what deferring a write of s bytes saves over writing it directly
+  double _gain(uint64_t s) const {
+    double kib = double(s) / 1024;
+    double deferred = kv_lat + b * kib;
+    return deferred > 0 ? (a + b * kib) / deferred : 0;
+  }
+
+public:
+  DeferredSizeController() = default;
+  DeferredSizeController(const config_t& c, uint64_t initial) {
+    configure(c, initial);
+  }
+
+  /// (re)start from the given threshold, dropping the latency history
+  void configure(const config_t& c, uint64_t initial) {
+    std::lock_guard l(lock);
+    conf = c;
+    ceph_assert(conf.granularity > 0 &&
+		(conf.granularity & (conf.granularity - 1)) == 0);
+    ceph_assert(conf.shrink_ratio <= conf.grow_ratio);
+    if (conf.max_size < conf.min_size) {
+      conf.max_size = conf.min_size;
+    }
+    size = _clamp(initial);
+    for (auto p : {&device.n, &device.x, &device.y, &device.xx, &device.xy,
+		   &kv.n, &kv.y}) {
+      *p = 0;
+    }
+    m = moments_t();
+    a = b = kv_lat = 0;
+    have_kv_lat = false;
+  }
+
+  /// latency of a direct (non deferred) write of the given length to the
+  /// main device
+  void add_device_write(double lat, uint64_t length) {
+    uint64_t x = (length + 1023) >> 10;
+    uint64_t y = _usec(lat);
+    device.n.fetch_add(1, std::memory_order_relaxed);
+    device.x.fetch_add(x, std::memory_order_relaxed);
+    device.y.fetch_add(y, std::memory_order_relaxed);
+    device.xx.fetch_add(x * x, std::memory_order_relaxed);
+    device.xy.fetch_add(x * y, std::memory_order_relaxed);
+  }
+
+  /// latency of a kv commit
+  void add_kv_commit(double lat) {
+    kv.n.fetch_add(1, std::memory_order_relaxed);
+    kv.y.fetch_add(_usec(lat), std::memory_order_relaxed);
+  }
+
+  /**
+   * Pick the threshold for the next period.
+   *
+   * A sample added while this runs may have some of its sums counted in
+   * this period and the rest in the next; that is noise the smoothing
+   * takes care of.
+   *
+   * @param queue_util how full the deferred write throttle is, 0..1
+   */
+  decision_t update(double queue_util) {
+    std::lock_guard l(lock);
+    uint64_t dn = device.n.exchange(0, std::memory_order_relaxed);
+    uint64_t dx = device.x.exchange(0, std::memory_order_relaxed);
+    uint64_t dy = device.y.exchange(0, std::memory_order_relaxed);
+    uint64_t dxx = device.xx.exchange(0, std::memory_order_relaxed);
+    uint64_t dxy = device.xy.exchange(0, std::memory_order_relaxed);
+    uint64_t kn = kv.n.exchange(0, std::memory_order_relaxed);
+    uint64_t ky = kv.y.exchange(0, std::memory_order_relaxed);
+    if (dn > 0) {
+      double keep = m.n > 0 ? 1.0 - ewma_weight : 0;
+      m.n = m.n * keep + dn;
+      m.x = m.x * keep + dx;
+      m.y = m.y * keep + dy;
+      m.xx = m.xx * keep + dxx;
+      m.xy = m.xy * keep + dxy;
+      _fit();
+    }
+    if (kn > 0) {
+      double v = double(ky) / kn;
+      kv_lat = have_kv_lat ? kv_lat + ewma_weight * (v - kv_lat) : v;
+      have_kv_lat = true;
+    }
+
+    uint64_t cur = size;
+    decision_t d = HOLD;
+    if (queue_util > conf.max_queue_util) {
+      d = SHRINK;
+    } else if (m.n >= conf.min_samples && kn >= conf.min_samples) {
+      if (_gain(cur) > conf.grow_ratio) {
+	d = GROW;
+      } else if (cur > 0 && _gain(cur / 2) < conf.shrink_ratio) {
+	d = SHRINK;
+      }
+    }
+
+    uint64_t s = cur;
+    if (d == GROW) {
+      s = s < conf.granularity ? conf.granularity : s * 2;
+    } else if (d == SHRINK) {
+      s = s > conf.granularity ? p2align(s / 2, conf.granularity) : 0;
+    }
+    s = _clamp(s);
+    if (s == cur) {
+      return HOLD;
+    }
+    size = s;
+    return d;
+  }
+
+  uint64_t get_size() const {
+    return size;
+  }
+  /// fitted direct write latency at the current threshold, in seconds
+  double get_device_lat() const {
+    std::lock_guard l(lock);
+    return (a + b * (double(size) / 1024)) / 1000000.0;
+  }
+  double get_kv_lat() const {
+    std::lock_guard l(lock);
+    return kv_lat / 1000000.0;
+  }
+  /// what deferring a write at the current threshold saves, see above
+  double get_gain() const {
+    std::lock_guard l(lock);
+    return _gain(size);
+  }
+};
@@ -0,0 +1,176 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <sched.h>
+
+#include "common/ceph_mutex.h"
+#include "common/likely.h"
+
+/**
+ * EpochDomain
+ *
+ * Deferred reclamation of objects published through an atomic pointer, so
+ * readers can use them without taking the lock that serializes updates.
+ *
+ * A reader holds a Guard while it loads and uses the pointer.  An updater
+ * swaps the pointer out and passes the old object to retire(); it is freed
+ * once every reader that could have loaded it has dropped its guard.
+ *
+ * Readers count themselves in per-cpu slots, under one of two parities
+ * picked by the current generation.  Reclaiming flips the generation, so
+ * new readers go to the other parity, and frees what was retired before
+ * the flip once the old parity has drained.  The generation is not flipped
+ * again until that happened.
+ *
+ * A reader reads the generation again after counting itself in, and
+ * starts over if it changed: a reader that was preempted across a flip
+ * would otherwise count itself in a parity that no longer protects the
+ * objects it goes on to load.  Once the generation read back matches, the
+ * reader is either counted in the parity the next drain check looks at,
+ * or was counted in time to hold off the drain check of the flip before,
+ * which is one the next flip waits for.  All of these accesses are
+ * sequentially consistent.  Neither side ever waits: reclaim() simply
+ * tries again later if readers are still around.
+ */
+template <typename T>
+class EpochDomain {
+  static constexpr unsigned num_slots = 64;
+
+  struct slot_t {
+    std::atomic<int64_t> readers[2] = {0, 0};
+  } __attribute__ ((aligned (128)));
+
+  slot_t slots[num_slots];
+  std::atomic<uint64_t> gen = {0};
+
+  ceph::mutex lock = ceph::make_mutex("EpochDomain::lock");
+  std::vector<const T*> pending;  ///< retired in the current generation
+  std::vector<const T*> waiting;  ///< retired before the last flip
+  unsigned waiting_parity = 0;
+  std::atomic<uint64_t> num_retired = {0};
+  void (*guard_delay)() = nullptr;  ///< test hook, see set_guard_delay()
+
+  static unsigned pick_slot() {
+    int cpu = sched_getcpu();
+    return (cpu < 0 ? 0 : cpu) % num_slots;
+  }
+
+  bool _drained(unsigned parity) const {
+    for (auto& s : slots) {
+      if (s.readers[parity].load() != 0) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void _free(std::vector<const T*>& v) {
+    for (auto p : v) {
+      delete p;
+    }
+    num_retired -= v.size();
+    v.clear();
+  }
+
+public:
+  class Guard {
+    EpochDomain *d;
+    slot_t *slot;
+    unsigned parity;
+  public:
+    explicit Guard(EpochDomain& domain)
+      : d(&domain),
+	slot(&domain.slots[pick_slot()]) {
+      uint64_t g = domain.gen.load();
+      while (true) {
+	parity = g & 1;
+	if (unlikely(domain.guard_delay != nullptr)) {
+	  domain.guard_delay();
+	}
+	slot->readers[parity].fetch_add(1);
+	uint64_t now = domain.gen.load();
+	if (now == g) {
+	  break;
+	}
+	// raced with a flip
+	slot->readers[parity].fetch_sub(1);
+	g = now;
+      }
+    }
+    ~Guard() {
+      slot->readers[parity].fetch_sub(1);
+    }
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+  };
+
+  EpochDomain() = default;
+  ~EpochDomain() {
+    std::lock_guard l(lock);
+    _free(waiting);
+    _free(pending);
+  }
+  EpochDomain(const EpochDomain&) = delete;
+  EpochDomain& operator=(const EpochDomain&) = delete;
+
+  /// free p once no reader can see it; p must be unreachable already
+  void retire(const T *p) {
+    if (!p) {
+      return;
+    }
+    std::lock_guard l(lock);
+    pending.push_back(p);
+    ++num_retired;
+    _reclaim();
+  }
+
+  /// free whatever is safe to free now
+  void reclaim() {
+    std::lock_guard l(lock);
+    _reclaim();
+  }
+
+  /// stall readers between reading the generation and registering, to
+  /// widen the window a reader can race a flip in; for tests only
+  void set_guard_delay(void (*f)()) {
+    guard_delay = f;
+  }
+
+  /// objects retired but not freed yet
+  uint64_t get_num_retired() const {
+    return num_retired;
+  }
+
+private:
+  void _reclaim() {
+    if (!waiting.empty()) {
+      if (!_drained(waiting_parity)) {
+	return;
+      }
+      _free(waiting);
+    }
+    if (pending.empty()) {
+      return;
+    }
+    waiting.swap(pending);
+    waiting_parity = gen.fetch_add(1) & 1;
+    if (_drained(waiting_parity)) {
+      _free(waiting);
+    }
+  }
+};
@@ -0,0 +1,184 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
+#include "include/spinlock.h"
+
+/**
+ * ReadaheadStream
+ *
+ * Sequential read detector, a trimmed down common/Readahead.  A stream
+ * follows one object at a time, identified by an owner tag; a read by
+ * another owner takes the stream over and starts it afresh.
+ *
+ * Once trigger_requests reads in a row each start where the previous one
+ * ended, update() returns the next extent to read ahead.  The read-ahead
+ * window starts at min_size and doubles on every issue up to max_size;
+ * the next read-ahead is issued when the reader has consumed half of the
+ * current one.  Any non-sequential read resets the stream.
+ */
+class ReadaheadStream {
+public:
+  typedef std::pair<uint64_t, uint64_t> extent_t;  ///< offset, length
+
+  struct config_t {
+    uint32_t trigger_requests = 4;
+    uint64_t min_size = 128 * 1024;
+    uint64_t max_size = 4 * 1024 * 1024;
+  };
+
+private:
+  ceph::spinlock lock;
+  uint64_t owner = 0;        ///< tag of the object being followed
+  uint64_t next_pos = 0;     ///< where the next sequential read starts
+  uint64_t ra_pos = 0;       ///< end of what was read ahead
+  uint64_t ra_trigger = 0;   ///< read ahead again once reads pass this
+  uint32_t window = 0;       ///< size of the last read-ahead
+  uint32_t nr_seq = 0;       ///< sequential reads in the current stream
+
+public:
+  /**
+   * Record a read and return the extent to read ahead, if any.
+   *
+   * @param limit object size, the read-ahead never passes it
+   * @return extent to read ahead, length 0 if none
+   */
+  extent_t update(const config_t& conf, uint64_t tag, uint64_t offset,
+		  uint64_t length, uint64_t limit) {
+    std::lock_guard l(lock);
+    if (length == 0) {
+      return {0, 0};
+    }
+    if (tag == owner && offset == next_pos && nr_seq > 0) {
+      if (nr_seq < UINT32_MAX) {
+	++nr_seq;
+      }
+    } else {
+      owner = tag;
+      nr_seq = 1;
+      ra_pos = ra_trigger = 0;
+      window = 0;
+    }
+    next_pos = offset + length;
+
+    if (nr_seq < conf.trigger_requests || next_pos < ra_trigger) {
+      return {0, 0};
+    }
+    uint64_t w = window ? uint64_t(window) * 2 : conf.min_size;
+    w = std::min(std::max(w, conf.min_size), conf.max_size);
+    uint64_t start = std::max(next_pos, ra_pos);
+    uint64_t end = std::min(next_pos + w, limit);
+    if (end <= start) {
+      return {0, 0};
+    }
+    window = std::min<uint64_t>(w, UINT32_MAX);
+    ra_pos = end;
+    ra_trigger = next_pos + (end - next_pos) / 2;
+    return {start, end - start};
+  }
+
+  /// forget a read-ahead that was not issued, so that it is retried
+  void cancel(uint64_t tag, const extent_t& e) {
+    std::lock_guard l(lock);
+    if (tag == owner && ra_pos == e.first + e.second) {
+      ra_pos = e.first;
+      ra_trigger = 0;
+    }
+  }
+
+  void reset(uint64_t tag) {
+    std::lock_guard l(lock);
+    if (tag == owner) {
+      next_pos = ra_pos = ra_trigger = 0;
+      window = nr_seq = 0;
+    }
+  }
+
+  bool is_owner(uint64_t tag) {
+    std::lock_guard l(lock);
+    return tag == owner;
+  }
+};
+
+/**
+ * ReadaheadStreamTable
+ *
+ * A fixed set of streams shared by all objects, so that objects nobody
+ * streams from carry no detector state.  The owner tag picks a set of
+ * Ways streams; an object keeps the stream it got in there, and a new one
+ * takes over the stream of the set that was used longest ago.  Up to Ways
+ * objects streamed at once through the same set each keep their own
+ * stream.
+ */
+template <size_t Sets, size_t Ways = 4>
+class ReadaheadStreamTable {
+  struct set_t {
+    ceph::spinlock lock;
+    uint64_t clock = 0;
+    std::array<uint64_t, Ways> last_used = {};
+    std::array<ReadaheadStream, Ways> ways;
+  };
+  std::array<set_t, Sets> sets;
+
+  static set_t& _set(std::array<set_t, Sets>& sets, uint64_t tag) {
+    return sets[tag % Sets];
+  }
+  /// the way owned by tag, or Ways
+  static size_t _find(set_t& s, uint64_t tag) {
+    for (size_t i = 0; i < Ways; ++i) {
+      if (s.ways[i].is_owner(tag)) {
+	return i;
+      }
+    }
+    return Ways;
+  }
+
+public:
+  /// see ReadaheadStream::update()
+  ReadaheadStream::extent_t update(const ReadaheadStream::config_t& conf,
+				   uint64_t tag, uint64_t offset,
+				   uint64_t length, uint64_t limit) {
+    auto& s = _set(sets, tag);
+    std::lock_guard l(s.lock);
+    size_t w = _find(s, tag);
+    if (w == Ways) {
+      w = std::min_element(s.last_used.begin(), s.last_used.end()) -
+	s.last_used.begin();
+    }
+    s.last_used[w] = ++s.clock;
+    return s.ways[w].update(conf, tag, offset, length, limit);
+  }
+
+  void cancel(uint64_t tag, const ReadaheadStream::extent_t& e) {
+    auto& s = _set(sets, tag);
+    std::lock_guard l(s.lock);
+    size_t w = _find(s, tag);
+    if (w < Ways) {
+      s.ways[w].cancel(tag, e);
+    }
+  }
+
+  void reset(uint64_t tag) {
+    auto& s = _set(sets, tag);
+    std::lock_guard l(s.lock);
+    size_t w = _find(s, tag);
+    if (w < Ways) {
+      s.ways[w].reset(tag);
+    }
+  }
+};
@@ -0,0 +1,359 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "SizeClassAllocator.h"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef  dout_prefix
+#define dout_prefix *_dout << "SizeClassAllocator "
+
+namespace {
+  // a light-weight "range_seg_t", only used as a key to search range_tree
+  struct range_t {
+    uint64_t start;
+    uint64_t end;
+  };
+}
+
+unsigned SizeClassAllocator::_class_of(uint64_t length) const
+{
+  uint64_t blocks = length / block_size;
+  ceph_assert(blocks > 0);
+  return std::min<unsigned>(std::bit_width(blocks) - 1, NUM_CLASSES - 1);
+}
+
+void SizeClassAllocator::_class_insert(range_seg_t& rs)
+{
+  unsigned cls = _class_of(rs.length());
+  classes[cls].insert(rs);
+  class_bytes[cls] += rs.length();
+  nonempty |= 1ull << cls;
+}
+
+void SizeClassAllocator::_class_remove(range_seg_t& rs)
+{
+  unsigned cls = _class_of(rs.length());
+  classes[cls].erase(classes[cls].iterator_to(rs));
+  class_bytes[cls] -= rs.length();
+  if (classes[cls].empty()) {
+    nonempty &= ~(1ull << cls);
+  }
+}
+
+void SizeClassAllocator::_add_to_tree(uint64_t start, uint64_t size)
+{
+  ceph_assert(size != 0);
+
+  uint64_t end = start + size;
+
+  auto rs_after = range_tree.upper_bound(range_t{start, end},
+					 range_tree.key_comp());
+
+  /* Make sure we don't overlap with either of our neighbors */
+  auto rs_before = range_tree.end();
+  if (rs_after != range_tree.begin()) {
+    rs_before = std::prev(rs_after);
+  }
+
+  bool merge_before = (rs_before != range_tree.end() && rs_before->end == start);
+  bool merge_after = (rs_after != range_tree.end() && rs_after->start == end);
+
+  if (merge_before && merge_after) {
+    _class_remove(*rs_before);
+    _class_remove(*rs_after);
+    rs_after->start = rs_before->start;
+    range_tree.erase_and_dispose(rs_before, dispose_rs{});
+    _class_insert(*rs_after);
+  } else if (merge_before) {
+    _class_remove(*rs_before);
+    rs_before->end = end;
+    _class_insert(*rs_before);
+  } else if (merge_after) {
+    _class_remove(*rs_after);
+    rs_after->start = start;
+    _class_insert(*rs_after);
+  } else {
+    auto new_rs = new range_seg_t{start, end};
+    range_tree.insert_before(rs_after, *new_rs);
+    _class_insert(*new_rs);
+  }
+  num_free += size;
+}
+
+void SizeClassAllocator::_remove_from_tree(uint64_t start, uint64_t size)
+{
+  uint64_t end = start + size;
+
+  ceph_assert(size != 0);
+  ceph_assert(size <= num_free);
+
+  auto rs = range_tree.find(range_t{start, end}, range_tree.key_comp());
+  /* Make sure we completely overlap with someone */
+  ceph_assert(rs != range_tree.end());
+  ceph_assert(rs->start <= start);
+  ceph_assert(rs->end >= end);
+
+  bool left_over = (rs->start != start);
+  bool right_over = (rs->end != end);
+
+  _class_remove(*rs);
+  if (left_over && right_over) {
+    auto new_rs = new range_seg_t{end, rs->end};
+    rs->end = start;
+    range_tree.insert_before(std::next(rs), *new_rs);
+    _class_insert(*rs);
+    _class_insert(*new_rs);
+  } else if (left_over) {
+    rs->end = start;
+    _class_insert(*rs);
+  } else if (right_over) {
+    rs->start = end;
+    _class_insert(*rs);
+  } else {
+    range_tree.erase_and_dispose(rs, dispose_rs{});
+  }
+  num_free -= size;
+}
+
+uint64_t SizeClassAllocator::_pick_in_class(unsigned cls,
+					    uint64_t size,
+					    uint64_t unit)
+{
+  unsigned n = 0;
+  for (auto rs = classes[cls].begin();
+       rs != classes[cls].end() && n < MAX_CLASS_SEARCH;
+       ++rs, ++n) {
+    uint64_t offset = p2roundup(rs->start, unit);
+    if (offset + size <= rs->end) {
+      return offset;
+    }
+  }
+  return -1ULL;
+}
+
+int SizeClassAllocator::_allocate(
+  uint64_t size,
+  uint64_t unit,
+  uint64_t *offset,
+  uint64_t *length)
+{
+  uint64_t start = -1ULL;
+
+  // the smallest class whose extents all hold size, unless misaligned
+  uint64_t blocks = std::max<uint64_t>(1, size / block_size);
+  unsigned fit_cls = std::bit_width(blocks - 1);
+  if (fit_cls < NUM_CLASSES) {
+    for (uint64_t m = nonempty & (~0ull << fit_cls);
+	 m != 0 && start == -1ULL;
+	 m &= m - 1) {
+      start = _pick_in_class(std::countr_zero(m), size, unit);
+    }
+  }
+  // the class below holds extents large enough for size, too
+  if (start == -1ULL && fit_cls > 0 &&
+      (nonempty & (1ull << (fit_cls - 1)))) {
+    start = _pick_in_class(fit_cls - 1, size, unit);
+  }
+  dout(20) << __func__ << " class fit=" << start << " size=" << size << dendl;
+
+  if (start == -1ULL) {
+    // nothing holds size in one piece, take what the largest extent offers
+    for (uint64_t m = nonempty; m != 0 && start == -1ULL; ) {
+      unsigned cls = std::bit_width(m) - 1;
+      unsigned n = 0;
+      for (auto rs = classes[cls].begin();
+	   rs != classes[cls].end() && n < MAX_CLASS_SEARCH;
+	   ++rs, ++n) {
+	uint64_t o = p2roundup(rs->start, unit);
+	if (o < rs->end && p2align(rs->end - o, unit) > 0) {
+	  start = o;
+	  size = std::min(size, p2align(rs->end - o, unit));
+	  break;
+	}
+      }
+      m &= ~(1ull << cls);
+    }
+    dout(20) << __func__ << " largest fit=" << start << " size=" << size
+	     << dendl;
+  }
+  if (start == -1ULL) {
+    return -ENOSPC;
+  }
+
+  _remove_from_tree(start, size);
+
+  *offset = start;
+  *length = size;
+  return 0;
+}
+
+void SizeClassAllocator::_shutdown()
+{
+  for (auto& c : classes) {
+    c.clear();
+  }
+  std::fill(std::begin(class_bytes), std::end(class_bytes), 0);
+  nonempty = 0;
+  range_tree.clear_and_dispose(dispose_rs{});
+  num_free = 0;
+}
+
+SizeClassAllocator::SizeClassAllocator(CephContext* cct,
+				       int64_t device_size,
+				       int64_t block_size,
+				       std::string_view name) :
+  Allocator(name, device_size, block_size),
+  cct(cct)
+{}
+
+SizeClassAllocator::~SizeClassAllocator()
+{
+  shutdown();
+}
+
+int64_t SizeClassAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint, // unused, for now!
+  PExtentVector* extents)
+{
+  ldout(cct, 10) << __func__ << std::hex
+                 << " want 0x" << want
+                 << " unit 0x" << unit
+                 << " max_alloc_size 0x" << max_alloc_size
+                 << " hint 0x" << hint
+                 << std::dec << dendl;
+  ceph_assert(std::has_single_bit(unit));
+  ceph_assert(want % unit == 0);
+
+  if (max_alloc_size == 0) {
+    max_alloc_size = want;
+  }
+  if (constexpr auto cap = std::numeric_limits<decltype(bluestore_pextent_t::length)>::max();
+      max_alloc_size >= cap) {
+    max_alloc_size = p2align(uint64_t(cap), (uint64_t)block_size);
+  }
+  std::lock_guard l(lock);
+  uint64_t allocated = 0;
+  while (allocated < want) {
+    uint64_t offset, length;
+    int r = _allocate(std::min(max_alloc_size, want - allocated),
+      unit, &offset, &length);
+    if (r < 0) {
+      // Allocation failed.
+      break;
+    }
+    extents->emplace_back(offset, length);
+    allocated += length;
+  }
+  return allocated ? allocated : -ENOSPC;
+}
+
+void SizeClassAllocator::release(const interval_set<uint64_t>& release_set)
+{
+  std::lock_guard l(lock);
+  for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+    const auto offset = p.get_start();
+    const auto length = p.get_len();
+    ceph_assert(offset + length <= uint64_t(device_size));
+    ldout(cct, 10) << __func__ << std::hex
+      << " offset 0x" << offset
+      << " length 0x" << length
+      << std::dec << dendl;
+    _add_to_tree(offset, length);
+  }
+}
+
+uint64_t SizeClassAllocator::get_free()
+{
+  std::lock_guard l(lock);
+  return num_free;
+}
+
+double SizeClassAllocator::get_fragmentation()
+{
+  std::lock_guard l(lock);
+  return _get_fragmentation();
+}
+
+double SizeClassAllocator::get_fragmentation_score()
+{
+  // class k holds extents of [2^k, 2^(k+1)) blocks, i.e. of the score grade
+  // k + log2(block_size)
+  unsigned shift = std::countr_zero(uint64_t(block_size));
+  std::lock_guard l(lock);
+  double score_sum = 0;
+  for (uint64_t m = nonempty; m != 0; m &= m - 1) {
+    unsigned cls = std::countr_zero(m);
+    score_sum += get_fragmentation_grade_score(
+      cls + shift, classes[cls].size(), class_bytes[cls]);
+  }
+  return get_fragmentation_score_of(score_sum, num_free);
+}
+
+void SizeClassAllocator::dump()
+{
+  std::lock_guard l(lock);
+  ldout(cct, 0) << __func__ << " range_tree: " << dendl;
+  for (auto& rs : range_tree) {
+    ldout(cct, 0) << std::hex
+      << "0x" << rs.start << "~" << rs.end
+      << std::dec
+      << dendl;
+  }
+  for (unsigned cls = 0; cls < NUM_CLASSES; ++cls) {
+    if (!classes[cls].empty()) {
+      ldout(cct, 0) << __func__ << " class " << cls << ": "
+		    << classes[cls].size() << " segments" << dendl;
+    }
+  }
+}
+
+void SizeClassAllocator::foreach(
+  std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  std::lock_guard l(lock);
+  for (auto& rs : range_tree) {
+    notify(rs.start, rs.end - rs.start);
+  }
+}
+
+void SizeClassAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  ldout(cct, 10) << __func__ << std::hex
+                 << " offset 0x" << offset
+                 << " length 0x" << length
+                 << std::dec << dendl;
+  if (!length)
+    return;
+  std::lock_guard l(lock);
+  ceph_assert(offset + length <= uint64_t(device_size));
+  _add_to_tree(offset, length);
+}
+
+void SizeClassAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  ldout(cct, 10) << __func__ << std::hex
+                 << " offset 0x" << offset
+                 << " length 0x" << length
+                 << std::dec << dendl;
+  if (!length)
+    return;
+  std::lock_guard l(lock);
+  ceph_assert(offset + length <= uint64_t(device_size));
+  _remove_from_tree(offset, length);
+}
+
+void SizeClassAllocator::shutdown()
+{
+  std::lock_guard l(lock);
+  _shutdown();
+}
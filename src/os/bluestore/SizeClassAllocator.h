@@ -0,0 +1,133 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <mutex>
+
+#include <boost/intrusive/avl_set.hpp>
+
+#include "Allocator.h"
+#include "AvlAllocator.h"
+#include "os/bluestore/bluestore_types.h"
+#include "include/mempool.h"
+
+/**
+ * SizeClassAllocator
+ *
+ * Free extents are segregated by size class: class k holds the extents of
+ * [2^k, 2^(k+1)) blocks, each class ordered by offset.  A request is served
+ * from the lowest address of the smallest non empty class whose extents all
+ * fit it, which is found in constant time with a bitmask of non empty
+ * classes.  Small requests thereby eat into small extents and large free
+ * extents are kept for large requests, instead of being chipped away by
+ * whatever comes first.  Only when no class is large enough is the class
+ * just below searched, and then the request is split over the largest
+ * extents left.
+ *
+ * Extents are also kept in an offset ordered tree to merge neighbours on
+ * release, like AvlAllocator, whose range_seg_t is reused.
+ *
+ * The bytes in each class are counted as well, which is all the
+ * fragmentation score needs, so it comes without walking the extents.
+ */
+class SizeClassAllocator : public Allocator {
+  struct dispose_rs {
+    void operator()(range_seg_t* p)
+    {
+      delete p;
+    }
+  };
+
+public:
+  SizeClassAllocator(CephContext* cct, int64_t device_size, int64_t block_size,
+		     std::string_view name);
+  ~SizeClassAllocator();
+  const char* get_type() const override
+  {
+    return "sizeclass";
+  }
+  int64_t allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t  hint,
+    PExtentVector *extents) override;
+  void release(const interval_set<uint64_t>& release_set) override;
+  uint64_t get_free() override;
+  double get_fragmentation() override;
+  double get_fragmentation_score() override;
+
+  void dump() override;
+  void foreach(
+    std::function<void(uint64_t offset, uint64_t length)> notify) override;
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+  void shutdown() override;
+
+private:
+  static constexpr unsigned NUM_CLASSES = 64;
+  /*
+   * Segments to look at in a class when the first one does not fit
+   * because of alignment, or when searching the class below the one
+   * that is guaranteed to fit.
+   */
+  static constexpr unsigned MAX_CLASS_SEARCH = 32;
+
+  using range_tree_t =
+    boost::intrusive::avl_set<
+      range_seg_t,
+      boost::intrusive::compare<range_seg_t::before_t>,
+      boost::intrusive::member_hook<
+	range_seg_t,
+	boost::intrusive::avl_set_member_hook<>,
+	&range_seg_t::offset_hook>>;
+  range_tree_t range_tree;    ///< all free segments, by offset
+
+  struct by_start_t {
+    bool operator()(const range_seg_t& lhs, const range_seg_t& rhs) const {
+      return lhs.start < rhs.start;
+    }
+  };
+  /// the segments of a size class by offset, linked through size_hook
+  using class_tree_t =
+    boost::intrusive::avl_set<
+      range_seg_t,
+      boost::intrusive::compare<by_start_t>,
+      boost::intrusive::member_hook<
+	range_seg_t,
+	boost::intrusive::avl_set_member_hook<>,
+	&range_seg_t::size_hook>>;
+  class_tree_t classes[NUM_CLASSES];
+  uint64_t class_bytes[NUM_CLASSES] = {0};
+  uint64_t nonempty = 0;      ///< bit k is set if classes[k] is not empty
+
+  uint64_t num_free = 0;      ///< total bytes in freelist
+
+  CephContext* cct;
+  std::mutex lock;
+
+  unsigned _class_of(uint64_t length) const;
+  void _class_insert(range_seg_t& rs);
+  void _class_remove(range_seg_t& rs);
+
+  void _add_to_tree(uint64_t start, uint64_t size);
+  void _remove_from_tree(uint64_t start, uint64_t size);
+
+  // first aligned fit among the first segments of a class
+  uint64_t _pick_in_class(unsigned cls, uint64_t size, uint64_t unit);
+  int _allocate(
+    uint64_t size,
+    uint64_t unit,
+    uint64_t *offset,
+    uint64_t *length);
+
+  double _get_fragmentation() const {
+    auto free_blocks = p2align(num_free, (uint64_t)block_size) / block_size;
+    if (free_blocks <= 1) {
+      return .0;
+    }
+    return (static_cast<double>(range_tree.size() - 1) / (free_blocks - 1));
+  }
+  void _shutdown();
+};
@@ -9,6 +9,9 @@
 #include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -290,6 +293,7 @@ int main(int argc, char **argv)
   string resharding_ctrl;
   int log_level = 30;
   bool fsck_deep = false;
+  unsigned progress_interval = 0;
   po::options_description po_options("Options");
   po_options.add_options()
     ("help,h", "produce help message")
@@ -304,6 +308,7 @@ int main(int argc, char **argv)
     ("devs-source", po::value<vector<string>>(&devs_source), "bluefs-dev-migrate source device(s)")
     ("dev-target", po::value<string>(&dev_target), "target/resulting device")
     ("deep", po::value<bool>(&fsck_deep), "deep fsck (read all data)")
+    ("progress", po::value<unsigned>(&progress_interval), "report fsck/repair progress every given number of seconds")
     ("key,k", po::value<string>(&key), "label metadata key name")
     ("value,v", po::value<string>(&value), "label metadata value")
     ("allocator", po::value<vector<string>>(&allocs_name), "allocator to inspect: 'block'/'bluefs-wal'/'bluefs-db'")
@@ -605,6 +610,33 @@ int main(int argc, char **argv)
       action == "quick-fix") {
     validate_path(cct.get(), path, false);
     BlueStore bluestore(cct.get(), path);
+
+    std::mutex progress_lock;
+    std::condition_variable progress_cond;
+    bool progress_stop = false;
+    std::thread progress_thread;
+    if (progress_interval) {
+      progress_thread = std::thread([&] {
+	std::unique_lock l(progress_lock);
+	while (!progress_cond.wait_for(l, std::chrono::seconds(progress_interval),
+				       [&] { return progress_stop; })) {
+	  BlueStore::fsck_progress_t p;
+	  bluestore.get_fsck_progress(&p);
+	  if (!p.running) {
+	    continue;
+	  }
+	  cerr << action << " " << p.phase
+	       << ": " << p.objects << " objects"
+	       << ", " << (int)(p.progress * 100) << "%"
+	       << ", elapsed " << (int)p.elapsed << "s";
+	  if (p.eta >= 0) {
+	    cerr << ", eta " << (int)p.eta << "s";
+	  }
+	  cerr << std::endl;
+	}
+      });
+    }
+
     int r;
     if (action == "fsck") {
       r = bluestore.fsck(fsck_deep);
@@ -613,6 +645,14 @@ int main(int argc, char **argv)
     } else {
       r = bluestore.quick_fix();
     }
+    if (progress_thread.joinable()) {
+      {
+	std::lock_guard l(progress_lock);
+	progress_stop = true;
+      }
+      progress_cond.notify_all();
+      progress_thread.join();
+    }
     if (r < 0) {
       cerr << action << " failed: " << cpp_strerror(r) << std::endl;
       exit(EXIT_FAILURE);
@@ -0,0 +1,344 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#include <boost/intrusive/list.hpp>
+
+#include "include/ceph_assert.h"
+#include "include/intarith.h"
+#include "include/mempool.h"
+
+/**
+ * slab_arena_t
+ *
+ * Fixed-size object allocator backing the operator new/delete of the
+ * hot BlueStore metadata objects (Onode, Extent, Blob, SharedBlob).
+ *
+ * Objects are carved out of SlabBytes-sized, SlabBytes-aligned slabs, so
+ * objects allocated close in time share pages instead of being spread
+ * over the heap, and the owning slab of any object is found by masking
+ * its address (no per-object header).
+ *
+ * Each thread keeps a small cache of free slots, so most allocations and
+ * frees take no lock at all; the cache is refilled from, and spills back
+ * to, the slabs in batches.  Slabs are kept in a few shards selected by
+ * thread, not by cache shard: onodes and blobs move between cache shards
+ * on collection split and merge, and an object may be freed from any
+ * thread.
+ *
+ * A slab is held as long as any of its objects lives, so a few survivors
+ * of an evicted working set can pin much more memory than they use.
+ * Slabs are kept small for that reason, refills take slots from the
+ * fullest slabs first, and slabs that drop below a quarter full move to
+ * the back and have their freed slots returned rather than reused by the
+ * thread cache, so that they drain and get returned to the system.  Each
+ * shard keeps at most max_spare_slabs free slabs around.
+ *
+ * Mempool bytes are accounted per slab, so that the cache autotuner sees
+ * the memory actually held, unused slots included, while items still
+ * count live objects.
+ *
+ * Arenas are immortal: objects, and the thread caches of exiting
+ * threads, may be freed at any time during process exit, so the
+ * destructor is deleted and arenas are allocated once and leaked.
+ */
+template <mempool::pool_index_t pool_ix, typename T,
+	  size_t SlabBytes = 16 * 1024>
+class slab_arena_t {
+  static_assert((SlabBytes & (SlabBytes - 1)) == 0,
+		"slab size must be a power of 2");
+
+  struct shard_t;
+
+  struct slab_t : public boost::intrusive::list_base_hook<> {
+    shard_t *shard;
+    void *free_head = nullptr;   ///< freed slots
+    uint32_t next_unused = 0;    ///< slots past this one were never handed out
+    /// slots live or in a thread cache; changed under the shard lock, read
+    /// without it by deallocate()
+    std::atomic<uint32_t> used = {0};
+    explicit slab_t(shard_t *s) : shard(s) {}
+  };
+
+  static constexpr size_t slot_align =
+    alignof(T) > alignof(void*) ? alignof(T) : alignof(void*);
+  static constexpr size_t slot_size =
+    p2roundup(sizeof(T) > sizeof(void*) ? sizeof(T) : sizeof(void*),
+	      slot_align);
+  static constexpr size_t first_slot =
+    p2roundup(sizeof(slab_t), slot_align);
+  static constexpr uint32_t slots_per_slab =
+    (SlabBytes - first_slot) / slot_size;
+  static_assert(slots_per_slab >= 4, "slab too small for the object type");
+  /// slabs this empty stop taking refills so that they can drain
+  static constexpr uint32_t sparse_slots = slots_per_slab / 4;
+
+  static constexpr size_t max_spare_slabs = 1;
+  static constexpr size_t num_shards = 8;
+
+  /// free slots a thread keeps; half of them move at once
+  static constexpr uint32_t max_cached_slots =
+    slots_per_slab < 64 ? slots_per_slab : 64;
+  static constexpr uint32_t cache_batch = max_cached_slots / 2;
+
+  typedef boost::intrusive::list<slab_t> slab_list_t;
+
+  struct shard_t {
+    std::mutex lock;
+    slab_list_t partial;  ///< slabs with both live and free slots
+    slab_list_t empty;    ///< free slabs kept around, up to max_spare_slabs
+  } __attribute__ ((aligned (128)));
+
+  struct slot_list_t {
+    void *head = nullptr;
+    uint32_t count = 0;
+  };
+
+  struct thread_cache_t {
+    slab_arena_t *arena = nullptr;  ///< the slots belong to
+    slot_list_t free;   ///< slots to allocate from
+    slot_list_t drain;  ///< slots of sparse slabs, only ever returned
+    ~thread_cache_t() {
+      if (arena) {
+	arena->_flush(*this);
+      }
+    }
+  };
+  static inline thread_local thread_cache_t thread_cache;
+
+  shard_t shards[num_shards];
+  std::atomic<size_t> slab_bytes = {0};
+  mempool::pool_t *pool = nullptr;
+  mempool::type_t *type = nullptr;
+
+  static slab_t *slab_of(void *p) {
+    return reinterpret_cast<slab_t*>(
+      reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(SlabBytes - 1));
+  }
+
+  static void *slot(slab_t *slab, uint32_t i) {
+    return reinterpret_cast<char*>(slab) + first_slot + i * slot_size;
+  }
+
+  static void push(void *&head, void *p) {
+    *reinterpret_cast<void**>(p) = head;
+    head = p;
+  }
+
+  static void *pop(void *&head) {
+    void *p = head;
+    head = *reinterpret_cast<void**>(p);
+    return p;
+  }
+
+  shard_t *pick_shard() {
+    return &shards[mempool::pool_t::pick_a_shard_int() % num_shards];
+  }
+
+  thread_cache_t &get_thread_cache() {
+    thread_cache_t &tc = thread_cache;
+    if (tc.arena != this) {
+      // another arena of the same type used this thread before
+      if (tc.arena) {
+	tc.arena->_flush(tc);
+      }
+      tc.arena = this;
+    }
+    return tc;
+  }
+
+  slab_t *_new_slab(shard_t *s) {
+    void *mem = ::aligned_alloc(SlabBytes, SlabBytes);
+    if (!mem) {
+      throw std::bad_alloc();
+    }
+    slab_bytes += SlabBytes;
+    pool->pick_a_shard()->bytes += SlabBytes;
+    return new (mem) slab_t(s);
+  }
+
+  void _free_slab(slab_t *slab) {
+    slab->~slab_t();
+    ::free(slab);
+    slab_bytes -= SlabBytes;
+    pool->pick_a_shard()->bytes -= SlabBytes;
+  }
+
+  /// move cache_batch free slots from the slabs to the thread cache
+  void _refill(slot_list_t &tc) {
+    shard_t *s = pick_shard();
+    std::unique_lock l(s->lock);
+    while (tc.count < cache_batch) {
+      if (s->partial.empty()) {
+	slab_t *slab;
+	if (!s->empty.empty()) {
+	  slab = &s->empty.front();
+	  s->empty.pop_front();
+	} else {
+	  l.unlock();
+	  slab = _new_slab(s);
+	  l.lock();
+	}
+	s->partial.push_back(*slab);
+      }
+      slab_t *slab = &s->partial.front();
+      void *p;
+      if (slab->free_head) {
+	p = pop(slab->free_head);
+      } else {
+	ceph_assert(slab->next_unused < slots_per_slab);
+	p = slot(slab, slab->next_unused++);
+      }
+      if (++slab->used == slots_per_slab) {
+	s->partial.pop_front();
+      }
+      push(tc.head, p);
+      ++tc.count;
+    }
+  }
+
+  /// return n slots of a thread cache list to their slabs
+  void _spill(slot_list_t &tc, uint32_t n) {
+    ceph_assert(n <= tc.count);
+    slab_list_t to_free;
+    shard_t *locked = nullptr;
+    std::unique_lock<std::mutex> l;
+    for (; n > 0; --n) {
+      void *p = pop(tc.head);
+      --tc.count;
+      slab_t *slab = slab_of(p);
+      shard_t *s = slab->shard;
+      if (s != locked) {
+	if (l.owns_lock()) {
+	  l.unlock();
+	}
+	l = std::unique_lock(s->lock);
+	locked = s;
+      }
+      ceph_assert(slab->used > 0);
+      push(slab->free_head, p);
+      --slab->used;
+      if (slab->used == slots_per_slab - 1) {
+	// mostly used slabs go first so that allocations keep them packed
+	s->partial.push_front(*slab);
+      } else if (slab->used == 0) {
+	s->partial.erase(s->partial.iterator_to(*slab));
+	if (s->empty.size() < max_spare_slabs) {
+	  s->empty.push_back(*slab);
+	} else {
+	  to_free.push_back(*slab);
+	}
+      } else if (slab->used == sparse_slots) {
+	s->partial.erase(s->partial.iterator_to(*slab));
+	s->partial.push_back(*slab);
+      }
+    }
+    if (l.owns_lock()) {
+      l.unlock();
+    }
+    to_free.clear_and_dispose([this](slab_t *slab) {
+      _free_slab(slab);
+    });
+  }
+
+  void _flush(thread_cache_t &tc) {
+    _spill(tc.free, tc.free.count);
+    _spill(tc.drain, tc.drain.count);
+  }
+
+public:
+  slab_arena_t() {
+    pool = &mempool::get_pool(pool_ix);
+    type = pool->get_type(typeid(T), sizeof(T));
+  }
+  ~slab_arena_t() = delete;
+  slab_arena_t(const slab_arena_t&) = delete;
+  slab_arena_t& operator=(const slab_arena_t&) = delete;
+
+  void *allocate() {
+    slot_list_t &tc = get_thread_cache().free;
+    if (!tc.head) {
+      _refill(tc);
+    }
+    void *p = pop(tc.head);
+    --tc.count;
+
+    pool->pick_a_shard()->items += 1;
+    type->items += 1;
+    return p;
+  }
+
+  void deallocate(void *p) {
+    pool->pick_a_shard()->items -= 1;
+    type->items -= 1;
+
+    thread_cache_t &tc = get_thread_cache();
+    // a slot of a sparse slab is not handed out again, or a steady trickle
+    // of allocations and frees would keep that slab from ever draining
+    if (slab_of(p)->used.load(std::memory_order_relaxed) <= sparse_slots) {
+      push(tc.drain.head, p);
+      if (++tc.drain.count >= cache_batch) {
+	_spill(tc.drain, tc.drain.count);
+      }
+      return;
+    }
+    push(tc.free.head, p);
+    if (++tc.free.count > max_cached_slots) {
+      _spill(tc.free, tc.free.count - cache_batch);
+    }
+  }
+
+  /// return the free slots cached by this thread to their slabs
+  void flush_thread_cache() {
+    _flush(get_thread_cache());
+  }
+
+  /// memory currently held in slabs, including unused slots
+  size_t get_slab_bytes() const {
+    return slab_bytes;
+  }
+
+  static constexpr size_t get_slab_size() {
+    return SlabBytes;
+  }
+
+  static constexpr uint32_t get_slots_per_slab() {
+    return slots_per_slab;
+  }
+
+  static constexpr size_t get_slot_size() {
+    return slot_size;
+  }
+};
+
+// Use this in a .cc file instead of MEMPOOL_DEFINE_OBJECT_FACTORY to
+// back a class with MEMPOOL_CLASS_HELPERS() by a slab_arena_t.
+#define MEMPOOL_DEFINE_SLAB_OBJECT_FACTORY(obj, factoryname, pool)	\
+  namespace mempool {							\
+    namespace pool {							\
+      slab_arena_t<id, obj>& slab_##factoryname =			\
+	*new slab_arena_t<id, obj>;					\
+    }									\
+  }									\
+  void *obj::operator new(size_t size) {				\
+    ceph_assert(size == sizeof(obj));					\
+    return mempool::pool::slab_##factoryname.allocate();		\
+  }									\
+  void obj::operator delete(void *p)  {					\
+    mempool::pool::slab_##factoryname.deallocate(p);			\
+  }
@@ -537,6 +537,41 @@ int MemStore::omap_get_values(
   return 0;
 }
 
+int MemStore::omap_get_range(
+  CollectionHandle& ch,
+  const ghobject_t &oid,
+  const std::string &start_after,
+  const std::string &filter_prefix,
+  uint64_t max_keys,
+  uint64_t max_bytes,
+  ceph::buffer::list *out,
+  uint32_t *num,
+  bool *more)
+{
+  dout(10) << __func__ << " " << ch->cid << " " << oid << dendl;
+  *num = 0;
+  *more = false;
+  Collection *c = static_cast<Collection*>(ch.get());
+  ObjectRef o = c->get_object(oid);
+  if (!o)
+    return -ENOENT;
+  std::lock_guard lock{o->omap_mutex};
+  auto p = filter_prefix > start_after ?
+    o->omap.lower_bound(filter_prefix) : o->omap.upper_bound(start_after);
+  for (; p != o->omap.end(); ++p) {
+    if (p->first.compare(0, filter_prefix.size(), filter_prefix) != 0)
+      break;
+    if (*num >= max_keys || out->length() >= max_bytes) {
+      *more = true;
+      break;
+    }
+    encode(p->first, *out);
+    encode(p->second, *out);
+    ++*num;
+  }
+  return 0;
+}
+
 #ifdef WITH_SEASTAR
 int MemStore::omap_get_values(
   CollectionHandle& ch,                    ///< [in] Collection containing oid
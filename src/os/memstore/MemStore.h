@@ -372,6 +372,18 @@ public:
     ) override;
 #endif
 
+  int omap_get_range(
+    CollectionHandle& c,
+    const ghobject_t &oid,
+    const std::string &start_after,
+    const std::string &filter_prefix,
+    uint64_t max_keys,
+    uint64_t max_bytes,
+    ceph::buffer::list *out,
+    uint32_t *num,
+    bool *more
+    ) override;
+
   using ObjectStore::omap_check_keys;
   /// Filters keys into out which are defined on oid
   int omap_check_keys(
@@ -1733,6 +1733,20 @@ void OSDService::queue_for_snap_trim(PG *pg)
       pg->get_osdmap_epoch()));
 }
 
+void OSDService::queue_for_defrag(PG *pg)
+{
+  dout(10) << "queueing " << *pg << " for defrag" << dendl;
+  enqueue_back(
+    OpSchedulerItem(
+      unique_ptr<OpSchedulerItem::OpQueueable>(
+	new PGDefrag(pg->get_pgid(), pg->get_osdmap_epoch())),
+      cct->_conf.get_val<Option::size_t>("osd_defrag_cost"),
+      cct->_conf.get_val<uint64_t>("osd_defrag_priority"),
+      ceph_clock_now(),
+      0,
+      pg->get_osdmap_epoch()));
+}
+
 template <class MSG_TYPE>
 void OSDService::queue_scrub_event_msg(PG* pg,
 				       Scrub::scrub_prio_t with_priority,
@@ -2779,6 +2793,10 @@ will start to track new ops received afterwards.";
     f->open_object_section("pq");
     op_shardedwq.dump(f);
     f->close_section();
+  } else if (prefix == "dump_mclock_capacity") {
+    f->open_object_section("mclock_capacity");
+    dump_mclock_capacity(f);
+    f->close_section();
   } else if (prefix == "dump_blocklist") {
     list<pair<entity_addr_t,utime_t> > bl;
     list<pair<entity_addr_t,utime_t> > rbl;
@@ -4056,6 +4074,11 @@ void OSD::final_init()
 				     asok_hook,
 				     "dump op queue state");
   ceph_assert(r == 0);
+  r = admin_socket->register_command("dump_mclock_capacity",
+				     asok_hook,
+				     "dump the OSD capacity used by mclock, configured"
+				     " and estimated");
+  ceph_assert(r == 0);
   r = admin_socket->register_command("dump_blocklist",
 				     asok_hook,
 				     "dump blocklisted clients and times");
@@ -5349,6 +5372,65 @@ static vector<int32_t> twiddle(const vector<int>& acting) {
   }
 }
 
+void OSD::sched_defrag()
+{
+  double interval = cct->_conf.get_val<double>("osd_defrag_interval");
+  if (interval <= 0) {
+    return;
+  }
+  const auto now = ceph::coarse_mono_clock::now();
+  if (now - last_defrag < ceph::make_timespan(interval)) {
+    return;
+  }
+  last_defrag = now;
+
+  vector<PGRef> pgs;
+  _get_pgs(&pgs);
+  if (pgs.empty()) {
+    return;
+  }
+  // PG::defrag_chunk() only rewrites the copies that serve reads.  Tell
+  // them from the map, as the PGs' own state needs their locks.
+  OSDMapRef osdmap = get_osdmap();
+  auto serves_reads = [&](const spg_t& pgid) {
+    const pg_pool_t *pool = osdmap->get_pg_pool(pgid.pool());
+    if (!pool) {
+      return false;
+    }
+    vector<int> acting;
+    int primary;
+    osdmap->pg_to_acting_osds(pgid.pgid, &acting, &primary);
+    if (pool->is_erasure()) {
+      return pgid.shard != shard_id_t::NO_SHARD &&
+	pgid.shard < (int)acting.size() &&
+	acting[pgid.shard] == whoami;
+    }
+    return primary == whoami;
+  };
+  PGRef next, first;
+  for (auto& pg : pgs) {
+    const spg_t& pgid = pg->get_pgid();
+    if (!serves_reads(pgid)) {
+      continue;
+    }
+    if (!first || pgid < first->get_pgid()) {
+      first = pg;
+    }
+    if (last_defrag_pgid < pgid &&
+	(!next || pgid < next->get_pgid())) {
+      next = pg;
+    }
+  }
+  if (!next) {
+    next = first;
+  }
+  if (!next) {
+    return;
+  }
+  last_defrag_pgid = next->get_pgid();
+  service.queue_for_defrag(next.get());
+}
+
 void OSD::resume_creating_pg()
 {
   bool do_sub_pg_creates = false;
@@ -6284,6 +6366,7 @@ void OSD::tick_without_osd_lock()
   if (is_active()) {
     service.get_scrub_services().initiate_scrub(service.is_recovery_active());
     service.promote_throttle_recalibrate();
+    sched_defrag();
     resume_creating_pg();
     bool need_send_beacon = false;
     const auto now = ceph::coarse_mono_clock::now();
@@ -6301,6 +6384,7 @@ void OSD::tick_without_osd_lock()
     }
   }
 
+  update_mclock_capacity_estimate();
   mgrc.update_daemon_health(get_health_metrics());
   service.kick_recovery_queue();
   tick_timer_without_osd_lock.add_event_after(get_tick_interval(),
@@ -9549,11 +9633,33 @@ void OSD::enqueue_op(spg_t pg, OpRequestRef&& op, epoch_t epoch)
       OpSchedulerItem(
         unique_ptr<OpSchedulerItem::OpQueueable>(new PGRecoveryMsg(pg, std::move(op))),
         cost, priority, stamp, owner, epoch));
+    return;
+  }
+
+  OpSchedulerItem::client_qos_t client_qos;
+  // only pure reads may take the fast path; anything that writes goes
+  // through the queue so it is not reordered against the pg's other ops
+  bool fast_read = false;
+  if (type == CEPH_MSG_OSD_OP) {
+    auto m = op->get_req<MOSDOp>();
+    fast_read = op_shardedwq.fast_read_enabled() &&
+      (m->get_flags() & CEPH_OSD_FLAG_READ) &&
+      !(m->get_flags() & CEPH_OSD_FLAG_WRITE);
+    client_qos.pool = pg.pool();
+    if (m->has_qos_params()) {
+      client_qos.tracked = true;
+      client_qos.delta = m->get_qos_delta();
+      client_qos.rho = m->get_qos_rho();
+    }
+  }
+  OpSchedulerItem item(
+    unique_ptr<OpSchedulerItem::OpQueueable>(new PGOpItem(pg, std::move(op))),
+    cost, priority, stamp, owner, epoch);
+  item.set_client_qos(client_qos);
+  if (fast_read) {
+    op_shardedwq.queue_fast_read(std::move(item));
   } else {
-    op_shardedwq.queue(
-      OpSchedulerItem(
-        unique_ptr<OpSchedulerItem::OpQueueable>(new PGOpItem(pg, std::move(op))),
-        cost, priority, stamp, owner, epoch));
+    op_shardedwq.queue(std::move(item));
   }
 }
 
@@ -9964,6 +10070,144 @@ void OSD::maybe_override_max_osd_capacity_for_qos()
   }
 }
 
+static void get_configured_capacity_for_qos(
+  CephContext *cct,
+  bool rotational,
+  double *iops,
+  double *bandwidth,
+  double *threshold_iops)
+{
+  const char *type = rotational ? "hdd" : "ssd";
+  *iops = cct->_conf.get_val<double>(
+    fmt::format("osd_mclock_max_capacity_iops_{}", type));
+  *bandwidth = cct->_conf.get_val<Option::size_t>(
+    fmt::format("osd_mclock_max_sequential_bandwidth_{}", type));
+  *threshold_iops = cct->_conf.get_val<double>(
+    fmt::format("osd_mclock_iops_capacity_threshold_{}", type));
+}
+
+void OSD::update_mclock_capacity_estimate()
+{
+  const bool enabled =
+    cct->_conf.get_val<std::string>("osd_op_queue") == "mclock_scheduler" &&
+    cct->_conf.get_val<bool>("osd_mclock_capacity_estimator") &&
+    !unsupported_objstore_for_qos();
+
+  std::lock_guard l(mclock_capacity_lock);
+  if (!enabled) {
+    if (mclock_applied_iops > 0) {
+      dout(1) << __func__ << " reverting to the configured capacity" << dendl;
+      for (auto s : shards) {
+	s->set_capacity_estimate(0, 0);
+      }
+      mclock_applied_iops = 0;
+      mclock_applied_bandwidth = 0;
+    }
+    mclock_capacity_estimator.reset();
+    return;
+  }
+
+  const double now = std::chrono::duration<double>(
+    ceph::mono_clock::now().time_since_epoch()).count();
+  if (now - mclock_capacity_estimator.get_last_time() <
+      cct->_conf.get_val<double>("osd_mclock_capacity_estimator_interval")) {
+    return;
+  }
+  ObjectStore::commit_stats_t stats;
+  if (store->get_commit_stats(&stats) < 0) {
+    return;
+  }
+
+  double cfg_iops, cfg_bandwidth, threshold_iops;
+  get_configured_capacity_for_qos(cct, store_is_rotational,
+    &cfg_iops, &cfg_bandwidth, &threshold_iops);
+  double cur_iops = cfg_iops;
+  double cur_bandwidth = cfg_bandwidth;
+  if (mclock_applied_iops > 0) {
+    cur_iops = mclock_applied_iops;
+    cur_bandwidth = mclock_applied_bandwidth;
+  }
+  // reads and writes take the same device time, so both count
+  mClockCapacityEstimator::params_t params;
+  params.min_queue_depth =
+    cct->_conf.get_val<double>("osd_mclock_capacity_estimator_min_queue_depth");
+  params.given_bandwidth = cur_bandwidth;
+  params.configured_iops = cfg_iops;
+  params.configured_bandwidth = cfg_bandwidth;
+  params.stale_age =
+    cct->_conf.get_val<double>("osd_mclock_capacity_estimator_stale_age");
+  if (!mclock_capacity_estimator.add_sample(
+	now, stats.txcs + stats.reads, stats.commit_lat_ns + stats.read_lat_ns,
+	stats.bytes + stats.read_bytes, params)) {
+    return;
+  }
+
+  // same upper bound as for the bench results, and not far below the
+  // configured or benched capacity.  the bandwidth is the sequential one,
+  // which the fit cannot exceed
+  const double min_ratio =
+    cct->_conf.get_val<double>("osd_mclock_capacity_estimator_min_ratio");
+  const double iops = std::max(
+    std::min(mclock_capacity_estimator.get_iops(), threshold_iops),
+    std::min(cfg_iops * min_ratio, threshold_iops));
+  const double bandwidth = std::clamp(
+    mclock_capacity_estimator.get_bandwidth(),
+    cfg_bandwidth * min_ratio, cfg_bandwidth);
+  const double hysteresis =
+    cct->_conf.get_val<double>("osd_mclock_capacity_estimator_hysteresis");
+  auto moved = [hysteresis](double estimate, double cur) {
+    return std::abs(estimate - cur) > hysteresis * cur;
+  };
+  if (mclock_capacity_estimator.is_stale() && mclock_applied_iops > 0 &&
+      !moved(iops, cfg_iops) && !moved(bandwidth, cfg_bandwidth)) {
+    dout(1) << __func__ << " estimate is stale, reverting to the configured "
+	    << "capacity" << dendl;
+    for (auto s : shards) {
+      s->set_capacity_estimate(0, 0);
+    }
+    mclock_applied_iops = 0;
+    mclock_applied_bandwidth = 0;
+    return;
+  }
+  if (!moved(iops, cur_iops) && !moved(bandwidth, cur_bandwidth)) {
+    return;
+  }
+
+  dout(1) << __func__ << std::fixed << std::setprecision(2)
+	  << " capacity iops " << cur_iops << " -> " << iops
+	  << ", bandwidth (MiB/sec) " << cur_bandwidth / (1024 * 1024)
+	  << " -> " << bandwidth / (1024 * 1024) << dendl;
+  for (auto s : shards) {
+    s->set_capacity_estimate(iops, bandwidth);
+  }
+  mclock_applied_iops = iops;
+  mclock_applied_bandwidth = bandwidth;
+}
+
+void OSD::dump_mclock_capacity(Formatter *f)
+{
+  double iops, bandwidth, threshold_iops;
+  get_configured_capacity_for_qos(cct, store_is_rotational,
+    &iops, &bandwidth, &threshold_iops);
+
+  std::lock_guard l(mclock_capacity_lock);
+  f->dump_bool("estimator_enabled",
+    cct->_conf.get_val<bool>("osd_mclock_capacity_estimator"));
+  f->open_object_section("configured");
+  f->dump_float("iops", iops);
+  f->dump_float("bandwidth", bandwidth);
+  f->close_section();
+  f->open_object_section("estimated");
+  mclock_capacity_estimator.dump(*f);
+  f->close_section();
+  f->open_object_section("in_use");
+  f->dump_bool("estimated", mclock_applied_iops > 0);
+  f->dump_float("iops", mclock_applied_iops > 0 ? mclock_applied_iops : iops);
+  f->dump_float("bandwidth",
+    mclock_applied_iops > 0 ? mclock_applied_bandwidth : bandwidth);
+  f->close_section();
+}
+
 bool OSD::maybe_override_options_for_qos(const std::set<std::string> *changed)
 {
   // Override options only if the scheduler enabled is mclock and the
@@ -10364,6 +10608,7 @@ void OSDShard::consume_map(
     old_osdmap = std::move(shard_osdmap);
     shard_osdmap = new_osdmap;
   }
+  scheduler->update_from_osdmap(*new_osdmap);
   dout(10) << new_osdmap->get_epoch()
            << " (was " << (old_osdmap ? old_osdmap->get_epoch() : 0) << ")"
 	   << dendl;
@@ -10441,6 +10686,12 @@ void OSDShard::consume_map(
   }
 }
 
+void OSDShard::set_capacity_estimate(double iops, double bandwidth)
+{
+  std::lock_guard l(shard_lock);
+  scheduler->set_capacity_estimate(iops, bandwidth);
+}
+
 int OSDShard::_wake_pg_slot(
   spg_t pgid,
   OSDShardPGSlot *slot)
@@ -10701,6 +10952,14 @@ OSDShard::OSDShard(
     context_queue(sdata_wait_lock, sdata_cond)
 {
   dout(0) << "using op scheduler " << *scheduler << dendl;
+  logger = build_osd_shard_perf(cct, "osd_shard." + stringify(id));
+  cct->get_perfcounters_collection()->add(logger);
+}
+
+OSDShard::~OSDShard()
+{
+  cct->get_perfcounters_collection()->remove(logger);
+  delete logger;
 }
 
 
@@ -10734,11 +10993,55 @@ void OSD::ShardedOpWQ::_add_slot_waiter(
 #undef dout_prefix
 #define dout_prefix *_dout << "osd." << osd->whoami << " op_wq(" << shard_index << ") "
 
+OSDShard *OSD::ShardedOpWQ::_steal(uint32_t shard_index)
+{
+  for (uint32_t i = 1; i < osd->num_shards; i++) {
+    auto victim = osd->shards[(shard_index + i) % osd->num_shards];
+    if (!victim->stealable || victim->idle_threads > 0) {
+      // nothing queued behind busy threads, or it has threads of its own
+      // to run whatever is queued
+      continue;
+    }
+    // never wait for another shard's lock, we hold our own
+    if (!victim->shard_lock.try_lock()) {
+      continue;
+    }
+    if (!victim->scheduler->empty()) {
+      return victim;
+    }
+    victim->stealable = false;
+    victim->shard_lock.unlock();
+  }
+  return nullptr;
+}
+
+void OSD::ShardedOpWQ::_wake_thief(uint32_t shard_index)
+{
+  if (m_thieves > 0) {
+    // one is at it already, and looks again once done with its item
+    return;
+  }
+  for (uint32_t i = 1; i < osd->num_shards; i++) {
+    auto s = osd->shards[(shard_index + i) % osd->num_shards];
+    if (s->idle_threads > 0) {
+      std::lock_guard l{s->sdata_wait_lock};
+      s->sdata_cond.notify_all();
+      return;
+    }
+  }
+}
+
 void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 {
   uint32_t shard_index = thread_index % osd->num_shards;
-  auto& sdata = osd->shards[shard_index];
+  OSDShard *sdata = osd->shards[shard_index];
   ceph_assert(sdata);
+  OSDShard *thief = nullptr;
+  auto stop_stealing = make_scope_guard([&] {
+    if (thief) {
+      --m_thieves;
+    }
+  });
 
   // If all threads of shards do oncommits, there is a out-of-order
   // problem.  So we choose the thread which has the smallest
@@ -10751,14 +11054,31 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
   if (sdata->scheduler->empty() &&
       (!is_smallest_thread_index || sdata->context_queue.empty())) {
     std::unique_lock wait_lock{sdata->sdata_wait_lock};
+    OSDShard *victim = nullptr;
     if (is_smallest_thread_index && !sdata->context_queue.empty()) {
       // we raced with a context_queue addition, don't wait
       wait_lock.unlock();
+    } else if (!sdata->stop_waiting && m_steal &&
+	       (victim = _steal(shard_index))) {
+      // run the victim's next item on its behalf.  everything below goes
+      // through the victim's pg slot and pg lock as if one of its own
+      // threads had dequeued the item, so per-pg ordering is kept.
+      dout(20) << __func__ << " empty q, stealing from shard "
+	       << victim->shard_id << dendl;
+      wait_lock.unlock();
+      sdata->shard_lock.unlock();
+      ++m_thieves;
+      thief = sdata;
+      sdata = victim;
+      is_smallest_thread_index = false;
     } else if (!sdata->stop_waiting) {
       dout(20) << __func__ << " empty q, waiting" << dendl;
       osd->cct->get_heartbeat_map()->clear_timeout(hb);
       sdata->shard_lock.unlock();
+      // with stealing, _enqueue() on a busy shard may wake us as well
+      ++sdata->idle_threads;
       sdata->sdata_cond.wait(wait_lock);
+      --sdata->idle_threads;
       wait_lock.unlock();
       sdata->shard_lock.lock();
       if (sdata->scheduler->empty() &&
@@ -10811,6 +11131,25 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
     // If the work item is scheduled in the future, wait until
     // the time returned in the dequeue response before retrying.
     if (auto when_ready = std::get_if<double>(&work_item)) {
+      if (thief) {
+	// not ours to wait for, leave that to the victim's threads and wait
+	// on our own shard until there is something new, here or to steal
+	sdata->stealable = false;
+	sdata->shard_lock.unlock();
+	OSDShard *own = thief;
+	thief = nullptr;
+	--m_thieves;
+	own->shard_lock.lock();
+	bool empty = own->scheduler->empty();
+	std::unique_lock wait_lock{own->sdata_wait_lock};
+	own->shard_lock.unlock();
+	if (empty && !own->stop_waiting) {
+	  ++own->idle_threads;
+	  own->sdata_cond.wait(wait_lock);
+	  --own->idle_threads;
+	}
+	return;
+      }
       if (is_smallest_thread_index) {
         sdata->shard_lock.unlock();
         handle_oncommits(oncommits);
@@ -10849,6 +11188,11 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
     return;    // OSD shutdown, discard.
   }
 
+  if (thief) {
+    thief->logger->inc(l_osd_shard_steal);
+    sdata->logger->inc(l_osd_shard_stolen);
+  }
+
   const auto token = item.get_ordering_token();
   auto r = sdata->pg_slots.emplace(token, nullptr);
   if (r.second) {
@@ -11056,7 +11400,10 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
   delete f;
   *_dout << dendl;
 
+  auto run_start = ceph::mono_clock::now();
   qi.run(osd, sdata, pg, tp_handle);
+  sdata->logger->inc(l_osd_shard_ops);
+  sdata->logger->tinc(l_osd_shard_busy, ceph::mono_clock::now() - run_start);
 
   {
 #ifdef WITH_LTTNG
@@ -11101,6 +11448,109 @@ void OSD::ShardedOpWQ::_enqueue(OpSchedulerItem&& item) {
       sdata->sdata_cond.notify_one();
     }
   }
+  if (m_steal && sdata->idle_threads == 0) {
+    // none of its own threads is free to take it
+    sdata->stealable = true;
+    _wake_thief(shard_index);
+  }
+}
+
+OSD::ShardedOpWQ::~ShardedOpWQ()
+{
+  for (auto& [tid, hb] : fast_read_hbs) {
+    osd->cct->get_heartbeat_map()->remove_worker(hb);
+  }
+}
+
+ceph::heartbeat_handle_d *OSD::ShardedOpWQ::_get_fast_read_hb()
+{
+  std::lock_guard l{fast_read_hb_lock};
+  auto [p, inserted] = fast_read_hbs.emplace(pthread_self(), nullptr);
+  if (inserted) {
+    p->second = osd->cct->get_heartbeat_map()->add_worker(
+      "OSD::fast_read", pthread_self());
+  }
+  return p->second;
+}
+
+void OSD::ShardedOpWQ::queue_fast_read(OpSchedulerItem&& item)
+{
+  if (unlikely(m_fast_shutdown)) {
+    return;
+  }
+
+  const auto token = item.get_ordering_token();
+  uint32_t shard_index = token.hash_to_shard(osd->shards.size());
+  OSDShard *sdata = osd->shards[shard_index];
+  ceph_assert(sdata);
+
+  // only when the shard is idle and nothing is queued or running for the
+  // pg.  ops from one client are dispatched one after the other, so then
+  // all the ops of this client to the pg that came before have been
+  // processed, and holding the pg lock keeps any later op behind us.
+  PGRef pg;
+  sdata->shard_lock.lock();
+  auto p = sdata->pg_slots.find(token);
+  if (sdata->scheduler->empty() &&
+      p != sdata->pg_slots.end() &&
+      p->second->pg &&
+      p->second->to_process.empty() &&
+      p->second->waiting.empty() &&
+      p->second->waiting_peering.empty() &&
+      p->second->waiting_for_split.empty() &&
+      p->second->num_running == 0 &&
+      p->second->pg->try_lock()) {
+    pg = p->second->pg;
+  }
+  sdata->shard_lock.unlock();
+  if (!pg) {
+    _enqueue(std::move(item));
+    return;
+  }
+
+  std::optional<OpRequestRef> op = item.maybe_get_op();
+  ceph_assert(op);
+  if (!pg->can_fast_read(*op, m_fast_read_max_bytes)) {
+    pg->unlock();
+    _enqueue(std::move(item));
+    return;
+  }
+
+  // still pass the op through the scheduler, so that mclock charges it to
+  // its client and may hold it back like any other op
+  sdata->shard_lock.lock();
+  if (!sdata->scheduler->empty()) {
+    sdata->shard_lock.unlock();
+    pg->unlock();
+    _enqueue(std::move(item));
+    return;
+  }
+  sdata->scheduler->enqueue(std::move(item));
+  WorkItem work_item = sdata->scheduler->dequeue();
+  if (!std::get_if<OpSchedulerItem>(&work_item)) {
+    // not due yet, leave it to the shard threads
+    dout(20) << __func__ << " " << token << " not due, queued" << dendl;
+    sdata->shard_lock.unlock();
+    pg->unlock();
+    std::lock_guard l{sdata->sdata_wait_lock};
+    sdata->sdata_cond.notify_all();
+    return;
+  }
+  auto qi = std::move(std::get<OpSchedulerItem>(work_item));
+  sdata->shard_lock.unlock();
+
+  dout(20) << __func__ << " " << qi << " pg " << pg << dendl;
+  auto hb = _get_fast_read_hb();
+  ThreadPool::TPHandle tp_handle(osd->cct, hb, timeout_interval.load(),
+				 suicide_interval.load());
+  osd->cct->get_heartbeat_map()->reset_timeout(
+    hb, timeout_interval.load(), suicide_interval.load());
+  auto run_start = ceph::mono_clock::now();
+  qi.run(osd, sdata, pg, tp_handle);  // unlocks pg
+  sdata->logger->inc(l_osd_shard_ops);
+  sdata->logger->tinc(l_osd_shard_busy, ceph::mono_clock::now() - run_start);
+  osd->logger->inc(l_osd_op_fast_read);
+  osd->cct->get_heartbeat_map()->clear_timeout(hb);
 }
 
 void OSD::ShardedOpWQ::_enqueue_front(OpSchedulerItem&& item)
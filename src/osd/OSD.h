@@ -39,6 +39,7 @@
 #include "Session.h"
 
 #include "osd/scheduler/OpScheduler.h"
+#include "osd/scheduler/mClockCapacityEstimator.h"
 
 #include <atomic>
 #include <map>
@@ -500,6 +501,7 @@ public:
                               uint64_t cost,
 			      int priority);
   void queue_for_snap_trim(PG *pg);
+  void queue_for_defrag(PG *pg);
   void queue_for_scrub(PG* pg, Scrub::scrub_prio_t with_priority);
 
   void queue_scrub_after_repair(PG* pg, Scrub::scrub_prio_t with_priority);
@@ -969,6 +971,16 @@ struct OSDShard {
   ceph::condition_variable sdata_cond;
   int waiting_threads = 0;
 
+  /// threads waiting for this shard's queue to fill; read without locks by
+  /// threads of other shards looking for work to steal
+  std::atomic<int> idle_threads = 0;
+  /// set when an item is queued while all of this shard's threads are busy,
+  /// cleared by a thread of another shard that finds nothing to take; only
+  /// a hint, read without locks
+  std::atomic<bool> stealable = false;
+
+  PerfCounters *logger;
+
   ceph::mutex osdmap_lock;  ///< protect shard_osdmap updates vs users w/o shard_lock
   OSDMapRef shard_osdmap;
 
@@ -1024,6 +1036,9 @@ struct OSDShard {
     const OSDMapRef& osdmap,
     unsigned *pushes_to_free);
 
+  /// pass an estimate of the OSD capacity to the scheduler
+  void set_capacity_estimate(double iops, double bandwidth);
+
   int _wake_pg_slot(spg_t pgid, OSDShardPGSlot *slot);
 
   void identify_splits_and_merges(
@@ -1044,6 +1059,7 @@ struct OSDShard {
     int id,
     CephContext *cct,
     OSD *osd);
+  ~OSDShard();
 };
 
 class OSD : public Dispatcher,
@@ -1099,6 +1115,14 @@ protected:
   bool store_is_rotational = true;
   bool journal_is_rotational = true;
 
+  /// the mClock capacity estimated from the store, see
+  /// update_mclock_capacity_estimate()
+  ceph::mutex mclock_capacity_lock =
+    ceph::make_mutex("OSD::mclock_capacity_lock");
+  ceph::osd::scheduler::mClockCapacityEstimator mclock_capacity_estimator;
+  double mclock_applied_iops = 0;       ///< in use by the shards, 0 if none
+  double mclock_applied_bandwidth = 0;  ///< in use by the shards, 0 if none
+
   ZTracer::Endpoint trace_endpoint;
   PerfCounters* create_logger();
   PerfCounters* create_recoverystate_perf();
@@ -1542,14 +1566,37 @@ protected:
   {
     OSD *osd;
     bool m_fast_shutdown = false;
+    const bool m_steal;
+    std::atomic<unsigned> m_thieves = {0}; ///< threads running stolen items
+
+    /// find a shard whose threads are all busy and that has items queued,
+    /// return it with its shard_lock held
+    OSDShard *_steal(uint32_t shard_index);
+    /// wake idle threads of another shard to steal from this one
+    void _wake_thief(uint32_t shard_index);
+
+    const bool m_fast_read;
+    const uint64_t m_fast_read_max_bytes;
+    /// heartbeat handles of the threads that ran fast reads
+    ceph::mutex fast_read_hb_lock =
+      ceph::make_mutex("OSD::ShardedOpWQ::fast_read_hb_lock");
+    std::map<pthread_t, ceph::heartbeat_handle_d*> fast_read_hbs;
+
+    ceph::heartbeat_handle_d *_get_fast_read_hb();
+
   public:
     ShardedOpWQ(OSD *o,
 		ceph::timespan ti,
 		ceph::timespan si,
 		ShardedThreadPool* tp)
       : ShardedThreadPool::ShardedWQ<OpSchedulerItem>(ti, si, tp),
-        osd(o) {
+        osd(o),
+        m_steal(o->cct->_conf.get_val<bool>("osd_op_queue_steal")),
+        m_fast_read(o->cct->_conf.get_val<bool>("osd_op_fast_read")),
+        m_fast_read_max_bytes(o->cct->_conf.get_val<Option::size_t>(
+          "osd_op_fast_read_max_bytes")) {
     }
+    ~ShardedOpWQ() override;
 
     void _add_slot_waiter(
       spg_t token,
@@ -1564,6 +1611,13 @@ protected:
     /// enqueue a new item
     void _enqueue(OpSchedulerItem&& item) override;
 
+    bool fast_read_enabled() const {
+      return m_fast_read;
+    }
+    /// run a client read right away in the calling thread if nothing is
+    /// queued ahead of it, else enqueue it
+    void queue_fast_read(OpSchedulerItem&& item);
+
     /// requeue an old item (at the front of the line)
     void _enqueue_front(OpSchedulerItem&& item) override;
 
@@ -1750,6 +1804,11 @@ protected:
 			     spg_t pgid, bool is_mon_create);
   void resume_creating_pg();
 
+  // -- defrag --
+  ceph::coarse_mono_clock::time_point last_defrag;
+  spg_t last_defrag_pgid;  ///< pgs are visited round-robin
+  void sched_defrag();
+
   void load_pgs();
 
   epoch_t last_pg_create_epoch;
@@ -1977,6 +2036,8 @@ private:
 
   int get_recovery_max_active();
   void maybe_override_max_osd_capacity_for_qos();
+  void update_mclock_capacity_estimate();
+  void dump_mclock_capacity(ceph::Formatter *f);
   void maybe_override_sleep_options_for_qos();
   bool maybe_override_options_for_qos(
     const std::set<std::string> *changed = nullptr);
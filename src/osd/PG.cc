@@ -249,6 +249,20 @@ void PG::lock(bool no_lockdep) const
   dout(30) << "lock" << dendl;
 }
 
+bool PG::try_lock() const
+{
+  if (!_lock.try_lock()) {
+    return false;
+  }
+#ifndef CEPH_DEBUG_MUTEX
+  locked_by = std::this_thread::get_id();
+#endif
+  ceph_assert(!recovery_state.debug_has_dirty_state());
+
+  dout(30) << "try_lock" << dendl;
+  return true;
+}
+
 bool PG::is_locked() const
 {
   return ceph_mutex_is_locked(_lock);
@@ -1711,6 +1725,93 @@ void PG::scrub_requested(scrub_level_t scrub_level, scrub_type_t scrub_type)
   m_scrubber->scrub_requested(scrub_level, scrub_type, m_planned_scrub);
 }
 
+void PG::defrag_chunk(epoch_t queued, ThreadPool::TPHandle& handle)
+{
+  if (pg_has_reset_since(queued)) {
+    dout(10) << __func__ << " reset since " << queued << dendl;
+    return;
+  }
+  // Only the copies that serve reads are worth the extra writes: the
+  // primary of a replicated pool, and every acting shard of an EC pool,
+  // since each holds its own chunks of the objects.
+  if (!is_primary() && !(pool.info.is_erasure() && is_nonprimary())) {
+    dout(10) << __func__ << " not serving reads, skipping" << dendl;
+    return;
+  }
+  // one chunk of rewrites at a time
+  if (defrag_in_flight > 0) {
+    dout(10) << __func__ << " " << defrag_in_flight
+	     << " rewrites still in flight, skipping" << dendl;
+    return;
+  }
+  // rewriting objects is pointless while they are being moved around,
+  // and would only disturb a scrub comparing them
+  if (!is_active() || !is_clean() || is_scrub_queued_or_active()) {
+    dout(10) << __func__ << " not active+clean or scrubbing, skipping"
+	     << dendl;
+    return;
+  }
+
+  const uint64_t max =
+    cct->_conf.get_val<uint64_t>("osd_defrag_chunk_objects");
+  const uint64_t max_bytes =
+    cct->_conf.get_val<Option::size_t>("osd_defrag_chunk_bytes");
+  const uint64_t bytes_before = defrag_stats.bytes;
+  std::vector<ghobject_t> ls;
+  ghobject_t next;
+  int r = osd->store->collection_list(ch, defrag_cursor,
+				      ghobject_t::get_max(), max, &ls, &next);
+  if (r < 0) {
+    dout(0) << __func__ << " collection_list failed: " << cpp_strerror(r)
+	    << dendl;
+    return;
+  }
+  for (auto p = ls.begin(); p != ls.end(); ++p) {
+    auto& oid = *p;
+    if (defrag_stats.bytes - bytes_before >= max_bytes) {
+      // carry on from here next time
+      dout(20) << __func__ << " rewrote "
+	       << byte_u_t(defrag_stats.bytes - bytes_before)
+	       << ", stopping at " << oid << dendl;
+      next = oid;
+      break;
+    }
+    if (oid.is_pgmeta()) {
+      continue;
+    }
+    ++defrag_in_flight;
+    r = osd->store->defragment(
+      ch, oid, &defrag_stats,
+      new LambdaContext([pg = PGRef(this)](int) {
+	--pg->defrag_in_flight;
+      }),
+      &handle);
+    if (r == -ENOTSUP) {
+      dout(10) << __func__ << " not supported by the object store" << dendl;
+      next = ghobject_t::get_max();
+      break;
+    }
+    if (r < 0 && r != -ENOENT) {
+      dout(0) << __func__ << " " << oid << " failed: " << cpp_strerror(r)
+	      << dendl;
+    }
+    handle.reset_tp_timeout();
+  }
+
+  if (next.is_max()) {
+    dout(10) << __func__ << " pass done: examined " << defrag_stats.objects
+	     << " rewrote " << defrag_stats.rewritten << " ("
+	     << byte_u_t(defrag_stats.bytes) << "), blobs "
+	     << defrag_stats.blobs_before << " -> " << defrag_stats.blobs_after
+	     << ", shards " << defrag_stats.shards_before << " -> "
+	     << defrag_stats.shards_after << dendl;
+    defrag_cursor = ghobject_t();
+    defrag_stats = ObjectStore::defrag_stats_t();
+  } else {
+    defrag_cursor = next;
+  }
+}
+
 void PG::clear_ready_to_merge() {
   osd->clear_ready_to_merge(this);
 }
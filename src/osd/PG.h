@@ -199,6 +199,11 @@ public:
 
   ObjectStore::CollectionHandle ch;
 
+  // -- defragmentation --
+  ghobject_t defrag_cursor;               ///< next object to look at
+  ObjectStore::defrag_stats_t defrag_stats;  ///< of the current pass
+  std::atomic<unsigned> defrag_in_flight = {0};  ///< rewrites not committed
+
   // -- methods --
   std::ostream& gen_prefix(std::ostream& out) const override;
   CephContext *get_cct() const override {
@@ -229,6 +234,7 @@ public:
     uint64_t events, utime_t event_dur) override;
 
   void lock(bool no_lockdep = false) const;
+  bool try_lock() const;
   void unlock() const;
   bool is_locked() const;
 
@@ -418,6 +424,9 @@ public:
   void finish_split_stats(const object_stat_sum_t& stats,
 			  ObjectStore::Transaction &t);
 
+  /// rewrite the next few fragmented objects in the store, see PGDefrag
+  void defrag_chunk(epoch_t queued, ThreadPool::TPHandle& handle);
+
   void scrub(epoch_t queued, ThreadPool::TPHandle& handle)
   {
     // a new scrub
@@ -771,6 +780,11 @@ public:
     OpRequestRef& op,
     ThreadPool::TPHandle &handle
   ) = 0;
+  /// true if op is a small read do_request() may run outside the op queue;
+  /// called with the pg locked
+  virtual bool can_fast_read(OpRequestRef& op, uint64_t max_bytes) {
+    return false;
+  }
   virtual void clear_cache() = 0;
   virtual int get_cache_obj_count() = 0;
 
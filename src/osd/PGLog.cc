@@ -638,6 +638,13 @@ void PGLog::write_log_and_missing(
   bool require_rollback)
 {
   if (needs_write()) {
+    if (log_segmented != (segment_entries > 0)) {
+      dout(6) << __func__ << " rewriting log "
+	      << (segment_entries > 0 ? "into segments" : "as single entries")
+	      << dendl;
+      mark_dirty_to(eversion_t::max());
+      log_segmented = segment_entries > 0;
+    }
     dout(6) << "write_log_and_missing with: "
 	     << "dirty_to: " << dirty_to
 	     << ", dirty_from: " << dirty_from
@@ -662,7 +669,9 @@ void PGLog::write_log_and_missing(
       write_from_dups,
       &may_include_deletes_in_missing_dirty,
       (pg_log_debug ? &log_keys_debug : nullptr),
-      this);
+      this,
+      segment_entries,
+      (log_segmented ? &log_segments : nullptr));
     undirty();
   } else {
     dout(10) << "log is not dirty" << dendl;
@@ -746,6 +755,12 @@ void PGLog::_write_log_and_missing_wo_missing(
       eversion_t().get_key_name(), dirty_to.get_key_name());
     clear_up_to(log_keys_debug, dirty_to.get_key_name());
   }
+  if (dirty_to == eversion_t::max()) {
+    t.omap_rmkeyrange(
+      coll, log_oid,
+      pg_log_segment_t::get_key_name(eversion_t()),
+      pg_log_segment_t::get_key_name(eversion_t::max()));
+  }
   if (dirty_to != eversion_t::max() && dirty_from != eversion_t::max()) {
     // dout(10) << "write_log_and_missing, clearing from " << dirty_from << dendl;
     t.omap_rmkeyrange(
@@ -865,7 +880,9 @@ void PGLog::_write_log_and_missing(
   eversion_t write_from_dups,
   bool *may_include_deletes_in_missing_dirty, // in/out param
   set<string> *log_keys_debug,
-  const DoutPrefixProvider *dpp
+  const DoutPrefixProvider *dpp,
+  uint64_t segment_entries,
+  map<eversion_t, eversion_t> *log_segments
   ) {
   ldpp_dout(dpp, 10) << __func__ << " clearing up to " << dirty_to
 		     << " dirty_to_dups=" << dirty_to_dups
@@ -881,53 +898,68 @@ void PGLog::_write_log_and_missing(
       ceph_assert(it != log_keys_debug->end());
       log_keys_debug->erase(it);
     }
-    to_remove.emplace(std::move(key));
+    if (!log_segments) {
+      to_remove.emplace(std::move(key));
+    }
   }
   trimmed.clear();
 
   if (touch_log)
     t.touch(coll, log_oid);
-  if (dirty_to != eversion_t()) {
-    t.omap_rmkeyrange(
-      coll, log_oid,
-      eversion_t().get_key_name(), dirty_to.get_key_name());
-    clear_up_to(log_keys_debug, dirty_to.get_key_name());
-  }
-  if (dirty_to != eversion_t::max() && dirty_from != eversion_t::max()) {
-    ldpp_dout(dpp, 10) << "write_log_and_missing, clearing from "
-		       << dirty_from << dendl;
-    t.omap_rmkeyrange(
-      coll, log_oid,
-      dirty_from.get_key_name(), eversion_t::max().get_key_name());
-    clear_after(log_keys_debug, dirty_from.get_key_name());
-  }
+  if (log_segments) {
+    _write_log_segments(
+      t, km, log, coll, log_oid,
+      dirty_to, dirty_from, writeout_from,
+      segment_entries, log_segments, log_keys_debug, dpp);
+  } else {
+    if (dirty_to != eversion_t()) {
+      t.omap_rmkeyrange(
+	coll, log_oid,
+	eversion_t().get_key_name(), dirty_to.get_key_name());
+      clear_up_to(log_keys_debug, dirty_to.get_key_name());
+    }
+    if (dirty_to == eversion_t::max()) {
+      t.omap_rmkeyrange(
+	coll, log_oid,
+	pg_log_segment_t::get_key_name(eversion_t()),
+	pg_log_segment_t::get_key_name(eversion_t::max()));
+    }
+    if (dirty_to != eversion_t::max() && dirty_from != eversion_t::max()) {
+      ldpp_dout(dpp, 10) << "write_log_and_missing, clearing from "
+			 << dirty_from << dendl;
+      t.omap_rmkeyrange(
+	coll, log_oid,
+	dirty_from.get_key_name(), eversion_t::max().get_key_name());
+      clear_after(log_keys_debug, dirty_from.get_key_name());
+    }
 
-  for (auto p = log.log.begin();
-       p != log.log.end() && p->version <= dirty_to;
-       ++p) {
-    bufferlist bl(sizeof(*p) * 2);
-    p->encode_with_checksum(bl);
-    (*km)[p->get_key_name()] = std::move(bl);
-  }
+    for (auto p = log.log.begin();
+	 p != log.log.end() && p->version <= dirty_to;
+	 ++p) {
+      bufferlist bl(sizeof(*p) * 2);
+      p->encode_with_checksum(bl);
+      (*km)[p->get_key_name()] = std::move(bl);
+    }
 
-  for (auto p = log.log.rbegin();
-       p != log.log.rend() &&
-	 (p->version >= dirty_from || p->version >= writeout_from) &&
-	 p->version >= dirty_to;
-       ++p) {
-    bufferlist bl(sizeof(*p) * 2);
-    p->encode_with_checksum(bl);
-    (*km)[p->get_key_name()] = std::move(bl);
-  }
+    for (auto p = log.log.rbegin();
+	 p != log.log.rend() &&
+	   (p->version >= dirty_from || p->version >= writeout_from) &&
+	   p->version >= dirty_to;
+	 ++p) {
+      bufferlist bl(sizeof(*p) * 2);
+      p->encode_with_checksum(bl);
+      (*km)[p->get_key_name()] = std::move(bl);
+    }
 
-  if (log_keys_debug) {
-    for (auto i = (*km).begin();
-	 i != (*km).end();
-	 ++i) {
-      if (i->first[0] == '_')
-	continue;
-      ceph_assert(!log_keys_debug->count(i->first));
-      log_keys_debug->insert(i->first);
+    if (log_keys_debug) {
+      for (auto i = (*km).begin();
+	   i != (*km).end();
+	   ++i) {
+	if (i->first[0] == '_')
+	  continue;
+	ceph_assert(!log_keys_debug->count(i->first));
+	log_keys_debug->insert(i->first);
+      }
     }
   }
 
@@ -1013,6 +1045,108 @@ void PGLog::_write_log_and_missing(
   ldpp_dout(dpp, 10) << "end of " << __func__ << dendl;
 }
 
+// static
+void PGLog::_write_log_segments(
+  ObjectStore::Transaction& t,
+  map<string,bufferlist>* km,
+  pg_log_t &log,
+  const coll_t& coll, const ghobject_t &log_oid,
+  eversion_t dirty_to,
+  eversion_t dirty_from,
+  eversion_t writeout_from,
+  uint64_t segment_entries,
+  map<eversion_t, eversion_t> *log_segments,
+  set<string> *log_keys_debug,
+  const DoutPrefixProvider *dpp)
+{
+  ceph_assert(segment_entries > 0);
+  const string seg_min = pg_log_segment_t::get_key_name(eversion_t());
+  const string seg_max = pg_log_segment_t::get_key_name(eversion_t::max());
+  auto seg_key = [&](map<eversion_t, eversion_t>::iterator p) {
+    return p == log_segments->end() ?
+      seg_max : pg_log_segment_t::get_key_name(p->first);
+  };
+
+  // drop the segments all of whose entries are trimmed, in one go
+  auto keep = log_segments->begin();
+  while (keep != log_segments->end() && keep->second <= log.tail) {
+    ++keep;
+  }
+  if (keep != log_segments->begin()) {
+    ldpp_dout(dpp, 10) << __func__ << " removing segments before "
+		       << seg_key(keep) << dendl;
+    t.omap_rmkeyrange(coll, log_oid, seg_min, seg_key(keep));
+    log_segments->erase(log_segments->begin(), keep);
+  }
+
+  // entries <= write_to and >= write_from are written below.  a segment
+  // that is partly dirty is rewritten as a whole.
+  eversion_t write_to;
+  eversion_t write_from = std::min(dirty_from, writeout_from);
+  if (dirty_to == eversion_t::max()) {
+    // this also removes the entry keys of a log stored the old way
+    t.omap_rmkeyrange(
+      coll, log_oid,
+      eversion_t().get_key_name(), eversion_t::max().get_key_name());
+    t.omap_rmkeyrange(coll, log_oid, seg_min, seg_max);
+    log_segments->clear();
+    if (log_keys_debug) {
+      log_keys_debug->clear();
+    }
+    write_to = eversion_t::max();
+  } else {
+    if (dirty_to != eversion_t()) {
+      write_to = dirty_to;
+      auto p = log_segments->upper_bound(dirty_to);
+      if (p != log_segments->begin() && std::prev(p)->second > write_to) {
+	write_to = std::prev(p)->second;
+      }
+      ldpp_dout(dpp, 10) << __func__ << " rewriting up to " << write_to
+			 << dendl;
+      t.omap_rmkeyrange(coll, log_oid, seg_min, seg_key(p));
+      log_segments->erase(log_segments->begin(), p);
+      clear_up_to(log_keys_debug, write_to.get_key_name());
+    }
+    if (dirty_from != eversion_t::max()) {
+      auto p = log_segments->upper_bound(dirty_from);
+      if (p != log_segments->begin() && std::prev(p)->second >= dirty_from) {
+	--p;
+	write_from = std::min(write_from, p->first);
+      }
+      ldpp_dout(dpp, 10) << __func__ << " rewriting from " << write_from
+			 << dendl;
+      t.omap_rmkeyrange(coll, log_oid, seg_key(p), seg_max);
+      log_segments->erase(p, log_segments->end());
+      clear_after(log_keys_debug, dirty_from.get_key_name());
+    }
+  }
+
+  auto write_segments = [&](auto p, auto end) {
+    while (p != end) {
+      auto first = p;
+      for (uint64_t n = 0; p != end && n < segment_entries; ++p, ++n) {
+	if (log_keys_debug) {
+	  log_keys_debug->insert(p->get_key_name());
+	}
+      }
+      bufferlist bl;
+      pg_log_segment_t::encode_entries(first, p, bl);
+      (*km)[pg_log_segment_t::get_key_name(first->version)] = std::move(bl);
+      (*log_segments)[first->version] = std::prev(p)->version;
+    }
+  };
+  auto head = log.log.begin();
+  while (head != log.log.end() && head->version <= write_to) {
+    ++head;
+  }
+  write_segments(log.log.begin(), head);
+  auto tail = log.log.end();
+  while (tail != head && std::prev(tail)->version >= write_from) {
+    --tail;
+  }
+  write_segments(tail, log.log.end());
+}
+
 void PGLog::rebuild_missing_set_with_deletes(
   ObjectStore *store,
   ObjectStore::CollectionHandle& ch,
@@ -1081,6 +1215,10 @@ namespace {
     std::set<std::string>* log_keys_debug = NULL;
     pg_missing_tracker_t &missing;
     const DoutPrefixProvider *dpp;
+    bool *log_segmented = nullptr;
+    std::map<eversion_t, eversion_t> *log_segments = nullptr;
+    bool read_entry_keys = false;
+    bool read_segments = false;
 
     eversion_t on_disk_can_rollback_to;
     eversion_t on_disk_rollback_info_trimmed_to;
@@ -1125,7 +1263,31 @@ namespace {
           ceph_assert(dups.back().version < dup.version);
         }
         dups.push_back(dup);
+      } else if (key.substr(0, 4) == std::string("seg_")) {
+        read_segments = true;
+        pg_log_segment_t seg;
+        decode(seg, bp);
+        ceph_assert(!seg.entries.empty());
+        if (log_segments) {
+          (*log_segments)[seg.entries.front().version] =
+            seg.entries.back().version;
+        }
+        for (auto& e : seg.entries) {
+          // segments are only removed once all their entries are trimmed
+          if (e.version <= info.log_tail) {
+            continue;
+          }
+          ldpp_dout(dpp, 20) << "read_log_and_missing " << e << dendl;
+          if (!entries.empty()) {
+            ceph_assert(entries.back().version.version < e.version.version);
+            ceph_assert(entries.back().version.epoch <= e.version.epoch);
+          }
+          if (log_keys_debug)
+            log_keys_debug->insert(e.get_key_name());
+          entries.push_back(std::move(e));
+        }
       } else {
+        read_entry_keys = true;
         pg_log_entry_t e;
         e.decode_with_checksum(bp);
         ldpp_dout(dpp, 20) << "read_log_and_missing " << e << dendl;
@@ -1145,6 +1307,9 @@ namespace {
       // will get overridden if recorded
       on_disk_can_rollback_to = info.last_update;
       missing.may_include_deletes = false;
+      if (log_segments) {
+        log_segments->clear();
+      }
 
       return seastar::do_with(
         std::move(ch),
@@ -1167,6 +1332,10 @@ namespace {
               );
             }, crimson::os::FuturizedStore::Shard::read_errorator::assert_all{});
           }).then([this] {
+            if (log_segmented && (read_entry_keys || read_segments)) {
+              // an empty log is in whatever layout we want it to be
+              *log_segmented = !read_entry_keys;
+            }
             if (info.pgid.is_no_shard()) {
               // replicated pool pg does not persist this key
               assert(on_disk_rollback_info_trimmed_to == eversion_t());
@@ -1193,14 +1362,16 @@ seastar::future<> PGLog::read_log_and_missing_crimson(
   std::set<std::string>* log_keys_debug,
   pg_missing_tracker_t &missing,
   ghobject_t pgmeta_oid,
-  const DoutPrefixProvider *dpp)
+  const DoutPrefixProvider *dpp,
+  bool *log_segmented,
+  std::map<eversion_t, eversion_t> *log_segments)
 {
   ldpp_dout(dpp, 20) << "read_log_and_missing coll "
                      << ch->get_cid()
                      << " " << pgmeta_oid << dendl;
   return seastar::do_with(FuturizedShardStoreLogReader{
       store, info, log, log_keys_debug,
-      missing, dpp},
+      missing, dpp, log_segmented, log_segments},
     [ch, pgmeta_oid](FuturizedShardStoreLogReader& reader) {
     return reader.read(ch, pgmeta_oid);
   });
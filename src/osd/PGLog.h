@@ -662,6 +662,12 @@ protected:
   bool dirty_log;
   bool clear_divergent_priors;
   bool may_include_deletes_in_missing_dirty = false;
+  /// entries per log segment, 0 to store each entry under its own key
+  const uint64_t segment_entries;
+  /// whether the log is stored in segments on disk
+  bool log_segmented;
+  /// first -> last version of each log segment on disk
+  std::map<eversion_t, eversion_t> log_segments;
 
   void mark_dirty_to(eversion_t to) {
     if (to > dirty_to)
@@ -758,7 +764,10 @@ public:
     pg_log_debug(!(cct && !(cct->_conf->osd_debug_pg_log_writeout))),
     touched_log(false),
     dirty_log(false),
-    clear_divergent_priors(false)
+    clear_divergent_priors(false),
+    segment_entries(cct ? cct->_conf.get_val<uint64_t>(
+		      "osd_pg_log_segment_entries") : 0),
+    log_segmented(segment_entries > 0)
   { }
 
   void reset_backfill();
@@ -1393,9 +1402,24 @@ public:
     eversion_t write_from_dups,
     bool *may_include_deletes_in_missing_dirty,
     std::set<std::string> *log_keys_debug,
-    const DoutPrefixProvider *dpp = nullptr
+    const DoutPrefixProvider *dpp = nullptr,
+    uint64_t segment_entries = 0,
+    std::map<eversion_t, eversion_t> *log_segments = nullptr
     );
 
+  static void _write_log_segments(
+    ObjectStore::Transaction& t,
+    std::map<std::string,ceph::buffer::list>* km,
+    pg_log_t &log,
+    const coll_t& coll, const ghobject_t &log_oid,
+    eversion_t dirty_to,
+    eversion_t dirty_from,
+    eversion_t writeout_from,
+    uint64_t segment_entries,
+    std::map<eversion_t, eversion_t> *log_segments,
+    std::set<std::string> *log_keys_debug,
+    const DoutPrefixProvider *dpp);
+
   void read_log_and_missing(
     ObjectStore *store,
     ObjectStore::CollectionHandle& ch,
@@ -1412,7 +1436,9 @@ public:
       &clear_divergent_priors,
       this,
       (pg_log_debug ? &log_keys_debug : nullptr),
-      debug_verify_stored_missing);
+      debug_verify_stored_missing,
+      &log_segmented,
+      &log_segments);
   }
 
   template <typename missing_type>
@@ -1429,7 +1455,9 @@ public:
     bool *clear_divergent_priors = nullptr,
     const DoutPrefixProvider *dpp = nullptr,
     std::set<std::string> *log_keys_debug = nullptr,
-    bool debug_verify_stored_missing = false
+    bool debug_verify_stored_missing = false,
+    bool *log_segmented = nullptr,
+    std::map<eversion_t, eversion_t> *log_segments = nullptr
     ) {
     ldpp_dout(dpp, 10) << "read_log_and_missing coll " << ch->cid
 		       << " " << pgmeta_oid << dendl;
@@ -1451,6 +1479,11 @@ public:
     missing.may_include_deletes = false;
     std::list<pg_log_entry_t> entries;
     std::list<pg_log_dup_t> dups;
+    bool read_entry_keys = false;
+    bool read_segments = false;
+    if (log_segments) {
+      log_segments->clear();
+    }
     const auto NUM_DUPS_WARN_THRESHOLD = 2*cct->_conf->osd_pg_log_dups_tracked;
     if (p) {
       using ceph::decode;
@@ -1498,7 +1531,31 @@ public:
 			      << dendl;
 	  }
 	  dups.push_back(dup);
+	} else if (p->key().substr(0, 4) == std::string("seg_")) {
+	  read_segments = true;
+	  pg_log_segment_t seg;
+	  decode(seg, bp);
+	  ceph_assert(!seg.entries.empty());
+	  if (log_segments) {
+	    (*log_segments)[seg.entries.front().version] =
+	      seg.entries.back().version;
+	  }
+	  for (auto& e : seg.entries) {
+	    // segments are only removed once all their entries are trimmed
+	    if (e.version <= info.log_tail) {
+	      continue;
+	    }
+	    ldpp_dout(dpp, 20) << "read_log_and_missing " << e << dendl;
+	    if (!entries.empty()) {
+	      ceph_assert(entries.back().version.version < e.version.version);
+	      ceph_assert(entries.back().version.epoch <= e.version.epoch);
+	    }
+	    if (log_keys_debug)
+	      log_keys_debug->insert(e.get_key_name());
+	    entries.push_back(std::move(e));
+	  }
 	} else {
+	  read_entry_keys = true;
 	  pg_log_entry_t e;
 	  e.decode_with_checksum(bp);
 	  ldpp_dout(dpp, 20) << "read_log_and_missing " << e << dendl;
@@ -1513,6 +1570,10 @@ public:
 	}
       }
     }
+    if (log_segmented && (read_entry_keys || read_segments)) {
+      // an empty log is in whatever layout we want it to be
+      *log_segmented = !read_entry_keys;
+    }
     if (info.pgid.is_no_shard()) {
       // replicated pool pg does not persist this key
       assert(on_disk_rollback_info_trimmed_to == eversion_t());
@@ -1691,7 +1752,7 @@ public:
     return read_log_and_missing_crimson(
       store, ch, info,
       log, (pg_log_debug ? &log_keys_debug : nullptr),
-      missing, pgmeta_oid, this);
+      missing, pgmeta_oid, this, &log_segmented, &log_segments);
   }
 
   static seastar::future<> read_log_and_missing_crimson(
@@ -1702,7 +1763,9 @@ public:
     std::set<std::string>* log_keys_debug,
     pg_missing_tracker_t &missing,
     ghobject_t pgmeta_oid,
-    const DoutPrefixProvider *dpp = nullptr);
+    const DoutPrefixProvider *dpp = nullptr,
+    bool *log_segmented = nullptr,
+    std::map<eversion_t, eversion_t> *log_segments = nullptr);
 
 #endif
 
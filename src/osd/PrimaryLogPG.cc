@@ -1980,6 +1980,85 @@ void PrimaryLogPG::do_request(
   }
 }
 
+/** can_fast_read - may op skip the op queue
+ *
+ * A plain read of at most max_bytes from the head of an object on an
+ * active+clean replicated pool, with no write in flight or queued on the
+ * object, that the store can serve from its caches.  Anything else is left
+ * to the op queue, even though do_request() would handle it just as well,
+ * to keep the fast path to what cannot block.
+ */
+bool PrimaryLogPG::can_fast_read(OpRequestRef& op, uint64_t max_bytes)
+{
+  ceph_assert(is_locked());
+  if (op->get_req()->get_type() != CEPH_MSG_OSD_OP ||
+      !is_primary() || !is_active() || !is_clean() ||
+      !pool.info.is_replicated() ||
+      pool.info.has_tiers() || pool.info.is_tier()) {
+    return false;
+  }
+
+  // same as do_op()
+  MOSDOp *m = static_cast<MOSDOp*>(op->get_nonconst_req());
+  if (m->finish_decode()) {
+    op->reset_desc();   // for TrackedOp
+    m->clear_payload();
+  }
+  if (m->get_snapid() != CEPH_NOSNAP ||
+      m->has_flag(CEPH_OSD_FLAG_WRITE) ||
+      !m->has_flag(CEPH_OSD_FLAG_READ)) {
+    return false;
+  }
+
+  uint64_t bytes = 0;
+  for (auto& osd_op : m->ops) {
+    switch (osd_op.op.op) {
+    case CEPH_OSD_OP_READ:
+    case CEPH_OSD_OP_SPARSE_READ:
+      if (osd_op.op.extent.length == 0) {
+	// to the end of the object, however large it is
+	return false;
+      }
+      bytes += osd_op.op.extent.length;
+      break;
+    case CEPH_OSD_OP_STAT:
+      break;
+    default:
+      return false;
+    }
+  }
+  if (bytes > max_bytes) {
+    return false;
+  }
+
+  ObjectContextRef obc = object_contexts.lookup(m->get_hobj());
+  if (obc && (obc->rwstate.waiters > 0 ||
+	      obc->rwstate.state == RWState::RWWRITE ||
+	      obc->rwstate.state == RWState::RWEXCL)) {
+    dout(20) << __func__ << " " << m->get_hobj() << " is "
+	     << obc->rwstate.get_state_name() << " with "
+	     << obc->rwstate.waiters << " waiters" << dendl;
+    return false;
+  }
+
+  // a read the store has to go to the device for would hold up the
+  // messenger thread until it completes
+  ghobject_t oid(m->get_hobj(), ghobject_t::NO_GEN, pg_whoami.shard);
+  for (auto& osd_op : m->ops) {
+    uint64_t offset = 0, length = 0;
+    if (osd_op.op.op != CEPH_OSD_OP_STAT) {
+      offset = osd_op.op.extent.offset;
+      length = osd_op.op.extent.length;
+    }
+    if (!osd->store->is_read_cached(ch, oid, offset, length)) {
+      dout(20) << __func__ << " " << oid << " 0x" << std::hex << offset
+	       << "~" << length << std::dec << " not cached" << dendl;
+      return false;
+    }
+  }
+  return true;
+}
+
 /** do_op - do an op
  * pg lock will be held (if multithreaded)
  * osd_lock NOT held.
@@ -7731,28 +7810,13 @@ int PrimaryLogPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	bool truncated = false;
 	bufferlist bl;
 	if (oi.is_omap()) {
-	  ObjectMap::ObjectMapIterator iter = osd->store->get_omap_iterator(
-	    ch, ghobject_t(soid)
-	    );
-          if (!iter) {
-            result = -ENOENT;
-            goto fail;
-          }
-	  iter->upper_bound(start_after);
-	  if (filter_prefix > start_after) iter->lower_bound(filter_prefix);
-	  for (num = 0;
-	       iter->valid() &&
-		 iter->key().substr(0, filter_prefix.size()) == filter_prefix;
-	       ++num, iter->next()) {
-	    dout(20) << "Found key " << iter->key() << dendl;
-	    if (num >= max_return ||
-		bl.length() >= cct->_conf->osd_max_omap_bytes_per_request) {
-	      truncated = true;
-	      break;
-	    }
-	    encode(iter->key(), bl);
-	    encode(iter->value(), bl);
+	  result = osd->store->omap_get_range(
+	    ch, ghobject_t(soid), start_after, filter_prefix, max_return,
+	    cct->_conf->osd_max_omap_bytes_per_request, &bl, &num, &truncated);
+	  if (result < 0) {
+	    goto fail;
 	  }
+	  dout(20) << "Found " << num << " keys, truncated " << truncated << dendl;
 	} // else return empty out_set
 	encode(num, osd_op.outdata);
 	osd_op.outdata.claim_append(bl);
@@ -132,6 +132,9 @@ PerfCounters *build_osd_logger(CephContext *cct) {
 
   osd_plb.add_time_avg(l_osd_op_before_dequeue_op_lat, "op_before_dequeue_op_lat",
     "Latency of IO before calling dequeue_op(already dequeued and get PG lock)"); // client io before dequeue_op latency
+  osd_plb.add_u64_counter(
+    l_osd_op_fast_read, "op_fast_read",
+    "Client reads run without going through an op shard thread");
 
   osd_plb.add_u64_counter(
     l_osd_sop, "subop", "Suboperations");
@@ -360,3 +363,66 @@ PerfCounters *build_recoverystate_perf(CephContext *cct) {
 
   return rs_perf.create_perf_counters();
 }
+
+PerfCounters *build_osd_shard_perf(CephContext *cct, const std::string& name) {
+  PerfCountersBuilder shard_plb(cct, name, l_osd_shard_first, l_osd_shard_last);
+
+  shard_plb.add_u64_counter(
+    l_osd_shard_ops, "ops",
+    "Items of this shard's queue processed, by any thread");
+  shard_plb.add_time(
+    l_osd_shard_busy, "busy",
+    "Time spent processing items of this shard's queue; its rate is the "
+    "number of threads kept busy");
+  shard_plb.add_u64_counter(
+    l_osd_shard_steal, "steal",
+    "Items this shard's idle threads took from other shards");
+  shard_plb.add_u64_counter(
+    l_osd_shard_stolen, "stolen",
+    "Items of this shard's queue processed by other shards' threads");
+
+  return shard_plb.create_perf_counters();
+}
+
+PerfCounters *build_mclock_perf(CephContext *cct, const std::string& name) {
+  PerfCountersBuilder plb(cct, name, l_mclock_first, l_mclock_last);
+
+  plb.add_u64_counter(
+    l_mclock_client_res, "client_res",
+    "Client ops dequeued within their reservation");
+  plb.add_u64_counter(
+    l_mclock_client_wgt, "client_wgt",
+    "Client ops dequeued by weight, over their reservation");
+  plb.add_u64_counter(
+    l_mclock_client_cost, "client_cost",
+    "Scaled cost of the client ops dequeued", NULL,
+    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(
+    l_mclock_recovery_res, "recovery_res",
+    "Recovery ops dequeued within their reservation");
+  plb.add_u64_counter(
+    l_mclock_recovery_wgt, "recovery_wgt",
+    "Recovery ops dequeued by weight, over their reservation");
+  plb.add_u64_counter(
+    l_mclock_recovery_cost, "recovery_cost",
+    "Scaled cost of the recovery ops dequeued", NULL,
+    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(
+    l_mclock_best_effort_res, "best_effort_res",
+    "Best effort ops dequeued within their reservation");
+  plb.add_u64_counter(
+    l_mclock_best_effort_wgt, "best_effort_wgt",
+    "Best effort ops dequeued by weight, over their reservation");
+  plb.add_u64_counter(
+    l_mclock_best_effort_cost, "best_effort_cost",
+    "Scaled cost of the best effort ops dequeued", NULL,
+    PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  plb.add_u64_counter(
+    l_mclock_high, "high",
+    "Ops dequeued from the high priority queue, ahead of mClock");
+  plb.add_u64(
+    l_mclock_clients, "clients",
+    "mClock clients: classes, pools or clients with queued or recent ops");
+
+  return plb.create_perf_counters();
+}
@@ -41,6 +41,7 @@ enum {
 
   l_osd_op_before_queue_op_lat,
   l_osd_op_before_dequeue_op_lat,
+  l_osd_op_fast_read,
 
   l_osd_sop,
   l_osd_sop_inb,
@@ -174,3 +175,34 @@ enum {
 };
 
 PerfCounters *build_recoverystate_perf(CephContext *cct);
+
+// OSDShard perf counters
+enum {
+  l_osd_shard_first = 30000,
+  l_osd_shard_ops,
+  l_osd_shard_busy,
+  l_osd_shard_steal,
+  l_osd_shard_stolen,
+  l_osd_shard_last,
+};
+
+PerfCounters *build_osd_shard_perf(CephContext *cct, const std::string& name);
+
+// mClockScheduler perf counters, by scheduler class
+enum {
+  l_mclock_first = 31000,
+  l_mclock_client_res,
+  l_mclock_client_wgt,
+  l_mclock_client_cost,
+  l_mclock_recovery_res,
+  l_mclock_recovery_wgt,
+  l_mclock_recovery_cost,
+  l_mclock_best_effort_res,
+  l_mclock_best_effort_wgt,
+  l_mclock_best_effort_cost,
+  l_mclock_high,
+  l_mclock_clients,
+  l_mclock_last,
+};
+
+PerfCounters *build_mclock_perf(CephContext *cct, const std::string& name);
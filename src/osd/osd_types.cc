@@ -1376,7 +1376,13 @@ static opt_mapping_t opt_mapping = boost::assign::map_list_of
            ("dedup_cdc_chunk_size", pool_opts_t::opt_desc_t(
 	     pool_opts_t::DEDUP_CDC_CHUNK_SIZE, pool_opts_t::INT))
 	   ("pg_num_max", pool_opts_t::opt_desc_t(
-             pool_opts_t::PG_NUM_MAX, pool_opts_t::INT));
+             pool_opts_t::PG_NUM_MAX, pool_opts_t::INT))
+	   ("qos_reservation", pool_opts_t::opt_desc_t(
+	     pool_opts_t::QOS_RESERVATION, pool_opts_t::DOUBLE))
+	   ("qos_weight", pool_opts_t::opt_desc_t(
+	     pool_opts_t::QOS_WEIGHT, pool_opts_t::INT))
+	   ("qos_limit", pool_opts_t::opt_desc_t(
+	     pool_opts_t::QOS_LIMIT, pool_opts_t::DOUBLE));
 
 bool pool_opts_t::is_opt_name(const std::string& name)
 {
@@ -5070,6 +5076,290 @@ std::string pg_log_entry_t::fmt_print() const
 
 // -- pg_log_dup_t --
 
+// -- pg_log_segment_t --
+
+namespace {
+enum {
+  SEG_SAME_OBJECT = 1 << 0,    ///< soid is the previous entry's
+  SEG_SAME_CLIENT = 1 << 1,    ///< reqid name and inc are the previous entry's
+  SEG_NO_PRIOR = 1 << 2,       ///< prior_version is zero
+  SEG_FULL_PRIOR = 1 << 3,     ///< prior_version is not below version
+  SEG_USER_VERSION = 1 << 4,   ///< user_version is not version.version
+  SEG_REVERTING_TO = 1 << 5,
+  SEG_SNAPS = 1 << 6,
+  SEG_EXTRA_REQIDS = 1 << 7,
+  SEG_RETURN_CODE = 1 << 8,
+  SEG_SAME_CLEAN_REGIONS = 1 << 9,
+  SEG_OP_RETURNS = 1 << 10,
+};
+
+void encode_seg_varint(uint64_t v, ceph::buffer::list &bl)
+{
+  char buf[10];
+  unsigned n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[n++] = v;
+  bl.append(buf, n);
+}
+
+uint64_t decode_seg_varint(ceph::buffer::list::const_iterator &p)
+{
+  uint64_t v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    __u8 byte;
+    decode(byte, p);
+    v |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return v;
+    }
+  }
+  throw ceph::buffer::malformed_input("bad varint in pg_log_segment_t");
+}
+}
+
+std::string pg_log_segment_t::get_key_name(const eversion_t& first)
+{
+  static const char prefix[] = "seg_";
+  std::string key(36, ' ');
+  memcpy(&key[0], prefix, 4);
+  first.get_key_name(&key[4]);
+  key.resize(35); // remove the null terminator
+  return key;
+}
+
+void pg_log_segment_t::encode_entry(const pg_log_entry_t &e,
+				    const pg_log_entry_t *prev,
+				    ceph::buffer::list &bl)
+{
+  using ceph::encode;
+  static const pg_log_entry_t none;
+  if (!prev) {
+    prev = &none;
+  }
+  ceph_assert(e.version.epoch >= prev->version.epoch);
+  ceph_assert(e.version.version > prev->version.version ||
+	      prev == &none);
+
+  uint64_t flags = 0;
+  if (e.soid == prev->soid) {
+    flags |= SEG_SAME_OBJECT;
+  }
+  if (e.reqid.name == prev->reqid.name && e.reqid.inc == prev->reqid.inc) {
+    flags |= SEG_SAME_CLIENT;
+  }
+  if (e.prior_version == eversion_t()) {
+    flags |= SEG_NO_PRIOR;
+  } else if (e.prior_version.epoch > e.version.epoch ||
+	     e.prior_version.version > e.version.version) {
+    flags |= SEG_FULL_PRIOR;
+  }
+  if (e.user_version != e.version.version) {
+    flags |= SEG_USER_VERSION;
+  }
+  if (e.op == pg_log_entry_t::LOST_REVERT) {
+    flags |= SEG_REVERTING_TO;
+  }
+  if (e.snaps.length()) {
+    flags |= SEG_SNAPS;
+  }
+  if (!e.extra_reqids.empty() || !e.extra_reqid_return_codes.empty()) {
+    flags |= SEG_EXTRA_REQIDS;
+  }
+  if (e.return_code) {
+    flags |= SEG_RETURN_CODE;
+  }
+  if (e.clean_regions == prev->clean_regions) {
+    flags |= SEG_SAME_CLEAN_REGIONS;
+  }
+  if (!e.op_returns.empty()) {
+    flags |= SEG_OP_RETURNS;
+  }
+
+  encode_seg_varint(flags, bl);
+  encode_seg_varint(e.op, bl);
+  encode_seg_varint(e.version.epoch - prev->version.epoch, bl);
+  encode_seg_varint(e.version.version - prev->version.version, bl);
+  if (flags & SEG_FULL_PRIOR) {
+    encode(e.prior_version, bl);
+  } else if (!(flags & SEG_NO_PRIOR)) {
+    encode_seg_varint(e.version.epoch - e.prior_version.epoch, bl);
+    encode_seg_varint(e.version.version - e.prior_version.version, bl);
+  }
+  if (!(flags & SEG_SAME_OBJECT)) {
+    encode(e.soid, bl);
+  }
+  if (!(flags & SEG_SAME_CLIENT)) {
+    encode(e.reqid.name, bl);
+    encode(e.reqid.inc, bl);
+  }
+  encode_seg_varint(e.reqid.tid, bl);
+  encode(e.mtime, bl);
+  if (flags & SEG_USER_VERSION) {
+    encode_seg_varint(e.user_version, bl);
+  }
+  if (flags & SEG_REVERTING_TO) {
+    encode(e.reverting_to, bl);
+  }
+  if (flags & SEG_SNAPS) {
+    encode(e.snaps, bl);
+  }
+  encode(e.mod_desc, bl);
+  if (flags & SEG_EXTRA_REQIDS) {
+    encode(e.extra_reqids, bl);
+    encode(e.extra_reqid_return_codes, bl);
+  }
+  if (flags & SEG_RETURN_CODE) {
+    encode(e.return_code, bl);
+  }
+  if (!(flags & SEG_SAME_CLEAN_REGIONS)) {
+    encode(e.clean_regions, bl);
+  }
+  if (flags & SEG_OP_RETURNS) {
+    encode(e.op_returns, bl);
+  }
+}
+
+void pg_log_segment_t::decode_entry(pg_log_entry_t &e,
+				    const pg_log_entry_t *prev,
+				    ceph::buffer::list::const_iterator &bl)
+{
+  using ceph::decode;
+  static const pg_log_entry_t none;
+  if (!prev) {
+    prev = &none;
+  }
+
+  uint64_t flags = decode_seg_varint(bl);
+  e.op = decode_seg_varint(bl);
+  e.version.epoch = prev->version.epoch + decode_seg_varint(bl);
+  e.version.version = prev->version.version + decode_seg_varint(bl);
+  if (flags & SEG_FULL_PRIOR) {
+    decode(e.prior_version, bl);
+  } else if (flags & SEG_NO_PRIOR) {
+    e.prior_version = eversion_t();
+  } else {
+    e.prior_version.epoch = e.version.epoch - decode_seg_varint(bl);
+    e.prior_version.version = e.version.version - decode_seg_varint(bl);
+  }
+  if (flags & SEG_SAME_OBJECT) {
+    e.soid = prev->soid;
+  } else {
+    decode(e.soid, bl);
+  }
+  if (flags & SEG_SAME_CLIENT) {
+    e.reqid.name = prev->reqid.name;
+    e.reqid.inc = prev->reqid.inc;
+  } else {
+    decode(e.reqid.name, bl);
+    decode(e.reqid.inc, bl);
+  }
+  e.reqid.tid = decode_seg_varint(bl);
+  decode(e.mtime, bl);
+  if (flags & SEG_USER_VERSION) {
+    e.user_version = decode_seg_varint(bl);
+  } else {
+    e.user_version = e.version.version;
+  }
+  if (flags & SEG_REVERTING_TO) {
+    decode(e.reverting_to, bl);
+  }
+  if (flags & SEG_SNAPS) {
+    decode(e.snaps, bl);
+    // ensure snaps does not pin the segment in memory
+    e.snaps.rebuild();
+    e.snaps.reassign_to_mempool(mempool::mempool_osd_pglog);
+  }
+  decode(e.mod_desc, bl);
+  if (flags & SEG_EXTRA_REQIDS) {
+    decode(e.extra_reqids, bl);
+    decode(e.extra_reqid_return_codes, bl);
+  }
+  if (flags & SEG_RETURN_CODE) {
+    decode(e.return_code, bl);
+  }
+  if (flags & SEG_SAME_CLEAN_REGIONS) {
+    e.clean_regions = prev->clean_regions;
+  } else {
+    decode(e.clean_regions, bl);
+  }
+  if (flags & SEG_OP_RETURNS) {
+    decode(e.op_returns, bl);
+    for (auto& i : e.op_returns) {
+      i.bl.rebuild();
+    }
+  }
+}
+
+void pg_log_segment_t::encode_payload(uint32_t num,
+				      const ceph::buffer::list &payload,
+				      ceph::buffer::list &bl)
+{
+  using ceph::encode;
+  ENCODE_START(1, 1, bl);
+  encode(num, bl);
+  encode(payload, bl);
+  encode(payload.crc32c(0), bl);
+  ENCODE_FINISH(bl);
+}
+
+void pg_log_segment_t::decode(ceph::buffer::list::const_iterator &bl)
+{
+  using ceph::decode;
+  uint32_t num;
+  ceph::buffer::list payload;
+  DECODE_START(1, bl);
+  decode(num, bl);
+  decode(payload, bl);
+  __u32 crc;
+  decode(crc, bl);
+  if (crc != payload.crc32c(0)) {
+    throw ceph::buffer::malformed_input("bad checksum on pg_log_segment_t");
+  }
+  DECODE_FINISH(bl);
+
+  entries.clear();
+  entries.resize(num);
+  auto p = payload.cbegin();
+  for (uint32_t i = 0; i < num; ++i) {
+    decode_entry(entries[i], i ? &entries[i - 1] : nullptr, p);
+  }
+}
+
+void pg_log_segment_t::dump(Formatter *f) const
+{
+  f->open_array_section("entries");
+  for (auto& e : entries) {
+    f->dump_object("entry", e);
+  }
+  f->close_section();
+}
+
+void pg_log_segment_t::generate_test_instances(list<pg_log_segment_t*>& o)
+{
+  o.push_back(new pg_log_segment_t());
+  o.push_back(new pg_log_segment_t());
+  hobject_t oid(object_t("objname"), "key", 123, 456, 0, "");
+  hobject_t other(object_t("other"), "", CEPH_NOSNAP, 789, 0, "ns");
+  auto client = osd_reqid_t(entity_name_t::CLIENT(777), 8, 999);
+  o.back()->entries.emplace_back(
+    pg_log_entry_t::MODIFY, oid, eversion_t(1,2), eversion_t(),
+    2, client, utime_t(8,9), 0);
+  client.tid++;
+  o.back()->entries.emplace_back(
+    pg_log_entry_t::MODIFY, oid, eversion_t(1,3), eversion_t(1,2),
+    3, client, utime_t(8,10), 0);
+  client.tid++;
+  o.back()->entries.emplace_back(
+    pg_log_entry_t::ERROR, other, eversion_t(2,4), eversion_t(3,4),
+    1, client, utime_t(9,1), -ENOENT);
+  o.back()->entries.emplace_back(
+    pg_log_entry_t::DELETE, other, eversion_t(2,5), eversion_t(1,1),
+    5, osd_reqid_t(entity_name_t::CLIENT(778), 1, 1), utime_t(9,2), 0);
+}
+
 std::string pg_log_dup_t::get_key_name() const
 {
   static const char prefix[] = "dup_";
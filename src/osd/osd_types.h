@@ -1081,6 +1081,9 @@ public:
     DEDUP_CHUNK_ALGORITHM,
     DEDUP_CDC_CHUNK_SIZE,
     PG_NUM_MAX, // max pg_num
+    QOS_RESERVATION, // mclock reservation, fraction of osd capacity
+    QOS_WEIGHT,      // mclock weight
+    QOS_LIMIT,       // mclock limit, fraction of osd capacity
   };
 
   enum type_t {
@@ -4383,6 +4386,53 @@ WRITE_CLASS_ENCODER(pg_log_entry_t)
 
 std::ostream& operator<<(std::ostream& out, const pg_log_entry_t& e);
 
+/**
+ * pg_log_segment_t - consecutive pg log entries stored under one key
+ *
+ * Each entry is encoded as the difference to the one before it: versions
+ * as varint deltas, the object and the client only when they change, and
+ * the fields that are nearly always empty only when they are not.  A
+ * single crc covers the segment.
+ */
+struct pg_log_segment_t {
+  std::vector<pg_log_entry_t> entries;
+
+  /// key of the segment starting with version first
+  static std::string get_key_name(const eversion_t& first);
+
+  /// encode [first, last) of a log as one segment
+  template <typename It>
+  static void encode_entries(It first, It last, ceph::buffer::list &bl) {
+    ceph::buffer::list payload;
+    const pg_log_entry_t *prev = nullptr;
+    uint32_t num = 0;
+    for (auto p = first; p != last; ++p, ++num) {
+      encode_entry(*p, prev, payload);
+      prev = &*p;
+    }
+    encode_payload(num, payload, bl);
+  }
+
+  void encode(ceph::buffer::list &bl) const {
+    encode_entries(entries.begin(), entries.end(), bl);
+  }
+  void decode(ceph::buffer::list::const_iterator &bl);
+  void dump(ceph::Formatter *f) const;
+  static void generate_test_instances(std::list<pg_log_segment_t*>& o);
+
+private:
+  static void encode_entry(const pg_log_entry_t &e,
+			   const pg_log_entry_t *prev,
+			   ceph::buffer::list &bl);
+  static void decode_entry(pg_log_entry_t &e,
+			   const pg_log_entry_t *prev,
+			   ceph::buffer::list::const_iterator &bl);
+  static void encode_payload(uint32_t num,
+			     const ceph::buffer::list &payload,
+			     ceph::buffer::list &bl);
+};
+WRITE_CLASS_ENCODER(pg_log_segment_t)
+
 struct pg_log_dup_t {
   osd_reqid_t reqid;  // caller+tid to uniquely identify request
   eversion_t version;
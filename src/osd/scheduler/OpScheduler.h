@@ -21,6 +21,8 @@
 #include "mon/MonClient.h"
 #include "osd/scheduler/OpSchedulerItem.h"
 
+class OSDMap;
+
 namespace ceph::osd::scheduler {
 
 using client = uint64_t;
@@ -54,6 +56,13 @@ public:
   // Apply config changes to the scheduler (if any)
   virtual void update_configuration() = 0;
 
+  // Apply the pool settings of a new osdmap to the scheduler (if any)
+  virtual void update_from_osdmap(const OSDMap &osdmap) = 0;
+
+  // Use an estimate of the OSD capacity in place of the configured one,
+  // or the configured one again if both are 0 (if any)
+  virtual void set_capacity_estimate(double iops, double bandwidth) = 0;
+
   // Destructor
   virtual ~OpScheduler() {};
 };
@@ -143,6 +152,14 @@ public:
     // no-op
   }
 
+  void update_from_osdmap(const OSDMap &osdmap) final {
+    // no-op
+  }
+
+  void set_capacity_estimate(double iops, double bandwidth) final {
+    // no-op
+  }
+
   ~ClassedOpQueueScheduler() final {};
 };
 
@@ -53,6 +53,16 @@ void PGSnapTrim::run(
   pg->unlock();
 }
 
+void PGDefrag::run(
+  OSD *osd,
+  OSDShard *sdata,
+  PGRef& pg,
+  ThreadPool::TPHandle &handle)
+{
+  pg->defrag_chunk(epoch_queued, handle);
+  pg->unlock();
+}
+
 void PGScrub::run(OSD* osd, OSDShard* sdata, PGRef& pg, ThreadPool::TPHandle& handle)
 {
   pg->scrub(epoch_queued, handle);
@@ -41,6 +41,21 @@ std::ostream& operator<<(std::ostream& out, const op_scheduler_class& class_id);
 
 class OpSchedulerItem {
 public:
+  /**
+   * client_qos_t
+   *
+   * Set by OSD::enqueue_op for client ops, used by mClockScheduler to
+   * schedule the ops of each pool or client separately: the pool and, for
+   * clients tracking the service they get from each OSD, the dmclock delta
+   * and rho they sent.
+   */
+  struct client_qos_t {
+    int64_t pool = -1;
+    bool tracked = false;
+    uint32_t delta = 0;
+    uint32_t rho = 0;
+  };
+
   // Abstraction for operations queueable in the op queue
   class OpQueueable {
   public:
@@ -102,6 +117,8 @@ private:
    */
   uint32_t qos_cost = 0;
 
+  client_qos_t client_qos;
+
   /// True iff queued via mclock proper, not the high/immediate queues
   bool was_queued_via_mclock() const {
     return qos_cost > 0;
@@ -168,6 +185,16 @@ public:
   void set_qos_cost(uint32_t scaled_cost) {
     qos_cost = scaled_cost;
   }
+  uint32_t get_qos_cost() const {
+    return qos_cost;
+  }
+
+  void set_client_qos(const client_qos_t &q) {
+    client_qos = q;
+  }
+  const client_qos_t &get_client_qos() const {
+    return client_qos;
+  }
 
   friend std::ostream& operator<<(std::ostream& out, const OpSchedulerItem& item) {
     out << "OpSchedulerItem("
@@ -301,6 +328,30 @@ public:
   }
 };
 
+/// rewrite fragmented objects of the PG in the background
+class PGDefrag : public PGOpQueueable {
+  epoch_t epoch_queued;
+public:
+  PGDefrag(
+    spg_t pg,
+    epoch_t epoch_queued)
+    : PGOpQueueable(pg), epoch_queued(epoch_queued) {}
+  std::ostream &print(std::ostream &rhs) const final {
+    return rhs << "PGDefrag(pgid=" << get_pgid()
+	       << " epoch_queued=" << epoch_queued
+	       << ")";
+  }
+  std::string print() const final {
+    return fmt::format(
+	"PGDefrag(pgid={} epoch_queued={})", get_pgid(), epoch_queued);
+  }
+  void run(
+    OSD *osd, OSDShard *sdata, PGRef& pg, ThreadPool::TPHandle &handle) final;
+  op_scheduler_class get_scheduler_class() const final {
+    return op_scheduler_class::background_best_effort;
+  }
+};
+
 class PGScrub : public PGOpQueueable {
   epoch_t epoch_queued;
 public:
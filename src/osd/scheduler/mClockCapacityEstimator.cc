@@ -0,0 +1,158 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <cmath>
+
+#include "osd/scheduler/mClockCapacityEstimator.h"
+
+namespace ceph::osd::scheduler {
+
+bool mClockCapacityEstimator::add_sample(
+  double now,
+  uint64_t ios,
+  uint64_t lat_ns,
+  uint64_t bytes,
+  const params_t &p)
+{
+  if (!primed || now <= last_time || ios < last_ios ||
+      lat_ns < last_lat_ns || bytes < last_bytes) {
+    // first sample, or the counters were reset
+    primed = true;
+    last_time = now;
+    last_busy_time = now;
+    last_ios = ios;
+    last_lat_ns = lat_ns;
+    last_bytes = bytes;
+    return false;
+  }
+
+  const double elapsed = now - last_time;
+  const uint64_t n = ios - last_ios;
+  const double lat = (lat_ns - last_lat_ns) / 1e9;
+  const double b = bytes - last_bytes;
+  last_time = now;
+  last_ios = ios;
+  last_lat_ns = lat_ns;
+  last_bytes = bytes;
+  ++intervals;
+
+  if (n == 0) {
+    queue_depth = 0;
+    latency = 0;
+    return _decay_stale(now, p);
+  }
+  queue_depth = lat / elapsed;
+  latency = lat / n;
+  if (queue_depth < p.min_queue_depth) {
+    // the device was idle part of the time, and served the IOs about as
+    // fast as it can serve one
+    base_latency = base_latency > 0 ?
+      base_latency * decay + latency * (1 - decay) : latency;
+    return _decay_stale(now, p);
+  }
+  if (base_latency == 0 || latency < knee * base_latency) {
+    // the device kept up with the queue, so it has capacity to spare
+    return _decay_stale(now, p);
+  }
+  ++busy_intervals;
+  last_busy_time = now;
+  stale = false;
+
+  const double x = b / n;
+  const double y = elapsed / n;
+  w = w * decay + 1;
+  sx = sx * decay + x;
+  sy = sy * decay + y;
+  sxx = sxx * decay + x * x;
+  sxy = sxy * decay + x * y;
+  if (w < min_weight) {
+    return false;
+  }
+
+  const double mx = sx / w;
+  const double my = sy / w;
+  const double var = sxx / w - mx * mx;
+  const double cov = sxy / w - mx * my;
+  if (mx > 0 &&
+      var > (min_size_deviation * mx) * (min_size_deviation * mx) &&
+      cov > 0) {
+    const double slope = cov / var;
+    const double intercept = my - slope * mx;
+    if (intercept > 0) {
+      iops = 1 / intercept;
+      bandwidth = 1 / slope;
+      bandwidth_fit = true;
+      return true;
+    }
+  }
+
+  bandwidth = p.given_bandwidth;
+  bandwidth_fit = false;
+  double per_io = bandwidth > 0 ? my - mx / bandwidth : my;
+  if (per_io <= 0) {
+    // the given bandwidth cannot explain the throughput, so charge all of
+    // the time to the IOs
+    per_io = my;
+  }
+  iops = 1 / per_io;
+  return true;
+}
+
+bool mClockCapacityEstimator::_decay_stale(double now, const params_t &p)
+{
+  if (iops == 0 || p.stale_age <= 0 || now - last_busy_time < p.stale_age) {
+    return false;
+  }
+  if (stale && iops == p.configured_iops &&
+      bandwidth == p.configured_bandwidth) {
+    return false;
+  }
+  stale = true;
+  auto toward = [](double v, double target) {
+    if (target <= 0) {
+      return v;
+    }
+    v = v * decay + target * (1 - decay);
+    return std::abs(v - target) <= snap * target ? target : v;
+  };
+  iops = toward(iops, p.configured_iops);
+  bandwidth = toward(bandwidth, p.configured_bandwidth);
+  // a fit of the old busy intervals would bring the estimate back as soon
+  // as there is a new one
+  w *= decay;
+  sx *= decay;
+  sy *= decay;
+  sxx *= decay;
+  sxy *= decay;
+  return true;
+}
+
+void mClockCapacityEstimator::reset()
+{
+  *this = mClockCapacityEstimator();
+}
+
+void mClockCapacityEstimator::dump(ceph::Formatter &f) const
+{
+  f.dump_unsigned("intervals", intervals);
+  f.dump_unsigned("busy_intervals", busy_intervals);
+  f.dump_float("queue_depth", queue_depth);
+  f.dump_float("latency", latency);
+  f.dump_float("base_latency", base_latency);
+  f.dump_float("iops", iops);
+  f.dump_float("bandwidth", bandwidth);
+  f.dump_bool("bandwidth_fit", bandwidth_fit);
+  f.dump_bool("stale", stale);
+  f.dump_float("busy_age", last_time - last_busy_time);
+}
+
+}
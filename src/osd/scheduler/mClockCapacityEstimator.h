@@ -0,0 +1,135 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "common/Formatter.h"
+
+namespace ceph::osd::scheduler {
+
+/**
+ * mClockCapacityEstimator
+ *
+ * Estimates the IOPS and bandwidth the OSD's device sustains from the
+ * transactions the object store commits and the reads it sends to the
+ * device, so mClock can follow a device whose capacity drifts from what
+ * was benchmarked when the OSD started.  Both are counted as IOs below.
+ *
+ * By Little's law, the time the IOs of an interval took, summed and
+ * divided by the length of the interval, is their mean queue depth.  A
+ * deep queue alone does not mean the device was kept busy, as SSDs serve
+ * many requests at once, so an interval is only used if its IOs also took
+ * at least knee times as long as those of the intervals with a shallow
+ * queue.  The device was then saturated, and the time it took per IO is
+ * the time it needs to serve one of their mean size:
+ *
+ *   1 / iops_observed = 1 / iops + size / bandwidth
+ *
+ * The two capacities are fit to that line over the busy intervals, older
+ * ones decayed so the estimate follows the device.  While the sizes have
+ * not varied enough to tell them apart, the bandwidth is taken as given and
+ * only the IOPS is fit.
+ *
+ * Without a busy interval for stale_age seconds, the estimate goes stale:
+ * the device may have recovered without being pushed hard enough to show
+ * it, so each interval moves the estimate back toward the configured
+ * capacity, and forgets the fit, at the decay rate.
+ */
+class mClockCapacityEstimator {
+public:
+  struct params_t {
+    double min_queue_depth = 4;      ///< for an interval to be sampled
+    double given_bandwidth = 0;      ///< to assume while it cannot be fit
+    double configured_iops = 0;      ///< a stale estimate returns to
+    double configured_bandwidth = 0; ///< a stale estimate returns to
+    double stale_age = 0;            ///< seconds, 0 to never go stale
+  };
+
+private:
+  /// weight an interval keeps in the fit for each interval after it
+  static constexpr double decay = 0.9;
+  /// busy intervals, decayed, needed before estimating
+  static constexpr double min_weight = 3.0;
+  /// relative deviation of the sizes needed to fit the bandwidth
+  static constexpr double min_size_deviation = 0.25;
+  /// IO latency, relative to base_latency, of a saturated device
+  static constexpr double knee = 2.0;
+  /// a stale estimate this close to the configured capacity snaps to it
+  static constexpr double snap = 0.01;
+
+  bool primed = false;
+  double last_time = 0;
+  double last_busy_time = 0;
+  uint64_t last_ios = 0;
+  uint64_t last_lat_ns = 0;
+  uint64_t last_bytes = 0;
+
+  // decayed sums over the busy intervals of x = mean size (bytes) and
+  // y = time per IO (seconds)
+  double w = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+  uint64_t intervals = 0;
+  uint64_t busy_intervals = 0;
+  double queue_depth = 0;     ///< of the last interval
+  double latency = 0;         ///< IO latency (seconds) of the last interval
+  /// IO latency of the intervals below min_queue_depth, decayed; 0 until
+  /// there was one
+  double base_latency = 0;
+  double iops = 0;            ///< 0 until estimated
+  double bandwidth = 0;       ///< bytes/second, 0 until estimated
+  bool bandwidth_fit = false; ///< bandwidth was fit rather than given
+  bool stale = false;
+
+  bool _decay_stale(double now, const params_t &p);
+
+public:
+  /**
+   * add_sample
+   *
+   * Feeds the cumulative IO counters of the object store at time now
+   * (seconds): the IOs, the sum of their latencies and their bytes.  The
+   * interval since the previous sample is used if its mean queue depth
+   * reached min_queue_depth and its latency the knee.  Returns true if
+   * the estimate was updated, which a stale estimate is on every interval.
+   */
+  bool add_sample(
+    double now,
+    uint64_t ios,
+    uint64_t lat_ns,
+    uint64_t bytes,
+    const params_t &p);
+
+  /// forget all samples and the estimate
+  void reset();
+
+  double get_last_time() const {
+    return last_time;
+  }
+  bool has_estimate() const {
+    return iops > 0;
+  }
+  double get_iops() const {
+    return iops;
+  }
+  double get_bandwidth() const {
+    return bandwidth;
+  }
+  bool is_stale() const {
+    return stale;
+  }
+
+  void dump(ceph::Formatter &f) const;
+};
+
+}
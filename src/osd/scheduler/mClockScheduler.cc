@@ -18,6 +18,8 @@
 
 #include "osd/scheduler/mClockScheduler.h"
 #include "common/dout.h"
+#include "osd/OSDMap.h"
+#include "osd/osd_perf_counters.h"
 
 namespace dmc = crimson::dmclock;
 using namespace std::placeholders;
@@ -55,6 +57,28 @@ mClockScheduler::mClockScheduler(CephContext *cct,
   set_config_defaults_from_profile();
   client_registry.update_from_config(
     cct->_conf, osd_bandwidth_capacity_per_shard);
+  set_client_qos_mode_from_config();
+
+  logger = build_mclock_perf(cct, "mclock_shard." + std::to_string(shard_id));
+  cct->get_perfcounters_collection()->add(logger);
+}
+
+static double calc_res(double res, double capacity_per_shard)
+{
+  if (res) {
+    return res * capacity_per_shard;
+  } else {
+    return default_min; // min reservation
+  }
+}
+
+static double calc_lim(double lim, double capacity_per_shard)
+{
+  if (lim) {
+    return lim * capacity_per_shard;
+  } else {
+    return default_max; // high limit
+  }
 }
 
 /* ClientRegistry holds the dmclock::ClientInfo configuration parameters
@@ -75,21 +99,12 @@ void mClockScheduler::ClientRegistry::update_from_config(
   const ConfigProxy &conf,
   const double capacity_per_shard)
 {
-
   auto get_res = [&](double res) {
-    if (res) {
-      return res * capacity_per_shard;
-    } else {
-      return default_min; // min reservation
-    }
+    return calc_res(res, capacity_per_shard);
   };
 
   auto get_lim = [&](double lim) {
-    if (lim) {
-      return lim * capacity_per_shard;
-    } else {
-      return default_max; // high limit
-    }
+    return calc_lim(lim, capacity_per_shard);
   };
 
   // Set external client infos
@@ -104,6 +119,13 @@ void mClockScheduler::ClientRegistry::update_from_config(
     wgt,
     get_lim(lim));
 
+  // and the pools', which default to them
+  {
+    std::lock_guard l(pool_lock);
+    default_pool_qos = pool_qos_t{res, wgt, lim};
+    _update_pool_infos(capacity_per_shard);
+  }
+
   // Set background recovery client infos
   res = conf.get_val<double>(
     "osd_mclock_scheduler_background_recovery_res");
@@ -131,11 +153,54 @@ void mClockScheduler::ClientRegistry::update_from_config(
       get_lim(lim));
 }
 
+bool mClockScheduler::ClientRegistry::update_pools(
+  std::map<int64_t, pool_qos_t> &&qos,
+  double capacity_per_shard)
+{
+  std::lock_guard l(pool_lock);
+  if (qos == pool_qos) {
+    return false;
+  }
+  pool_qos = std::move(qos);
+  _update_pool_infos(capacity_per_shard);
+  return true;
+}
+
+void mClockScheduler::ClientRegistry::_update_pool_infos(
+  double capacity_per_shard)
+{
+  for (auto& [pool, qos] : pool_qos) {
+    double res = calc_res(
+      qos.reservation ? qos.reservation : default_pool_qos.reservation,
+      capacity_per_shard);
+    double wgt = qos.weight ? qos.weight : default_pool_qos.weight;
+    double lim = calc_lim(
+      qos.limit ? qos.limit : default_pool_qos.limit,
+      capacity_per_shard);
+    auto [i, inserted] = pool_client_infos.try_emplace(
+      static_cast<uint64_t>(pool) + 1, res, wgt, lim);
+    if (!inserted) {
+      i->second.update(res, wgt, lim);
+    }
+  }
+  // pools whose options were unset or which were removed
+  for (auto& [profile_id, info] : pool_client_infos) {
+    if (!pool_qos.count(static_cast<int64_t>(profile_id - 1))) {
+      info.update(
+	calc_res(default_pool_qos.reservation, capacity_per_shard),
+	default_pool_qos.weight,
+	calc_lim(default_pool_qos.limit, capacity_per_shard));
+    }
+  }
+}
+
 const dmc::ClientInfo *mClockScheduler::ClientRegistry::get_external_client(
   const client_profile_id_t &client) const
 {
-  auto ret = external_client_infos.find(client);
-  if (ret == external_client_infos.end())
+  if (client.profile_id == 0)
+    return &default_external_client_info;
+  auto ret = pool_client_infos.find(client.profile_id);
+  if (ret == pool_client_infos.end())
     return &default_external_client_info;
   else
     return &(ret->second);
@@ -155,6 +220,65 @@ const dmc::ClientInfo *mClockScheduler::ClientRegistry::get_info(
   }
 }
 
+scheduler_id_t mClockScheduler::get_scheduler_id(
+  const OpSchedulerItem &item) const
+{
+  auto class_id = item.get_scheduler_class();
+  const auto& qos = item.get_client_qos();
+  if (class_id != op_scheduler_class::client || qos.pool < 0) {
+    return scheduler_id_t{class_id, client_profile_id_t()};
+  }
+  // pool ids may be 0, and profile 0 is the one all clients share
+  uint64_t profile_id = static_cast<uint64_t>(qos.pool) + 1;
+  switch (client_qos_mode.load()) {
+  case client_qos_mode_t::by_pool:
+    return scheduler_id_t{class_id, client_profile_id_t(0, profile_id)};
+  case client_qos_mode_t::by_client:
+    return scheduler_id_t{
+      class_id,
+      client_profile_id_t(item.get_owner(), profile_id)
+    };
+  default:
+    return scheduler_id_t{class_id, client_profile_id_t()};
+  }
+}
+
+void mClockScheduler::set_client_qos_mode_from_config()
+{
+  auto mode = cct->_conf.get_val<std::string>(
+    "osd_mclock_scheduler_client_qos_mode");
+  if (mode == "pool") {
+    client_qos_mode = client_qos_mode_t::by_pool;
+  } else if (mode == "client") {
+    client_qos_mode = client_qos_mode_t::by_client;
+  } else {
+    client_qos_mode = client_qos_mode_t::by_class;
+  }
+  dout(10) << __func__ << " client qos mode " << mode << dendl;
+}
+
+void mClockScheduler::update_from_osdmap(const OSDMap &osdmap)
+{
+  std::map<int64_t, pool_qos_t> qos;
+  for (const auto& [id, pool] : osdmap.get_pools()) {
+    pool_qos_t q;
+    int64_t wgt = 0;
+    pool.opts.get(pool_opts_t::QOS_RESERVATION, &q.reservation);
+    pool.opts.get(pool_opts_t::QOS_WEIGHT, &wgt);
+    pool.opts.get(pool_opts_t::QOS_LIMIT, &q.limit);
+    q.weight = wgt;
+    if (q != pool_qos_t()) {
+      qos.emplace(id, q);
+    }
+  }
+  if (client_registry.update_pools(
+	std::move(qos), osd_bandwidth_capacity_per_shard)) {
+    // mclock keeps the ClientInfo it looked up for each client it has
+    // seen, which is the default one for a pool that had no options yet
+    scheduler.update_client_infos();
+  }
+}
+
 void mClockScheduler::set_osd_capacity_params_from_config()
 {
   uint64_t osd_bandwidth_capacity;
@@ -174,6 +298,13 @@ void mClockScheduler::set_osd_capacity_params_from_config()
     }
   }();
 
+  if (double iops = estimated_iop_capacity; iops > 0) {
+    osd_iop_capacity = iops;
+  }
+  if (double bw = estimated_bandwidth_capacity; bw > 0) {
+    osd_bandwidth_capacity = static_cast<uint64_t>(bw);
+  }
+
   osd_bandwidth_capacity = std::max<uint64_t>(1, osd_bandwidth_capacity);
   osd_iop_capacity = std::max<double>(1.0, osd_iop_capacity);
 
@@ -190,6 +321,17 @@ void mClockScheduler::set_osd_capacity_params_from_config()
           << dendl;
 }
 
+void mClockScheduler::set_capacity_estimate(double iops, double bandwidth)
+{
+  dout(10) << __func__ << " iops " << iops
+	   << " bandwidth " << bandwidth << dendl;
+  estimated_iop_capacity = iops;
+  estimated_bandwidth_capacity = bandwidth;
+  set_osd_capacity_params_from_config();
+  client_registry.update_from_config(
+    cct->_conf, osd_bandwidth_capacity_per_shard);
+}
+
 /**
  * profile_t
  *
@@ -359,9 +501,20 @@ void mClockScheduler::dump(ceph::Formatter &f) const
   f.dump_int("scheduler", scheduler.request_count());
   f.close_section();
 
+  // capacity in use, and whether it was estimated
+  f.open_object_section("capacity");
+  f.dump_float("bandwidth_cost_per_io", osd_bandwidth_cost_per_io);
+  f.dump_float("bandwidth_capacity_per_shard",
+    osd_bandwidth_capacity_per_shard);
+  f.dump_bool("estimated", estimated_iop_capacity > 0 ||
+    estimated_bandwidth_capacity > 0);
+  f.close_section();
+
   // client map and queue tops (res, wgt, lim)
   std::ostringstream out;
   f.open_object_section("mClockClients");
+  f.dump_string("client_qos_mode",
+    cct->_conf.get_val<std::string>("osd_mclock_scheduler_client_qos_mode"));
   f.dump_int("client_count", scheduler.client_count());
   out << scheduler;
   f.dump_string("clients", out.str());
@@ -399,11 +552,27 @@ void mClockScheduler::enqueue(OpSchedulerItem&& item)
              << " scaled_cost: " << cost
              << dendl;
 
-    // Add item to scheduler queue
-    scheduler.add_request(
-      std::move(item),
-      id,
-      cost);
+    // Add item to scheduler queue, with the service the client got from
+    // other OSDs if it tracks that and has a QoS of its own
+    const auto& qos = item.get_client_qos();
+    if (id.client_profile_id.client_id && qos.tracked) {
+      auto to_cost = [](uint32_t v) {
+	return static_cast<uint32_t>(std::min<uint64_t>(
+	  uint64_t(v) * qos_cost_unit,
+	  std::numeric_limits<uint32_t>::max()));
+      };
+      dmc::ReqParams params(to_cost(qos.delta), to_cost(qos.rho));
+      scheduler.add_request(
+	std::move(item),
+	id,
+	params,
+	cost);
+    } else {
+      scheduler.add_request(
+	std::move(item),
+	id,
+	cost);
+    }
   }
 
  dout(20) << __func__ << " client_count: " << scheduler.client_count()
@@ -459,6 +628,7 @@ WorkItem mClockScheduler::dequeue()
       high_priority.erase(iter);
     }
     ceph_assert(std::get_if<OpSchedulerItem>(&ret));
+    logger->inc(l_mclock_high);
     return ret;
   } else {
     mclock_queue_t::PullReq result = scheduler.pull_request();
@@ -472,11 +642,50 @@ WorkItem mClockScheduler::dequeue()
       ceph_assert(result.is_retn());
 
       auto &retn = result.get_retn();
+      account_dequeue(retn.client, retn.phase, *retn.request);
       return std::move(*retn.request);
     }
   }
 }
 
+void mClockScheduler::account_dequeue(
+  const scheduler_id_t &id,
+  dmc::PhaseType phase,
+  const OpSchedulerItem &item)
+{
+  const bool res = phase == dmc::PhaseType::reservation;
+  switch (id.class_id) {
+  case op_scheduler_class::client:
+    logger->inc(res ? l_mclock_client_res : l_mclock_client_wgt);
+    logger->inc(l_mclock_client_cost, item.get_qos_cost());
+    break;
+  case op_scheduler_class::background_recovery:
+    logger->inc(res ? l_mclock_recovery_res : l_mclock_recovery_wgt);
+    logger->inc(l_mclock_recovery_cost, item.get_qos_cost());
+    break;
+  case op_scheduler_class::background_best_effort:
+    logger->inc(res ? l_mclock_best_effort_res : l_mclock_best_effort_wgt);
+    logger->inc(l_mclock_best_effort_cost, item.get_qos_cost());
+    break;
+  default:
+    break;
+  }
+  logger->set(l_mclock_clients, scheduler.client_count());
+
+  if (id.class_id != op_scheduler_class::client ||
+      !item.get_client_qos().tracked) {
+    return;
+  }
+  auto op = item.maybe_get_op();
+  if (!op || (*op)->get_req()->get_type() != CEPH_MSG_OSD_OP) {
+    return;
+  }
+  auto m = static_cast<MOSDOp*>((*op)->get_nonconst_req());
+  m->set_qos_resp(
+    res ? OSD_OP_QOS_PHASE_RESERVATION : OSD_OP_QOS_PHASE_PRIORITY,
+    (item.get_qos_cost() + qos_cost_unit - 1) / qos_cost_unit);
+}
+
 std::string mClockScheduler::display_queues() const
 {
   std::ostringstream out;
@@ -501,6 +710,7 @@ const char** mClockScheduler::get_tracked_conf_keys() const
     "osd_mclock_max_sequential_bandwidth_hdd",
     "osd_mclock_max_sequential_bandwidth_ssd",
     "osd_mclock_profile",
+    "osd_mclock_scheduler_client_qos_mode",
     NULL
   };
   return KEYS;
@@ -527,6 +737,9 @@ void mClockScheduler::handle_conf_change(
     client_registry.update_from_config(
       conf, osd_bandwidth_capacity_per_shard);
   }
+  if (changed.count("osd_mclock_scheduler_client_qos_mode")) {
+    set_client_qos_mode_from_config();
+  }
 
   auto get_changed_key = [&changed]() -> std::optional<std::string> {
     static const std::vector<std::string> qos_params = {
@@ -592,6 +805,8 @@ void mClockScheduler::handle_conf_change(
 mClockScheduler::~mClockScheduler()
 {
   cct->_conf.remove_observer(this);
+  cct->get_perfcounters_collection()->remove(logger);
+  delete logger;
 }
 
 }
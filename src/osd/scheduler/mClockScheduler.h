@@ -15,6 +15,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <ostream>
 #include <map>
@@ -27,7 +28,9 @@
 #include "osd/scheduler/OpScheduler.h"
 #include "common/config.h"
 #include "common/ceph_context.h"
+#include "common/ceph_mutex.h"
 #include "common/mClockPriorityQueue.h"
+#include "common/perf_counters.h"
 #include "osd/scheduler/OpSchedulerItem.h"
 
 
@@ -44,14 +47,13 @@ constexpr double default_max = std::numeric_limits<double>::is_iec559 ?
  * client_id - global id (client.####) for client QoS
  * profile_id - id generated by client's QoS profile
  *
- * Currently (Reef and below), both members are set to
- * 0 which ensures that all external clients share the
- * mClock profile allocated reservation and limit
- * bandwidth.
+ * With osd_mclock_scheduler_client_qos_mode = class, both members are
+ * set to 0 which ensures that all external clients share the mClock
+ * profile allocated reservation and limit bandwidth.
  *
- * Note: Post Reef, both members will be set to non-zero
- * values when the distributed feature of the mClock
- * algorithm is utilized.
+ * With "pool", profile_id is the pool id + 1, so each pool gets its own
+ * reservation and limit.  With "client", client_id is also set, to the
+ * client's global id, so each client of each pool gets its own.
  */
 struct client_profile_id_t {
   uint64_t client_id = 0;
@@ -72,6 +74,21 @@ struct client_profile_id_t {
   }
 };
 
+/**
+ * pool_qos_t
+ *
+ * The QoS pool options of a pool, 0 where unset: reservation and limit are
+ * fractions of the OSD's capacity like osd_mclock_scheduler_client_res and
+ * osd_mclock_scheduler_client_lim.
+ */
+struct pool_qos_t {
+  double reservation = 0;
+  uint64_t weight = 0;
+  double limit = 0;
+
+  bool operator==(const pool_qos_t&) const = default;
+};
+
 struct scheduler_id_t {
   op_scheduler_class class_id;
   client_profile_id_t client_profile_id;
@@ -142,6 +159,18 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
    */
   double osd_bandwidth_capacity_per_shard;
 
+  /**
+   * estimated_iop_capacity, estimated_bandwidth_capacity
+   *
+   * The OSD capacity estimated from the commit latency of the object store
+   * when osd_mclock_capacity_estimator is enabled, used in place of
+   * osd_mclock_max_capacity_iops_(hdd|ssd) and
+   * osd_mclock_max_sequential_bandwidth_(hdd|ssd) unless 0.  Set by the OSD
+   * through set_capacity_estimate.
+   */
+  std::atomic<double> estimated_iop_capacity = 0.0;
+  std::atomic<double> estimated_bandwidth_capacity = 0.0;
+
   class ClientRegistry {
     std::array<
       crimson::dmclock::ClientInfo,
@@ -153,10 +182,27 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
     };
 
     crimson::dmclock::ClientInfo default_external_client_info = {1, 1, 1};
-    std::map<client_profile_id_t,
-	     crimson::dmclock::ClientInfo> external_client_infos;
+
+    /// osd_mclock_scheduler_client_*, the defaults of the pool options
+    pool_qos_t default_pool_qos;
+    std::map<int64_t, pool_qos_t> pool_qos;
+    /**
+     * pool_client_infos
+     *
+     * The resolved pool_qos of the pools that have ever had it set, by pool
+     * id + 1.  Entries are updated in place and never removed, as mclock
+     * keeps pointers to them.  Only updated with pool_lock held, as
+     * update_from_config is called from the config observer while
+     * update_pools is called from the OSD shard; get_info is not, as it
+     * only runs in the shard and the map is never restructured but there.
+     */
+    std::map<uint64_t, crimson::dmclock::ClientInfo> pool_client_infos;
+    ceph::mutex pool_lock =
+      ceph::make_mutex("mClockScheduler::ClientRegistry::pool_lock");
+
     const crimson::dmclock::ClientInfo *get_external_client(
       const client_profile_id_t &client) const;
+    void _update_pool_infos(double capacity_per_shard);
   public:
     /**
      * update_from_config
@@ -168,10 +214,39 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
     void update_from_config(
       const ConfigProxy &conf,
       double capacity_per_shard);
+    /**
+     * update_pools
+     *
+     * Sets the mclock parameters of the pools that have QoS options set,
+     * for osd_mclock_scheduler_client_qos_mode pool and client.  Returns
+     * true if they changed.
+     */
+    bool update_pools(
+      std::map<int64_t, pool_qos_t> &&qos,
+      double capacity_per_shard);
     const crimson::dmclock::ClientInfo *get_info(
       const scheduler_id_t &id) const;
   } client_registry;
 
+  enum class client_qos_mode_t {
+    by_class,
+    by_pool,
+    by_client,
+  };
+  std::atomic<client_qos_mode_t> client_qos_mode = client_qos_mode_t::by_class;
+
+  /**
+   * qos_cost_unit
+   *
+   * The unit of the costs reported to clients tracking their service, and
+   * of the delta and rho they send back.  Units of the bytes mclock costs
+   * are counted in would overflow the 32 bit counters of the clients for
+   * those doing large IO, and would tie them to this OSD's cost per IO.
+   */
+  static constexpr uint32_t qos_cost_unit = 4096;
+
+  PerfCounters *logger = nullptr;
+
   using mclock_queue_t = crimson::dmclock::PullPriorityQueue<
     scheduler_id_t,
     OpSchedulerItem,
@@ -192,12 +267,7 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
   SubQueue high_priority;
   priority_t immediate_class_priority = std::numeric_limits<priority_t>::max();
 
-  static scheduler_id_t get_scheduler_id(const OpSchedulerItem &item) {
-    return scheduler_id_t{
-      item.get_scheduler_class(),
-      client_profile_id_t()
-    };
-  }
+  scheduler_id_t get_scheduler_id(const OpSchedulerItem &item) const;
 
   static unsigned int get_io_prio_cut(CephContext *cct) {
     if (cct->_conf->osd_op_queue_cut_off == "debug_random") {
@@ -225,12 +295,22 @@ class mClockScheduler : public OpScheduler, md_config_obs_t {
    * Invoking set_osd_capacity_params_from_config() resets those derived
    * params based on the current config and should be invoked any time they
    * are modified as well as in the constructor.  See handle_conf_change().
+   * A capacity estimated by the OSD takes precedence over the config.
    */
   void set_osd_capacity_params_from_config();
 
   // Set the mclock related config params based on the profile
   void set_config_defaults_from_profile();
 
+  void set_client_qos_mode_from_config();
+
+  // Account a dequeued item to the perf counters and, for clients tracking
+  // their service, record the phase it was scheduled in for the reply
+  void account_dequeue(
+    const scheduler_id_t &id,
+    crimson::dmclock::PhaseType phase,
+    const OpSchedulerItem &item);
+
 public: 
   mClockScheduler(CephContext *cct, int whoami, uint32_t num_shards,
     int shard_id, bool is_rotational, MonClient *monc);
@@ -266,6 +346,12 @@ public:
   // Update data associated with the modified mclock config key(s)
   void update_configuration() final;
 
+  // Update the pool QoS options
+  void update_from_osdmap(const OSDMap &osdmap) final;
+
+  // Use the OSD capacity estimated from the object store, if not 0
+  void set_capacity_estimate(double iops, double bandwidth) final;
+
   const char** get_tracked_conf_keys() const final;
   void handle_conf_change(const ConfigProxy& conf,
 			  const std::set<std::string> &changed) final;
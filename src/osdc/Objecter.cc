@@ -58,6 +58,8 @@
 #include "common/async/waiter.h"
 #include "error_code.h"
 
+#include "dmclock/src/dmclock_client.h"
+
 
 using std::list;
 using std::make_pair;
@@ -188,6 +190,13 @@ inline bs::error_code osdcode(int r) {
 }
 }
 
+// Counts the service each OSD reports for our ops, to send the dmclock
+// delta and rho with the next op to each OSD
+class Objecter::QosTracker {
+public:
+  crimson::dmclock::ServiceTracker<int> tracker;
+};
+
 // config obs ----------------------------
 
 class Objecter::RequestStateHook : public AdminSocketHook {
@@ -3232,6 +3241,11 @@ Objecter::MOSDOp *Objecter::_prepare_osd_op(Op *op)
     m->set_reqid(op->reqid);
   }
 
+  if (qos_tracker) {
+    auto params = qos_tracker->tracker.get_req_params(op->target.osd);
+    m->set_qos_params(params.delta, params.rho);
+  }
+
   logger->inc(l_osdc_op_send);
   ssize_t sum = 0;
   for (unsigned i = 0; i < m->ops.size(); i++) {
@@ -3411,6 +3425,14 @@ void Objecter::handle_osd_op_reply(MOSDOpReply *m)
   Op *op = iter->second;
   op->trace.event("osd op reply");
 
+  if (qos_tracker && m->has_qos_resp()) {
+    qos_tracker->tracker.track_resp(
+      s->osd,
+      m->is_qos_reservation() ? crimson::dmclock::PhaseType::reservation :
+				crimson::dmclock::PhaseType::priority,
+      m->get_qos_cost());
+  }
+
   if (retry_writes_after_first_reply && op->attempts == 1 &&
       (op->target.flags & CEPH_OSD_FLAG_WRITE)) {
     ldout(cct, 7) << "retrying write after first reply: " << tid << dendl;
@@ -5009,6 +5031,9 @@ Objecter::Objecter(CephContext *cct,
 {
   mon_timeout = cct->_conf.get_val<std::chrono::seconds>("rados_mon_op_timeout");
   osd_timeout = cct->_conf.get_val<std::chrono::seconds>("rados_osd_op_timeout");
+  if (cct->_conf->objecter_mclock_service_tracker) {
+    qos_tracker = std::make_unique<QosTracker>();
+  }
 }
 
 Objecter::~Objecter()
@@ -1754,6 +1754,10 @@ private:
 
   RequestStateHook *m_request_state_hook = nullptr;
 
+  // dmclock service tracking, see objecter_mclock_service_tracker
+  class QosTracker;
+  std::unique_ptr<QosTracker> qos_tracker;
+
 public:
   /*** track pending operations ***/
   // read
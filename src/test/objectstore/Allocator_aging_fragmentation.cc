@@ -460,4 +460,4 @@ TEST_P(AllocTest, test_bonus_empty_fragmented)
 INSTANTIATE_TEST_SUITE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap", "avl", "btree"));
+  ::testing::Values("stupid", "bitmap", "avl", "btree", "sizeclass"));
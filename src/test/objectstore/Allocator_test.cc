@@ -654,7 +654,80 @@ TEST_P(AllocTest, test_init_rm_free_unbound)
   }
 }
 
+TEST_P(AllocTest, test_fragmentation_score_no_walk)
+{
+  // allocators that keep what the score needs must agree with the walk
+  uint64_t capacity = 1024 * 1024 * 1024;
+  uint64_t alloc_unit = 4096;
+  gen_type rng;
+  PExtentVector allocated;
+
+  init_alloc(capacity, alloc_unit);
+  alloc->init_add_free(0, capacity);
+  EXPECT_EQ(alloc->Allocator::get_fragmentation_score(),
+	    alloc->get_fragmentation_score());
+  for (size_t round = 0; round < 10; round++) {
+    for (size_t j = 0; j < 1000; j++) {
+      if (allocated.empty() || rng() % 2) {
+	uint64_t want = (rng() % (256 * alloc_unit)) / alloc_unit * alloc_unit +
+	  alloc_unit;
+	alloc->allocate(want, alloc_unit, 0, 0, &allocated);
+      } else {
+	size_t item = rng() % allocated.size();
+	interval_set<uint64_t> release_set;
+	release_set.insert(allocated[item].offset, allocated[item].length);
+	alloc->release(release_set);
+	std::swap(allocated[item], allocated.back());
+	allocated.pop_back();
+      }
+    }
+    EXPECT_NEAR(alloc->Allocator::get_fragmentation_score(),
+		alloc->get_fragmentation_score(), 1e-9);
+  }
+}
+
+TEST_P(AllocTest, test_alloc_size_class)
+{
+  if (GetParam() != string("sizeclass")) {
+    GTEST_SKIP() << "size class segregation is specific to sizeclass";
+  }
+  uint64_t block = 0x1000;
+  uint64_t size = 0x10000000;
+
+  init_alloc(size, block);
+  // a large extent first, then small holes further on
+  alloc->init_add_free(0, 0x1000000);
+  alloc->init_add_free(0x2000000, 0x1000);
+  alloc->init_add_free(0x2002000, 0x3000);
+  alloc->init_add_free(0x2006000, 0x8000);
+
+  // small allocations go to the smallest extents that fit...
+  PExtentVector extents;
+  EXPECT_EQ(0x1000, alloc->allocate(0x1000, block, 0, 0, &extents));
+  EXPECT_EQ(0x2000000u, extents[0].offset);
+  extents.clear();
+  EXPECT_EQ(0x2000, alloc->allocate(0x2000, block, 0, 0, &extents));
+  EXPECT_EQ(0x2002000u, extents[0].offset);
+  extents.clear();
+  EXPECT_EQ(0x4000, alloc->allocate(0x4000, block, 0, 0, &extents));
+  EXPECT_EQ(0x2006000u, extents[0].offset);
+
+  // ...and the large extent is left whole
+  extents.clear();
+  EXPECT_EQ(0x1000000, alloc->allocate(0x1000000, block, 0, 0, &extents));
+  ASSERT_EQ(1u, extents.size());
+  EXPECT_EQ(0u, extents[0].offset);
+
+  // no extent is large enough: the request is split over what is left
+  extents.clear();
+  alloc->init_add_free(0x4000000, 0x10000);
+  EXPECT_EQ(0x15000, alloc->allocate(0x15000, block, 0, 0, &extents));
+  EXPECT_EQ(3u, extents.size());
+  EXPECT_EQ(0u, alloc->get_free());
+}
+
 INSTANTIATE_TEST_SUITE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap", "avl", "hybrid", "btree"));
+  ::testing::Values("stupid", "bitmap", "avl", "hybrid", "btree",
+		    "sizeclass"));
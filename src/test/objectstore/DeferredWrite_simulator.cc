@@ -0,0 +1,241 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Deferred write simulator
+ *
+ * Replays a random overwrite workload through ObjectStoreImitator and puts
+ * a simple device model on top of its allocations to compare a static
+ * deferred write threshold with the one picked by DeferredSizeController.
+ */
+#include "common/ceph_argparse.h"
+#include "common/common_init.h"
+#include "common/hobject.h"
+
+#include "global/global_context.h"
+#include "global/global_init.h"
+#include <gtest/gtest.h>
+
+#include "include/buffer_fwd.h"
+#include "os/ObjectStore.h"
+#include "os/bluestore/DeferredSizeController.h"
+#include "test/objectstore/ObjectStoreImitator.h"
+#include <algorithm>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int.hpp>
+#include <fmt/core.h>
+#include <string>
+
+#define dout_context g_ceph_context
+#define dout_subsys ceph_subsys_test
+
+constexpr uint64_t _1Kb = 1024;
+constexpr uint64_t _1Mb = 1024 * _1Kb;
+constexpr uint64_t _1Gb = 1024 * _1Mb;
+
+typedef boost::mt11213b gen_type;
+
+static bufferlist make_bl(size_t len, char c) {
+  bufferlist bl;
+  if (len > 0) {
+    bl.reserve(len);
+    bl.append(std::string(len, c));
+  }
+
+  return bl;
+}
+
+// --------- Device model ----------
+
+struct DeviceModel {
+  std::string name;
+  double main_seek;      // seconds per random main device IO
+  double main_bw;        // bytes/s
+  double wal_commit;     // seconds per kv commit
+  double wal_bw;         // bytes/s
+  bool wal_on_main;      // WAL shares the main device
+  double flush_seek_ratio; // seek cost of a sorted deferred flush, per IO
+};
+
+static const DeviceModel hdd_nvme = {"hdd+nvme", 0.008,  150.0 * _1Mb,
+                                     0.0002,     1.0 * _1Gb, false,
+                                     0.25};
+static const DeviceModel all_flash = {"flash", 0.00002, 2.0 * _1Gb,
+                                      0.0001,  2.0 * _1Gb, true,
+                                      0.25};
+
+// Accounts the busy time of the main and WAL devices for a workload that
+// keeps both queues full, so the elapsed time is that of the busiest one.
+class DeferredWriteModel {
+public:
+  DeferredWriteModel(const DeviceModel &d, uint64_t static_size,
+                     bool adaptive, uint64_t throttle_bytes)
+      : dev(d), static_size(static_size), adaptive(adaptive),
+        throttle_bytes(throttle_bytes) {
+    DeferredSizeController::config_t c;
+    c.min_size = 0;
+    c.max_size = 256 * _1Kb;
+    c.granularity = 4 * _1Kb;
+    ctl.configure(c, static_size);
+  }
+
+  void on_write(uint64_t length, const PExtentVector &extents) {
+    uint64_t threshold = adaptive ? ctl.get_size() : static_size;
+    if (length < threshold || extents.empty()) {
+      // data goes to the kv WAL now, to the main device with a later flush
+      double lat = dev.wal_commit + length / dev.wal_bw;
+      _wal_io(lat);
+      ctl.add_kv_commit(lat);
+      backlog_bytes += length;
+      backlog_ios++;
+      deferred_bytes += length;
+      if (backlog_bytes >= flush_batch) {
+        _flush();
+      }
+    } else {
+      double lat = extents.size() * dev.main_seek + length / dev.main_bw;
+      main_busy += lat;
+      ctl.add_device_write(lat, length);
+      _wal_io(dev.wal_commit);
+      ctl.add_kv_commit(dev.wal_commit);
+    }
+    bytes += length;
+    if (adaptive && ++since_update >= update_every) {
+      since_update = 0;
+      ctl.update(double(backlog_bytes) / throttle_bytes);
+    }
+  }
+
+  void finish() { _flush(); }
+
+  double throughput() const {
+    return bytes / std::max(main_busy, wal_busy);
+  }
+  uint64_t get_threshold() const {
+    return adaptive ? ctl.get_size() : static_size;
+  }
+  uint64_t get_deferred_bytes() const { return deferred_bytes; }
+
+private:
+  static constexpr uint64_t flush_batch = 4 * _1Mb;
+  static constexpr unsigned update_every = 64;
+
+  const DeviceModel dev;
+  const uint64_t static_size;
+  const bool adaptive;
+  const uint64_t throttle_bytes;
+  DeferredSizeController ctl;
+
+  double main_busy = 0;
+  double wal_busy = 0;
+  uint64_t bytes = 0;
+  uint64_t deferred_bytes = 0;
+  uint64_t backlog_bytes = 0;
+  uint64_t backlog_ios = 0;
+  unsigned since_update = 0;
+
+  void _wal_io(double lat) {
+    if (dev.wal_on_main) {
+      main_busy += lat;
+    } else {
+      wal_busy += lat;
+    }
+  }
+
+  void _flush() {
+    main_busy += backlog_ios * dev.flush_seek_ratio * dev.main_seek +
+                 backlog_bytes / dev.main_bw;
+    backlog_bytes = 0;
+    backlog_ios = 0;
+  }
+};
+
+// --------- Simulator ----------
+
+class DeferredWriteSimulator : public ::testing::Test {
+public:
+  struct result_t {
+    double throughput;
+    uint64_t threshold;
+    uint64_t deferred_bytes;
+  };
+
+  result_t run(const DeviceModel &dev, uint64_t static_size, bool adaptive) {
+    ObjectStoreImitator os(g_ceph_context, "", 4 * _1Kb);
+    os.init_alloc("avl", 64 * _1Gb);
+
+    DeferredWriteModel model(dev, static_size, adaptive, 64 * _1Mb);
+    os.set_write_observer(
+        [&model](uint64_t length, const PExtentVector &extents) {
+          model.on_write(length, extents);
+        });
+
+    ObjectStore::CollectionHandle ch = os.create_new_collection(coll_t::meta());
+    ObjectStore::Transaction t;
+    t.create_collection(ch->cid, 0);
+    os.queue_transaction(ch, std::move(t));
+
+    constexpr unsigned num_objs = 64;
+    constexpr uint64_t obj_size = 4 * _1Mb;
+    std::vector<ghobject_t> objs;
+    for (unsigned i = 0; i < num_objs; ++i) {
+      hobject_t h;
+      h.oid = fmt::format("obj_{}", i);
+      h.set_hash(i);
+      h.pool = 1;
+      objs.emplace_back(h);
+      ObjectStore::Transaction t;
+      t.create(ch->get_cid(), objs.back());
+      os.queue_transaction(ch, std::move(t));
+    }
+
+    // same seed for every run so that runs are comparable
+    gen_type rng(0);
+    boost::uniform_int<> obj_idx(0, num_objs - 1);
+    boost::uniform_int<> blocks(1, 64);
+    for (unsigned i = 0; i < 4000; ++i) {
+      uint64_t length = blocks(rng) * 4 * _1Kb;
+      boost::uniform_int<> off_blocks(0, (obj_size - length) / (4 * _1Kb));
+      uint64_t offset = off_blocks(rng) * 4 * _1Kb;
+      ObjectStore::Transaction t;
+      t.write(ch->get_cid(), objs[obj_idx(rng)], offset, length,
+              make_bl(length, 'c'));
+      os.queue_transaction(ch, std::move(t));
+    }
+    model.finish();
+
+    result_t r{model.throughput(), model.get_threshold(),
+               model.get_deferred_bytes()};
+    dout(0) << dev.name << (adaptive ? " adaptive" : " static")
+            << " threshold 0x" << std::hex << r.threshold << " deferred 0x"
+            << r.deferred_bytes << std::dec << " throughput "
+            << r.throughput / _1Mb << " MB/s" << dendl;
+    return r;
+  }
+};
+
+TEST_F(DeferredWriteSimulator, HddWithFlashDB) {
+  auto s = run(hdd_nvme, 64 * _1Kb, false);
+  auto a = run(hdd_nvme, 64 * _1Kb, true);
+  ASSERT_GT(a.threshold, 64 * _1Kb);
+  ASSERT_GT(a.throughput, s.throughput);
+}
+
+TEST_F(DeferredWriteSimulator, AllFlash) {
+  auto s = run(all_flash, 64 * _1Kb, false);
+  auto a = run(all_flash, 64 * _1Kb, true);
+  ASSERT_LT(a.threshold, 64 * _1Kb);
+  ASSERT_GE(a.throughput, s.throughput * 0.95);
+}
+
+// ----------- main -----------
+
+int main(int argc, char **argv) {
+  auto args = argv_to_vec(argc, argv);
+  auto cct =
+      global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY,
+                  CINIT_FLAG_NO_DEFAULT_CONFIG_FILE);
+  common_init_finish(g_ceph_context);
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
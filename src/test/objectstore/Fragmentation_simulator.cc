@@ -435,7 +435,7 @@ TEST_P(FragmentationSimulator, MultiThreadedCWGenerator) {
 
 INSTANTIATE_TEST_SUITE_P(Allocator, FragmentationSimulator,
                          ::testing::Values("stupid", "bitmap", "avl", "btree",
-                                           "hybrid"));
+                                           "hybrid", "sizeclass"));
 
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
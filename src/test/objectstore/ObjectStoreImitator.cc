@@ -663,6 +663,9 @@ int ObjectStoreImitator::_do_write(CollectionRef &c, ObjectRef &o,
   }
 
   if (length < min_alloc_size) {
+    if (write_observer) {
+      write_observer(length, {});
+    }
     return 0;
   }
 
@@ -755,6 +758,9 @@ int ObjectStoreImitator::_do_alloc_write(CollectionRef coll, ObjectRef &o,
   }
 
   o->append(extents, offset);
+  if (write_observer) {
+    write_observer(length, extents);
+  }
 
   if (prealloc_left > 0) {
     PExtentVector old_extents;
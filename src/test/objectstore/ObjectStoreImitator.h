@@ -13,6 +13,7 @@
 #include "os/bluestore/bluestore_types.h"
 #include <algorithm>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <functional>
 
 #define META_POOL_ID ((uint64_t)-1ull)
 
@@ -30,6 +31,14 @@
  * any object data is not stored.
  */
 class ObjectStoreImitator : public ObjectStore {
+public:
+  // Called for every write with the device extents it was allocated, empty
+  // when the write is too small to get its own allocation (BlueStore would
+  // merge it into an existing blob). Lets simulators put a device model on
+  // top of the allocation decisions.
+  typedef std::function<void(uint64_t length, const PExtentVector &extents)>
+      write_observer_t;
+
 private:
   class Collection;
   typedef boost::intrusive_ptr<Collection> CollectionRef;
@@ -196,6 +205,8 @@ private:
 
   // Members
 
+  write_observer_t write_observer;
+
   double alloc_time = 0.0;
   uint64_t alloc_ops = 0;
 
@@ -239,6 +250,8 @@ public:
 
   // Print allocator average latency
   void print_allocator_profile();
+
+  void set_write_observer(write_observer_t o) { write_observer = std::move(o); }
   // Overrides
 
   // This is often not called directly but through queue_transaction
@@ -16,14 +16,21 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <algorithm>
+#include <random>
 #include <string>
 #include <iostream>
+#include <thread>
 
 using namespace std;
 
 #include "common/ceph_argparse.h"
 #include "common/debug.h"
 #include "common/Cycles.h"
+#include "common/Cond.h"
+#include "common/errno.h"
+#include "common/Formatter.h"
+#include "common/perf_counters.h"
 #include "global/global_init.h"
 #include "os/ObjectStore.h"
 
@@ -234,9 +241,303 @@ const ghobject_t PerfCase::info_oid(hobject_t(sobject_t(object_t("infos"), 0)));
 Transaction::Tick Transaction::write_ticks, Transaction::setattr_ticks, Transaction::omap_setkeys_ticks, Transaction::omap_rmkey_ticks;
 Transaction::Tick Transaction::encode_ticks, Transaction::decode_ticks, Transaction::iterate_ticks;
 
+// Reads back whole 4MB objects that were written one after the other as
+// shuffled 4K writes, so that every object ends up made of many small
+// extents that are physically adjacent but out of logical order.  The
+// reads bypass the buffer cache, so each one goes to the device and
+// exercises the fragmented (and coalesced) read path of the store.
+class FragmentedReadCase {
+  static constexpr uint64_t object_size = 4 << 20;
+  static constexpr uint64_t chunk_size = 4096;
+  static constexpr unsigned num_objects = 16;
+
+  ObjectStore *store;
+  coll_t cid;
+  ObjectStore::CollectionHandle ch;
+  vector<ghobject_t> oids;
+
+  int apply(ObjectStore::Transaction&& t) {
+    C_SaferCond c;
+    t.register_on_commit(&c);
+    int r = store->queue_transaction(ch, std::move(t));
+    if (r < 0)
+      return r;
+    return c.wait();
+  }
+
+ public:
+  explicit FragmentedReadCase(ObjectStore *s)
+    : store(s), cid(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD)) {
+    for (unsigned i = 0; i < num_objects; ++i) {
+      oids.emplace_back(hobject_t(sobject_t(
+        object_t("frag_obj_" + std::to_string(i)), CEPH_NOSNAP)));
+    }
+  }
+
+  int prepare() {
+    ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = apply(std::move(t));
+    if (r < 0)
+      return r;
+
+    vector<pair<unsigned, uint64_t>> writes;
+    std::mt19937 rng(0);
+    for (unsigned i = 0; i < num_objects; ++i) {
+      auto first = writes.size();
+      for (uint64_t off = 0; off < object_size; off += chunk_size) {
+        writes.emplace_back(i, off);
+      }
+      std::shuffle(writes.begin() + first, writes.end(), rng);
+    }
+
+    bufferlist bl;
+    bl.append(buffer::create_page_aligned(chunk_size));
+    bl.rebuild_page_aligned();
+    memset(bl.c_str(), 0x5a, chunk_size);
+    const unsigned batch = 64;
+    for (size_t i = 0; i < writes.size(); i += batch) {
+      ObjectStore::Transaction t;
+      for (size_t j = i; j < std::min(writes.size(), i + batch); ++j) {
+        t.write(cid, oids[writes[j].first], writes[j].second, chunk_size, bl);
+      }
+      r = apply(std::move(t));
+      if (r < 0)
+        return r;
+    }
+    return 0;
+  }
+
+  // returns total ticks spent in read()
+  int64_t run(uint64_t times) {
+    uint64_t ticks = 0;
+    for (uint64_t i = 0; i < times; ++i) {
+      bufferlist bl;
+      uint64_t start_time = Cycles::rdtsc();
+      int r = store->read(ch, oids[i % num_objects], 0, object_size, bl,
+                          CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+                          CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+      ticks += Cycles::rdtsc() - start_time;
+      if (r != (int)object_size) {
+        cerr << "read failed: " << r << std::endl;
+        return -1;
+      }
+    }
+    return ticks;
+  }
+
+  int cleanup() {
+    ObjectStore::Transaction t;
+    for (auto& oid : oids) {
+      t.remove(cid, oid);
+    }
+    t.remove_collection(cid);
+    int r = apply(std::move(t));
+    ch.reset();
+    return r;
+  }
+
+  static uint64_t get_object_size() {
+    return object_size;
+  }
+};
+
+// Many threads reading the same few small, cached objects of a single
+// collection, like a boot storm of cloned images.  All lookups hit the
+// same cache shard, so this measures the cost of cache hits under
+// contention.
+class HotReadCase {
+  static constexpr uint64_t object_size = 64 << 10;
+  static constexpr uint64_t read_size = 4096;
+  static constexpr unsigned num_objects = 8;
+
+  ObjectStore *store;
+  coll_t cid;
+  ObjectStore::CollectionHandle ch;
+  vector<ghobject_t> oids;
+
+  int apply(ObjectStore::Transaction&& t) {
+    C_SaferCond c;
+    t.register_on_commit(&c);
+    int r = store->queue_transaction(ch, std::move(t));
+    if (r < 0)
+      return r;
+    return c.wait();
+  }
+
+ public:
+  explicit HotReadCase(ObjectStore *s)
+    : store(s), cid(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD)) {
+    for (unsigned i = 0; i < num_objects; ++i) {
+      oids.emplace_back(hobject_t(sobject_t(
+        object_t("hot_obj_" + std::to_string(i)), CEPH_NOSNAP)));
+    }
+  }
+
+  int prepare() {
+    ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    bufferlist bl;
+    bl.append(string(object_size, 0x5a));
+    for (auto& oid : oids) {
+      t.write(cid, oid, 0, object_size, bl);
+    }
+    int r = apply(std::move(t));
+    if (r < 0)
+      return r;
+    // warm up the cache
+    for (auto& oid : oids) {
+      bufferlist out;
+      r = store->read(ch, oid, 0, object_size, out,
+                      CEPH_OSD_OP_FLAG_FADVISE_WILLNEED);
+      if (r < 0)
+        return r;
+    }
+    return 0;
+  }
+
+  // returns wall clock seconds for times reads in each thread
+  double run(uint64_t times, unsigned threads) {
+    std::atomic<bool> failed = false;
+    vector<std::thread> workers;
+    auto start = ceph::mono_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t] {
+        std::mt19937 rng(t);
+        for (uint64_t i = 0; i < times && !failed; ++i) {
+          bufferlist bl;
+          uint64_t off = (rng() % (object_size / read_size)) * read_size;
+          int r = store->read(ch, oids[rng() % num_objects], off, read_size, bl);
+          if (r != (int)read_size) {
+            cerr << "read failed: " << r << std::endl;
+            failed = true;
+          }
+        }
+      });
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+    if (failed)
+      return -1;
+    return std::chrono::duration<double>(ceph::mono_clock::now() - start).count();
+  }
+
+  int cleanup() {
+    ObjectStore::Transaction t;
+    for (auto& oid : oids) {
+      t.remove(cid, oid);
+    }
+    t.remove_collection(cid);
+    int r = apply(std::move(t));
+    ch.reset();
+    return r;
+  }
+};
+
+static std::unique_ptr<ObjectStore> create_and_mount(const string& type,
+                                                     const string& path)
+{
+  auto store = ObjectStore::create(g_ceph_context, type, path);
+  if (!store) {
+    cerr << "unknown objectstore type " << type << std::endl;
+    return nullptr;
+  }
+  int r = store->mkfs();
+  if (r < 0) {
+    cerr << "mkfs failed: " << cpp_strerror(r) << std::endl;
+    return nullptr;
+  }
+  r = store->mount();
+  if (r < 0) {
+    cerr << "mount failed: " << cpp_strerror(r) << std::endl;
+    return nullptr;
+  }
+  g_conf().set_safe_to_start_threads();
+  return store;
+}
+
+int hot_read(uint64_t times, const string& type, const string& path,
+             unsigned threads)
+{
+  auto store = create_and_mount(type, path);
+  if (!store) {
+    return 1;
+  }
+
+  int ret = 1;
+  {
+    HotReadCase c(store.get());
+    int r = c.prepare();
+    if (r < 0) {
+      cerr << "prepare failed: " << cpp_strerror(r) << std::endl;
+    } else {
+      double secs = c.run(times, threads);
+      if (secs >= 0) {
+        cerr << " Total 4K hot reads " << times * threads << " by "
+             << threads << " threads run time " << secs * 1000000 << "us, "
+             << (secs > 0 ? times * threads / secs : 0) << " reads/s"
+             << std::endl;
+        if (auto logger = store->get_perf_counters(); logger) {
+          JSONFormatter f(true);
+          f.open_object_section("counters");
+          for (auto name : {"buffer_lockless_hits", "buffer_lock_waits"}) {
+            logger->dump_formatted(&f, false, false, name);
+          }
+          f.close_section();
+          f.flush(cerr);
+          cerr << std::endl;
+        }
+        ret = 0;
+      }
+    }
+    c.cleanup();
+  }
+  store->umount();
+  return ret;
+}
+
+int fragmented_read(uint64_t times, const string& type, const string& path)
+{
+  auto store = create_and_mount(type, path);
+  if (!store) {
+    return 1;
+  }
+
+  int ret = 1;
+  {
+    FragmentedReadCase c(store.get());
+    int r = c.prepare();
+    if (r < 0) {
+      cerr << "prepare failed: " << cpp_strerror(r) << std::endl;
+    } else {
+      int64_t ticks = c.run(times);
+      if (ticks >= 0) {
+        double secs = Cycles::to_seconds(ticks);
+        cerr << " Total 4MB fragmented reads " << times << " run time "
+             << Cycles::to_microseconds(ticks) << "us, "
+             << (secs > 0 ? times / secs : 0) << " reads/s, "
+             << (secs > 0 ? times * FragmentedReadCase::get_object_size() /
+                 secs / (1 << 20) : 0)
+             << " MB/s" << std::endl;
+        ret = 0;
+      }
+    }
+    c.cleanup();
+  }
+  store->umount();
+  return ret;
+}
+
 void usage(const string &name) {
   cerr << "Usage: " << name << " [times] "
        << std::endl;
+  cerr << "       " << name << " [times] fragmented_read <store type> <path>"
+       << std::endl;
+  cerr << "       " << name
+       << " [times] hot_read <store type> <path> [threads]" << std::endl;
 }
 
 int main(int argc, char **argv)
@@ -257,6 +558,18 @@ int main(int argc, char **argv)
   }
 
   uint64_t times = atoi(args[0]);
+  if (args.size() > 1) {
+    if (args.size() == 4 && string(args[1]) == "fragmented_read") {
+      return fragmented_read(times, args[2], args[3]);
+    }
+    if ((args.size() == 4 || args.size() == 5) &&
+        string(args[1]) == "hot_read") {
+      unsigned threads = args.size() == 5 ? atoi(args[4]) : 16;
+      return hot_read(times, args[2], args[3], std::max(threads, 1u));
+    }
+    usage(argv[0]);
+    return 1;
+  }
   PerfCase c;
   uint64_t ticks = c.rados_write_4k(times);
   Transaction::dump_stat();
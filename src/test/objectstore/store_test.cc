@@ -5433,6 +5433,392 @@ TEST_P(StoreTestSpecificAUSize, SyntheticMatrixPreferDeferred) {
   };
   do_matrix(m, &StoreTestSpecificAUSize::SyntheticTest);
 }
+
+TEST_P(StoreTestSpecificAUSize, KVSyncLanes) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_kv_sync_lanes", "4");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "32768");
+  StartDeferred(4096);
+
+  const int num_colls = 8;
+  const int num_objects = 16;
+  vector<coll_t> cids;
+  vector<ObjectStore::CollectionHandle> chs;
+  for (int i = 0; i < num_colls; ++i) {
+    coll_t cid = coll_t(spg_t(pg_t(0, 100 + i), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    cids.push_back(cid);
+    chs.push_back(ch);
+  }
+
+  // interleave deferred and direct writes over all collections (and
+  // thus all lanes)
+  auto make_oid = [](int coll, int i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+                                        CEPH_NOSNAP)));
+    hoid.hobj.pool = 100 + coll;
+    return hoid;
+  };
+  auto make_data = [](int coll, int i) {
+    bufferlist bl;
+    unsigned len = (i % 2) ? 4096 : 65536;
+    bl.append(string(len, 'a' + (coll + i) % 26));
+    return bl;
+  };
+  for (int i = 0; i < num_objects; ++i) {
+    for (int c = 0; c < num_colls; ++c) {
+      ObjectStore::Transaction t;
+      bufferlist bl = make_data(c, i);
+      t.write(cids[c], make_oid(c, i), 0, bl.length(), bl);
+      int r = queue_transaction(store, chs[c], std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+
+  chs.clear();
+  int r = store->umount();
+  ASSERT_EQ(0, r);
+  r = store->fsck(false);
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+
+  for (int c = 0; c < num_colls; ++c) {
+    auto ch = store->open_collection(cids[c]);
+    ASSERT_TRUE(ch);
+    for (int i = 0; i < num_objects; ++i) {
+      bufferlist expected = make_data(c, i);
+      bufferlist in;
+      r = store->read(ch, make_oid(c, i), 0, expected.length(), in);
+      ASSERT_EQ((int)expected.length(), r);
+      ASSERT_TRUE(bl_eq(expected, in));
+    }
+    ObjectStore::Transaction t;
+    for (int i = 0; i < num_objects; ++i) {
+      t.remove(cids[c], make_oid(c, i));
+    }
+    t.remove_collection(cids[c]);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, AllocationJournalReplay) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  if (smr) {
+    cout << "SKIP: no allocation file on smr" << std::endl;
+    return;
+  }
+
+  SetVal(g_conf(), "bluestore_allocation_journal", "true");
+  SetVal(g_conf(), "bluestore_allocation_journal_checkpoint_deltas", "16");
+  StartDeferred(4096);
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  if (!bstore->has_null_manager()) {
+    cout << "SKIP: no null freelist manager" << std::endl;
+    return;
+  }
+
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const int num_objects = 64;
+  auto make_oid = [](int i) {
+    return ghobject_t(hobject_t(sobject_t("Object " + stringify(i),
+                                          CEPH_NOSNAP)));
+  };
+  bufferlist bl;
+  bl.append(string(65536, 'j'));
+  for (int i = 0; i < num_objects; ++i) {
+    ObjectStore::Transaction t;
+    t.write(cid, make_oid(i), 0, bl.length(), bl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // release and reallocate some space
+  for (int i = 0; i < num_objects; i += 2) {
+    ObjectStore::Transaction t;
+    t.remove(cid, make_oid(i));
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bufferlist half;
+  half.substr_of(bl, 0, bl.length() / 2);
+  for (int i = 0; i < num_objects; i += 4) {
+    ObjectStore::Transaction t;
+    t.write(cid, make_oid(i), 0, half.length(), half);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // let the mempool thread fold the deltas at least once
+  for (int i = 0; i < 50; ++i) {
+    if (bstore->get_perf_counters()->get(
+          l_bluestore_alloc_journal_checkpoints) > 0) {
+      break;
+    }
+    usleep(100000);
+  }
+  ASSERT_GT(bstore->get_perf_counters()->get(
+              l_bluestore_alloc_journal_checkpoints), 0u);
+  ASSERT_GT(bstore->get_perf_counters()->get(
+              l_bluestore_alloc_journal_deltas), 0u);
+  ch.reset();
+  int r = store->umount();
+  ASSERT_EQ(0, r);
+
+  // pretend the allocation file was lost in an unplanned shutdown
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "1");
+  r = store->fsck(false);
+  ASSERT_EQ(0, r);
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  SetVal(g_conf(), "bluestore_debug_inject_allocation_from_file_failure", "0");
+
+  AdminSocket* admin_socket = g_ceph_context->get_admin_socket();
+  ceph_assert(admin_socket);
+  ceph::bufferlist in, out;
+  ostringstream err;
+  r = admin_socket->execute_command(
+    { "{\"prefix\": \"bluestore startup timings\"}" },
+    in, err, &out);
+  ASSERT_EQ(0, r);
+  string timings(out.c_str(), out.length());
+  cout << timings << std::endl;
+  ASSERT_NE(string::npos, timings.find("allocation_journal"));
+
+  ch = store->open_collection(cid);
+  ASSERT_TRUE(ch);
+  for (int i = 0; i < num_objects; ++i) {
+    bufferlist in;
+    r = store->read(ch, make_oid(i), 0, bl.length(), in);
+    if (i % 4 == 0) {
+      ASSERT_EQ((int)half.length(), r);
+    } else if (i % 2 == 0) {
+      ASSERT_EQ(-ENOENT, r);
+    } else {
+      ASSERT_EQ((int)bl.length(), r);
+    }
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, SequentialReadahead) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_readahead_budget_hdd", "16777216");
+  SetVal(g_conf(), "bluestore_readahead_budget_ssd", "16777216");
+  SetVal(g_conf(), "bluestore_readahead_trigger_requests", "2");
+  SetVal(g_conf(), "bluestore_readahead_min_size", "262144");
+  SetVal(g_conf(), "bluestore_default_buffered_write", "false");
+  StartDeferred(4096);
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+
+  coll_t cid;
+  ghobject_t hoid(hobject_t("seq_read", "", CEPH_NOSNAP, 0, -1, ""));
+  auto ch = store->create_new_collection(cid);
+  const uint64_t obj_size = 4 << 20;
+  bufferlist data;
+  for (uint64_t i = 0; i < obj_size / 4096; ++i) {
+    data.append(string(4096, 'a' + i % 26));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const uint64_t chunk = 64 << 10;
+  for (uint64_t off = 0; off < obj_size; off += chunk) {
+    bufferlist in, expected;
+    int r = store->read(ch, hoid, off, chunk, in);
+    ASSERT_EQ((int)chunk, r);
+    expected.substr_of(data, off, chunk);
+    ASSERT_TRUE(bl_eq(expected, in));
+    if (off == chunk * 4) {
+      // let the first read-ahead land
+      for (int i = 0; i < 50; ++i) {
+        if (bstore->get_perf_counters()->get(l_bluestore_readahead_ios) > 0) {
+          break;
+        }
+        usleep(100000);
+      }
+    }
+  }
+  ASSERT_GT(bstore->get_perf_counters()->get(l_bluestore_readahead_ios), 0u);
+  ASSERT_GT(bstore->get_perf_counters()->get(l_bluestore_readahead_bytes), 0u);
+  ASSERT_GT(bstore->get_perf_counters()->get(l_bluestore_buffer_hit_bytes), 0u);
+
+  // sparse reads stream as well
+  uint64_t ios = bstore->get_perf_counters()->get(l_bluestore_readahead_ios);
+  for (uint64_t off = 0; off < obj_size; off += chunk) {
+    interval_set<uint64_t> m;
+    m.insert(off, chunk);
+    bufferlist in, expected;
+    int r = store->readv(ch, hoid, m, in);
+    ASSERT_EQ((int)chunk, r);
+    expected.substr_of(data, off, chunk);
+    ASSERT_TRUE(bl_eq(expected, in));
+  }
+  for (int i = 0; i < 50; ++i) {
+    if (bstore->get_perf_counters()->get(l_bluestore_readahead_ios) > ios) {
+      break;
+    }
+    usleep(100000);
+  }
+  ASSERT_GT(bstore->get_perf_counters()->get(l_bluestore_readahead_ios), ios);
+}
+
+TEST_P(StoreTestSpecificAUSize, Defragment) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_defrag_min_blobs", "8");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "0");
+  StartDeferred(4096);
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+
+  coll_t cid;
+  ghobject_t hoid(hobject_t("fragmented", "", CEPH_NOSNAP, 0, -1, ""));
+  auto ch = store->create_new_collection(cid);
+  // backwards in small pieces, so that every piece gets a blob of its own
+  const uint64_t obj_size = 256 << 10;
+  const uint64_t chunk = 4096;
+  const uint32_t hint_flags = CEPH_OSD_ALLOC_HINT_FLAG_SEQUENTIAL_READ |
+    CEPH_OSD_ALLOC_HINT_FLAG_IMMUTABLE;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.touch(cid, hoid);
+    t.set_alloc_hint(cid, hoid, obj_size, chunk, hint_flags);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bufferlist data;
+  for (uint64_t i = 0; i < obj_size / chunk; ++i) {
+    data.append(string(chunk, 'a' + i % 26));
+  }
+  for (uint64_t off = obj_size; off > 0; off -= chunk) {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.substr_of(data, off - chunk, chunk);
+    t.write(cid, hoid, off - chunk, chunk, bl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  ObjectStore::defrag_stats_t stats;
+  C_SaferCond committed;
+  int r = store->defragment(ch, hoid, &stats, &committed);
+  ASSERT_EQ(1, r);
+  ASSERT_EQ(0, committed.wait());
+  ASSERT_EQ(1u, stats.objects);
+  ASSERT_EQ(1u, stats.rewritten);
+  ASSERT_EQ(obj_size, stats.bytes);
+  ASSERT_LT(stats.blobs_after, stats.blobs_before);
+  ASSERT_GT(bstore->get_perf_counters()->get(l_bluestore_defrag_blobs_reclaimed),
+            0u);
+  {
+    bufferlist in;
+    r = store->read(ch, hoid, 0, obj_size, in);
+    ASSERT_EQ((int)obj_size, r);
+    ASSERT_TRUE(bl_eq(data, in));
+  }
+  // the allocation hints survive the rewrite
+  {
+    JSONFormatter f(false);
+    f.open_object_section("onode");
+    ASSERT_EQ(0, store->dump_onode(ch, hoid, "dump", &f));
+    f.close_section();
+    std::stringstream ss;
+    f.flush(ss);
+    ASSERT_NE(string::npos, ss.str().find(
+      "\"expected_write_size\":" + stringify(chunk)));
+    ASSERT_NE(string::npos, ss.str().find(
+      "\"alloc_hint_flags\":" + stringify(hint_flags)));
+  }
+
+  // nothing left to do, the completion is called right away
+  C_SaferCond skipped;
+  r = store->defragment(ch, hoid, &stats, &skipped);
+  ASSERT_EQ(0, r);
+  ASSERT_EQ(0, skipped.wait());
+  ASSERT_EQ(2u, stats.objects);
+  ASSERT_EQ(1u, stats.rewritten);
+
+  ghobject_t missing(hobject_t("missing", "", CEPH_NOSNAP, 0, -1, ""));
+  C_SaferCond failed;
+  ASSERT_EQ(-ENOENT, store->defragment(ch, missing, &stats, &failed));
+  ASSERT_EQ(-ENOENT, failed.wait());
+}
+
+TEST_P(StoreTestSpecificAUSize, FsckThreads) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  if (smr) {
+    cout << "SKIP: zoned stores are checked by a single thread" << std::endl;
+    return;
+  }
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  StartDeferred(0x10000);
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+
+  // enough collections for the keyspace to be split into several ranges
+  const uint64_t pool = 555;
+  std::vector<coll_t> cids;
+  std::vector<ghobject_t> oids;
+  for (unsigned p = 0; p < 8; ++p) {
+    coll_t cid(spg_t(pg_t(p, pool), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 3);
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(p), CEPH_NOSNAP),
+                              "", p, pool, ""));
+    bufferlist bl;
+    bl.append(string(0x10000, 'a' + p));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    cids.push_back(cid);
+    oids.push_back(hoid);
+  }
+  bstore->umount();
+  SetVal(g_conf(), "bluestore_fsck_threads", "0");
+  ASSERT_EQ(bstore->fsck(false), 0);
+  SetVal(g_conf(), "bluestore_fsck_threads", "4");
+  ASSERT_EQ(bstore->fsck(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+
+  // a misreference between collections checked by different workers
+  bstore->mount();
+  bstore->inject_misreference(cids[1], oids[1], cids[6], oids[6], 0);
+  bstore->umount();
+  SetVal(g_conf(), "bluestore_fsck_threads", "0");
+  int expected_errors = bstore->fsck(false);
+  ASSERT_GT(expected_errors, 0);
+  SetVal(g_conf(), "bluestore_fsck_threads", "4");
+  ASSERT_EQ(bstore->fsck(false), expected_errors);
+  ASSERT_EQ(bstore->repair(false), 0);
+  ASSERT_EQ(bstore->fsck(true), 0);
+
+  BlueStore::fsck_progress_t progress;
+  bstore->get_fsck_progress(&progress);
+  ASSERT_FALSE(progress.running);
+  bstore->mount();
+}
 #endif // WITH_BLUESTORE
 
 TEST_P(StoreTest, AttrSynthetic) {
@@ -6046,6 +6432,97 @@ TEST_P(StoreTest, OMapIterator) {
   }
 }
 
+TEST_P(StoreTest, OMapGetRange) {
+  coll_t cid;
+  ghobject_t hoid(hobject_t("tesomap", "", CEPH_NOSNAP, 0, 0, ""));
+  auto ch = store->create_new_collection(cid);
+  int r;
+  map<string, bufferlist> attrs;
+  for (char p : {'a', 'b', 'c'}) {
+    for (int i = 0; i < 20; ++i) {
+      bufferlist bl;
+      bl.append(string(i * 10, p));
+      attrs[string(1, p) + "-" + stringify(100 + i)] = bl;
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.touch(cid, hoid);
+    t.omap_setkeys(cid, hoid, attrs);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  struct range_t {
+    string start_after;
+    string filter_prefix;
+    uint64_t max_keys;
+    uint64_t max_bytes;
+  };
+  for (auto& q : std::vector<range_t>{
+	 {"", "", 1000, 1 << 20},
+	 {"", "", 7, 1 << 20},
+	 {"", "", 1000, 500},
+	 {"a-105", "", 10, 1 << 20},
+	 {"", "b", 1000, 1 << 20},
+	 {"", "b", 5, 1 << 20},
+	 {"b-110", "b", 1000, 1 << 20},
+	 {"b-119", "b", 1000, 1 << 20},
+	 {"c-", "b", 1000, 1 << 20},
+	 {"", "d", 1000, 1 << 20},
+	 {"z", "", 1000, 1 << 20}}) {
+    // the store's own implementation must match the iterator based one
+    bufferlist bl, expected_bl;
+    uint32_t num = 0, expected_num = 0;
+    bool more = false, expected_more = false;
+    r = store->omap_get_range(ch, hoid, q.start_after, q.filter_prefix,
+			      q.max_keys, q.max_bytes, &bl, &num, &more);
+    ASSERT_EQ(r, 0);
+    r = store->ObjectStore::omap_get_range(
+      ch, hoid, q.start_after, q.filter_prefix, q.max_keys, q.max_bytes,
+      &expected_bl, &expected_num, &expected_more);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(expected_num, num);
+    ASSERT_EQ(expected_more, more);
+    ASSERT_TRUE(bl.contents_equal(expected_bl));
+
+    uint32_t n = 0;
+    auto p = bl.cbegin();
+    string last = q.start_after;
+    while (!p.end()) {
+      string key;
+      bufferlist value;
+      decode(key, p);
+      decode(value, p);
+      ASSERT_GT(key, last);
+      ASSERT_EQ(0, key.compare(0, q.filter_prefix.size(), q.filter_prefix));
+      ASSERT_TRUE(attrs[key].contents_equal(value));
+      last = key;
+      ++n;
+    }
+    ASSERT_EQ(num, n);
+    ASSERT_LE(num, q.max_keys);
+  }
+
+  {
+    bufferlist bl;
+    uint32_t num = 0;
+    bool more = false;
+    ghobject_t missing(hobject_t("missing", "", CEPH_NOSNAP, 0, 0, ""));
+    r = store->omap_get_range(ch, missing, "", "", 10, 1 << 20,
+			      &bl, &num, &more);
+    ASSERT_EQ(r, -ENOENT);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, XattrTest) {
   coll_t cid;
   ghobject_t hoid(hobject_t("tesomap", "", CEPH_NOSNAP, 0, 0, ""));
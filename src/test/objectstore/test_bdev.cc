@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <random>
 #include <gtest/gtest.h>
 #include "global/global_init.h"
 #include "global/global_context.h"
@@ -13,6 +14,7 @@
 #include "common/errno.h"
 
 #include "blk/BlockDevice.h"
+#include "blk/kernel/KernelDevice.h"
 
 using namespace std;
 
@@ -91,6 +93,253 @@ TEST(KernelDevice, Ticket45337) {
   b->close();
 }
 
+TEST(KernelDevice, QueueBench) {
+  // direct 4k random writes at increasing queue depths, with each of the
+  // io queue backends; the rates are only reported, but what is written
+  // is read back, to check the registered buffer path
+  struct backend_t {
+    const char *name;
+    std::map<string, string> conf;
+  };
+  const backend_t backends[] = {
+    { "libaio", { { "bdev_ioring", "false" } } },
+    { "io_uring", { { "bdev_ioring", "true" } } },
+    { "io_uring fixed buffers", { { "bdev_ioring", "true" },
+				  { "bdev_ioring_fixed_buffers", "64" } } },
+    { "io_uring sqpoll", { { "bdev_ioring", "true" },
+			   { "bdev_ioring_sqthread_poll", "true" } } },
+  };
+  const uint64_t size = 256ull << 20;
+  const unsigned block = 4096;
+  const unsigned ops = 4096;
+  TempBdev bdev{ size };
+  std::mt19937_64 rng(0);
+
+  for (auto& backend : backends) {
+    for (auto& k : { "bdev_ioring", "bdev_ioring_fixed_buffers",
+		     "bdev_ioring_sqthread_poll" }) {
+      g_ceph_context->_conf.rm_val(k);
+    }
+    for (auto& [k, v] : backend.conf) {
+      g_ceph_context->_conf.set_val_or_die(k, v);
+    }
+    g_ceph_context->_conf.apply_changes(nullptr);
+
+    std::unique_ptr<BlockDevice> b(
+      BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+	[](void* handle, void* aio) {}, NULL));
+    int r = b->open(bdev.path);
+    if (r < 0) {
+      std::cerr << "open " << bdev.path << " failed" << std::endl;
+      return;
+    }
+    for (unsigned qd = 1; qd <= 256; qd *= 4) {
+      auto start = ceph::mono_clock::now();
+      for (unsigned done = 0; done < ops; done += qd) {
+	IOContext ioc(g_ceph_context, NULL);
+	for (unsigned i = 0; i < qd; ++i) {
+	  bufferlist bl;
+	  bl.append(string(block, 'a' + i % 26));
+	  ASSERT_EQ(0, b->aio_write(rng() % (size / block) * block, bl, &ioc,
+				    false));
+	}
+	b->aio_submit(&ioc);
+	ioc.aio_wait();
+      }
+      double secs = std::chrono::duration<double>(
+	ceph::mono_clock::now() - start).count();
+      std::cout << backend.name << " qd " << qd << ": "
+		<< (uint64_t)(ops / secs) << " iops" << std::endl;
+    }
+
+    bufferlist bl;
+    for (unsigned i = 0; i < 16; ++i) {
+      bl.append(string(block, 'A' + i));
+    }
+    for (unsigned i = 0; i < 16; ++i) {
+      IOContext ioc(g_ceph_context, NULL);
+      bufferlist t;
+      t.substr_of(bl, i * block, block);
+      ASSERT_EQ(0, b->aio_write(i * block, t, &ioc, false));
+      b->aio_submit(&ioc);
+      ioc.aio_wait();
+    }
+    {
+      IOContext ioc(g_ceph_context, NULL);
+      bufferlist in;
+      ASSERT_EQ(0, b->read(0, bl.length(), &in, &ioc, false));
+      ASSERT_TRUE(bl.contents_equal(in));
+    }
+    b->close();
+  }
+  for (auto& k : { "bdev_ioring", "bdev_ioring_fixed_buffers",
+		   "bdev_ioring_sqthread_poll" }) {
+    g_ceph_context->_conf.rm_val(k);
+  }
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST(KernelDevice, MultiQueue) {
+  uint64_t size = 64ull << 20;
+  TempBdev bdev{ size };
+  g_ceph_context->_conf.set_val_or_die("bdev_aio_queues", "4");
+  g_ceph_context->_conf.apply_changes(nullptr);
+
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  g_ceph_context->_conf.rm_val("bdev_aio_queues");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  int r = b->open(bdev.path);
+  if (r < 0) {
+    std::cerr << "open " << bdev.path << " failed" << std::endl;
+    return;
+  }
+  // by hint, and by whatever cpu we are on
+  const unsigned block = 4096;
+  for (int hint = -1; hint < 8; ++hint) {
+    IOContext ioc(g_ceph_context, NULL);
+    ioc.queue_hint = hint;
+    for (unsigned i = 0; i < 16; ++i) {
+      bufferlist bl;
+      bl.append(string(block, 'a' + hint + 1));
+      ASSERT_EQ(0, b->aio_write(((hint + 1) * 16 + i) * block, bl, &ioc,
+				false));
+    }
+    b->aio_submit(&ioc);
+    ioc.aio_wait();
+  }
+  for (int hint = -1; hint < 8; ++hint) {
+    IOContext ioc(g_ceph_context, NULL);
+    ioc.queue_hint = hint;
+    bufferlist in;
+    ASSERT_EQ(0, b->aio_read((hint + 1) * 16 * block, 16 * block, &in, &ioc));
+    b->aio_submit(&ioc);
+    ioc.aio_wait();
+    ASSERT_EQ(in.length(), 16 * block);
+    string expected(16 * block, 'a' + hint + 1);
+    ASSERT_EQ(0, memcmp(in.c_str(), expected.c_str(), expected.size()));
+  }
+  b->close();
+}
+
+// The discard queue of a device that is never opened, so no discard thread
+// drains it behind the test's back.
+class KernelDeviceDiscardTest : public ::testing::Test {
+protected:
+  static constexpr uint64_t _4K = 4096;
+  static constexpr uint64_t _64K = 65536;
+
+  KernelDevice bdev{g_ceph_context, [](void*, void*) {}, NULL,
+		    [](void*, void*) {}, NULL};
+
+  void SetUp() override {
+    bdev.block_size = _4K;
+  }
+  bool queue(uint64_t offset, uint64_t length, uint64_t max_queued = 0) {
+    interval_set<uint64_t> to_release;
+    to_release.insert(offset, length);
+    return bdev._discard_enqueue(to_release, max_queued);
+  }
+  // what one slice of the discard thread would send
+  interval_set<uint64_t> pick(uint64_t max_bytes, uint64_t max_ops) {
+    bdev._discard_pick(max_bytes, max_ops);
+    interval_set<uint64_t> picked;
+    picked.swap(bdev.discard_finishing);
+    return picked;
+  }
+  const interval_set<uint64_t>& queued() const {
+    return bdev.discard_queued;
+  }
+};
+
+TEST_F(KernelDeviceDiscardTest, AdjacentMerge) {
+  ASSERT_TRUE(queue(_64K, _4K));
+  ASSERT_TRUE(queue(0, _4K));
+  ASSERT_TRUE(queue(_64K + _4K, _4K));
+  ASSERT_TRUE(queue(_4K, _4K));
+  ASSERT_EQ(2u, queued().num_intervals());
+
+  // no budget: everything goes, as merged ranges
+  auto picked = pick(0, 0);
+  interval_set<uint64_t> expected;
+  expected.insert(0, 2 * _4K);
+  expected.insert(_64K, 2 * _4K);
+  ASSERT_EQ(expected, picked);
+  ASSERT_TRUE(queued().empty());
+}
+
+TEST_F(KernelDeviceDiscardTest, BudgetExhaustion) {
+  ASSERT_TRUE(queue(0, 4 * _4K));
+  ASSERT_TRUE(queue(_64K, 16 * _4K));
+  ASSERT_TRUE(queue(4 * _64K, 8 * _4K));
+
+  // largest first, until the ops run out
+  auto picked = pick(0, 2);
+  interval_set<uint64_t> expected;
+  expected.insert(_64K, 16 * _4K);
+  expected.insert(4 * _64K, 8 * _4K);
+  ASSERT_EQ(expected, picked);
+  ASSERT_EQ(4 * _4K, queued().size());
+
+  // or the bytes do; what is left stays queued and keeps merging
+  ASSERT_TRUE(queue(_64K, 16 * _4K));
+  picked = pick(16 * _4K, 0);
+  expected.clear();
+  expected.insert(_64K, 16 * _4K);
+  ASSERT_EQ(expected, picked);
+  expected.clear();
+  expected.insert(0, 4 * _4K);
+  ASSERT_EQ(expected, queued());
+  ASSERT_TRUE(queue(4 * _4K, 4 * _4K));
+  ASSERT_EQ(1u, queued().num_intervals());
+}
+
+TEST_F(KernelDeviceDiscardTest, Split) {
+  ASSERT_TRUE(queue(0, 16 * _64K));
+  ASSERT_TRUE(queue(32 * _64K, 2 * _64K));
+
+  // a range over the budget goes piece by piece, at block granularity
+  uint64_t budget = 5 * _64K + 100;
+  auto picked = pick(budget, 0);
+  ASSERT_EQ(1u, picked.num_intervals());
+  ASSERT_EQ(0u, picked.range_start());
+  ASSERT_EQ(p2align(budget, _4K), picked.size());
+
+  uint64_t sent = picked.size();
+  while (!queued().empty()) {
+    picked = pick(budget, 0);
+    ASSERT_FALSE(picked.empty());
+    ASSERT_LE(picked.size(), budget);
+    sent += picked.size();
+  }
+  ASSERT_EQ(18 * _64K, sent);
+
+  // a budget below a block still makes progress
+  ASSERT_TRUE(queue(0, 2 * _4K));
+  picked = pick(100, 0);
+  ASSERT_EQ(_4K, picked.size());
+  ASSERT_EQ(_4K, queued().size());
+}
+
+TEST_F(KernelDeviceDiscardTest, CapOverflow) {
+  const uint64_t cap = 4 * _4K;
+  ASSERT_TRUE(queue(0, 3 * _4K, cap));
+  // would go over the cap: left to the caller, the queue is untouched
+  ASSERT_FALSE(queue(_64K, 2 * _4K, cap));
+  ASSERT_EQ(3 * _4K, queued().size());
+  ASSERT_EQ(1u, queued().num_intervals());
+  ASSERT_TRUE(queue(_64K, _4K, cap));
+  ASSERT_EQ(cap, queued().size());
+  ASSERT_FALSE(queue(2 * _64K, _4K, cap));
+
+  // room again once some of it was picked
+  pick(_4K, 0);
+  ASSERT_TRUE(queue(2 * _64K, _4K, cap));
+  // no cap
+  ASSERT_TRUE(queue(4 * _64K, 16 * _64K, 0));
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   map<string,string> defaults = {
@@ -0,0 +1,222 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "global/global_context.h"
+#include "include/ceph_hash.h"
+#include "kv/rocksdb_cache/BinnedLRUCache.h"
+
+using namespace rocksdb_cache;
+
+static std::atomic<int64_t> live_values = {0};
+
+static void delete_value(const rocksdb::Slice&, void* value)
+{
+  --live_values;
+  delete static_cast<int*>(value);
+}
+
+struct Key {
+  char buf[32];
+  rocksdb::Slice slice;
+  uint32_t hash;
+
+  explicit Key(unsigned n) {
+    int len = snprintf(buf, sizeof(buf), "key%u", n);
+    slice = rocksdb::Slice(buf, len);
+    hash = ceph_str_hash_rjenkins(buf, len);
+  }
+};
+
+static rocksdb::Cache::Handle* insert(BinnedLRUCacheShard& shard,
+                                      unsigned n, size_t charge, bool pin,
+                                      rocksdb::Cache::Priority pri =
+                                        rocksdb::Cache::Priority::LOW)
+{
+  Key k(n);
+  rocksdb::Cache::Handle* h = nullptr;
+  ++live_values;
+  auto s = shard.Insert(k.slice, k.hash, new int(n), charge, delete_value,
+                        pin ? &h : nullptr, pri);
+  EXPECT_TRUE(s.ok());
+  return h;
+}
+
+static rocksdb::Cache::Handle* lookup(BinnedLRUCacheShard& shard, unsigned n)
+{
+  Key k(n);
+  return shard.Lookup(k.slice, k.hash);
+}
+
+// The charge of the entries in the table, which is the usage once no
+// handle is held any more.
+static size_t table_charge(BinnedLRUCacheShard& shard)
+{
+  size_t charge = 0;
+  shard.ApplyToAllCacheEntries(
+    [&charge](const rocksdb::Slice&, void*, size_t c, DeleterFn) {
+      charge += c;
+    }, true);
+  return charge;
+}
+
+TEST(BinnedLRUCache, PinnedNotInBins)
+{
+  BinnedLRUCacheShard shard(g_ceph_context, 1000, false, 0.5);
+  uint32_t bins = shard.get_bin_count();
+
+  auto h = insert(shard, 1, 10, true);
+  ASSERT_EQ(10u, shard.GetUsage());
+  ASSERT_EQ(10u, shard.GetPinnedUsage());
+  ASSERT_EQ(0u, shard.sum_bins(0, bins));
+  shard.Release(h);
+  ASSERT_EQ(0u, shard.GetPinnedUsage());
+  ASSERT_EQ(10u, shard.sum_bins(0, bins));
+
+  h = lookup(shard, 1);
+  ASSERT_NE(nullptr, h);
+  ASSERT_EQ(0u, shard.sum_bins(0, bins));
+  shard.Release(h);
+  ASSERT_EQ(10u, shard.sum_bins(0, bins));
+
+  h = insert(shard, 2, 20, true, rocksdb::Cache::Priority::HIGH);
+  ASSERT_EQ(0u, shard.GetHighPriPoolUsage());
+  shard.Release(h);
+  ASSERT_EQ(20u, shard.GetHighPriPoolUsage());
+  ASSERT_EQ(10u, shard.sum_bins(0, bins));
+
+  shard.EraseUnRefEntries();
+  ASSERT_EQ(0u, shard.GetUsage());
+  ASSERT_EQ(0u, shard.GetHighPriPoolUsage());
+  ASSERT_EQ(0u, shard.sum_bins(0, bins));
+  ASSERT_EQ(0, live_values);
+}
+
+TEST(BinnedLRUCache, ReleaseKeepsRecentEntry)
+{
+  // More pinned entries than one eviction pass skips, so inserts can't get
+  // the cache back under its capacity.
+  const unsigned pinned = 1500;
+  BinnedLRUCacheShard shard(g_ceph_context, 2000, false, 0);
+  std::vector<rocksdb::Cache::Handle*> handles;
+  for (unsigned i = 0; i < pinned; i++) {
+    handles.push_back(insert(shard, i, 1, true));
+  }
+  auto h = insert(shard, pinned, 600, true);
+  ASSERT_GT(shard.GetUsage(), 2000u);
+
+  // releasing the most recently used entry leaves it in the cache
+  shard.Release(h);
+  h = lookup(shard, pinned);
+  ASSERT_NE(nullptr, h);
+  shard.Release(h);
+
+  // as the pins go, the releases evict down to the capacity
+  for (auto p : handles) {
+    shard.Release(p);
+  }
+  ASSERT_LE(shard.GetUsage(), 2000u);
+  ASSERT_EQ(0u, shard.GetPinnedUsage());
+  ASSERT_EQ(shard.GetUsage(), table_charge(shard));
+
+  shard.EraseUnRefEntries();
+  ASSERT_EQ(0, live_values);
+}
+
+TEST(BinnedLRUCache, HitAges)
+{
+  BinnedLRUCacheShard shard(g_ceph_context, 1000, false, 0.5);
+  shard.set_bin_count(4);
+
+  shard.Release(insert(shard, 1, 10, true));
+  shard.Release(lookup(shard, 1));            // age 0
+  shard.shift_bins();
+  shard.Release(lookup(shard, 1));            // age 1
+  for (int i = 0; i < 4; i++) {
+    shard.shift_bins();
+  }
+  shard.Release(lookup(shard, 1));            // older than the bins tracked
+  shard.Release(insert(shard, 2, 10, true, rocksdb::Cache::Priority::HIGH));
+  shard.Release(lookup(shard, 2));            // age 0, high-pri
+
+  std::vector<uint64_t> high, low;
+  shard.add_hit_ages(&high, &low);
+  ASSERT_EQ((std::vector<uint64_t>{1, 0, 0, 0, 0}), high);
+  ASSERT_EQ((std::vector<uint64_t>{1, 1, 0, 0, 1}), low);
+  ASSERT_EQ(1u, shard.get_high_pri_hits());
+  ASSERT_EQ(3u, shard.get_low_pri_hits());
+
+  shard.EraseUnRefEntries();
+  ASSERT_EQ(0, live_values);
+}
+
+TEST(BinnedLRUCache, ConcurrentAccounting)
+{
+  const size_t capacity = 1000;
+  BinnedLRUCacheShard shard(g_ceph_context, capacity, false, 0.3);
+  // enough bins that none of the charge ages out of them
+  const uint32_t bins = 1 << 16;
+  shard.set_bin_count(bins);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&shard, t] {
+      std::mt19937 rng(t);
+      for (int i = 0; i < 100000; i++) {
+        unsigned n = rng() % 300;
+        int op = rng() % 100;
+        if (op < 60) {
+          auto h = lookup(shard, n);
+          if (h) {
+            if (rng() % 3 == 0) {
+              shard.Ref(h);
+              shard.Release(h);
+            }
+            shard.Release(h, rng() % 50 == 0);
+          }
+        } else if (op < 90) {
+          bool pin = rng() % 2;
+          auto pri = rng() % 2 ? rocksdb::Cache::Priority::HIGH :
+                                 rocksdb::Cache::Priority::LOW;
+          auto h = insert(shard, n, 1 + rng() % 20, pin, pri);
+          if (h) {
+            shard.Release(h);
+          }
+        } else if (op < 98) {
+          Key k(n);
+          shard.Erase(k.slice, k.hash);
+        } else {
+          shard.shift_bins();
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // no handle is held: nothing is pinned, all of the charge is in the table
+  // and in either pool
+  ASSERT_EQ(0u, shard.GetPinnedUsage());
+  ASSERT_EQ(shard.GetUsage(), table_charge(shard));
+  ASSERT_EQ(shard.GetUsage(),
+            shard.sum_bins(0, bins) + shard.GetHighPriPoolUsage());
+  // over the capacity by no more than what the threads had pinned when the
+  // last insert evicted
+  ASSERT_LE(shard.GetUsage(), capacity + 8 * 20);
+
+  shard.SetCapacity(capacity / 2);
+  ASSERT_LE(shard.GetUsage(), capacity / 2);
+  ASSERT_EQ(shard.GetUsage(),
+            shard.sum_bins(0, bins) + shard.GetHighPriPoolUsage());
+
+  shard.EraseUnRefEntries();
+  ASSERT_EQ(0u, shard.GetUsage());
+  ASSERT_EQ(0u, shard.sum_bins(0, bins) + shard.GetHighPriPoolUsage());
+  ASSERT_EQ(0, live_values);
+}
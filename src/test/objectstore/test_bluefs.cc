@@ -1559,6 +1559,355 @@ TEST(BlueFS, test_log_runway_3) {
   }
 }
 
+TEST(BlueFS, bench_wal_fsync_during_compaction) {
+  uint64_t size = 1048576 * 256;
+  TempBdev bdev{size};
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_compact_log_sync", "false");
+  // only the compactions started below
+  conf.SetVal("bluefs_log_compact_min_size", "1099511627776");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+
+  // enough files for the compacted metadata to take a while
+  const unsigned num_files = 5000;
+  ASSERT_EQ(0, fs.mkdir("db"));
+  for (unsigned i = 0; i < num_files; ++i) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db", "file." + to_string(i), &h, false));
+    h->append("x", 1);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+  BlueFS::FileWriter *wal;
+  ASSERT_EQ(0, fs.open_for_write("db.wal", "000001.log", &wal, false));
+  std::unique_ptr<char[]> buf = gen_buffer(4096);
+  const unsigned num_syncs = 2000;
+  uint64_t wal_size = 0;
+
+  auto run = [&](std::vector<double>* lat) {
+    for (unsigned i = 0; i < num_syncs; ++i) {
+      auto t0 = mono_clock::now();
+      wal->append(buf.get(), 4096);
+      fs.fsync(wal);
+      lat->push_back(std::chrono::duration<double, std::micro>(
+	mono_clock::now() - t0).count());
+      wal_size += 4096;
+    }
+    std::sort(lat->begin(), lat->end());
+  };
+  auto pct = [](const std::vector<double>& lat, double p) {
+    return lat[std::min<size_t>(lat.size() - 1, lat.size() * p)];
+  };
+
+  std::vector<double> idle;
+  run(&idle);
+
+  std::atomic<bool> stop{false};
+  unsigned compactions = 0;
+  std::thread compactor([&] {
+    while (!stop) {
+      fs.compact_log();
+      ++compactions;
+    }
+  });
+  std::vector<double> compacting;
+  run(&compacting);
+  stop = true;
+  compactor.join();
+  fs.close_writer(wal);
+
+  auto *logger = fs.get_perf_counters();
+  std::cout << "wal fsync usec idle: p50 " << pct(idle, 0.5)
+	    << " p99 " << pct(idle, 0.99)
+	    << " max " << idle.back() << std::endl;
+  std::cout << "wal fsync usec compacting: p50 " << pct(compacting, 0.5)
+	    << " p99 " << pct(compacting, 0.99)
+	    << " max " << compacting.back()
+	    << " (" << compactions << " compactions, "
+	    << logger->get(l_bluefs_log_expand_waits)
+	    << " log expansion waits)" << std::endl;
+  ASSERT_GT(compactions, 0u);
+
+  fs.umount(true);
+  ASSERT_EQ(0, fs.mount());
+  uint64_t file_size = 0;
+  utime_t mtime;
+  ASSERT_EQ(0, fs.stat("db.wal", "000001.log", &file_size, &mtime));
+  ASSERT_EQ(wal_size, file_size);
+  std::vector<std::string> ls;
+  ASSERT_EQ(0, fs.readdir("db", &ls));
+  ASSERT_EQ(num_files + 2, ls.size()); // with . and ..
+  fs.umount();
+}
+
+TEST(BlueFS, bench_concurrent_open_read) {
+  uint64_t size = 1048576 * 256;
+  TempBdev bdev{size};
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+
+  const unsigned num_files = 64;
+  const uint64_t file_size = 1048576;
+  std::unique_ptr<char[]> buf = gen_buffer(file_size);
+  ASSERT_EQ(0, fs.mkdir("db"));
+  for (unsigned i = 0; i < num_files; ++i) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db", "file." + to_string(i), &h, false));
+    h->append(buf.get(), file_size);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+
+  // readers open a random sst and read 4k from it, like table cache misses,
+  // while a writer keeps appending to and syncing a wal
+  auto run = [&](unsigned num_threads) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> ops{0};
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < num_threads; ++t) {
+      readers.emplace_back([&, t] {
+	std::mt19937 rng(t);
+	char out[4096];
+	uint64_t n = 0;
+	while (!stop) {
+	  BlueFS::FileReader *h;
+	  string name = "file." + to_string(rng() % num_files);
+	  ASSERT_EQ(0, fs.open_for_read("db", name, &h, true));
+	  uint64_t off = (rng() % (file_size / 4096)) * 4096;
+	  ASSERT_EQ(4096, fs.read_random(h, off, 4096, out));
+	  ASSERT_EQ(0, memcmp(out, buf.get() + off, 4096));
+	  delete h;
+	  ++n;
+	}
+	ops += n;
+      });
+    }
+    std::thread writer([&] {
+      BlueFS::FileWriter *h;
+      ASSERT_EQ(0, fs.open_for_write("db.wal", "wal." + to_string(num_threads),
+				     &h, false));
+      while (!stop) {
+	h->append(buf.get(), 4096);
+	fs.fsync(h);
+      }
+      fs.close_writer(h);
+    });
+    auto t0 = mono_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    stop = true;
+    join_all(readers);
+    writer.join();
+    return ops / std::chrono::duration<double>(mono_clock::now() - t0).count();
+  };
+
+  double base = 0;
+  for (unsigned num_threads = 1; num_threads <= 32; num_threads *= 2) {
+    double rate = run(num_threads);
+    if (num_threads == 1) {
+      base = rate;
+    }
+    std::cout << num_threads << " threads: " << (uint64_t)rate
+	      << " open+read/s, scaling " << rate / base << std::endl;
+    ASSERT_GT(rate, 0);
+  }
+  fs.umount();
+}
+
+TEST(BlueFS, concurrent_lookup_and_rename) {
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+
+  // few names, so that lookups keep hitting buckets being replaced
+  const unsigned num_files = 8;
+  const uint64_t file_size = 4096;
+  std::unique_ptr<char[]> buf = gen_buffer(file_size);
+  ASSERT_EQ(0, fs.mkdir("db"));
+  for (unsigned i = 0; i < num_files; ++i) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db", "file." + to_string(i), &h, false));
+    h->append(buf.get(), file_size);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> found{0};
+  std::vector<std::thread> readers;
+  for (unsigned t = 0; t < 8; ++t) {
+    readers.emplace_back([&, t] {
+      std::mt19937 rng(t);
+      char out[4096];
+      while (!stop) {
+	unsigned i = rng() % num_files;
+	string name = (rng() % 2 ? "file." : "tmp.") + to_string(i);
+	uint64_t fsize = 0;
+	utime_t mtime;
+	int r = fs.stat("db", name, &fsize, &mtime);
+	ASSERT_TRUE(r == 0 || r == -ENOENT);
+	if (r == 0) {
+	  ASSERT_EQ(file_size, fsize);
+	}
+	BlueFS::FileReader *h;
+	r = fs.open_for_read("db", name, &h, true);
+	ASSERT_TRUE(r == 0 || r == -ENOENT);
+	if (r == 0) {
+	  ASSERT_EQ((int)file_size, fs.read_random(h, 0, file_size, out));
+	  ASSERT_EQ(0, memcmp(out, buf.get(), file_size));
+	  delete h;
+	  ++found;
+	}
+	ASSERT_TRUE(fs.dir_exists("db"));
+      }
+    });
+  }
+  // every name keeps moving between file.N and tmp.N
+  for (unsigned n = 0; n < 2000; ++n) {
+    unsigned i = n % num_files;
+    string from = (n / num_files) % 2 ? "tmp." : "file.";
+    string to = (n / num_files) % 2 ? "file." : "tmp.";
+    ASSERT_EQ(0, fs.rename("db", from + to_string(i), "db", to + to_string(i)));
+  }
+  stop = true;
+  join_all(readers);
+  ASSERT_GT(found.load(), 0u);
+  fs.umount();
+}
+
+TEST(BlueFS, recycled_wal_presize) {
+  uint64_t size = 1048576 * 128;
+  TempBdev bdev{size};
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_recycled_wal_presize", "true");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+
+  const uint64_t prealloc = 4 * 1048576;
+  std::unique_ptr<char[]> buf = gen_buffer(1048576);
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db.wal", "000001.log", &h, false));
+    ASSERT_EQ(0, fs.preallocate(h->file, 0, prealloc));
+    h->append(buf.get(), 65536);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  // what ReuseWritableFile does for rocksdb's recycle_log_file_num
+  ASSERT_EQ(0, fs.rename("db.wal", "000001.log", "db.wal", "000002.log"));
+  BlueFS::FileWriter *h;
+  ASSERT_EQ(0, fs.open_for_write("db.wal", "000002.log", &h, true));
+  fs.sync_metadata(false);
+
+  auto *logger = fs.get_perf_counters();
+  uint64_t log_writes = logger->get(l_bluefs_log_write_count);
+  for (unsigned i = 0; i < 256; ++i) {
+    h->append(buf.get() + i * 4096, 4096);
+    fs.fsync(h);
+  }
+  // only the first append past the old size is logged
+  ASSERT_EQ(log_writes + 1, logger->get(l_bluefs_log_write_count));
+  ASSERT_EQ(1u, logger->get(l_bluefs_recycled_wal_presized));
+  fs.close_writer(h);
+
+  fs.umount(true);
+  ASSERT_EQ(0, fs.mount());
+  uint64_t file_size = 0;
+  utime_t mtime;
+  ASSERT_EQ(0, fs.stat("db.wal", "000002.log", &file_size, &mtime));
+  ASSERT_GE(file_size, prealloc);
+  BlueFS::FileReader *r;
+  ASSERT_EQ(0, fs.open_for_read("db.wal", "000002.log", &r, false));
+  bufferlist bl;
+  ASSERT_EQ(1048576, fs.read(r, 0, 1048576, &bl, nullptr));
+  ASSERT_EQ(0, memcmp(bl.c_str(), buf.get(), 1048576));
+  delete r;
+  fs.umount();
+}
+
+TEST(BlueFS, bench_group_fsync) {
+  uint64_t size = 1048576 * 512;
+  TempBdev bdev{size};
+  ConfSaver conf(g_ceph_context->_conf);
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+
+  std::unique_ptr<char[]> buf = gen_buffer(4096);
+  auto *logger = fs.get_perf_counters();
+  unsigned n = 0;
+  for (auto group : {"false", "true"}) {
+    conf.SetVal("bluefs_group_fsync", group);
+    conf.ApplyChanges();
+    for (unsigned num_threads = 1; num_threads <= 16; num_threads *= 2) {
+      uint64_t flushes0 = logger->get(l_bluefs_fsync_flushes);
+      uint64_t saved0 = logger->get(l_bluefs_fsync_flushes_saved);
+      std::atomic<bool> stop{false};
+      std::atomic<uint64_t> syncs{0};
+      std::vector<std::thread> writers;
+      for (unsigned t = 0; t < num_threads; ++t) {
+	string name = "wal." + to_string(n++) + ".log";
+	writers.emplace_back([&, name] {
+	  BlueFS::FileWriter *h;
+	  ASSERT_EQ(0, fs.open_for_write("db.wal", name, &h, false));
+	  uint64_t k = 0;
+	  while (!stop) {
+	    h->append(buf.get(), 4096);
+	    fs.fsync(h);
+	    ++k;
+	  }
+	  fs.close_writer(h);
+	  syncs += k;
+	});
+      }
+      auto t0 = mono_clock::now();
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      stop = true;
+      join_all(writers);
+      double secs =
+	std::chrono::duration<double>(mono_clock::now() - t0).count();
+      std::cout << "group_fsync " << group << " " << num_threads
+		<< " writers: " << (uint64_t)(syncs / secs) << " fsync/s, "
+		<< (uint64_t)((logger->get(l_bluefs_fsync_flushes) - flushes0) / secs)
+		<< " flushes/s, "
+		<< (uint64_t)((logger->get(l_bluefs_fsync_flushes_saved) - saved0) / secs)
+		<< " flushes saved/s" << std::endl;
+      ASSERT_GT(syncs.load(), 0u);
+    }
+  }
+  fs.umount();
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   map<string,string> defaults = {
@@ -8,13 +8,17 @@
 #include "common/ceph_time.h"
 #include "os/bluestore/BlueStore.h"
 #include "os/bluestore/simple_bitmap.h"
+#include "os/bluestore/slab_arena.h"
 #include "os/bluestore/AvlAllocator.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
 #include "global/global_context.h"
 #include "perfglue/heap_profiler.h"
 
+#include <algorithm>
+#include <random>
 #include <sstream>
+#include <thread>
 
 #define _STR(x) #x
 #define STRINGIFY(x) _STR(x)
@@ -2875,6 +2879,489 @@ TEST(bluestore_blob_use_tracker_t, mempool_stats_test)
   }
 }
 
+struct slab_test_obj_t {
+  MEMPOOL_CLASS_HELPERS();
+  uint64_t v[12];
+};
+MEMPOOL_DEFINE_SLAB_OBJECT_FACTORY(slab_test_obj_t, slab_test_obj,
+				   unittest_1);
+
+TEST(slab_arena_t, basic)
+{
+  using mempool::unittest_1::allocated_items;
+  using mempool::unittest_1::allocated_bytes;
+  auto& arena = mempool::unittest_1::slab_slab_test_obj;
+  arena.flush_thread_cache();
+  uint64_t items0 = allocated_items();
+  uint64_t bytes0 = allocated_bytes();
+  size_t slab_bytes0 = arena.get_slab_bytes();
+  const size_t per_slab = arena.get_slots_per_slab();
+  const size_t n = per_slab * 3 + 1;
+
+  vector<slab_test_obj_t*> v;
+  for (size_t i = 0; i < n; ++i) {
+    auto o = new slab_test_obj_t;
+    for (auto& x : o->v) {
+      x = i;
+    }
+    v.push_back(o);
+  }
+  // mempool counts objects, and the bytes of the slabs holding them
+  ASSERT_EQ(n, allocated_items() - items0);
+  ASSERT_EQ(arena.get_slab_bytes() - slab_bytes0, allocated_bytes() - bytes0);
+  ASSERT_GE(arena.get_slab_bytes() - slab_bytes0,
+	    n * sizeof(slab_test_obj_t));
+  for (size_t i = 0; i < n; ++i) {
+    for (auto x : v[i]->v) {
+      ASSERT_EQ(i, x);
+    }
+  }
+
+  // freed slots are reused
+  slab_test_obj_t *p = v[per_slab / 2];
+  delete p;
+  v[per_slab / 2] = new slab_test_obj_t;
+  ASSERT_EQ(p, v[per_slab / 2]);
+
+  for (auto o : v) {
+    delete o;
+  }
+  arena.flush_thread_cache();
+  ASSERT_EQ(items0, allocated_items());
+  ASSERT_EQ(arena.get_slab_bytes() - slab_bytes0, allocated_bytes() - bytes0);
+  // at most one spare slab is kept around
+  ASSERT_LE(arena.get_slab_bytes(), slab_bytes0 + arena.get_slab_size());
+}
+
+TEST(slab_arena_t, threads)
+{
+  auto& arena = mempool::unittest_1::slab_slab_test_obj;
+  arena.flush_thread_cache();
+  uint64_t items0 = mempool::unittest_1::allocated_items();
+  const size_t per_thread = 10000;
+  vector<vector<slab_test_obj_t*>> objs(8);
+  vector<std::thread> threads;
+  for (auto& ov : objs) {
+    threads.emplace_back([&ov, per_thread] {
+      for (size_t i = 0; i < per_thread; ++i) {
+	ov.push_back(new slab_test_obj_t);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  threads.clear();
+  ASSERT_EQ(objs.size() * per_thread,
+	    mempool::unittest_1::allocated_items() - items0);
+  // free everything from threads other than the allocating ones, with
+  // some allocations mixed in
+  for (size_t i = 0; i < objs.size(); ++i) {
+    threads.emplace_back([&objs, i] {
+      auto& ov = objs[(i + 1) % objs.size()];
+      for (size_t j = 0; j < ov.size(); ++j) {
+	delete ov[j];
+	if (j % 3 == 0) {
+	  ov[j] = new slab_test_obj_t;
+	} else {
+	  ov[j] = nullptr;
+	}
+      }
+      for (auto o : ov) {
+	delete o;
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  // exiting threads return their cached slots
+  ASSERT_EQ(items0, mempool::unittest_1::allocated_items());
+  // every shard may keep one spare slab
+  ASSERT_LE(arena.get_slab_bytes(), 8 * arena.get_slab_size());
+}
+
+TEST(slab_arena_t, churn)
+{
+  auto& arena = mempool::unittest_1::slab_slab_test_obj;
+  arena.flush_thread_cache();
+  const size_t slab_size = arena.get_slab_size();
+  const size_t per_slab = arena.get_slots_per_slab();
+  std::mt19937 rng(0);
+
+  // fill a working set, then evict most of it in random order: the
+  // survivors are spread over all of the slabs
+  const size_t n = per_slab * 200;
+  vector<slab_test_obj_t*> v;
+  for (size_t i = 0; i < n; ++i) {
+    v.push_back(new slab_test_obj_t);
+  }
+  std::shuffle(v.begin(), v.end(), rng);
+  const size_t live = n / 10;
+  for (size_t i = live; i < n; ++i) {
+    delete v[i];
+  }
+  v.resize(live);
+  arena.flush_thread_cache();
+  size_t evicted_bytes = arena.get_slab_bytes();
+
+  // replacing objects at random lets the sparse slabs drain
+  for (size_t i = 0; i < live * 20; ++i) {
+    size_t j = rng() % live;
+    delete v[j];
+    v[j] = new slab_test_obj_t;
+  }
+  arena.flush_thread_cache();
+  const size_t packed = (live + per_slab - 1) / per_slab;
+  std::cout << "slab bytes for " << live << " objects: " << evicted_bytes
+	    << " after eviction, " << arena.get_slab_bytes()
+	    << " after churn, " << packed * slab_size << " packed" << std::endl;
+  ASSERT_LE(arena.get_slab_bytes(), (packed * 3 / 2 + 2) * slab_size);
+
+  for (auto o : v) {
+    delete o;
+  }
+  arena.flush_thread_cache();
+  // every shard may keep one spare slab
+  ASSERT_LE(arena.get_slab_bytes(), 8 * slab_size);
+}
+
+TEST(slab_arena_t, onode_footprint)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
+    g_ceph_context, "lru", NULL);
+  BlueStore::BufferCacheShard *bc = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "lru", NULL);
+  auto coll = ceph::make_ref<BlueStore::Collection>(&store, oc, bc, coll_t());
+
+  auto slab_pool_bytes = [] {
+    return mempool::bluestore_cache_onode::allocated_bytes() +
+      mempool::bluestore_extent::allocated_bytes() +
+      mempool::bluestore_blob::allocated_bytes() +
+      mempool::bluestore_shared_blob::allocated_bytes();
+  };
+  uint64_t bytes0 = slab_pool_bytes();
+
+  // onodes with four extents, each with a blob of its own
+  const size_t n = 10000;
+  const size_t extents = 4;
+  vector<BlueStore::Onode*> onodes;
+  for (size_t i = 0; i < n; ++i) {
+    auto o = new BlueStore::Onode(coll.get(), ghobject_t(), "");
+    for (size_t j = 0; j < extents; ++j) {
+      BlueStore::BlobRef b(new BlueStore::Blob);
+      b->shared_blob = new BlueStore::SharedBlob(coll.get());
+      o->extent_map.extent_map.insert(
+	*new BlueStore::Extent(j * 0x1000, 0, 0x1000, b));
+    }
+    onodes.push_back(o);
+  }
+  // what the same objects take at their size, as a per-object
+  // allocation would account them
+  uint64_t object_bytes = sizeof(BlueStore::Onode) +
+    extents * (sizeof(BlueStore::Extent) + sizeof(BlueStore::Blob) +
+	       sizeof(BlueStore::SharedBlob));
+  uint64_t slab_bytes = (slab_pool_bytes() - bytes0) / n;
+  std::cout << "bytes per onode: " << object_bytes << " by object size, "
+	    << slab_bytes << " in slabs" << std::endl;
+  // nothing but slot padding and the part-filled slabs on top
+  ASSERT_LE(slab_bytes, object_bytes * 11 / 10 + 4 * 2 * 16 * 1024 / n);
+  for (auto o : onodes) {
+    delete o;
+  }
+}
+
+TEST(ReadaheadStream, sequential)
+{
+  ReadaheadStream::config_t conf;
+  conf.trigger_requests = 3;
+  conf.min_size = 0x10000;
+  conf.max_size = 0x40000;
+  ReadaheadStream ra;
+  const uint64_t size = 0x1000000;
+  const uint64_t len = 0x1000;
+
+  ASSERT_EQ(0u, ra.update(conf, 1, 0, len, size).second);
+  ASSERT_EQ(0u, ra.update(conf, 1, len, len, size).second);
+  // third sequential read triggers
+  auto e = ra.update(conf, 1, 2 * len, len, size);
+  ASSERT_EQ(3 * len, e.first);
+  ASSERT_EQ(3 * len + 0x10000, e.first + e.second);
+  // nothing more until half of it is consumed
+  uint64_t pos = 3 * len;
+  while (pos + len < 3 * len + 0x8000) {
+    ASSERT_EQ(0u, ra.update(conf, 1, pos, len, size).second);
+    pos += len;
+  }
+  // then continue where the last one ended, with a doubled window
+  e = ra.update(conf, 1, pos, len, size);
+  ASSERT_EQ(3 * len + 0x10000, e.first);
+  ASSERT_EQ(pos + len + 0x20000, e.first + e.second);
+
+  // a random read resets the stream
+  ASSERT_EQ(0u, ra.update(conf, 1, 0x800000, len, size).second);
+  ASSERT_EQ(0u, ra.update(conf, 1, 0x800000 + len, len, size).second);
+  e = ra.update(conf, 1, 0x800000 + 2 * len, len, size);
+  ASSERT_EQ(0x10000u, e.second);
+}
+
+TEST(ReadaheadStream, limits)
+{
+  ReadaheadStream::config_t conf;
+  conf.trigger_requests = 1;
+  conf.min_size = 0x10000;
+  conf.max_size = 0x20000;
+  ReadaheadStream ra;
+
+  // never past the object size
+  auto e = ra.update(conf, 1, 0, 0x1000, 0x8000);
+  ASSERT_EQ(0x1000u, e.first);
+  ASSERT_EQ(0x7000u, e.second);
+  ASSERT_EQ(0u, ra.update(conf, 1, 0x7000, 0x1000, 0x8000).second);
+
+  // the window stops growing at max_size
+  ra.reset(1);
+  uint64_t pos = 0;
+  uint64_t last = 0;
+  for (int i = 0; i < 64; ++i) {
+    e = ra.update(conf, 1, pos, 0x4000, 0x1000000);
+    pos += 0x4000;
+    if (e.second) {
+      ASSERT_LE(e.first + e.second - pos, conf.max_size);
+      last = e.first + e.second - pos;
+    }
+  }
+  ASSERT_EQ(conf.max_size, last);
+
+  // a cancelled read-ahead is offered again
+  ra.reset(1);
+  e = ra.update(conf, 1, 0, 0x1000, 0x1000000);
+  ASSERT_NE(0u, e.second);
+  ra.cancel(1, e);
+  auto e2 = ra.update(conf, 1, 0x1000, 0x1000, 0x1000000);
+  ASSERT_EQ(0x2000u, e2.first);
+  ASSERT_NE(0u, e2.second);
+}
+
+TEST(ReadaheadStream, owners)
+{
+  ReadaheadStream::config_t conf;
+  conf.trigger_requests = 2;
+  conf.min_size = 0x10000;
+  conf.max_size = 0x10000;
+  ReadaheadStreamTable<4, 2> table;
+  const uint64_t size = 0x1000000;
+
+  // tags 1, 5 and 9 share a set of two streams; 1 and 5 stream at once
+  // without resetting each other
+  ASSERT_EQ(0u, table.update(conf, 1, 0, 0x1000, size).second);
+  ASSERT_EQ(0u, table.update(conf, 5, 0, 0x1000, size).second);
+  ASSERT_NE(0u, table.update(conf, 1, 0x1000, 0x1000, size).second);
+  ASSERT_NE(0u, table.update(conf, 5, 0x1000, 0x1000, size).second);
+
+  // a third one takes over the stream used longest ago, that of 1
+  ASSERT_EQ(0u, table.update(conf, 9, 0, 0x1000, size).second);
+  ASSERT_NE(0u, table.update(conf, 9, 0x1000, 0x1000, size).second);
+  // so 1 starts over, in the stream of 5
+  ASSERT_EQ(0u, table.update(conf, 1, 0x2000, 0x1000, size).second);
+
+  // only the owner may reset its stream
+  table.reset(9);
+  auto e = table.update(conf, 1, 0x3000, 0x1000, size);
+  ASSERT_EQ(0x4000u, e.first);
+  table.reset(1);
+  ASSERT_EQ(0u, table.update(conf, 1, 0x4000, 0x1000, size).second);
+}
+
+TEST(EpochDomain, retire)
+{
+  struct obj_t {
+    std::atomic<uint64_t> magic = {0x600dcafe};
+    ~obj_t() {
+      magic = 0;
+    }
+  };
+  EpochDomain<obj_t> epoch;
+  std::atomic<obj_t*> cur = {new obj_t};
+  std::atomic<bool> stop = false;
+  std::atomic<uint64_t> bad = {0};
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 8; ++t) {
+    readers.emplace_back([&] {
+      while (!stop) {
+	EpochDomain<obj_t>::Guard g(epoch);
+	obj_t *o = cur.load();
+	for (int i = 0; i < 16; ++i) {
+	  if (o->magic.load() != 0x600dcafe) {
+	    ++bad;
+	  }
+	}
+      }
+    });
+  }
+  for (int i = 0; i < 100000; ++i) {
+    epoch.retire(cur.exchange(new obj_t));
+  }
+  stop = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  ASSERT_EQ(0u, bad.load());
+  // nothing holds a guard any more
+  epoch.reclaim();
+  epoch.reclaim();
+  ASSERT_EQ(0u, epoch.get_num_retired());
+  delete cur.load();
+}
+
+TEST(EpochDomain, preempted_reader)
+{
+  struct obj_t {
+    std::atomic<uint64_t> magic = {0x600dcafe};
+    ~obj_t() {
+      magic = 0;
+    }
+  };
+  EpochDomain<obj_t> epoch;
+  // readers sit between picking a parity and counting themselves in it
+  // while updaters flip the generation under them
+  epoch.set_guard_delay([] {
+    if (rand() % 4 == 0) {
+      usleep(rand() % 100);
+    } else {
+      std::this_thread::yield();
+    }
+  });
+  std::atomic<obj_t*> cur = {new obj_t};
+  std::atomic<bool> stop = false;
+  std::atomic<uint64_t> bad = {0};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&] {
+      while (!stop) {
+	EpochDomain<obj_t>::Guard g(epoch);
+	obj_t *o = cur.load();
+	std::this_thread::yield();
+	if (o->magic.load() != 0x600dcafe) {
+	  ++bad;
+	}
+      }
+    });
+  }
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 20000; ++i) {
+	epoch.retire(cur.exchange(new obj_t));
+	if (i % 16 == 0) {
+	  std::this_thread::yield();
+	}
+      }
+    });
+  }
+  for (int t = 8; t < 10; ++t) {
+    threads[t].join();
+  }
+  stop = true;
+  for (int t = 0; t < 8; ++t) {
+    threads[t].join();
+  }
+  ASSERT_EQ(0u, bad.load());
+  epoch.reclaim();
+  epoch.reclaim();
+  ASSERT_EQ(0u, epoch.get_num_retired());
+  delete cur.load();
+}
+
+TEST(BufferSpace, lockless_read)
+{
+  g_ceph_context->_conf.set_val("bluestore_buffer_lockless_reads", "true");
+  g_ceph_context->_conf.set_val("bluestore_buffer_snapshot_min_hits", "2");
+  PerfCountersBuilder plb(g_ceph_context, "bluestore_test",
+			  l_bluestore_first, l_bluestore_last);
+  plb.add_u64_counter(l_bluestore_buffer_lockless_hits, "buffer_lockless_hits",
+		      "lockless hits");
+  plb.add_u64_counter(l_bluestore_buffer_snapshots, "buffer_snapshots",
+		      "snapshots");
+  std::unique_ptr<PerfCounters> logger(plb.create_perf_counters());
+  BlueStore::BufferCacheShard *cache = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "lru", logger.get());
+  cache->set_max(1 << 20);
+
+  auto make_bl = [](char c) {
+    bufferlist bl;
+    bl.append(std::string(4096, c));
+    return bl;
+  };
+  auto first_byte = [](BlueStore::ready_regions_t& res, uint64_t off) {
+    return res[off].c_str()[0];
+  };
+  {
+    BlueStore::BufferSpace bs;
+    bufferlist a = make_bl('a'), b = make_bl('b');
+    bs.did_read(cache, 0, a);
+    bs.did_read(cache, 8192, b);
+
+    BlueStore::ready_regions_t res;
+    interval_set<uint32_t> res_intervals;
+    // partial hits never publish a snapshot
+    for (int i = 0; i < 4; ++i) {
+      bs.read(cache, 0, 12288, res, res_intervals);
+      ASSERT_EQ(8192u, res_intervals.size());
+    }
+    ASSERT_EQ(0u, logger->get(l_bluestore_buffer_snapshots));
+
+    bs.read(cache, 0, 4096, res, res_intervals);
+    bs.read(cache, 0, 4096, res, res_intervals);
+    ASSERT_EQ(1u, logger->get(l_bluestore_buffer_snapshots));
+    ASSERT_EQ(0u, logger->get(l_bluestore_buffer_lockless_hits));
+
+    bs.read(cache, 0, 12288, res, res_intervals);
+    ASSERT_EQ(1u, logger->get(l_bluestore_buffer_lockless_hits));
+    ASSERT_EQ(8192u, res_intervals.size());
+    ASSERT_EQ('a', first_byte(res, 0));
+    ASSERT_EQ('b', first_byte(res, 8192));
+    bs.read(cache, 2048, 8192, res, res_intervals);
+    ASSERT_EQ(2u, logger->get(l_bluestore_buffer_lockless_hits));
+    ASSERT_EQ(4096u, res_intervals.size());
+    ASSERT_EQ(2048u, res[2048].length());
+    ASSERT_EQ(2048u, res[8192].length());
+
+    // a write drops the snapshot, the new data is seen right away
+    bufferlist c = make_bl('c');
+    bs.write(cache, 1, 0, c, 0);
+    bs.read(cache, 0, 4096, res, res_intervals);
+    ASSERT_EQ(2u, logger->get(l_bluestore_buffer_lockless_hits));
+    ASSERT_EQ('c', first_byte(res, 0));
+    {
+      std::lock_guard l(cache->lock);
+      bs._finish_write(cache, 1);
+    }
+    bs.read(cache, 0, 4096, res, res_intervals);
+    ASSERT_EQ(2u, logger->get(l_bluestore_buffer_snapshots));
+    bs.read(cache, 0, 4096, res, res_intervals);
+    ASSERT_EQ(3u, logger->get(l_bluestore_buffer_lockless_hits));
+    ASSERT_EQ('c', first_byte(res, 0));
+
+    // so does a discard
+    bs.discard(cache, 0, 4096);
+    bs.read(cache, 0, 4096, res, res_intervals);
+    ASSERT_EQ(0u, res_intervals.size());
+    {
+      std::lock_guard l(cache->lock);
+      bs._clear(cache);
+    }
+  }
+  cache->snapshot_epoch.reclaim();
+  cache->snapshot_epoch.reclaim();
+  ASSERT_EQ(0u, cache->snapshot_epoch.get_num_retired());
+  delete cache;
+  g_ceph_context->_conf.set_val("bluestore_buffer_lockless_reads", "false");
+  g_ceph_context->_conf.set_val("bluestore_buffer_snapshot_min_hits", "8");
+}
+
 int main(int argc, char **argv) {
   auto args = argv_to_vec(argc, argv);
   auto cct = global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT,
@@ -0,0 +1,138 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <random>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "os/bluestore/DeferredSizeController.h"
+
+static constexpr uint64_t _1K = 1024;
+
+// Direct writes take seek + length / bw on the main device, kv commits a
+// fixed time; every latency is off by up to 10% either way.
+struct Model {
+  double seek;      ///< seconds
+  double per_kib;   ///< seconds
+  double kv;        ///< seconds
+  uint64_t min_len;
+  uint64_t max_len;
+
+  double gain(uint64_t s) const {
+    double kib = double(s) / _1K;
+    return (seek + per_kib * kib) / (kv + per_kib * kib);
+  }
+};
+
+// Run the controller for the given number of update periods and return the
+// threshold after each.
+static std::vector<uint64_t> run(DeferredSizeController& ctl, const Model& m,
+				 unsigned periods, double queue_util = 0)
+{
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<uint64_t> len(m.min_len / (4 * _1K),
+					      m.max_len / (4 * _1K));
+  std::uniform_real_distribution<double> jitter(0.9, 1.1);
+  std::vector<uint64_t> sizes;
+  for (unsigned p = 0; p < periods; ++p) {
+    for (unsigned i = 0; i < 256; ++i) {
+      uint64_t l = len(rng) * 4 * _1K;
+      if (l >= ctl.get_size()) {
+	ctl.add_device_write(
+	  (m.seek + m.per_kib * l / _1K) * jitter(rng), l);
+      }
+      ctl.add_kv_commit(m.kv * jitter(rng));
+    }
+    ctl.update(queue_util);
+    sizes.push_back(ctl.get_size());
+  }
+  return sizes;
+}
+
+static DeferredSizeController::config_t make_config(uint64_t max_size)
+{
+  DeferredSizeController::config_t c;
+  c.min_size = 0;
+  c.max_size = max_size;
+  c.granularity = 4 * _1K;
+  return c;
+}
+
+static bool settled(const std::vector<uint64_t>& sizes, unsigned last)
+{
+  for (size_t i = sizes.size() - last; i < sizes.size(); ++i) {
+    if (sizes[i] != sizes.back()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST(DeferredSizeController, Converges)
+{
+  // the gain crosses 2 at 140K and 1.5 at 310K
+  Model m{0.002, 0.00001, 0.0003, 4 * _1K, 2048 * _1K};
+  for (uint64_t initial : {uint64_t(0), 4 * _1K, 1024 * _1K}) {
+    DeferredSizeController ctl(make_config(1024 * _1K), initial);
+    auto sizes = run(ctl, m, 200);
+    uint64_t s = sizes.back();
+    EXPECT_TRUE(settled(sizes, 100)) << "from " << initial;
+    // neither of the next steps would be taken
+    EXPECT_LE(m.gain(s), 2.0) << "from " << initial << " at " << s;
+    EXPECT_GE(m.gain(s / 2), 1.5) << "from " << initial << " at " << s;
+  }
+}
+
+TEST(DeferredSizeController, AllDeferred)
+{
+  // HDD with a flash DB; once the threshold passes the longest write no
+  // direct write is left to sample, and the threshold has to stay put
+  Model m{0.008, 0.0000065, 0.0002, 4 * _1K, 64 * _1K};
+  DeferredSizeController ctl(make_config(256 * _1K), 16 * _1K);
+  auto sizes = run(ctl, m, 300);
+  ASSERT_EQ(256 * _1K, sizes.back());
+  ASSERT_TRUE(settled(sizes, 250));
+}
+
+TEST(DeferredSizeController, AllFlash)
+{
+  // per-IO cost below the kv commit: deferring never pays off
+  Model m{0.00002, 0.0000005, 0.0001, 4 * _1K, 256 * _1K};
+  DeferredSizeController ctl(make_config(256 * _1K), 64 * _1K);
+  auto sizes = run(ctl, m, 50);
+  ASSERT_EQ(0u, sizes.back());
+  ASSERT_TRUE(settled(sizes, 30));
+}
+
+TEST(DeferredSizeController, QueueFull)
+{
+  Model m{0.008, 0.0000065, 0.0002, 4 * _1K, 64 * _1K};
+  DeferredSizeController ctl(make_config(256 * _1K), 256 * _1K);
+  auto sizes = run(ctl, m, 20, 0.9);
+  ASSERT_EQ(0u, sizes.back());
+}
+
+TEST(DeferredSizeController, ConcurrentSamples)
+{
+  DeferredSizeController ctl(make_config(256 * _1K), 64 * _1K);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&ctl] {
+      for (int i = 0; i < 10000; ++i) {
+	// 1ms + 10us per KiB
+	uint64_t kib = i % 2 ? 4 : 64;
+	ctl.add_device_write(0.001 + 0.00001 * kib, kib * _1K);
+	ctl.add_kv_commit(0.0002);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ctl.update(0);
+  ASSERT_NEAR(0.0002, ctl.get_kv_lat(), 1e-6);
+  // fitted at the new threshold
+  double kib = double(ctl.get_size()) / _1K;
+  ASSERT_NEAR(0.001 + 0.00001 * kib, ctl.get_device_lat(), 2e-6);
+}
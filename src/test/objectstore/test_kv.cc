@@ -16,15 +16,19 @@
 #include <string.h>
 #include <iostream>
 #include <time.h>
+#include <thread>
 #include <sys/mount.h>
 #include "kv/KeyValueDB.h"
 #include "kv/RocksDBStore.h"
+#include "rocksdb/perf_level.h"
 #include "include/Context.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
 #include "common/Cond.h"
 #include "common/errno.h"
 #include "include/stringify.h"
+#include "include/scope_guard.h"
+#include "common/perf_counters_collection.h"
 #include <gtest/gtest.h>
 
 using namespace std;
@@ -608,6 +612,257 @@ TEST_P(KVTest, RocksDB_estimate_size_column_family) {
   fini();
 }
 
+TEST_P(KVTest, RocksDB_BenchColumnFamilyFilters) {
+  if(string(GetParam()) != "rocksdb")
+    GTEST_SKIP();
+
+  // same keys in columns that differ only in their filters; keys look
+  // like omap keys: an 8 byte object prefix followed by the key name
+  std::vector<std::pair<std::string, std::string>> columns = {
+    {"nobloom", "bloom_bits=0"},
+    {"bloom", "bloom_bits=10"},
+    {"prefixbloom", "bloom_bits=10;prefix_len=8"},
+    {"prefixcache", "bloom_bits=10;prefix_len=8;"
+		    "block_cache={type=binned_lru;size=16M;ratio=0.05}"},
+  };
+  std::string cfs;
+  for (auto& [name, opts] : columns) {
+    cfs += name + "=" + opts + " ";
+  }
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+
+  auto caches = db->get_cf_priority_caches();
+  ASSERT_EQ(1u, caches.size());
+  ASSERT_EQ(1u, caches.count("prefixcache"));
+  ASSERT_EQ(0.05, caches["prefixcache"].ratio);
+
+  const unsigned num_objects = 4096;
+  const unsigned keys_per_object = 16;
+  auto object_prefix = [](unsigned o) {
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08x", o);
+    return std::string(buf, 8);
+  };
+  bufferlist v;
+  v.append(string(100, 'v'));
+  for (auto& [name, opts] : columns) {
+    // objects are spread over several tables, every other one missing
+    for (unsigned o = 0; o < num_objects; o += 2) {
+      KeyValueDB::Transaction t = db->get_transaction();
+      for (unsigned k = 0; k < keys_per_object; ++k) {
+	t->set(name, object_prefix(o) + ".key" + stringify(k), v);
+      }
+      db->submit_transaction(t);
+      if (o % 1024 == 1022) {
+	db->compact_prefix(name);
+      }
+    }
+  }
+
+  auto pct = [](std::vector<double>& lat, double p) {
+    return lat[std::min<size_t>(lat.size() - 1, lat.size() * p)];
+  };
+  for (auto& [name, opts] : columns) {
+    std::vector<double> hit, miss, seek;
+    for (unsigned o = 0; o < num_objects; ++o) {
+      bufferlist out;
+      std::string key = object_prefix(o) + ".key" + stringify(o % keys_per_object);
+      auto t0 = ceph::mono_clock::now();
+      int r = db->get(name, key, &out);
+      double usec = std::chrono::duration<double, std::micro>(
+	ceph::mono_clock::now() - t0).count();
+      if (o % 2 == 0) {
+	ASSERT_EQ(0, r);
+	hit.push_back(usec);
+      } else {
+	ASSERT_EQ(-ENOENT, r);
+	miss.push_back(usec);
+      }
+
+      // list the omap of an object, like omap_get_values does
+      t0 = ceph::mono_clock::now();
+      KeyValueDB::Iterator it = db->get_iterator(name, 0,
+	{object_prefix(o), object_prefix(o + 1)});
+      unsigned n = 0;
+      for (it->lower_bound(object_prefix(o) + ".");
+	   it->valid() && it->key() < object_prefix(o + 1);
+	   it->next()) {
+	++n;
+      }
+      seek.push_back(std::chrono::duration<double, std::micro>(
+	ceph::mono_clock::now() - t0).count());
+      ASSERT_EQ(o % 2 == 0 ? keys_per_object : 0, n);
+    }
+    std::sort(hit.begin(), hit.end());
+    std::sort(miss.begin(), miss.end());
+    std::sort(seek.begin(), seek.end());
+    cout << name << " (" << opts << ") usec:"
+	 << " get hit p50 " << pct(hit, 0.5) << " p99 " << pct(hit, 0.99)
+	 << ", get miss p50 " << pct(miss, 0.5) << " p99 " << pct(miss, 0.99)
+	 << ", seek p50 " << pct(seek, 0.5) << " p99 " << pct(seek, 0.99)
+	 << std::endl;
+  }
+  fini();
+}
+
+TEST_P(KVTest, RocksDB_PrefixLenWholeSpaceIteration) {
+  if(string(GetParam()) != "rocksdb")
+    GTEST_SKIP();
+
+  // a cache of its own but no ratio is left out of the cache autotuner
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_EQ(0, db->create_and_open(cout,
+    "pl=bloom_bits=10;prefix_len=8;block_cache={type=binned_lru;size=4M}"));
+  ASSERT_EQ(0u, db->get_cf_priority_caches().size());
+
+  auto object_prefix = [](unsigned o) {
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08x", o);
+    return std::string(buf, 8);
+  };
+  const unsigned num_objects = 8;
+  const unsigned keys_per_object = 4;
+  bufferlist v;
+  v.append("v");
+  for (unsigned o = 0; o < num_objects; ++o) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (unsigned k = 0; k < keys_per_object; ++k) {
+      t->set("pl", object_prefix(o) + ".key" + stringify(k), v);
+    }
+    db->submit_transaction_sync(t);
+    // some objects in tables, some only in the memtable
+    if (o % 3 == 2) {
+      db->compact_prefix("pl");
+    }
+  }
+
+  // walk past the end of every object's prefix
+  KeyValueDB::WholeSpaceIterator it = db->get_wholespace_iterator();
+  unsigned n = 0;
+  for (it->seek_to_first("pl"); it->valid(); it->next()) {
+    if (it->raw_key().first != "pl") {
+      break;
+    }
+    ASSERT_EQ(object_prefix(n / keys_per_object) + ".key" +
+	      stringify(n % keys_per_object), it->raw_key().second);
+    ++n;
+  }
+  ASSERT_EQ(num_objects * keys_per_object, n);
+
+  n = 0;
+  for (it->lower_bound("pl", object_prefix(num_objects / 2));
+       it->valid() && it->raw_key().first == "pl";
+       it->next()) {
+    ++n;
+  }
+  ASSERT_EQ(num_objects / 2 * keys_per_object, n);
+  fini();
+}
+
+TEST_P(KVTest, RocksDB_TombstoneCompact) {
+  if(string(GetParam()) != "rocksdb")
+    GTEST_SKIP();
+
+  auto& conf = g_ceph_context->_conf;
+  conf.set_val("rocksdb_tombstone_compact", "true");
+  conf.set_val("rocksdb_tombstone_compact_min_skipped", "100");
+  conf.set_val("rocksdb_tombstone_compact_trigger", "1000");
+  conf.set_val("rocksdb_tombstone_compact_interval", "0");
+  conf.set_val("rocksdb_tombstone_compact_sample", "1");
+  conf.apply_changes(nullptr);
+  auto restore = make_scope_guard([&] {
+    conf.rm_val("rocksdb_tombstone_compact");
+    conf.rm_val("rocksdb_tombstone_compact_min_skipped");
+    conf.rm_val("rocksdb_tombstone_compact_trigger");
+    conf.rm_val("rocksdb_tombstone_compact_interval");
+    conf.rm_val("rocksdb_tombstone_compact_sample");
+    conf.apply_changes(nullptr);
+  });
+
+  std::string cfs("cf1");
+  ASSERT_EQ(0, db->init(g_conf()->bluestore_rocksdb_options));
+  ASSERT_EQ(0, db->create_and_open(cout, cfs));
+  auto counter = [](const std::string& name) {
+    uint64_t v = 0;
+    g_ceph_context->get_perfcounters_collection()->with_counters(
+      [&](const PerfCountersCollectionImpl::CounterMap& m) {
+	auto p = m.find("rocksdb." + name);
+	if (p != m.end()) {
+	  v = p->second.data->u64;
+	}
+      });
+    return v;
+  };
+
+  bufferlist v;
+  v.append(string(100, 'v'));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 10000; i++) {
+      t->set("cf1", stringify(100000 + i), v);
+    }
+    db->submit_transaction_sync(t);
+    db->compact_prefix("cf1");
+  }
+  {
+    // a mass delete, like a PG removal, leaves the first keys live
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 10; i < 10000; i++) {
+      t->rmkey("cf1", stringify(100000 + i));
+    }
+    db->submit_transaction_sync(t);
+  }
+
+  uint64_t skipped = counter("tombstones_skipped");
+  auto walk = [&] {
+    KeyValueDB::Iterator it = db->get_iterator("cf1");
+    unsigned n = 0;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+      ++n;
+    }
+    return n;
+  };
+  rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+  ASSERT_EQ(10u, walk());
+  ASSERT_GE(counter("tombstones_skipped") - skipped, 9000u);
+  // the perf level was only raised while the iterator moved
+  ASSERT_EQ(rocksdb::PerfLevel::kDisable, rocksdb::GetPerfLevel());
+  {
+    // an iterator used on one thread and dropped on another leaves the
+    // perf level of either alone
+    KeyValueDB::Iterator it = db->get_iterator("cf1");
+    rocksdb::PerfLevel level = rocksdb::PerfLevel::kUninitialized;
+    std::thread t([&] {
+      rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+      it->seek_to_first();
+      it->next();
+      level = rocksdb::GetPerfLevel();
+    });
+    t.join();
+    ASSERT_EQ(rocksdb::PerfLevel::kDisable, level);
+    it.reset();
+    ASSERT_EQ(rocksdb::PerfLevel::kDisable, rocksdb::GetPerfLevel());
+  }
+
+  // the range is compacted in the background
+  for (int i = 0; i < 100 && counter("tombstone_compact") == 0; i++) {
+    usleep(100000);
+  }
+  ASSERT_EQ(1u, counter("tombstone_compact"));
+  {
+    JSONFormatter f(true);
+    db->dump_tombstone_ranges(&f);
+    f.flush(cout);
+    cout << std::endl;
+  }
+
+  skipped = counter("tombstones_skipped");
+  ASSERT_EQ(10u, walk());
+  ASSERT_LT(counter("tombstones_skipped") - skipped, 100u);
+  fini();
+}
+
 TEST_P(KVTest, RocksDB_parse_sharding_def) {
   if(string(GetParam()) != "rocksdb")
     GTEST_SKIP();
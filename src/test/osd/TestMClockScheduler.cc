@@ -7,7 +7,9 @@
 #include "global/global_context.h"
 #include "global/global_init.h"
 #include "common/common_init.h"
+#include "osd/OSDMap.h"
 
+#include "osd/scheduler/mClockCapacityEstimator.h"
 #include "osd/scheduler/mClockScheduler.h"
 #include "osd/scheduler/OpSchedulerItem.h"
 
@@ -258,3 +260,335 @@ TEST_F(mClockSchedulerTest, TestAllQueuesEnqueueDequeue) {
 
   ASSERT_TRUE(q.empty());
 }
+
+using client_qos_t = OpSchedulerItem::client_qos_t;
+
+OpSchedulerItem create_client_item(
+  epoch_t e, uint64_t owner, const client_qos_t &qos)
+{
+  auto item = create_item(e, owner, op_scheduler_class::client);
+  item.set_client_qos(qos);
+  return item;
+}
+
+// enqueue a burst from a noisy client ahead of a few ops from a quiet one,
+// and count the quiet client's ops among the first dequeued
+static unsigned count_quiet_first(
+  mClockScheduler &q,
+  uint64_t noisy, const client_qos_t &noisy_qos,
+  uint64_t quiet, const client_qos_t &quiet_qos,
+  unsigned first)
+{
+  for (unsigned i = 0; i < 100; ++i) {
+    q.enqueue(create_client_item(i, noisy, noisy_qos));
+  }
+  for (unsigned i = 0; i < 10; ++i) {
+    q.enqueue(create_client_item(i, quiet, quiet_qos));
+  }
+  unsigned n = 0;
+  for (unsigned i = 0; i < first; ++i) {
+    auto r = get_item(q.dequeue());
+    if (r.get_owner() == quiet) {
+      ++n;
+    }
+  }
+  while (!q.empty()) {
+    q.dequeue();
+  }
+  return n;
+}
+
+static void set_client_qos_mode(const std::string &mode)
+{
+  g_ceph_context->_conf.set_val_or_die(
+    "osd_mclock_scheduler_client_qos_mode", mode);
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST_F(mClockSchedulerTest, TestClientQosByClass) {
+  client_qos_t qos{0, false, 0, 0};
+  // all clients share one queue, the quiet one waits behind the burst
+  ASSERT_EQ(0u, count_quiet_first(q, client1, qos, client2, qos, 20));
+}
+
+TEST_F(mClockSchedulerTest, TestClientQosByClient) {
+  set_client_qos_mode("client");
+  client_qos_t qos{0, false, 0, 0};
+  // each client is scheduled on its own, with the same share
+  unsigned n = count_quiet_first(q, client1, qos, client2, qos, 20);
+  set_client_qos_mode("class");
+  ASSERT_GE(n, 8u);
+}
+
+TEST_F(mClockSchedulerTest, TestClientQosByPool) {
+  set_client_qos_mode("pool");
+  // clients of a pool share its queue, other pools are isolated from it
+  unsigned same = count_quiet_first(
+    q, client1, {1, false, 0, 0}, client2, {1, false, 0, 0}, 20);
+  unsigned other = count_quiet_first(
+    q, client1, {1, false, 0, 0}, client2, {2, false, 0, 0}, 20);
+  set_client_qos_mode("class");
+  ASSERT_EQ(0u, same);
+  ASSERT_GE(other, 8u);
+}
+
+// a map with pools 1 and 2, pool 1 held down to a tiny share of the OSD
+static void build_pool_qos_map(OSDMap &osdmap)
+{
+  uuid_d fsid;
+  osdmap.build_simple(g_ceph_context, 0, fsid, 1);
+  OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+  inc.fsid = osdmap.get_fsid();
+  inc.new_pool_max = osdmap.get_pool_max();
+  for (int64_t id : {1, 2}) {
+    pg_pool_t empty;
+    pg_pool_t *p = inc.get_new_pool(++inc.new_pool_max, &empty);
+    ceph_assert(inc.new_pool_max == id);
+    p->size = 1;
+    p->set_pg_num(1);
+    p->set_pgp_num(1);
+    p->type = pg_pool_t::TYPE_REPLICATED;
+    p->crush_rule = 0;
+    if (id == 1) {
+      p->opts.set(pool_opts_t::QOS_RESERVATION, 1e-6);
+      p->opts.set(pool_opts_t::QOS_LIMIT, 1e-6);
+    }
+    inc.new_pool_names[id] = "pool" + std::to_string(id);
+  }
+  osdmap.apply_incremental(inc);
+}
+
+// queue a burst from a client of pool 1 and a few ops from one of pool 2,
+// and count the latter among the first dequeued.  the rest is left queued,
+// as pool 1 may be limited
+static unsigned count_pool2_first(
+  mClockScheduler &q, uint64_t noisy, uint64_t quiet,
+  const OSDMap &osdmap, bool map_first)
+{
+  if (map_first) {
+    q.update_from_osdmap(osdmap);
+  }
+  for (unsigned i = 0; i < 100; ++i) {
+    q.enqueue(create_client_item(i, noisy, {1, false, 0, 0}));
+  }
+  for (unsigned i = 0; i < 10; ++i) {
+    q.enqueue(create_client_item(i, quiet, {2, false, 0, 0}));
+  }
+  if (!map_first) {
+    q.update_from_osdmap(osdmap);
+  }
+  unsigned n = 0;
+  for (unsigned i = 0; i < 11; ++i) {
+    auto r = get_item(q.dequeue());
+    if (r.get_owner() == quiet) {
+      ++n;
+    }
+  }
+  return n;
+}
+
+TEST_F(mClockSchedulerTest, TestClientQosPoolOptions) {
+  set_client_qos_mode("pool");
+  OSDMap osdmap;
+  build_pool_qos_map(osdmap);
+  // pool 1 is limited, so pool 2 gets nearly all the service
+  unsigned n = count_pool2_first(q, client1, client2, osdmap, true);
+  set_client_qos_mode("class");
+  ASSERT_GE(n, 9u);
+}
+
+TEST_F(mClockSchedulerTest, TestClientQosPoolOptionsQueued) {
+  set_client_qos_mode("pool");
+  OSDMap osdmap;
+  build_pool_qos_map(osdmap);
+  // the pools' ops were queued before their options were known
+  unsigned n = count_pool2_first(q, client1, client2, osdmap, false);
+  set_client_qos_mode("class");
+  ASSERT_GE(n, 9u);
+}
+
+TEST_F(mClockSchedulerTest, TestClientQosFeedback) {
+  set_client_qos_mode("client");
+  // the noisy client got plenty of service from other OSDs already, so
+  // this one holds it back further than the quiet client
+  unsigned n = count_quiet_first(
+    q, client1, {0, true, 1000, 1000}, client2, {0, false, 0, 0}, 12);
+  set_client_qos_mode("class");
+  ASSERT_GE(n, 9u);
+}
+
+static mClockCapacityEstimator::params_t estimator_params(
+  double stale_age = 0)
+{
+  mClockCapacityEstimator::params_t p;
+  p.min_queue_depth = 4;
+  p.given_bandwidth = 1e9;
+  p.configured_iops = 10000;
+  p.configured_bandwidth = 1e9;
+  p.stale_age = stale_age;
+  return p;
+}
+
+// feed the estimator an interval of a device with the given capacity kept
+// busy by IOs of the given size
+static bool add_busy_interval(
+  mClockCapacityEstimator &e, double &now,
+  uint64_t &txcs, uint64_t &lat_ns, uint64_t &bytes,
+  double iops, double bandwidth, uint64_t size, double queue_depth,
+  const mClockCapacityEstimator::params_t &p = estimator_params())
+{
+  const double interval = 5;
+  const double per_txc = 1 / iops + size / bandwidth;
+  const uint64_t n = interval / per_txc;
+  now += interval;
+  txcs += n;
+  lat_ns += queue_depth * interval * 1e9;
+  bytes += n * size;
+  return e.add_sample(now, txcs, lat_ns, bytes, p);
+}
+
+// feed the estimator lightly loaded intervals of a device with the given
+// capacity, for the commit latency it has when not saturated
+static void add_light_intervals(
+  mClockCapacityEstimator &e, double &now,
+  uint64_t &txcs, uint64_t &lat_ns, uint64_t &bytes,
+  double iops, double bandwidth, uint64_t size)
+{
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_FALSE(add_busy_interval(
+      e, now, txcs, lat_ns, bytes, iops, bandwidth, size, 1));
+  }
+}
+
+TEST(mClockCapacityEstimatorTest, TestIdle) {
+  mClockCapacityEstimator e;
+  double now = 100;
+  uint64_t txcs = 0, lat_ns = 0, bytes = 0;
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_FALSE(add_busy_interval(
+      e, now, txcs, lat_ns, bytes, 10000, 500e6, 4096, 1));
+  }
+  ASSERT_FALSE(e.has_estimate());
+}
+
+TEST(mClockCapacityEstimatorTest, TestUnsaturated) {
+  mClockCapacityEstimator e;
+  double now = 100;
+  uint64_t txcs = 0, lat_ns = 0, bytes = 0;
+  // an SSD serving 8 transactions at once, each in 100us.  without knowing
+  // how long they take when lightly loaded, a deep queue is not trusted
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_FALSE(add_busy_interval(
+      e, now, txcs, lat_ns, bytes, 80000, 1e9, 4096, 8));
+  }
+  ASSERT_FALSE(e.has_estimate());
+  // and with it, they are seen to take no longer with the queue 8 deep
+  add_light_intervals(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096);
+  for (int i = 0; i < 20; ++i) {
+    ASSERT_FALSE(add_busy_interval(
+      e, now, txcs, lat_ns, bytes, 80000, 1e9, 4096, 8));
+  }
+  ASSERT_FALSE(e.has_estimate());
+  // once the queue gets deeper than the device, the latency goes up
+  for (int i = 0; i < 20; ++i) {
+    add_busy_interval(e, now, txcs, lat_ns, bytes, 80000, 1e9, 4096, 32);
+  }
+  ASSERT_TRUE(e.has_estimate());
+  ASSERT_NEAR(80000, e.get_iops(), 800);
+}
+
+TEST(mClockCapacityEstimatorTest, TestFixedSize) {
+  mClockCapacityEstimator e;
+  double now = 100;
+  uint64_t txcs = 0, lat_ns = 0, bytes = 0;
+  add_light_intervals(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096);
+  // the bandwidth cannot be told apart, so the one given is used
+  for (int i = 0; i < 20; ++i) {
+    add_busy_interval(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096, 8);
+  }
+  ASSERT_TRUE(e.has_estimate());
+  ASSERT_NEAR(10000, e.get_iops(), 100);
+  ASSERT_EQ(1e9, e.get_bandwidth());
+}
+
+TEST(mClockCapacityEstimatorTest, TestMixedSizes) {
+  mClockCapacityEstimator e;
+  double now = 100;
+  uint64_t txcs = 0, lat_ns = 0, bytes = 0;
+  const uint64_t sizes[] = {4096, 65536, 1 << 20};
+  add_light_intervals(e, now, txcs, lat_ns, bytes, 10000, 500e6, 4096);
+  for (int i = 0; i < 30; ++i) {
+    add_busy_interval(
+      e, now, txcs, lat_ns, bytes, 10000, 500e6, sizes[i % 3], 8);
+  }
+  ASSERT_TRUE(e.has_estimate());
+  ASSERT_NEAR(10000, e.get_iops(), 200);
+  ASSERT_NEAR(500e6, e.get_bandwidth(), 10e6);
+
+  // the device slows down, and the estimate follows
+  for (int i = 0; i < 60; ++i) {
+    add_busy_interval(
+      e, now, txcs, lat_ns, bytes, 5000, 250e6, sizes[i % 3], 8);
+  }
+  ASSERT_NEAR(5000, e.get_iops(), 250);
+  ASSERT_NEAR(250e6, e.get_bandwidth(), 12.5e6);
+}
+
+TEST(mClockCapacityEstimatorTest, TestCounterReset) {
+  mClockCapacityEstimator e;
+  double now = 100;
+  uint64_t txcs = 0, lat_ns = 0, bytes = 0;
+  add_light_intervals(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096);
+  for (int i = 0; i < 5; ++i) {
+    add_busy_interval(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096, 8);
+  }
+  ASSERT_TRUE(e.has_estimate());
+  double iops = e.get_iops();
+  // counters going backwards restart the interval rather than
+  // producing a sample
+  txcs = lat_ns = bytes = 0;
+  ASSERT_FALSE(add_busy_interval(
+    e, now, txcs, lat_ns, bytes, 1000, 1e9, 4096, 8));
+  ASSERT_EQ(iops, e.get_iops());
+}
+
+TEST(mClockCapacityEstimatorTest, TestStale) {
+  mClockCapacityEstimator e;
+  double now = 100;
+  uint64_t txcs = 0, lat_ns = 0, bytes = 0;
+  const auto p = estimator_params(60);
+  add_light_intervals(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096);
+  for (int i = 0; i < 10; ++i) {
+    add_busy_interval(e, now, txcs, lat_ns, bytes, 5000, 1e9, 4096, 8, p);
+  }
+  ASSERT_TRUE(e.has_estimate());
+  ASSERT_NEAR(5000, e.get_iops(), 50);
+
+  // lightly loaded for less than stale_age: the estimate holds
+  for (int i = 0; i < 11; ++i) {
+    ASSERT_FALSE(add_busy_interval(
+      e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096, 1, p));
+  }
+  ASSERT_FALSE(e.is_stale());
+  ASSERT_NEAR(5000, e.get_iops(), 50);
+
+  // then it returns to the configured capacity, and stays there
+  double last = e.get_iops();
+  for (int i = 0; i < 60; ++i) {
+    add_busy_interval(e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096, 1, p);
+    ASSERT_TRUE(e.is_stale());
+    ASSERT_GE(e.get_iops(), last);
+    last = e.get_iops();
+  }
+  ASSERT_EQ(10000, e.get_iops());
+  ASSERT_EQ(1e9, e.get_bandwidth());
+  ASSERT_FALSE(add_busy_interval(
+    e, now, txcs, lat_ns, bytes, 10000, 1e9, 4096, 1, p));
+
+  // a saturated interval makes it current again
+  for (int i = 0; i < 10; ++i) {
+    add_busy_interval(e, now, txcs, lat_ns, bytes, 5000, 1e9, 4096, 8, p);
+  }
+  ASSERT_FALSE(e.is_stale());
+  ASSERT_NEAR(5000, e.get_iops(), 250);
+}
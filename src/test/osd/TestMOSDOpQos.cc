@@ -0,0 +1,109 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "gtest/gtest.h"
+
+#include "include/ceph_features.h"
+#include "messages/MOSDOp.h"
+#include "messages/MOSDOpReply.h"
+
+// the features of a peer built before OSD_OP_QOS
+static const uint64_t old_features =
+  CEPH_FEATURES_SUPPORTED_DEFAULT & ~CEPH_FEATURE_OSD_OP_QOS;
+static const uint64_t new_features = CEPH_FEATURES_SUPPORTED_DEFAULT;
+
+static ceph::ref_t<MOSDOp> make_op(bool tracked)
+{
+  hobject_t hobj(object_t("foo"), "", CEPH_NOSNAP, 0x1234, 1, "");
+  spg_t pgid(pg_t(0x34, 1));
+  auto m = ceph::make_message<MOSDOp>(
+    1, 100, hobj, pgid, 10, CEPH_OSD_FLAG_READ, new_features);
+  m->read(0, 4096);
+  if (tracked) {
+    m->set_qos_params(3, 2);
+  }
+  return m;
+}
+
+template <typename M>
+static ceph::ref_t<M> roundtrip(M &m, uint64_t features)
+{
+  m.encode_payload(features);
+  auto d = ceph::make_message<M>();
+  d->set_header(m.get_header());
+  ceph::buffer::list payload = m.get_payload();
+  d->set_payload(payload);
+  d->set_data(m.get_data());
+  d->decode_payload();
+  return d;
+}
+
+static ceph::buffer::list encoded(MOSDOp &m, uint64_t features)
+{
+  m.encode_payload(features);
+  return m.get_payload();
+}
+
+TEST(MOSDOpQos, OldClientToNewOsd) {
+  auto m = make_op(false);
+  auto d = roundtrip(*m, new_features);
+  ASSERT_EQ(8, d->get_header().version);
+  d->finish_decode();
+  ASSERT_FALSE(d->has_qos_params());
+  ASSERT_EQ(1u, d->ops.size());
+}
+
+TEST(MOSDOpQos, NewClientToOldOsd) {
+  // sent as v8, exactly as by a client that does not track its service
+  auto tracked = make_op(true);
+  auto untracked = make_op(false);
+  ceph::buffer::list a = encoded(*tracked, old_features);
+  ASSERT_EQ(8, tracked->get_header().version);
+  ceph::buffer::list b = encoded(*untracked, old_features);
+  ASSERT_TRUE(a.contents_equal(b));
+
+  auto d = roundtrip(*tracked, old_features);
+  d->finish_decode();
+  ASSERT_FALSE(d->has_qos_params());
+  ASSERT_EQ(1u, d->ops.size());
+}
+
+TEST(MOSDOpQos, NewClientToNewOsd) {
+  auto m = make_op(true);
+  auto d = roundtrip(*m, new_features);
+  ASSERT_EQ(9, d->get_header().version);
+  ASSERT_TRUE(d->has_qos_params());
+  ASSERT_EQ(3u, d->get_qos_delta());
+  ASSERT_EQ(2u, d->get_qos_rho());
+  d->finish_decode();
+  ASSERT_EQ(1u, d->ops.size());
+}
+
+TEST(MOSDOpQos, ReplyToOldClient) {
+  auto m = make_op(true);
+  m->set_qos_resp(OSD_OP_QOS_PHASE_RESERVATION, 4096);
+  auto r = ceph::make_message<MOSDOpReply>(m.get(), 0, 10, 0, false);
+  ASSERT_TRUE(r->has_qos_resp());
+  auto d = roundtrip(*r, old_features);
+  ASSERT_EQ(8, d->get_header().version);
+  ASSERT_FALSE(d->has_qos_resp());
+  ASSERT_EQ(0, d->get_result());
+  ASSERT_EQ(10u, d->get_map_epoch());
+}
+
+TEST(MOSDOpQos, ReplyToNewClient) {
+  auto m = make_op(true);
+  m->set_qos_resp(OSD_OP_QOS_PHASE_RESERVATION, 4096);
+  auto r = ceph::make_message<MOSDOpReply>(m.get(), 0, 10, 0, false);
+  auto d = roundtrip(*r, new_features);
+  ASSERT_EQ(9, d->get_header().version);
+  ASSERT_TRUE(d->is_qos_reservation());
+  ASSERT_EQ(4096u, d->get_qos_cost());
+
+  // and a reply to an op that was not tracked stays v8
+  auto u = make_op(false);
+  auto ur = ceph::make_message<MOSDOpReply>(u.get(), 0, 10, 0, false);
+  auto ud = roundtrip(*ur, new_features);
+  ASSERT_EQ(8, ud->get_header().version);
+  ASSERT_FALSE(ud->has_qos_resp());
+}
@@ -3244,6 +3244,223 @@ TEST_F(PGLogTrimTest, TestCopyAfter2) {
   EXPECT_EQ(7u, copy.dups.size()) << copy;
 }
 
+class PGLogSegmentTest : public StoreTestFixture, public PGLogTestBase {
+public:
+  struct TestLog : public PGLog {
+    explicit TestLog(CephContext *cct) : PGLog(cct) {}
+    using PGLog::log;
+    using PGLog::log_segmented;
+    using PGLog::log_segments;
+  };
+
+  coll_t test_coll;
+  ghobject_t log_oid;
+  ObjectStore::CollectionHandle ch;
+  pg_info_t info;
+
+  PGLogSegmentTest() : StoreTestFixture("memstore") {}
+
+  void SetUp() override {
+    StoreTestFixture::SetUp();
+    test_coll = coll_t(spg_t(pg_t(1, 1)));
+    hobject_t hoid;
+    hoid.pool = 1;
+    hoid.oid = "log";
+    log_oid = ghobject_t(hoid);
+    ch = store->create_new_collection(test_coll);
+    ObjectStore::Transaction t;
+    t.create_collection(test_coll, 0);
+    t.touch(test_coll, log_oid);
+    ASSERT_EQ(0, store->queue_transaction(ch, std::move(t)));
+  }
+
+  void TearDown() override {
+    ch.reset();
+    StoreTestFixture::TearDown();
+  }
+
+  unique_ptr<TestLog> make_log(uint64_t segment_entries) {
+    g_ceph_context->_conf.set_val_or_die("osd_pg_log_segment_entries",
+					 stringify(segment_entries));
+    auto l = make_unique<TestLog>(g_ceph_context);
+    g_ceph_context->_conf.set_val_or_die("osd_pg_log_segment_entries", "0");
+    return l;
+  }
+
+  /// write out l, returning the size of the transaction
+  uint64_t write(TestLog &l) {
+    ObjectStore::Transaction t;
+    map<string, bufferlist> km;
+    l.write_log_and_missing(t, &km, test_coll, log_oid, false);
+    if (!km.empty()) {
+      t.omap_setkeys(test_coll, log_oid, km);
+    }
+    uint64_t bytes = t.get_encoded_bytes();
+    EXPECT_EQ(0, store->queue_transaction(ch, std::move(t)));
+    return bytes;
+  }
+
+  unique_ptr<TestLog> read(uint64_t segment_entries) {
+    auto l = make_log(segment_entries);
+    ostringstream err;
+    l->read_log_and_missing(store.get(), ch, log_oid, info, err, false);
+    return l;
+  }
+
+  /// a client write to one of a few objects, trimmed like the osd does
+  void append(TestLog &l, unsigned v,
+	      unsigned max_entries = 1000, unsigned trim_min = 100) {
+    auto e = mk_ple_mod(mk_obj(v % 16), mk_evt(10, v),
+			v > 16 ? mk_evt(10, v - 16) : eversion_t(),
+			osd_reqid_t(entity_name_t::CLIENT(4242), 0, v));
+    e.mtime = utime_t(1000 + v, 0);
+    e.user_version = v;
+    l.add(e);
+    info.last_update = info.last_complete = e.version;
+    if (l.log.log.size() >= max_entries + trim_min) {
+      l.trim(mk_evt(10, v - max_entries), info);
+    }
+  }
+
+  void check_same(const TestLog &a, const TestLog &b) {
+    ASSERT_EQ(a.log.log.size(), b.log.log.size());
+    for (auto p = a.log.log.begin(), q = b.log.log.begin();
+	 p != a.log.log.end();
+	 ++p, ++q) {
+      bufferlist pbl, qbl;
+      encode(*p, pbl);
+      encode(*q, qbl);
+      ASSERT_EQ(pbl, qbl) << *p << " != " << *q;
+    }
+  }
+
+  unsigned count_keys(const string &prefix) {
+    set<string> keys;
+    store->omap_get_keys(ch, log_oid, &keys);
+    return std::count_if(keys.begin(), keys.end(), [&](auto &k) {
+      return k.compare(0, prefix.size(), prefix) == 0;
+    });
+  }
+};
+
+TEST_F(PGLogSegmentTest, RoundTrip) {
+  auto l = make_log(4);
+  unsigned v = 1;
+  // a single entry per write, as for client ops
+  for (; v <= 3; ++v) {
+    append(*l, v);
+    write(*l);
+  }
+  // and a batch, as for recovery
+  for (; v <= 13; ++v) {
+    append(*l, v);
+  }
+  write(*l);
+  EXPECT_EQ(3u + 3u, count_keys("seg_"));
+
+  auto r = read(4);
+  EXPECT_TRUE(r->log_segmented);
+  EXPECT_EQ(l->log_segments, r->log_segments);
+  check_same(*l, *r);
+}
+
+TEST_F(PGLogSegmentTest, Upgrade) {
+  auto l = make_log(0);
+  for (unsigned v = 1; v <= 20; ++v) {
+    append(*l, v);
+  }
+  write(*l);
+  EXPECT_EQ(0u, count_keys("seg_"));
+
+  auto r = read(8);
+  EXPECT_FALSE(r->log_segmented);
+  check_same(*l, *r);
+  append(*l, 21);
+  append(*r, 21);
+  write(*r);
+  EXPECT_EQ(0u, count_keys("00"));
+  EXPECT_EQ(3u, count_keys("seg_"));
+
+  r = read(8);
+  EXPECT_TRUE(r->log_segmented);
+  check_same(*l, *r);
+
+  // and back
+  append(*l, 22);
+  append(*r, 22);
+  write(*r);
+  r = read(0);
+  EXPECT_TRUE(r->log_segmented);
+  check_same(*l, *r);
+  append(*l, 23);
+  append(*r, 23);
+  write(*r);
+  EXPECT_EQ(0u, count_keys("seg_"));
+  r = read(0);
+  EXPECT_FALSE(r->log_segmented);
+  check_same(*l, *r);
+}
+
+TEST_F(PGLogSegmentTest, TrimAndRewind) {
+  auto l = make_log(4);
+  for (unsigned v = 1; v <= 60; ++v) {
+    append(*l, v, 20, 10);
+    if (v % 3 == 0) {
+      write(*l);
+    }
+  }
+  // only segments with no entry left are gone
+  EXPECT_GT(l->log_segments.begin()->second, l->log.tail);
+  EXPECT_LE(l->log_segments.begin()->first, l->log.tail);
+  auto r = read(4);
+  check_same(*l, *r);
+
+  // cut into the middle of a segment
+  list<hobject_t> removed;
+  TestHandler h(removed);
+  bool dirty_info = false, dirty_big_info = false;
+  l->rewind_divergent_log(mk_evt(10, 56), info, &h,
+			  dirty_info, dirty_big_info);
+  write(*l);
+  r = read(4);
+  check_same(*l, *r);
+  EXPECT_EQ(mk_evt(10, 56), r->log.log.back().version);
+
+  for (unsigned v = 57; v <= 64; ++v) {
+    append(*l, v, 20, 10);
+    write(*l);
+  }
+  r = read(4);
+  check_same(*l, *r);
+}
+
+TEST_F(PGLogSegmentTest, BytesPerOp) {
+  // bytes handed to the store for the pg log per client write, steady
+  // state with trimming
+  constexpr unsigned ops = 5000;
+  std::map<uint64_t, double> per_op;
+  for (uint64_t segment_entries : {0, 32}) {
+    auto l = make_log(segment_entries);
+    uint64_t bytes = 0;
+    for (unsigned v = 1; v <= ops; ++v) {
+      append(*l, v, 500, 100);
+      bytes += write(*l);
+    }
+    per_op[segment_entries] = double(bytes) / ops;
+    std::cout << "osd_pg_log_segment_entries=" << segment_entries
+	      << ": " << per_op[segment_entries] << " bytes/op" << std::endl;
+    auto r = read(segment_entries);
+    check_same(*l, *r);
+
+    // start over
+    ObjectStore::Transaction t;
+    t.omap_clear(test_coll, log_oid);
+    ASSERT_EQ(0, store->queue_transaction(ch, std::move(t)));
+    info = pg_info_t();
+  }
+  EXPECT_LT(per_op[32], per_op[0]);
+}
+
 // Local Variables:
 // compile-command: "cd ../.. ; make unittest_pglog ; ./unittest_pglog --log-to-stderr=true  --debug-osd=20 # --gtest_filter=*.* "
 // End:
@@ -27,6 +27,7 @@ TYPE(PastIntervals)
 TYPE_FEATUREFUL(pg_query_t)
 TYPE(ObjectModDesc)
 TYPE(pg_log_entry_t)
+TYPE(pg_log_segment_t)
 TYPE(pg_log_dup_t)
 TYPE(pg_log_t)
 TYPE_FEATUREFUL(pg_missing_item)
@@ -685,21 +685,46 @@ int do_trim_pg_log(ObjectStore *store, const coll_t &coll,
 
       bufferlist bl = p->value();
       auto bp = bl.cbegin();
-      pg_log_entry_t e;
-      try {
-	e.decode_with_checksum(bp);
-      } catch (const buffer::error &e) {
-	cerr << "Error reading pg log entry: " << e.what() << std::endl;
-      }
-      if (debug) {
-	cerr << "read entry " << e << std::endl;
+      eversion_t last;
+      if (p->key().substr(0, 4) == string("seg_")) {
+	// a segment can only go once all of its entries are trimmed
+	pg_log_segment_t seg;
+	try {
+	  decode(seg, bp);
+	} catch (const buffer::error &e) {
+	  cerr << "Error reading pg log segment " << p->key() << ": "
+	       << e.what() << std::endl;
+	  done = true;
+	  break;
+	}
+	if (seg.entries.empty()) {
+	  cerr << "Empty pg log segment " << p->key() << std::endl;
+	  done = true;
+	  break;
+	}
+	if (debug) {
+	  cerr << "read segment " << seg.entries.front().version << " - "
+	       << seg.entries.back().version << std::endl;
+	}
+	last = seg.entries.back().version;
+      } else {
+	pg_log_entry_t e;
+	try {
+	  e.decode_with_checksum(bp);
+	} catch (const buffer::error &e) {
+	  cerr << "Error reading pg log entry: " << e.what() << std::endl;
+	}
+	if (debug) {
+	  cerr << "read entry " << e << std::endl;
+	}
+	last = e.version;
       }
-      if (e.version.version > trim_to) {
+      if (last.version > trim_to) {
 	done = true;
 	break;
       }
       keys_to_trim.insert(p->key());
-      new_tail = e.version;
+      new_tail = last;
       if (keys_to_trim.size() >= trim_at_once)
 	break;
     }